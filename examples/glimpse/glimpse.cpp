@@ -1,5 +1,6 @@
 /*
- * View the data/message structure received by the bridge.
+ * View the data/message structure received by the bridge, or monitor the
+ * throughput of the stream.
  *
  * Author: Jun Zhu, zhujun981661@gmail.com
  *
@@ -7,20 +8,134 @@
 #include "karabo-bridge/kb_client.hpp"
 
 #include <iostream>
+#include <iomanip>
 #include <chrono>
 #include <cstdlib>
+#include <map>
+
+
+namespace {
+
+/*
+ * Refresh the throughput, latency and loss of the stream in the terminal
+ * every "interval" seconds, like top.
+ *
+ * Only the header frames of the trains are decoded. The monitor subscribes
+ * by default, since a REQ client would take the trains of a REP server
+ * from the other clients.
+ */
+void monitor(karabo_bridge::Client& client, const std::string& addr, double interval) {
+    using clock = std::chrono::steady_clock;
+
+    karabo_bridge::LatencyHistogram next_latency; // since the last refresh
+    std::map<std::string, std::size_t> source_bytes; // since the last refresh
+    std::map<std::string, std::size_t> source_trains; // since the last refresh
+    std::size_t n_trains = 0, n_bytes = 0;
+    std::size_t n_total = 0, n_timeouts = 0;
+    uint64_t last_tid = 0;
+
+    auto start = clock::now();
+    auto last_refresh = start;
+    while (true) {
+        karabo_bridge::TrainHeader header;
+        auto t0 = clock::now();
+        bool received = client.nextHeader(header);
+        auto t1 = clock::now();
+
+        if (received) {
+            next_latency.record(std::chrono::duration<double>(t1 - t0).count());
+            ++n_trains;
+            n_bytes += header.bytes;
+            for (auto& v : header.source_bytes) {
+                source_bytes[v.first] += v.second;
+                ++source_trains[v.first];
+            }
+            if (header.tid) last_tid = header.tid;
+        } else {
+            ++n_timeouts;
+        }
+
+        double elapsed = std::chrono::duration<double>(t1 - last_refresh).count();
+        if (elapsed < interval) continue;
+        n_total += n_trains;
+
+        std::ostringstream ss;
+        ss << "\033[2J\033[H"; // clear the screen
+        ss << std::fixed << std::setprecision(1)
+           << "glimpse " << addr << ", "
+           << std::chrono::duration<double>(t1 - start).count() << " s, "
+           << n_total << " trains, last train ID " << last_tid << "\n\n"
+           << "trains/s: " << std::setw(8) << n_trains / elapsed
+           << "    MB/s: " << std::setw(10) << 1e-6 * n_bytes / elapsed
+           << "    timeouts: " << n_timeouts
+           << "    reconnections: " << client.recoveryStats().reconnections << "\n\n";
+
+        ss << "next() latency [ms]:";
+        if (next_latency.count()) {
+            ss << std::setprecision(3)
+               << "  mean " << 1e3 * next_latency.mean()
+               << "  p50 <" << 1e3 * next_latency.percentile(0.5)
+               << "  p90 <" << 1e3 * next_latency.percentile(0.9)
+               << "  p99 <" << 1e3 * next_latency.percentile(0.99)
+               << "  max " << 1e3 * next_latency.max();
+        }
+        ss << "\n\n";
+
+        ss << std::left << std::setw(48) << "source" << std::right
+           << std::setw(10) << "trains" << std::setw(12) << "MB/train"
+           << std::setw(8) << "gaps" << std::setw(10) << "missing"
+           << std::setw(8) << "dupl." << std::setw(10) << "reorder." << "\n";
+        for (auto& v : client.trainStats()) {
+            auto& stats = v.second;
+            auto it = source_bytes.find(v.first);
+            double mb = it != source_bytes.end() ? 1e-6 * it->second / source_trains[v.first] : 0.;
+            ss << std::left << std::setw(48) << v.first << std::right
+               << std::setw(10) << stats.trains << std::setw(12) << std::setprecision(3) << mb
+               << std::setw(8) << stats.gaps << std::setw(10) << stats.missing
+               << std::setw(8) << stats.duplicates << std::setw(10) << stats.reordered << "\n";
+        }
+        std::cout << ss.str() << std::flush;
+
+        next_latency = karabo_bridge::LatencyHistogram();
+        source_bytes.clear();
+        source_trains.clear();
+        n_trains = 0;
+        n_bytes = 0;
+        last_refresh = t1;
+    }
+}
+
+} // namespace
 
 
 int main (int argc, char* argv[]) {
     std::string addr;
     bool show_msg = false;
+    bool show_monitor = false;
+    auto socket_type = karabo_bridge::SocketType::SUB;
+    double interval = 1.;
 
     if (argc >= 2) {
         addr = argv[1];
         if (argc >=3 && (*argv[2] == 'm' || *argv[2] == 'M')) show_msg = true;
+        if (argc >=3 && (*argv[2] == 't' || *argv[2] == 'T')) show_monitor = true;
+        for (int i = 3; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "req") socket_type = karabo_bridge::SocketType::REQ;
+            else if (arg == "sub") socket_type = karabo_bridge::SocketType::SUB;
+            else if (arg == "pull") socket_type = karabo_bridge::SocketType::PULL;
+            else if (std::atof(argv[i]) > 0) interval = std::atof(argv[i]);
+        }
     }
     else throw std::invalid_argument("Server address required!");
 
+    if (show_monitor) {
+        karabo_bridge::Client client(interval, socket_type);
+        client.connect(addr);
+        monitor(client, addr, interval);
+        return 0;
+    }
+
     karabo_bridge::Client client;
     client.connect(addr);
 
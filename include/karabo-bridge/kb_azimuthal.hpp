@@ -0,0 +1,385 @@
+/*
+    Azimuthal integration of detector images.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_AZIMUTHAL_HPP
+#define KARABO_BRIDGE_KB_AZIMUTHAL_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kb_client.hpp"
+#include "kb_geometry.hpp"
+#include "kb_parallel.hpp"
+
+
+namespace karabo_bridge {
+
+class IntegrationError : public std::runtime_error {
+public:
+    explicit IntegrationError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+/*
+ * Radial coordinate of the bins.
+ */
+enum class RadialUnit {
+    PIXEL, // distance from the beam center in pixels
+    TWO_THETA // scattering angle in degrees
+};
+
+struct AzimuthalOptions {
+    std::size_t n_bins = 500;
+    RadialUnit unit = RadialUnit::PIXEL;
+    // radial range of the bins, both 0 for the range of the unmasked pixels
+    double r_min = 0.;
+    double r_max = 0.;
+    // split each pixel into split x split sub-pixels, which are binned
+    // separately, 1 for no splitting
+    std::size_t split = 1;
+    // correct the intensities for the solid angle of the pixels
+    bool solid_angle = false;
+};
+
+
+namespace detail {
+
+/*
+ * Return the dot product of a row of a CSR matrix with a vector.
+ *
+ * The independent accumulators allow the compiler to vectorize the loop
+ * with gathers where available.
+ */
+template<typename T>
+inline float csrRowDot(const float* values, const uint32_t* columns, std::size_t n, const T* x) {
+    float acc0 = 0.f, acc1 = 0.f, acc2 = 0.f, acc3 = 0.f;
+    std::size_t k = 0;
+    for (; k + 4 <= n; k += 4) {
+        acc0 += values[k] * static_cast<float>(x[columns[k]]);
+        acc1 += values[k + 1] * static_cast<float>(x[columns[k + 1]]);
+        acc2 += values[k + 2] * static_cast<float>(x[columns[k + 2]]);
+        acc3 += values[k + 3] * static_cast<float>(x[columns[k + 3]]);
+    }
+    for (; k < n; ++k) acc0 += values[k] * static_cast<float>(x[columns[k]]);
+    return (acc0 + acc1) + (acc2 + acc3);
+}
+
+/*
+ * Return the dot product of a row of a CSR matrix with a vector, skipping
+ * the NaN elements of the vector and renormalising by the fraction of the
+ * row which they do not cover. Return NaN if every element of the row is NaN.
+ */
+template<typename T>
+inline float csrRowDotFinite(const float* values, const float* fractions, const uint32_t* columns,
+                             std::size_t n, const T* x) {
+    double acc = 0., covered = 0.;
+    for (std::size_t k = 0; k < n; ++k) {
+        float v = static_cast<float>(x[columns[k]]);
+        if (std::isnan(v)) continue;
+        acc += values[k] * v;
+        covered += fractions[k];
+    }
+    if (!(covered > 0.)) return std::numeric_limits<float>::quiet_NaN();
+    return static_cast<float>(acc / covered);
+}
+
+} // detail
+
+/*
+ * Azimuthal integrator of the pulses of a detector into radial profiles.
+ *
+ * The contribution of every pixel to every bin is precomputed into a sparse
+ * matrix in CSR format, whose rows are the bins and whose columns are the
+ * pixels of the module data [modules, ss, fs]. The mask, the pixel splitting,
+ * the solid-angle correction and the normalisation by the number of pixels
+ * of a bin are all folded into the matrix, so that the profile of a pulse,
+ * i.e. the mean intensity in each bin, is a single sparse matrix-vector
+ * product. Bins without any pixel are 0.
+ *
+ * NaN pixels, e.g. the pixels masked by Calibration, are left out of the
+ * mean of their bins for the pulses in which they are NaN. A bin whose
+ * pixels are all NaN is NaN.
+ */
+class AzimuthalIntegrator {
+
+    std::size_t n_pixels_; // per pulse
+    std::size_t n_bins_;
+    double r_min_;
+    double r_max_;
+
+    std::vector<std::size_t> row_begin_; // CSR row pointers, n_bins + 1
+    std::vector<uint32_t> columns_;
+    std::vector<float> values_;
+    std::vector<float> fractions_; // fraction of the pixels of its bin of each element
+
+    // only floating-point data can contain NaN pixels
+    template<typename T>
+    static constexpr bool mayBeNaN() {
+        return !std::numeric_limits<T>::is_specialized || !std::numeric_limits<T>::is_integer;
+    }
+
+    // a sub-pixel contribution
+    struct Entry {
+        std::size_t bin;
+        uint32_t pixel;
+        float weight;
+        float coverage; // fraction of the pixel
+    };
+
+    /*
+     * Call fn(r, pixel, weight) for each sub-pixel of the unmasked pixels,
+     * where r is its radial position. The sub-pixels of a pixel are visited
+     * in a row.
+     */
+    template<typename Func>
+    static void forEachSubpixel(const DetectorGeometry& geometry, double center_x, double center_y,
+                                double distance, const AzimuthalOptions& options,
+                                const std::vector<uint8_t>& mask, Func&& fn) {
+        auto module_shape = geometry.moduleShape();
+        const std::size_t n_ss = module_shape[1];
+        const std::size_t n_fs = module_shape[2];
+        const double pi = std::acos(-1.);
+        const std::size_t split = options.split;
+        const float sub_weight = 1.f / static_cast<float>(split * split);
+
+        for (auto& t : geometry.tiles()) {
+            for (std::size_t ss = t.min_ss; ss <= t.max_ss; ++ss) {
+                for (std::size_t fs = t.min_fs; fs <= t.max_fs; ++fs) {
+                    std::size_t pixel = (t.module * n_ss + ss) * n_fs + fs;
+                    if (!mask.empty() && mask[pixel]) continue;
+
+                    float weight = sub_weight;
+                    if (options.solid_angle) {
+                        // relative to a pixel at normal incidence: cos^3(2 theta)
+                        double u = ss - t.min_ss + 0.5;
+                        double v = fs - t.min_fs + 0.5;
+                        double x = t.corner_x + u * t.ss_x + v * t.fs_x - center_x;
+                        double y = t.corner_y + u * t.ss_y + v * t.fs_y - center_y;
+                        double cos_2theta = distance / std::sqrt(distance * distance + x * x + y * y);
+                        // I / solid angle
+                        weight /= static_cast<float>(cos_2theta * cos_2theta * cos_2theta);
+                    }
+
+                    for (std::size_t i = 0; i < split; ++i) {
+                        for (std::size_t j = 0; j < split; ++j) {
+                            double u = ss - t.min_ss + (i + 0.5) / split;
+                            double v = fs - t.min_fs + (j + 0.5) / split;
+                            double r = std::hypot(t.corner_x + u * t.ss_x + v * t.fs_x - center_x,
+                                                  t.corner_y + u * t.ss_y + v * t.fs_y - center_y);
+                            if (options.unit == RadialUnit::TWO_THETA)
+                                r = std::atan2(r, distance) * 180. / pi;
+                            fn(r, static_cast<uint32_t>(pixel), weight);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+public:
+    /*
+     * Constructor.
+     *
+     * @param geometry: detector geometry, in units of pixels.
+     * @param center_x, center_y: position of the beam in the lab frame of the geometry.
+     * @param distance: distance from the sample to the detector in pixels,
+     *                  i.e. divided by the pixel size. It is only used by
+     *                  RadialUnit::TWO_THETA and the solid-angle correction.
+     * @param options: binning options.
+     * @param mask: pixels of the module data to ignore (nonzero), empty for none.
+     *
+     * Exceptions:
+     * IntegrationError: if an option or the mask is invalid
+     */
+    AzimuthalIntegrator(const DetectorGeometry& geometry, double center_x, double center_y,
+                        double distance, const AzimuthalOptions& options=AzimuthalOptions(),
+                        const std::vector<uint8_t>& mask={}) {
+        auto module_shape = geometry.moduleShape();
+        const std::size_t n_ss = module_shape[1];
+        const std::size_t n_fs = module_shape[2];
+        n_pixels_ = module_shape[0] * n_ss * n_fs;
+        n_bins_ = options.n_bins;
+
+        if (!n_bins_) throw IntegrationError("The number of bins must be positive");
+        if (!options.split) throw IntegrationError("The pixel splitting must be at least 1");
+        if (n_pixels_ > std::numeric_limits<uint32_t>::max())
+            throw IntegrationError("Too many pixels");
+        if (!mask.empty() && mask.size() != n_pixels_)
+            throw IntegrationError("The mask does not match the module shape of the geometry");
+        bool use_distance = options.unit == RadialUnit::TWO_THETA || options.solid_angle;
+        if (use_distance && !(distance > 0.))
+            throw IntegrationError("The distance must be positive");
+
+        const std::size_t split = options.split;
+        const float sub_weight = 1.f / static_cast<float>(split * split);
+
+        // the radial range of the unmasked sub-pixels in a first pass, so
+        // that the sub-pixels are binned as they are computed
+        r_min_ = options.r_min;
+        r_max_ = options.r_max;
+        if (r_min_ == 0. && r_max_ == 0.) {
+            double lo = std::numeric_limits<double>::infinity();
+            double hi = -std::numeric_limits<double>::infinity();
+            forEachSubpixel(geometry, center_x, center_y, distance, options, mask,
+                            [&](double r, uint32_t, float) {
+                lo = std::min(lo, r);
+                hi = std::max(hi, r);
+            });
+            if (lo <= hi) {
+                r_min_ = lo;
+                // include the outermost sub-pixel in the last bin
+                r_max_ = std::nextafter(hi, std::numeric_limits<double>::infinity());
+            }
+        }
+        if (!(r_max_ > r_min_)) throw IntegrationError("The radial range is empty");
+
+        // bin the sub-pixels, merging the sub-pixels of a pixel in the same bin
+        std::vector<Entry> entries;
+        const double scale = n_bins_ / (r_max_ - r_min_);
+        forEachSubpixel(geometry, center_x, center_y, distance, options, mask,
+                        [&](double r, uint32_t pixel, float weight) {
+            double b = std::floor((r - r_min_) * scale);
+            if (b < 0. || b >= static_cast<double>(n_bins_)) return;
+            std::size_t bin = static_cast<std::size_t>(b);
+            if (!entries.empty() && entries.back().pixel == pixel && entries.back().bin == bin) {
+                entries.back().weight += weight;
+                entries.back().coverage += sub_weight;
+            } else
+                entries.push_back(Entry{bin, pixel, weight, sub_weight});
+        });
+
+        // counting sort of the entries by bin
+        row_begin_.assign(n_bins_ + 1, 0);
+        for (auto& e : entries) ++row_begin_[e.bin + 1];
+        for (std::size_t b = 0; b < n_bins_; ++b) row_begin_[b + 1] += row_begin_[b];
+        columns_.resize(entries.size());
+        values_.resize(entries.size());
+        fractions_.resize(entries.size());
+        std::vector<std::size_t> next(row_begin_.begin(), row_begin_.end() - 1);
+        std::vector<double> coverage(n_bins_, 0.); // pixels in each bin
+        for (auto& e : entries) {
+            std::size_t k = next[e.bin]++;
+            columns_[k] = e.pixel;
+            values_[k] = e.weight;
+            fractions_[k] = e.coverage;
+            coverage[e.bin] += e.coverage;
+        }
+
+        // normalise to the mean of each bin
+        for (std::size_t b = 0; b < n_bins_; ++b) {
+            if (coverage[b] <= 0.) continue;
+            for (std::size_t k = row_begin_[b]; k < row_begin_[b + 1]; ++k) {
+                values_[k] = static_cast<float>(values_[k] / coverage[b]);
+                fractions_[k] = static_cast<float>(fractions_[k] / coverage[b]);
+            }
+        }
+    }
+
+    std::size_t nBins() const { return n_bins_; }
+
+    // Return the number of pixels of the data of a pulse.
+    std::size_t pixelsPerPulse() const { return n_pixels_; }
+
+    // Return the number of nonzero elements of the matrix.
+    std::size_t nnz() const { return values_.size(); }
+
+    // Return the radial range of the bins.
+    std::pair<double, double> radialRange() const { return {r_min_, r_max_}; }
+
+    // Return the radial position of the center of each bin.
+    std::vector<double> radialAxis() const {
+        std::vector<double> axis(n_bins_);
+        double width = (r_max_ - r_min_) / n_bins_;
+        for (std::size_t b = 0; b < n_bins_; ++b) axis[b] = r_min_ + (b + 0.5) * width;
+        return axis;
+    }
+
+    /*
+     * Integrate pulses into radial profiles.
+     *
+     * The NaN pixels of a pulse are skipped and the bins which contain them
+     * are renormalised to the mean of their other pixels, at the cost of a
+     * second pass over these bins only.
+     *
+     * @param src: data of shape [pulses, modules, ss, fs].
+     * @param n_pulses: number of pulses.
+     * @param dst: buffer of shape [pulses, bins].
+     * @param pool: thread pool.
+     */
+    template<typename T>
+    void integrate(const T* src, std::size_t n_pulses, float* dst,
+                   ThreadPool& pool=ThreadPool::global()) const {
+        const std::size_t n_rows = n_pulses * n_bins_;
+        pool.parallelFor(0, n_rows, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t r = begin; r < end; ++r) {
+                std::size_t pulse = r / n_bins_;
+                std::size_t bin = r % n_bins_;
+                std::size_t k = row_begin_[bin];
+                std::size_t n = row_begin_[bin + 1] - k;
+                const T* x = src + pulse * n_pixels_;
+                dst[r] = detail::csrRowDot(values_.data() + k, columns_.data() + k, n, x);
+                if (mayBeNaN<T>() && std::isnan(dst[r]))
+                    dst[r] = detail::csrRowDotFinite(values_.data() + k, fractions_.data() + k,
+                                                     columns_.data() + k, n, x);
+            }
+        }, pool.grainFor(n_rows));
+    }
+
+    /*
+     * Integrate an array of shape [pulses, modules, ss, fs], or
+     * [modules, ss, fs] for a single pulse.
+     *
+     * @param array: data of a numeric dtype.
+     * @param dst: buffer of shape [pulses, bins].
+     * @param pool: thread pool.
+     *
+     * Return an NDArray of float of shape [pulses, bins], or [bins], which
+     * refers to the buffer.
+     *
+     * Exceptions:
+     * IntegrationError: if the number of pixels does not match
+     * TypeMismatchErrorNDArray: if the dtype is not numeric
+     */
+    NDArray integrate(const NDArray& array, float* dst,
+                      ThreadPool& pool=ThreadPool::global()) const {
+        const Shape& shape = array.shape();
+        if (shape.size() != 3 && shape.size() != 4)
+            throw IntegrationError("The array must have the shape [pulses, modules, ss, fs]");
+        std::size_t n_pulses = shape.size() == 4 ? shape[0] : 1;
+        if (array.size() != n_pulses * n_pixels_)
+            throw IntegrationError("The array does not match the module shape of the geometry");
+
+        switch (array.dtypeId()) {
+            case DType::UINT8: integrate(array.data<uint8_t>(), n_pulses, dst, pool); break;
+            case DType::INT8: integrate(array.data<int8_t>(), n_pulses, dst, pool); break;
+            case DType::UINT16: integrate(array.data<uint16_t>(), n_pulses, dst, pool); break;
+            case DType::INT16: integrate(array.data<int16_t>(), n_pulses, dst, pool); break;
+            case DType::UINT32: integrate(array.data<uint32_t>(), n_pulses, dst, pool); break;
+            case DType::INT32: integrate(array.data<int32_t>(), n_pulses, dst, pool); break;
+            case DType::FLOAT16: integrate(array.data<Float16>(), n_pulses, dst, pool); break;
+            case DType::FLOAT: integrate(array.data<float>(), n_pulses, dst, pool); break;
+            case DType::DOUBLE: integrate(array.data<double>(), n_pulses, dst, pool); break;
+            default:
+                throw TypeMismatchErrorNDArray("Cannot integrate an array of " + array.dtype());
+        }
+
+        if (shape.size() == 4) return NDArray(dst, {n_pulses, n_bins_}, DType::FLOAT);
+        return NDArray(dst, {n_bins_}, DType::FLOAT);
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_AZIMUTHAL_HPP
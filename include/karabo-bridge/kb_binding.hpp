@@ -0,0 +1,445 @@
+/*
+    Decoding of a source into a user-declared struct.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_BINDING_HPP
+#define KARABO_BRIDGE_KB_BINDING_HPP
+
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "kb_client.hpp"
+
+
+/*
+ * Bind the members of a struct to the paths of a source, in the spirit of
+ * MSGPACK_DEFINE, e.g.
+ *
+ *     struct Detector {
+ *         uint64_t tid;
+ *         uint64_t n_pulses;
+ *         karabo_bridge::ArrayView<uint16_t> data;
+ *
+ *         KARABO_BRIDGE_BIND("timestamp.tid", tid,
+ *                            "header.pulseCount", n_pulses,
+ *                            "image.data", data)
+ *     };
+ *
+ * ArrayView members are bound to arrays and the other members are converted
+ * from metadata or data.
+ */
+#define KARABO_BRIDGE_BIND(...) \
+    template<typename KaraboBridgeBinder> \
+    void karaboBridgeBind(KaraboBridgeBinder& binder) { binder(__VA_ARGS__); }
+
+
+namespace karabo_bridge {
+
+class BindingError : public std::runtime_error {
+public:
+    explicit BindingError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+/*
+ * A typed view of an array of a received train.
+ *
+ * The view refers to the data held by the Client, which stay valid until
+ * the next call of Client::nextInto().
+ */
+template<typename T>
+class ArrayView {
+
+    template<typename> friend class StructDecoder;
+
+    const T* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::vector<std::size_t> shape_;
+
+public:
+    using value_type = T;
+    using const_iterator = const T*;
+
+    const T* data() const { return data_; }
+
+    std::size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    const std::vector<std::size_t>& shape() const { return shape_; }
+
+    const T& operator[](std::size_t i) const { return data_[i]; }
+
+    const_iterator begin() const { return data_; }
+
+    const_iterator end() const { return data_ + size_; }
+};
+
+
+namespace detail {
+
+template<typename T>
+struct IsArrayView : std::false_type {};
+
+template<typename T>
+struct IsArrayView<ArrayView<T>> : std::true_type {};
+
+inline bool strEquals(const msgpack::object& obj, const char* s, std::size_t size) {
+    return obj.type == msgpack::type::STR && obj.via.str.size == size &&
+           std::memcmp(obj.via.str.ptr, s, size) == 0;
+}
+
+// header fields and data of an array frame
+struct ArrayFrame {
+    StringRef path;
+    StringRef dtype;
+    std::size_t ndim;
+    std::array<std::size_t, HeaderFields::maxRank()> shape;
+    const void* data;
+    std::size_t bytes;
+};
+
+inline StringRef strField(const msgpack::object* obj) {
+    if (!obj || obj->type != msgpack::type::STR) return StringRef();
+    return StringRef(obj->via.str.ptr, obj->via.str.size);
+}
+
+/*
+ * Read the fields of an unpacked header which parseHeader() does not
+ * understand. The strings refer to the zone of the header.
+ *
+ * Exceptions:
+ * BindingError: if the shape is not an array of at most
+ *               HeaderFields::maxRank() non-negative integers
+ */
+inline void readHeaderFields(const msgpack::object& header, HeaderFields& fields) {
+    fields = HeaderFields();
+    fields.source = strField(findKey(header, "source"));
+    fields.content = strField(findKey(header, "content"));
+    fields.path = strField(findKey(header, "path"));
+    fields.dtype = strField(findKey(header, "dtype"));
+    fields.compression = strField(findKey(header, "compression"));
+
+    const msgpack::object* shape = findKey(header, "shape");
+    if (!shape) return;
+    if (shape->type != msgpack::type::ARRAY || shape->via.array.size > HeaderFields::maxRank())
+        throw BindingError(fields.path.str() + " has an invalid shape");
+    fields.has_shape = true;
+    fields.ndim = shape->via.array.size;
+    for (std::size_t k = 0; k < fields.ndim; ++k) {
+        try {
+            fields.shape[k] = shape->via.array.ptr[k].as<std::size_t>();
+        } catch (const msgpack::type_error&) {
+            throw BindingError(fields.path.str() + " has an invalid shape");
+        }
+    }
+}
+
+} // detail
+
+/*
+ * Decoder of a source into a struct declared with KARABO_BRIDGE_BIND.
+ *
+ * The header frames of the source and the location of each bound path,
+ * i.e. its index in the metadata, data or array frames, are resolved on
+ * the first train. On the following trains, only the cached header frames
+ * are parsed with parseHeader() and compared with the cached source, path
+ * and dtype, and the maps are only unpacked for the source itself, so that
+ * no ObjectMap is built and no path is searched for as long as the schema
+ * of the source does not change.
+ */
+template<typename T>
+class StructDecoder {
+
+    enum class Location { UNRESOLVED, METADATA, DATA, ARRAY };
+
+    struct Field {
+        Location location = Location::UNRESOLVED;
+        uint32_t index = 0; // index in the metadata or data map or in arrays_
+        const char* path = nullptr;
+        std::size_t path_size = 0;
+        uint64_t layout = 0; // layout_ for which an array was validated
+    };
+
+    // a header frame of the source in the cached layout
+    struct CachedFrame {
+        std::size_t index;
+        std::string content;
+        std::string path;
+        std::string dtype;
+    };
+
+    std::string source_;
+    std::vector<Field> fields_;
+    Field metadata_field_;
+
+    // header frames of the source, empty if they cannot be cached
+    std::vector<CachedFrame> layout_frames_;
+    std::size_t layout_size_ = 0; // number of frames of the cached train
+    uint64_t layout_ = 0; // incremented whenever the frames are resolved again
+    std::vector<HeaderFields> headers_;
+
+    // decoded frames of the current train
+    std::vector<msgpack::object_handle> handles_;
+    const msgpack::object* metadata_ = nullptr;
+    msgpack::object data_;
+    bool has_data_ = false;
+    std::vector<detail::ArrayFrame> arrays_;
+
+    // Return the value at the cached index of a map if its key matches,
+    // otherwise search for the key and update the index.
+    static const msgpack::object* lookup(const msgpack::object* map, Field& field,
+                                         const char* path, std::size_t size) {
+        if (!map || map->type != msgpack::type::MAP) return nullptr;
+        if (field.index < map->via.map.size &&
+            detail::strEquals(map->via.map.ptr[field.index].key, path, size))
+            return &map->via.map.ptr[field.index].val;
+        for (uint32_t i = 0; i < map->via.map.size; ++i) {
+            if (detail::strEquals(map->via.map.ptr[i].key, path, size)) {
+                field.index = i;
+                return &map->via.map.ptr[i].val;
+            }
+        }
+        return nullptr;
+    }
+
+    Field& field(std::size_t i, const char* path) {
+        if (fields_.size() <= i) fields_.resize(i + 1);
+        Field& f = fields_[i];
+        // the paths are literals of KARABO_BRIDGE_BIND
+        if (f.path != path) {
+            f.path = path;
+            f.path_size = std::strlen(path);
+        }
+        return f;
+    }
+
+    template<typename M>
+    void bindMember(std::size_t i, const char* path, M& member, std::false_type) {
+        Field& f = field(i, path);
+        std::size_t size = f.path_size;
+        const msgpack::object* data = has_data_ ? &data_ : nullptr;
+
+        const msgpack::object* obj = nullptr;
+        if (f.location == Location::METADATA) obj = lookup(metadata_, f, path, size);
+        else if (f.location == Location::DATA) obj = lookup(data, f, path, size);
+        if (!obj) {
+            // resolve the location again
+            f.location = Location::METADATA;
+            obj = lookup(metadata_, f, path, size);
+            if (!obj) {
+                f.location = Location::DATA;
+                obj = lookup(data, f, path, size);
+            }
+            if (!obj) {
+                f.location = Location::UNRESOLVED;
+                throw BindingError(std::string(path) + " is not found in " + source_);
+            }
+        }
+
+        try {
+            member = obj->as<M>();
+        } catch (const msgpack::type_error&) {
+            throw CastErrorMsgpackObject(std::string("Failed to cast ") + path);
+        }
+    }
+
+    template<typename M>
+    void bindMember(std::size_t i, const char* path, M& view, std::true_type) {
+        using E = typename M::value_type;
+        Field& f = field(i, path);
+
+        const detail::ArrayFrame* a = nullptr;
+        if (f.location == Location::ARRAY && f.layout == layout_) {
+            // the path and the dtype were verified with the layout
+            a = &arrays_[f.index];
+        } else {
+            for (std::size_t k = 0; k < arrays_.size(); ++k) {
+                const StringRef& p = arrays_[k].path;
+                if (p.size() == f.path_size && std::memcmp(p.data(), path, f.path_size) == 0) {
+                    a = &arrays_[k];
+                    f.index = static_cast<uint32_t>(k);
+                    break;
+                }
+            }
+            if (!a) {
+                f.location = Location::UNRESOLVED;
+                throw BindingError(std::string(path) + " is not an array of " + source_);
+            }
+            std::string cpp_dtype = a->dtype.str();
+            toCppTypeString(cpp_dtype);
+            // reuse the type checking of NDArray
+            NDArray(const_cast<void*>(a->data), {}, cpp_dtype).template data<E>();
+            f.location = Location::ARRAY;
+            f.layout = layout_;
+        }
+
+        view.shape_.assign(a->shape.begin(), a->shape.begin() + a->ndim);
+        std::size_t n = 1;
+        for (std::size_t k = 0; k < a->ndim; ++k) n *= a->shape[k];
+        if (n * sizeof(E) > a->bytes)
+            throw BindingError(std::string(path) + " has less data than its shape");
+        view.data_ = static_cast<const E*>(a->data);
+        view.size_ = n;
+    }
+
+    // Visit the (path, member) pairs of KARABO_BRIDGE_BIND.
+    class Binder {
+        StructDecoder& decoder_;
+        std::size_t i_ = 0;
+
+    public:
+        explicit Binder(StructDecoder& decoder) : decoder_(decoder) {}
+
+        void operator()() {}
+
+        template<typename M, typename... Rest>
+        void operator()(const char* path, M& member, Rest&&... rest) {
+            decoder_.bindMember(i_++, path, member, detail::IsArrayView<M>());
+            (*this)(std::forward<Rest>(rest)...);
+        }
+    };
+
+    // Parse the cached header frames into headers_ and return whether they
+    // still belong to the source with the same contents, paths and dtypes.
+    bool parseLayout(const MultipartMsg& mpmsg) {
+        if (layout_frames_.empty() || mpmsg.size() != layout_size_) return false;
+        headers_.resize(layout_frames_.size());
+        for (std::size_t j = 0; j < layout_frames_.size(); ++j) {
+            const CachedFrame& c = layout_frames_[j];
+            HeaderFields& fields = headers_[j];
+            if (!parseHeader(mpmsg[c.index].data(), mpmsg[c.index].size(), fields)) return false;
+            if (fields.source != source_ || fields.content != c.content) return false;
+            if (!c.path.empty() && (fields.path != c.path || fields.dtype != c.dtype)) return false;
+        }
+        return true;
+    }
+
+    /*
+     * Decode a header frame of the source and its data frame.
+     *
+     * @param header: the unpacked header, or nullptr if it was parsed by
+     *                parseHeader() into "fields".
+     */
+    void decodeFrame(MultipartMsg& mpmsg, std::size_t i, const HeaderFields& fields,
+                     msgpack::object_handle& oh, const msgpack::object* header, BufferPool* pool) {
+        if (fields.content == "msgpack") {
+            if (!header) {
+                msgpack::unpack(oh, static_cast<const char*>(mpmsg[i].data()), mpmsg[i].size());
+                header = &oh.get();
+            }
+            metadata_ = lookup(header, metadata_field_, "metadata", 8);
+            msgpack::object_handle oh_data;
+            msgpack::unpack(oh_data, static_cast<const char*>(mpmsg[i + 1].data()), mpmsg[i + 1].size());
+            data_ = oh_data.get();
+            has_data_ = true;
+            handles_.push_back(std::move(oh_data));
+        } else {
+            if (fields.path.isNull() || fields.dtype.isNull() || !fields.has_shape)
+                throw BindingError("Invalid array header of " + source_);
+
+            if (!fields.compression.isNull() && fields.content == "compressed-array") {
+                std::string dtype = fields.dtype.str();
+                toCppTypeString(dtype);
+                detail::decompressFrame(mpmsg[i + 1],
+                                        std::vector<std::size_t>(fields.shape.begin(),
+                                                                 fields.shape.begin() + fields.ndim),
+                                        dtype, toCompression(fields.compression.str()), pool);
+            }
+            arrays_.push_back(detail::ArrayFrame{fields.path, fields.dtype, fields.ndim, fields.shape,
+                                                 mpmsg[i + 1].data(), mpmsg[i + 1].size()});
+        }
+        // the objects live in the zone of the handle
+        if (header) handles_.push_back(std::move(oh));
+    }
+
+    // Find and decode the header frames of the source in all the frames.
+    void resolveLayout(MultipartMsg& mpmsg, bool& cacheable, BufferPool* pool) {
+        for (std::size_t i = 0; i + 1 < mpmsg.size(); i += 2) {
+            HeaderFields fields;
+            msgpack::object_handle oh;
+            const msgpack::object* header = nullptr;
+            if (!parseHeader(mpmsg[i].data(), mpmsg[i].size(), fields)) {
+                msgpack::unpack(oh, static_cast<const char*>(mpmsg[i].data()), mpmsg[i].size());
+                header = &oh.get();
+                const msgpack::object* source = detail::findKey(*header, "source");
+                if (!source || !detail::strEquals(*source, source_.data(), source_.size())) continue;
+                detail::readHeaderFields(*header, fields);
+                cacheable = false;
+            } else if (fields.source != source_) {
+                continue;
+            }
+
+            layout_frames_.push_back(CachedFrame{i, fields.content.str(),
+                                                 fields.content == "msgpack" ? "" : fields.path.str(),
+                                                 fields.dtype.str()});
+            decodeFrame(mpmsg, i, fields, oh, header, pool);
+        }
+    }
+
+public:
+    explicit StructDecoder(const std::string& source) : source_(source) {}
+
+    const std::string& source() const { return source_; }
+
+    /*
+     * Decode the frames of the source in a train into a struct.
+     *
+     * Compressed arrays are decompressed in place, into buffers from the
+     * pool if given. Array views refer to the frames.
+     *
+     * Return false if the source is not in the train.
+     *
+     * Exceptions:
+     * BindingError: if a bound path is not found or the header of an array
+     *               is invalid, e.g. its shape is not an array of at most
+     *               HeaderFields::maxRank() non-negative integers
+     * CastErrorMsgpackObject: if a value cannot be converted to its member
+     * TypeMismatchErrorNDArray: if the dtype of an array does not match its view
+     * CompressionError: if a compressed array cannot be decompressed
+     */
+    bool decode(MultipartMsg& mpmsg, T& out, BufferPool* pool=nullptr) {
+        handles_.clear();
+        arrays_.clear();
+        metadata_ = nullptr;
+        has_data_ = false;
+
+        if (parseLayout(mpmsg)) {
+            for (std::size_t j = 0; j < layout_frames_.size(); ++j) {
+                msgpack::object_handle oh;
+                decodeFrame(mpmsg, layout_frames_[j].index, headers_[j], oh, nullptr, pool);
+            }
+        } else {
+            // the frames of the source are resolved again
+            ++layout_;
+            layout_frames_.clear();
+            layout_size_ = mpmsg.size();
+            bool cacheable = true;
+            try {
+                resolveLayout(mpmsg, cacheable, pool);
+            } catch (...) {
+                layout_frames_.clear();
+                throw;
+            }
+            if (layout_frames_.empty()) return false;
+            if (!cacheable) layout_frames_.clear();
+        }
+
+        Binder binder(*this);
+        out.karaboBridgeBind(binder);
+        return true;
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_BINDING_HPP
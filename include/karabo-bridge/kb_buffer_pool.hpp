@@ -0,0 +1,213 @@
+/*
+    Pool of aligned receive buffers.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_BUFFER_POOL_HPP
+#define KARABO_BRIDGE_KB_BUFFER_POOL_HPP
+
+#include <zmq.hpp>
+
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+
+namespace karabo_bridge {
+
+/*
+ * Pages backing the buffers of a BufferPool. Huge pages only back the
+ * buffers of at least BufferPool::hugePageThreshold() bytes.
+ */
+enum class HugePages {
+    NONE, // regular pages
+    TRANSPARENT, // transparent huge pages, if enabled in the kernel
+    EXPLICIT // pages reserved in hugetlbfs, TRANSPARENT if none is available
+};
+
+/*
+ * A thread-safe pool of recycled buffers for receiving array data.
+ *
+ * Buffers are aligned to at least BufferPool::alignment() bytes and go back
+ * to the pool when the zmq::message_t wrapping them is destroyed. The pool
+ * must be owned by a std::shared_ptr, which is shared by all the buffers in
+ * use.
+ */
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+
+    struct Buffer {
+        void* ptr;
+        std::size_t capacity;
+        bool mapped; // allocated by mmap instead of posix_memalign
+    };
+
+    // hint passed to the free function of zmq::message_t
+    struct Lease {
+        std::shared_ptr<BufferPool> pool;
+        Buffer buffer;
+    };
+
+    HugePages huge_pages_;
+    std::size_t max_idle_bytes_;
+
+    std::mutex mtx_;
+    std::multimap<std::size_t, Buffer> idle_; // idle buffers keyed by capacity
+    std::size_t idle_bytes_ = 0;
+    std::size_t allocated_bytes_ = 0;
+
+    // Return true if a buffer of the given size is backed by huge pages.
+    bool useHugePages(std::size_t size) const {
+        return huge_pages_ != HugePages::NONE && size >= hugePageThreshold();
+    }
+
+    std::size_t granularity(std::size_t size) const {
+        return useHugePages(size) ? hugePageSize() : pageSize();
+    }
+
+    Buffer allocate(std::size_t capacity) {
+        bool huge = useHugePages(capacity);
+#ifdef __linux__
+        if (huge && huge_pages_ == HugePages::EXPLICIT) {
+            void* ptr = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (ptr != MAP_FAILED) return Buffer{ptr, capacity, true};
+        }
+#endif
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, granularity(capacity), capacity)) throw std::bad_alloc();
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        // only a hint, the kernel may ignore it
+        if (huge) madvise(ptr, capacity, MADV_HUGEPAGE);
+#endif
+        return Buffer{ptr, capacity, false};
+    }
+
+    static void deallocate(const Buffer& buffer) {
+#ifdef __linux__
+        if (buffer.mapped) {
+            munmap(buffer.ptr, buffer.capacity);
+            return;
+        }
+#endif
+        free(buffer.ptr);
+    }
+
+    Buffer acquire(std::size_t size) {
+        std::size_t page = granularity(size);
+        std::size_t capacity = (size + page - 1) / page * page;
+        if (!capacity) capacity = page;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            // do not waste more than half of a recycled buffer
+            auto it = idle_.lower_bound(capacity);
+            if (it != idle_.end() && it->first < 2 * capacity) {
+                Buffer buffer = it->second;
+                idle_.erase(it);
+                idle_bytes_ -= buffer.capacity;
+                return buffer;
+            }
+        }
+
+        Buffer buffer = allocate(capacity);
+        std::lock_guard<std::mutex> lock(mtx_);
+        allocated_bytes_ += buffer.capacity;
+        return buffer;
+    }
+
+    void release(const Buffer& buffer) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (idle_bytes_ + buffer.capacity <= max_idle_bytes_) {
+                idle_.insert(std::make_pair(buffer.capacity, buffer));
+                idle_bytes_ += buffer.capacity;
+                return;
+            }
+            allocated_bytes_ -= buffer.capacity;
+        }
+        deallocate(buffer);
+    }
+
+    static void releaseLease(void* /*data*/, void* hint) {
+        auto lease = static_cast<Lease*>(hint);
+        lease->pool->release(lease->buffer);
+        delete lease;
+    }
+
+public:
+    static constexpr std::size_t alignment() { return 64; }
+    static constexpr std::size_t pageSize() { return 4096; }
+    static constexpr std::size_t hugePageSize() { return 2 * 1024 * 1024; }
+    // Smaller buffers are backed by regular pages, so that rounding up to
+    // huge pages wastes no more than half of a buffer.
+    static constexpr std::size_t hugePageThreshold() { return hugePageSize() / 2; }
+
+    /*
+     * Constructor.
+     *
+     * @param huge_pages: pages backing the buffers.
+     * @param max_idle_bytes: idle buffers beyond this size are freed instead
+     *                        of being recycled.
+     */
+    explicit BufferPool(HugePages huge_pages=HugePages::TRANSPARENT,
+                        std::size_t max_idle_bytes=std::numeric_limits<std::size_t>::max())
+        : huge_pages_(huge_pages), max_idle_bytes_(max_idle_bytes) {}
+
+    ~BufferPool() { clear(); }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    /*
+     * Return a message of the given size backed by a buffer from the pool.
+     *
+     * Exceptions:
+     * std::bad_alloc if the allocation fails
+     * std::bad_weak_ptr if the pool is not owned by a std::shared_ptr
+     */
+    zmq::message_t message(std::size_t size) {
+        std::shared_ptr<BufferPool> self = shared_from_this();
+        Buffer buffer = acquire(size);
+        auto lease = new Lease{std::move(self), buffer};
+        return zmq::message_t(buffer.ptr, size, &BufferPool::releaseLease, lease);
+    }
+
+    // Free all the idle buffers.
+    void clear() {
+        std::multimap<std::size_t, Buffer> idle;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            idle.swap(idle_);
+            allocated_bytes_ -= idle_bytes_;
+            idle_bytes_ = 0;
+        }
+        for (auto& v : idle) deallocate(v.second);
+    }
+
+    // Return the bytes of the idle buffers.
+    std::size_t idleBytes() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return idle_bytes_;
+    }
+
+    // Return the bytes of all the buffers, either idle or in use.
+    std::size_t allocatedBytes() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return allocated_bytes_;
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_BUFFER_POOL_HPP
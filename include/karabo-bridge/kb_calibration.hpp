@@ -0,0 +1,427 @@
+/*
+    Calibration of raw detector data.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_CALIBRATION_HPP
+#define KARABO_BRIDGE_KB_CALIBRATION_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "kb_client.hpp"
+#include "kb_parallel.hpp"
+
+
+namespace karabo_bridge {
+
+class CalibrationError : public std::runtime_error {
+public:
+    explicit CalibrationError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+/*
+ * Meaning of the gain array of a detector with adaptive gain.
+ */
+enum class GainMode {
+    THRESHOLD, // analog gain signal compared with per-pixel thresholds, e.g. AGIPD
+    STAGE // gain stage index, e.g. JUNGFRAU
+};
+
+
+namespace detail {
+
+/*
+ * Correct a run of pixels of a pulse with the constants of its memory cell.
+ *
+ * The constants are selected without branches, which the compiler can
+ * vectorize.
+ */
+template<typename TData, typename TGain>
+inline void calibrateRunScalar(const TData* raw, const TGain* gain, GainMode mode,
+                               const float* offset, const float* relgain, const float* threshold,
+                               std::size_t stride, std::size_t n, float* dst) {
+    const float* o0 = offset;
+    const float* o1 = offset + stride;
+    const float* o2 = offset + 2 * stride;
+    const float* g0 = relgain;
+    const float* g1 = relgain + stride;
+    const float* g2 = relgain + 2 * stride;
+
+    if (!gain) {
+        for (std::size_t i = 0; i < n; ++i) dst[i] = (raw[i] - o0[i]) * g0[i];
+        return;
+    }
+
+    if (mode == GainMode::STAGE) {
+        for (std::size_t i = 0; i < n; ++i) {
+            // stages beyond the last one are treated as the last one
+            bool s1 = gain[i] >= 1;
+            bool s2 = gain[i] >= 2;
+            float o = s2 ? o2[i] : (s1 ? o1[i] : o0[i]);
+            float g = s2 ? g2[i] : (s1 ? g1[i] : g0[i]);
+            dst[i] = (raw[i] - o) * g;
+        }
+        return;
+    }
+
+    const float* t0 = threshold;
+    const float* t1 = threshold + stride;
+    for (std::size_t i = 0; i < n; ++i) {
+        float v = static_cast<float>(gain[i]);
+        bool s1 = v >= t0[i];
+        bool s2 = v >= t1[i];
+        float o = s2 ? o2[i] : (s1 ? o1[i] : o0[i]);
+        float g = s2 ? g2[i] : (s1 ? g1[i] : g0[i]);
+        dst[i] = (raw[i] - o) * g;
+    }
+}
+
+template<typename TData, typename TGain>
+inline void calibrateRun(const TData* raw, const TGain* gain, GainMode mode,
+                         const float* offset, const float* relgain, const float* threshold,
+                         std::size_t stride, std::size_t n, float* dst) {
+    calibrateRunScalar(raw, gain, mode, offset, relgain, threshold, stride, n, dst);
+}
+
+#if defined(__SSE2__)
+
+// Convert the 4 lower uint16 in a register to float.
+inline __m128 u16ToFloat(__m128i v) {
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+}
+
+inline __m128 select(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// AGIPD case: uint16 ADC and analog gain, 4 pixels per step.
+template<>
+inline void calibrateRun<uint16_t, uint16_t>(
+        const uint16_t* raw, const uint16_t* gain, GainMode mode,
+        const float* offset, const float* relgain, const float* threshold,
+        std::size_t stride, std::size_t n, float* dst) {
+    if (!gain || mode != GainMode::THRESHOLD) {
+        calibrateRunScalar(raw, gain, mode, offset, relgain, threshold, stride, n, dst);
+        return;
+    }
+
+    const float* o0 = offset;
+    const float* o1 = offset + stride;
+    const float* o2 = offset + 2 * stride;
+    const float* g0 = relgain;
+    const float* g1 = relgain + stride;
+    const float* g2 = relgain + 2 * stride;
+    const float* t0 = threshold;
+    const float* t1 = threshold + stride;
+
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = u16ToFloat(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(raw + i)));
+        __m128 v = u16ToFloat(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(gain + i)));
+        __m128 s1 = _mm_cmpge_ps(v, _mm_loadu_ps(t0 + i));
+        __m128 s2 = _mm_cmpge_ps(v, _mm_loadu_ps(t1 + i));
+
+        __m128 o = select(s2, _mm_loadu_ps(o2 + i), select(s1, _mm_loadu_ps(o1 + i), _mm_loadu_ps(o0 + i)));
+        __m128 g = select(s2, _mm_loadu_ps(g2 + i), select(s1, _mm_loadu_ps(g1 + i), _mm_loadu_ps(g0 + i)));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_sub_ps(x, o), g));
+    }
+
+    for (; i < n; ++i) {
+        float v = gain[i];
+        bool s1 = v >= t0[i];
+        bool s2 = v >= t1[i];
+        float o = s2 ? o2[i] : (s1 ? o1[i] : o0[i]);
+        float g = s2 ? g2[i] : (s1 ? g1[i] : g0[i]);
+        dst[i] = (raw[i] - o) * g;
+    }
+}
+
+#endif // __SSE2__
+
+} // detail
+
+/*
+ * Calibration constants of a detector with memory cells and up to three
+ * gain stages, and the correction
+ *
+ *     photon = (adc - offset[cell][stage]) * relgain[cell][stage]
+ *
+ * for each pixel. The gain stage is found from the gain array according to
+ * the GainMode. The constants are stored cell-major, so that the pixels of
+ * a pulse are corrected in a single linear pass over the data and the
+ * constants of its cell.
+ *
+ * Pixels can be masked by setting their relative gain to NaN.
+ */
+class Calibration {
+
+    std::size_t n_cells_;
+    std::size_t n_pixels_;
+    GainMode mode_;
+
+    std::vector<float> offset_; // [cells, 3, pixels]
+    std::vector<float> relgain_; // [cells, 3, pixels]
+    std::vector<float> threshold_; // [cells, 2, pixels]
+
+    void checkConstant(std::size_t cell, std::size_t stage, std::size_t n_stages) const {
+        if (cell >= n_cells_ || stage >= n_stages)
+            throw CalibrationError("Cell " + std::to_string(cell) + " or gain stage " +
+                                   std::to_string(stage) + " is out of range");
+    }
+
+    template<typename TCell>
+    void checkCells(const TCell* cell_ids, std::size_t n_pulses) const {
+        for (std::size_t p = 0; p < n_pulses; ++p) {
+            if (static_cast<std::size_t>(cell_ids[p]) >= n_cells_)
+                throw CalibrationError("Cell ID " + std::to_string(cell_ids[p]) + " is out of range");
+        }
+    }
+
+    // Correct pulse-major data or data with the pulses last, by a typed gain.
+    template<typename TGain>
+    void correctArray(const uint16_t* raw, const TGain* gain, const uint16_t* cells,
+                      std::size_t n_pulses, bool pulses_last, float* dst, ThreadPool& pool) const {
+        if (pulses_last) correctPulsesLast(raw, gain, cells, n_pulses, dst, pool);
+        else correct(raw, gain, cells, n_pulses, dst, pool);
+    }
+
+public:
+    static constexpr std::size_t nStages() { return 3; }
+
+    /*
+     * Constructor.
+     *
+     * The offsets are initialized to 0, the relative gains to 1 and the
+     * thresholds to infinity, i.e. every pixel is in the first gain stage.
+     *
+     * @param n_cells: number of memory cells.
+     * @param n_pixels: number of pixels of a pulse, e.g. modules * ss * fs.
+     * @param mode: meaning of the gain array.
+     */
+    Calibration(std::size_t n_cells, std::size_t n_pixels, GainMode mode=GainMode::THRESHOLD)
+        : n_cells_(n_cells), n_pixels_(n_pixels), mode_(mode),
+          offset_(n_cells * nStages() * n_pixels, 0.f),
+          relgain_(n_cells * nStages() * n_pixels, 1.f),
+          threshold_(n_cells * (nStages() - 1) * n_pixels, std::numeric_limits<float>::infinity()) {}
+
+    std::size_t nCells() const { return n_cells_; }
+
+    std::size_t nPixels() const { return n_pixels_; }
+
+    GainMode gainMode() const { return mode_; }
+
+    /*
+     * Return the nPixels() offsets of a memory cell and gain stage.
+     *
+     * Exceptions:
+     * CalibrationError: if the cell or the stage is out of range
+     */
+    float* offset(std::size_t cell, std::size_t stage) {
+        checkConstant(cell, stage, nStages());
+        return &offset_[(cell * nStages() + stage) * n_pixels_];
+    }
+
+    /*
+     * Return the nPixels() relative gains of a memory cell and gain stage.
+     *
+     * Exceptions:
+     * CalibrationError: if the cell or the stage is out of range
+     */
+    float* relativeGain(std::size_t cell, std::size_t stage) {
+        checkConstant(cell, stage, nStages());
+        return &relgain_[(cell * nStages() + stage) * n_pixels_];
+    }
+
+    /*
+     * Return the nPixels() thresholds of a memory cell between gain stage
+     * "stage" and "stage + 1".
+     *
+     * Exceptions:
+     * CalibrationError: if the cell or the stage is out of range
+     */
+    float* threshold(std::size_t cell, std::size_t stage) {
+        checkConstant(cell, stage, nStages() - 1);
+        return &threshold_[(cell * (nStages() - 1) + stage) * n_pixels_];
+    }
+
+    /*
+     * Correct the raw data of pulses in a single pass.
+     *
+     * @param raw: ADC data of shape [pulses, pixels].
+     * @param gain: gain data of shape [pulses, pixels], or nullptr for the
+     *              first gain stage only.
+     * @param cell_ids: memory cell of each pulse.
+     * @param n_pulses: number of pulses.
+     * @param dst: output buffer of shape [pulses, pixels].
+     * @param pool: thread pool.
+     *
+     * Exceptions:
+     * CalibrationError: if a cell ID is out of range
+     */
+    template<typename TData, typename TGain, typename TCell>
+    void correct(const TData* raw, const TGain* gain, const TCell* cell_ids,
+                 std::size_t n_pulses, float* dst, ThreadPool& pool=ThreadPool::global()) const {
+        checkCells(cell_ids, n_pulses);
+
+        // chunks of pixels which leave room for the constants in the L2 cache
+        const std::size_t chunk = std::min<std::size_t>(std::max<std::size_t>(n_pixels_, 1), 8192);
+        const std::size_t n_chunks = (n_pixels_ + chunk - 1) / chunk;
+        const std::size_t n_tasks = n_pulses * n_chunks;
+
+        pool.parallelFor(0, n_tasks, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t t = begin; t < end; ++t) {
+                std::size_t p = t / n_chunks;
+                std::size_t first = t % n_chunks * chunk;
+                std::size_t n = std::min(chunk, n_pixels_ - first);
+                std::size_t cell = static_cast<std::size_t>(cell_ids[p]);
+                std::size_t offset = p * n_pixels_ + first;
+
+                detail::calibrateRun(
+                    raw + offset, gain ? gain + offset : nullptr, mode_,
+                    &offset_[cell * nStages() * n_pixels_ + first],
+                    &relgain_[cell * nStages() * n_pixels_ + first],
+                    &threshold_[cell * (nStages() - 1) * n_pixels_ + first],
+                    n_pixels_, n, dst + offset);
+            }
+        }, std::max<std::size_t>(1, pool.grainFor(n_tasks)));
+    }
+
+    /*
+     * Correct raw data with the pulses last, e.g. [modules, ss, fs, pulses]
+     * as sent by the bridge, into pulse-major output in the same pass.
+     *
+     * Tiles of pixels are transposed into a small buffer which stays in
+     * the cache, from which the pixels of each pulse are corrected by the
+     * same kernel as pulse-major data.
+     *
+     * @param raw: ADC data of shape [pixels, pulses].
+     * @param gain: gain data of shape [pixels, pulses], or nullptr for the
+     *              first gain stage only.
+     * @param cell_ids: memory cell of each pulse.
+     * @param n_pulses: number of pulses.
+     * @param dst: output buffer of shape [pulses, pixels].
+     * @param pool: thread pool.
+     *
+     * Exceptions:
+     * CalibrationError: if a cell ID is out of range
+     */
+    template<typename TData, typename TGain, typename TCell>
+    void correctPulsesLast(const TData* raw, const TGain* gain, const TCell* cell_ids,
+                           std::size_t n_pulses, float* dst, ThreadPool& pool=ThreadPool::global()) const {
+        checkCells(cell_ids, n_pulses);
+
+        const std::size_t tile = 128; // pixels
+        const std::size_t n_tiles = (n_pixels_ + tile - 1) / tile;
+
+        pool.parallelFor(0, n_tiles, [&](std::size_t begin, std::size_t end) {
+            std::vector<TData> raw_tile(n_pulses * tile);
+            std::vector<TGain> gain_tile(gain ? n_pulses * tile : 0);
+            for (std::size_t t = begin; t < end; ++t) {
+                std::size_t first = t * tile;
+                std::size_t n = std::min(tile, n_pixels_ - first);
+
+                // transpose the tile to [pulses, pixels]
+                for (std::size_t i = 0; i < n; ++i) {
+                    const TData* r = raw + (first + i) * n_pulses;
+                    for (std::size_t p = 0; p < n_pulses; ++p) raw_tile[p * tile + i] = r[p];
+                }
+                if (gain) {
+                    for (std::size_t i = 0; i < n; ++i) {
+                        const TGain* g = gain + (first + i) * n_pulses;
+                        for (std::size_t p = 0; p < n_pulses; ++p) gain_tile[p * tile + i] = g[p];
+                    }
+                }
+
+                for (std::size_t p = 0; p < n_pulses; ++p) {
+                    std::size_t cell = static_cast<std::size_t>(cell_ids[p]);
+                    detail::calibrateRun(
+                        &raw_tile[p * tile], gain ? &gain_tile[p * tile] : nullptr, mode_,
+                        &offset_[cell * nStages() * n_pixels_ + first],
+                        &relgain_[cell * nStages() * n_pixels_ + first],
+                        &threshold_[cell * (nStages() - 1) * n_pixels_ + first],
+                        n_pixels_, n, dst + p * n_pixels_ + first);
+                }
+            }
+        }, std::max<std::size_t>(1, pool.grainFor(n_tiles)));
+    }
+
+    /*
+     * Correct the "image.data", "image.gain" and "image.cellId" arrays of a
+     * train. The data must be uint16_t, the gain uint16_t or uint8_t and
+     * the cell IDs uint16_t.
+     *
+     * @param data: ADC data with nPixels() pixels per pulse, of shape
+     *              [pulses, ...] or [..., pulses] as sent by the bridge.
+     * @param gain: gain data of the same shape.
+     * @param cell_id: memory cells of shape [pulses].
+     * @param pulse_axis: the pulse axis, which must be the first or the
+     *                    last one.
+     * @param dst: output buffer of the size of the data.
+     * @param pool: thread pool.
+     *
+     * Return an NDArray of float which refers to the output buffer. It is
+     * pulse-major, i.e. a last pulse axis is moved to the front as by
+     * toPulseMajor, without a separate transpose.
+     *
+     * Exceptions:
+     * CalibrationError: if the shapes do not match, the pulse axis is
+     *                   neither the first nor the last one or a cell ID is
+     *                   out of range
+     * TypeMismatchErrorNDArray: if a dtype is not supported
+     */
+    NDArray correct(const NDArray& data, const NDArray& gain, const NDArray& cell_id,
+                    std::size_t pulse_axis, float* dst, ThreadPool& pool=ThreadPool::global()) const {
+        const Shape& shape = data.shape();
+        if (shape.empty() || gain.shape() != shape)
+            throw CalibrationError("The data and gain arrays do not match");
+        if (pulse_axis != 0 && pulse_axis != shape.size() - 1)
+            throw CalibrationError("The pulse axis must be the first or the last one");
+        std::size_t n_pulses = shape[pulse_axis];
+        if (n_pulses * n_pixels_ != data.size())
+            throw CalibrationError("The data do not have " + std::to_string(n_pixels_) +
+                                   " pixels per pulse");
+        if (cell_id.size() != n_pulses)
+            throw CalibrationError("The cell IDs do not match the pulses");
+
+        const uint16_t* raw = data.data<uint16_t>();
+        const uint16_t* cells = cell_id.data<uint16_t>();
+        bool pulses_last = pulse_axis != 0;
+        if (gain.dtypeId() == DType::UINT8)
+            correctArray(raw, gain.data<uint8_t>(), cells, n_pulses, pulses_last, dst, pool);
+        else
+            correctArray(raw, gain.data<uint16_t>(), cells, n_pulses, pulses_last, dst, pool);
+
+        std::vector<std::size_t> out_shape {n_pulses};
+        for (std::size_t k = 0; k < shape.size(); ++k) {
+            if (k != pulse_axis) out_shape.push_back(shape[k]);
+        }
+        return NDArray(dst, out_shape, DType::FLOAT);
+    }
+
+    /*
+     * Correct the arrays of a train with the pulses first, i.e. of shape
+     * [pulses, ...].
+     */
+    NDArray correct(const NDArray& data, const NDArray& gain, const NDArray& cell_id,
+                    float* dst, ThreadPool& pool=ThreadPool::global()) const {
+        return correct(data, gain, cell_id, 0, dst, pool);
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_CALIBRATION_HPP
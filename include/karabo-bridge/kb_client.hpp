@@ -16,6 +16,13 @@
 #include <zmq.hpp>
 #include <msgpack.hpp>
 
+#include "kb_buffer_pool.hpp"
+#include "kb_compression.hpp"
+#include "kb_float16.hpp"
+#include "kb_header.hpp"
+#include "kb_train_stats.hpp"
+
+#include <algorithm>
 #include <string>
 #include <stack>
 #include <array>
@@ -26,6 +33,16 @@
 #include <exception>
 #include <limits>
 #include <type_traits>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <vector>
 
 
 #ifdef __GNUC__
@@ -81,6 +98,162 @@ public:
   ZmqTimeoutError() : std::runtime_error("") {}
 };
 
+class MemoryBudgetError : public std::runtime_error {
+public:
+    explicit MemoryBudgetError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+class BatchError : public std::runtime_error {
+public:
+    explicit BatchError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+/*
+ * Policy applied by the Client when the data held by the received kb_data
+ * would exceed the memory budget.
+ */
+enum class MemoryPolicy {
+    BACKPRESSURE, // stop requesting data until enough memory is released
+    DROP_INCOMING, // receive and discard the train which does not fit
+    FAIL_FAST // throw MemoryBudgetError
+};
+
+/*
+ * Type of the socket of a Client, which must match the socket of the server.
+ */
+enum class SocketType {
+    REQ, // request each train from a REP server, the trains are shared by the clients
+    SUB, // subscribe to a PUB server, every client receives all the trains
+    PULL // pull from a PUSH server, the trains are shared by the clients
+};
+
+/*
+ * Data type of an Object.
+ */
+enum class DType : uint8_t {
+    BOOL, INT8, UINT8, INT16, UINT16, INT32, UINT32, INT64, UINT64, FLOAT16, FLOAT, DOUBLE,
+    STRING, CHAR,
+    // msgpack objects which are not converted
+    NIL, ARRAY, MAP, BIN, EXT,
+    UNDEFINED, // elements of a map or ext
+    UNKNOWN, // elements of an empty array
+    OTHER // an unrecognized dtype of an NDArray, whose name is kept by the NDArray
+};
+
+namespace detail {
+
+inline const std::array<std::string, 22>& dtypeNames() {
+    static const std::array<std::string, 22> names {{
+        "bool", "int8_t", "uint8_t", "int16_t", "uint16_t", "int32_t", "uint32_t",
+        "int64_t", "uint64_t", "float16", "float", "double",
+        "string", "char",
+        "MSGPACK_OBJECT_NIL", "MSGPACK_OBJECT_ARRAY", "MSGPACK_OBJECT_MAP",
+        "MSGPACK_OBJECT_BIN", "MSGPACK_OBJECT_EXT",
+        "undefined", "unknown", ""
+    }};
+    return names;
+}
+
+} // detail
+
+// Return the name of a data type, e.g. "uint16_t". Empty for DType::OTHER.
+inline const std::string& dtypeName(DType dtype) {
+    return detail::dtypeNames()[static_cast<std::size_t>(dtype)];
+}
+
+// Return the data type of a name returned by dtypeName(), DType::OTHER if unknown.
+inline DType toDType(const std::string& name) {
+    auto& names = detail::dtypeNames();
+    for (std::size_t i = 0; i < static_cast<std::size_t>(DType::OTHER); ++i) {
+        if (names[i] == name) return static_cast<DType>(i);
+    }
+    return DType::OTHER;
+}
+
+// Return the data type of a C++ type, DType::OTHER if it is not a numeric type.
+template<typename T> inline DType dtypeOf() { return DType::OTHER; }
+template<> inline DType dtypeOf<bool>() { return DType::BOOL; }
+template<> inline DType dtypeOf<int8_t>() { return DType::INT8; }
+template<> inline DType dtypeOf<uint8_t>() { return DType::UINT8; }
+template<> inline DType dtypeOf<int16_t>() { return DType::INT16; }
+template<> inline DType dtypeOf<uint16_t>() { return DType::UINT16; }
+template<> inline DType dtypeOf<int32_t>() { return DType::INT32; }
+template<> inline DType dtypeOf<uint32_t>() { return DType::UINT32; }
+template<> inline DType dtypeOf<int64_t>() { return DType::INT64; }
+template<> inline DType dtypeOf<uint64_t>() { return DType::UINT64; }
+template<> inline DType dtypeOf<Float16>() { return DType::FLOAT16; }
+template<> inline DType dtypeOf<float>() { return DType::FLOAT; }
+template<> inline DType dtypeOf<double>() { return DType::DOUBLE; }
+
+/*
+ * Shape of an Object, which is stored inline up to rank 8.
+ */
+class Shape {
+public:
+    using value_type = std::size_t;
+    using size_type = std::size_t;
+    using const_iterator = const std::size_t*;
+    using iterator = const_iterator;
+
+    static constexpr std::size_t inlineRank() { return 8; }
+
+private:
+    std::array<std::size_t, 8> inline_ {{}};
+    std::vector<std::size_t> heap_; // only used above inlineRank()
+    std::size_t ndim_ = 0;
+
+public:
+    Shape() = default;
+
+    template<typename InputIt>
+    Shape(InputIt first, InputIt last) {
+        ndim_ = static_cast<std::size_t>(std::distance(first, last));
+        if (ndim_ > inlineRank()) heap_.assign(first, last);
+        else std::copy(first, last, inline_.begin());
+    }
+
+    Shape(std::initializer_list<std::size_t> dims) : Shape(dims.begin(), dims.end()) {}
+
+    Shape(const std::vector<std::size_t>& dims) : Shape(dims.begin(), dims.end()) {}
+
+    const std::size_t* data() const { return heap_.empty() ? inline_.data() : heap_.data(); }
+
+    std::size_t size() const { return ndim_; }
+
+    bool empty() const { return ndim_ == 0; }
+
+    std::size_t operator[](std::size_t i) const { return data()[i]; }
+
+    const_iterator begin() const { return data(); }
+
+    const_iterator end() const { return data() + ndim_; }
+
+    // Return the number of elements, 1 for rank 0.
+    std::size_t numel() const {
+        std::size_t n = 1;
+        for (auto v : *this) n *= v;
+        return n;
+    }
+
+    operator std::vector<std::size_t>() const { return std::vector<std::size_t>(begin(), end()); }
+};
+
+inline bool operator==(const Shape& lhs, const Shape& rhs) {
+    return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+inline bool operator==(const Shape& lhs, const std::vector<std::size_t>& rhs) {
+    return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+inline bool operator==(const std::vector<std::size_t>& lhs, const Shape& rhs) { return rhs == lhs; }
+
+inline bool operator!=(const Shape& lhs, const Shape& rhs) { return !(lhs == rhs); }
+
+inline bool operator!=(const Shape& lhs, const std::vector<std::size_t>& rhs) { return !(lhs == rhs); }
+
+inline bool operator!=(const std::vector<std::size_t>& lhs, const Shape& rhs) { return !(rhs == lhs); }
+
 /*
  * Abstract class for MsgpackObject and NDArray.
  */
@@ -90,57 +263,215 @@ protected:
     // size of the flattened array, 0 for scalar data and NIL
     std::size_t size_;
     // data type, if container, it refers to the data type in the container
-    std::string dtype_;
+    DType dtype_;
+    // name of DType::OTHER
+    std::string dtype_name_;
+    // empty for scalar data
+    Shape shape_;
 
 public:
-    Object() : size_(0) {};
+    Object() : size_(0), dtype_(DType::UNKNOWN) {};
     virtual ~Object() = default;
 
     virtual std::size_t size() const = 0;
-    virtual std::string dtype() const = 0;
-    // empty vector for scalar data
-    virtual std::vector<std::size_t> shape() const = 0;
+    virtual const std::string& dtype() const = 0;
+    // empty shape for scalar data
+    virtual const Shape& shape() const = 0;
     // empty string for scalar data
-    virtual std::string containerType() const = 0;
+    virtual const std::string& containerType() const = 0;
+
+    DType dtypeId() const { return dtype_; }
 };
 
+/*
+ * Read-only span of a contiguous typed array.
+ *
+ * Unlike the ArrayView of kb_binding.hpp, the span shares the ownership
+ * of the elements, so that it stays valid when the object it was taken
+ * from is destroyed.
+ */
+template<typename T>
+class ArraySpan {
+
+    std::shared_ptr<const T> data_;
+    std::size_t size_ = 0;
+
+public:
+    using value_type = T;
+    using const_iterator = const T*;
+
+    ArraySpan() = default;
+
+    ArraySpan(std::shared_ptr<const T> data, std::size_t size) : data_(std::move(data)), size_(size) {}
+
+    const T* data() const { return data_.get(); }
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const T& operator[](std::size_t i) const { return data_.get()[i]; }
+
+    const T* begin() const { return data_.get(); }
+    const T* end() const { return data_.get() + size_; }
+
+    std::vector<T> toVector() const { return std::vector<T>(begin(), end()); }
+};
+
+namespace detail {
+
+// Typed elements of a msgpack array decoded by MsgpackObject::view().
+struct ArrayCache {
+    DType dtype;
+    std::shared_ptr<const void> data;
+};
+
+// Holder of the ArrayCache of an array, shared by the copies of a
+// MsgpackObject made after its first view().
+struct ArrayCacheHolder {
+    std::shared_ptr<const ArrayCache> entry; // only accessed atomically
+};
+
+// Return whether an integer is in the range of a type.
+template<typename T>
+inline typename std::enable_if<std::is_integral<T>::value, bool>::type fitsIn(uint64_t v) {
+    return v <= static_cast<uint64_t>(std::numeric_limits<T>::max());
+}
+
+template<typename T>
+inline typename std::enable_if<std::is_integral<T>::value, bool>::type fitsIn(int64_t v) {
+    return std::is_signed<T>::value ? v >= static_cast<int64_t>(std::numeric_limits<T>::min()) : v >= 0;
+}
+
+template<typename T, typename I>
+inline typename std::enable_if<std::is_floating_point<T>::value, bool>::type fitsIn(I) {
+    return true;
+}
+
+/*
+ * Decode the elements of a msgpack array of numbers or bools into "dst".
+ *
+ * Arrays whose elements all have the same encoding are converted in a
+ * single loop without branches, which the compiler can vectorize. Mixed
+ * encodings fall back to the element-wise msgpack conversion. The
+ * conversion rules are those of msgpack, e.g. a float is not converted
+ * to an integer and an out-of-range integer is an error.
+ *
+ * Return false if an element cannot be converted.
+ */
+template<typename T>
+inline bool decodeArray(const msgpack::object* src, std::size_t n, T* dst) {
+    using msgpack::type::object_type;
+    if (!n) return true;
+
+    object_type type = src[0].type;
+    if (type == object_type::FLOAT32) type = object_type::FLOAT64;
+    bool uniform = true;
+    for (std::size_t i = 1; i < n; ++i) {
+        object_type t = src[i].type == object_type::FLOAT32 ? object_type::FLOAT64 : src[i].type;
+        uniform &= t == type;
+    }
+
+    if (uniform && !std::is_same<T, bool>::value) {
+        if (type == object_type::POSITIVE_INTEGER) {
+            uint64_t max = 0;
+            for (std::size_t i = 0; i < n; ++i) max = std::max(max, src[i].via.u64);
+            if (!fitsIn<T>(max)) return false;
+            for (std::size_t i = 0; i < n; ++i) dst[i] = static_cast<T>(src[i].via.u64);
+            return true;
+        }
+        if (type == object_type::NEGATIVE_INTEGER) {
+            int64_t min = 0;
+            for (std::size_t i = 0; i < n; ++i) min = std::min(min, src[i].via.i64);
+            if (!fitsIn<T>(min)) return false;
+            for (std::size_t i = 0; i < n; ++i) dst[i] = static_cast<T>(src[i].via.i64);
+            return true;
+        }
+        if (type == object_type::FLOAT64) {
+            if (!std::is_floating_point<T>::value) return false;
+            for (std::size_t i = 0; i < n; ++i) dst[i] = static_cast<T>(src[i].via.f64);
+            return true;
+        }
+    }
+    if (uniform && std::is_same<T, bool>::value && type == object_type::BOOLEAN) {
+        for (std::size_t i = 0; i < n; ++i) dst[i] = static_cast<T>(src[i].via.boolean);
+        return true;
+    }
+
+    try {
+        for (std::size_t i = 0; i < n; ++i) dst[i] = src[i].as<T>();
+    } catch (std::bad_cast&) {
+        return false;
+    }
+    return true;
+}
+
+} // detail
+
 /*
  * A container that holds a msgpack::object for deferred unpack.
  */
 class MsgpackObject : public Object {
 
     msgpack::object value_; // msgpack::object has a shallow copy constructor
+    // keeps the memory of value_, e.g. the zone it was unpacked into, alive
+    std::shared_ptr<const void> owner_;
+    // elements converted by view(), created by the first call and shared
+    // by the copies made after it; only accessed atomically
+    mutable std::shared_ptr<detail::ArrayCacheHolder> cache_;
 
 public:
     MsgpackObject() = default;  // must be default constructable
 
+    /*
+     * Construct an object which shares the ownership of the memory of the
+     * value, so that it stays valid on its own.
+     */
+    MsgpackObject(const msgpack::object& value, std::shared_ptr<const void> owner)
+            : MsgpackObject(value) {
+        owner_ = std::move(owner);
+    }
+
     explicit MsgpackObject(const msgpack::object& value): value_(value) {
         if (value.type == msgpack::type::object_type::ARRAY
                 || value.type == msgpack::type::object_type::MAP
-                || value.type == msgpack::type::object_type::BIN)
+                || value.type == msgpack::type::object_type::BIN) {
             size_ = value.via.array.size;
+            if (size_) shape_ = Shape{size_};
+        }
 
         if (value.type == msgpack::type::object_type::ARRAY)
             if (value.via.array.ptr)
-                dtype_ = getTypeString(value.via.array.ptr[0].type);
+                dtype_ = getType(value.via.array.ptr[0].type);
             else
-                dtype_ = "unknown";
+                dtype_ = DType::UNKNOWN;
         else if (value.type == msgpack::type::object_type::BIN)
-            dtype_ = "char";
+            dtype_ = DType::CHAR;
         else if (value.type == msgpack::type::object_type::MAP
                 || value.type == msgpack::type::object_type::EXT)
-            dtype_ = "undefined";
-        else dtype_ = getTypeString(value.type);
+            dtype_ = DType::UNDEFINED;
+        else dtype_ = getType(value.type);
     }
 
     ~MsgpackObject() override = default;
 
-    MsgpackObject(const MsgpackObject&) = default;
-    MsgpackObject& operator=(const MsgpackObject&) = default;
+    // The cache is loaded atomically, since view() may set it concurrently.
+    MsgpackObject(const MsgpackObject& other)
+        : Object(other), value_(other.value_), owner_(other.owner_),
+          cache_(std::atomic_load(&other.cache_)) {}
+
+    MsgpackObject& operator=(const MsgpackObject& other) {
+        Object::operator=(other);
+        value_ = other.value_;
+        owner_ = other.owner_;
+        std::atomic_store(&cache_, std::atomic_load(&other.cache_));
+        return *this;
+    }
 
     MsgpackObject(MsgpackObject&&) = default;
     MsgpackObject& operator=(MsgpackObject&&) = default;
 
+    // Return the owner of the memory of the value, null if it is not owned.
+    const std::shared_ptr<const void>& owner() const { return owner_; }
+
     /*
      * Cast the held msgpack::object to a given type.
      *
@@ -162,42 +493,87 @@ public:
         }
     }
 
-    std::string dtype() const override { return dtype_; }
+    /*
+     * Return a span of the elements of an array of numbers or bools
+     * converted to a given type.
+     *
+     * The conversion is done once and cached, so that the following calls
+     * with the same type, on this object or the copies made after the first
+     * call, return the same elements without converting them again. It can
+     * be called on copies in several threads. Calling it with another type
+     * replaces the cache, but not the elements of the spans taken before.
+     *
+     * Exceptions:
+     * CastErrorMsgpackObject: if the object is not an array or an element
+     *                         cannot be converted
+     */
+    template<typename T>
+    ArraySpan<T> view() const {
+        static_assert(std::is_arithmetic<T>::value, "The elements must be numbers or bools");
+
+        // types without a DType, e.g. char, are not cached
+        const bool cached = dtypeOf<T>() != DType::OTHER;
+        std::shared_ptr<detail::ArrayCacheHolder> holder;
+        if (cached) holder = std::atomic_load(&cache_);
+        std::shared_ptr<const detail::ArrayCache> cache;
+        if (holder) cache = std::atomic_load(&holder->entry);
+        if (cache && cache->dtype == dtypeOf<T>())
+            return ArraySpan<T>(std::static_pointer_cast<const T>(cache->data), size_);
+
+        if (value_.type != msgpack::type::object_type::ARRAY)
+            throw CastErrorMsgpackObject("The expected type is an array-like of " + dtypeName(dtypeOf<T>()));
+
+        std::shared_ptr<T> data(new T[size_], std::default_delete<T[]>());
+        if (!detail::decodeArray(value_.via.array.ptr, size_, data.get()))
+            throw CastErrorMsgpackObject("Cannot convert the array-like of " + dtype()
+                                         + " to " + dtypeName(dtypeOf<T>()));
+
+        if (!cached) return ArraySpan<T>(std::move(data), size_);
+        auto entry = std::make_shared<detail::ArrayCache>();
+        entry->dtype = dtypeOf<T>();
+        entry->data = data;
+        if (!holder) {
+            // another thread may have created the holder meanwhile
+            auto created = std::make_shared<detail::ArrayCacheHolder>();
+            if (std::atomic_compare_exchange_strong(&cache_, &holder, created)) holder = std::move(created);
+        }
+        std::atomic_store(&holder->entry, std::shared_ptr<const detail::ArrayCache>(std::move(entry)));
+        return ArraySpan<T>(std::move(data), size_);
+    }
+
+    const std::string& dtype() const override { return dtypeName(dtype_); }
 
     std::size_t size() const override { return size_; }
 
-    std::vector<std::size_t> shape() const override {
-        if (size_) return std::vector<std::size_t>({size_});
-        return std::vector<std::size_t>();
-    }
+    const Shape& shape() const override { return shape_; }
 
-    std::string containerType() const override {
-        if (!size_) return ""; // scalar and NIL
+    const std::string& containerType() const override {
+        static const std::string scalar, array_like("array-like"), map("map");
+        if (!size_) return scalar; // scalar and NIL
         if (value_.type == msgpack::type::object_type::ARRAY
                 || value_.type == msgpack::type::object_type::BIN)
-            return "array-like";
-        if (value_.type == msgpack::type::object_type::MAP) return "map";
-        return getTypeString(value_.type);
+            return array_like;
+        if (value_.type == msgpack::type::object_type::MAP) return map;
+        return dtypeName(getType(value_.type));
     }
 
 private:
-    // map msgpack object types to strings
-    static std::string getTypeString(msgpack::type::object_type type) {
-        const std::map<msgpack::type::object_type, std::string> map {
-            {msgpack::type::object_type::NIL, "MSGPACK_OBJECT_NIL"},
-            {msgpack::type::object_type::BOOLEAN, "bool"},
-            {msgpack::type::object_type::POSITIVE_INTEGER, "uint64_t"},
-            {msgpack::type::object_type::NEGATIVE_INTEGER, "int64_t"},
-            {msgpack::type::object_type::FLOAT32, "float"},
-            {msgpack::type::object_type::FLOAT64, "double"},
-            {msgpack::type::object_type::STR, "string"},
-            {msgpack::type::object_type::ARRAY, "MSGPACK_OBJECT_ARRAY"},
-            {msgpack::type::object_type::MAP, "MSGPACK_OBJECT_MAP"},
-            {msgpack::type::object_type::BIN, "MSGPACK_OBJECT_BIN"},
-            {msgpack::type::object_type::EXT, "MSGPACK_OBJECT_EXT"}
-        };
-
-        return map.at(type);
+    // map msgpack object types to data types
+    static DType getType(msgpack::type::object_type type) {
+        switch (type) {
+            case msgpack::type::object_type::NIL: return DType::NIL;
+            case msgpack::type::object_type::BOOLEAN: return DType::BOOL;
+            case msgpack::type::object_type::POSITIVE_INTEGER: return DType::UINT64;
+            case msgpack::type::object_type::NEGATIVE_INTEGER: return DType::INT64;
+            case msgpack::type::object_type::FLOAT32: return DType::FLOAT;
+            case msgpack::type::object_type::FLOAT64: return DType::DOUBLE;
+            case msgpack::type::object_type::STR: return DType::STRING;
+            case msgpack::type::object_type::ARRAY: return DType::ARRAY;
+            case msgpack::type::object_type::MAP: return DType::MAP;
+            case msgpack::type::object_type::BIN: return DType::BIN;
+            case msgpack::type::object_type::EXT: return DType::EXT;
+            default: return DType::UNDEFINED;
+        }
     }
 };
 
@@ -206,6 +582,114 @@ using ObjectPair = std::pair<std::string, MsgpackObject>;
 
 namespace detail {
 
+/*
+ * Thread-safe accounting of the bytes held by the kb_data from a client.
+ */
+class MemoryTracker {
+    std::atomic<std::size_t> in_use_;
+    std::atomic<std::size_t> peak_;
+
+public:
+    MemoryTracker() : in_use_(0), peak_(0) {}
+
+    void acquire(std::size_t n) {
+        std::size_t current = in_use_.fetch_add(n) + n;
+        std::size_t peak = peak_.load();
+        while (current > peak && !peak_.compare_exchange_weak(peak, current)) {}
+    }
+
+    void release(std::size_t n) { in_use_.fetch_sub(n); }
+
+    std::size_t inUse() const { return in_use_.load(); }
+
+    std::size_t peak() const { return peak_.load(); }
+
+    void resetPeak() { peak_.store(in_use_.load()); }
+};
+
+/*
+ * Bytes charged to a MemoryTracker, which are released on destruction.
+ */
+class MemoryLease {
+    std::shared_ptr<MemoryTracker> tracker_;
+    std::size_t bytes_ = 0;
+
+public:
+    MemoryLease() = default;
+
+    ~MemoryLease() { reset(); }
+
+    MemoryLease(const MemoryLease&) = delete;
+    MemoryLease& operator=(const MemoryLease&) = delete;
+
+    MemoryLease(MemoryLease&& other) noexcept
+        : tracker_(std::move(other.tracker_)), bytes_(other.bytes_) {
+        other.bytes_ = 0;
+    }
+
+    MemoryLease& operator=(MemoryLease&& other) noexcept {
+        if (this != &other) {
+            reset();
+            tracker_ = std::move(other.tracker_);
+            bytes_ = other.bytes_;
+            other.bytes_ = 0;
+        }
+        return *this;
+    }
+
+    void charge(const std::shared_ptr<MemoryTracker>& tracker, std::size_t n) {
+        if (tracker_ != tracker) {
+            reset();
+            tracker_ = tracker;
+        }
+        if (tracker_) {
+            tracker_->acquire(n);
+            bytes_ += n;
+        }
+    }
+
+    void reset() {
+        if (tracker_ && bytes_) tracker_->release(bytes_);
+        tracker_.reset();
+        bytes_ = 0;
+    }
+
+    std::size_t bytes() const { return bytes_; }
+
+    void swap(MemoryLease& other) noexcept {
+        tracker_.swap(other.tracker_);
+        std::swap(bytes_, other.bytes_);
+    }
+};
+
+/*
+ * A received frame, shared by the kb_data and the objects which refer to
+ * it. The bytes charged to a memory budget are released with the frame.
+ */
+struct Frame {
+    explicit Frame(zmq::message_t&& msg) : msg(std::move(msg)) {}
+
+    zmq::message_t msg;
+    MemoryLease lease;
+};
+
+/*
+ * Convert an unpacked map into objects which share the ownership of its
+ * memory.
+ *
+ * Exceptions:
+ * msgpack::type_error: if it is not a map with string keys
+ */
+inline ObjectMap sharedObjectMap(const msgpack::object& obj, const std::shared_ptr<const void>& owner) {
+    if (obj.type != msgpack::type::MAP) throw msgpack::type_error();
+    ObjectMap map;
+    for (uint32_t i = 0; i < obj.via.map.size; ++i) {
+        const msgpack::object_kv& kv = obj.via.map.ptr[i];
+        map[kv.key.as<std::string>()] = MsgpackObject(kv.val, owner);
+    }
+    return map;
+}
+
 template<typename Container, typename ElementType>
 struct as_imp {
     Container operator()(void* ptr_, std::size_t size) {
@@ -235,23 +719,32 @@ struct as_imp<std::array<ElementType, N>, ElementType> {
  */
 class NDArray : public Object {
 
-    void* ptr_; // pointer to the data chunk
-    std::vector<std::size_t> shape_; // shape of the array
+    void* ptr_ = nullptr; // pointer to the data chunk
+    // keeps the data chunk, e.g. the received frame, alive
+    std::shared_ptr<const void> owner_;
 
 public:
     NDArray() = default;
 
-    // shape and dtype should be moved into the constructor
-    NDArray(void* ptr, const std::vector<std::size_t>& shape, const std::string& dtype):
-            ptr_(ptr), shape_(shape) {
-        std::size_t size = 1;
+    /*
+     * Construct an array of the data at ptr, which must outlive it unless
+     * the array shares its ownership via "owner".
+     */
+    NDArray(void* ptr, const Shape& shape, DType dtype,
+            std::shared_ptr<const void> owner=nullptr) : ptr_(ptr), owner_(std::move(owner)) {
+        shape_ = shape;
         // Overflow is not expected since otherwise zmq::message_t
         // cannot hold the data.
-        for (auto& v : shape) size *= v;
-        size_ = size;
+        size_ = shape.numel();
         dtype_ = dtype;
     }
 
+    NDArray(void* ptr, const Shape& shape, const std::string& dtype,
+            std::shared_ptr<const void> owner=nullptr)
+            : NDArray(ptr, shape, toDType(dtype), std::move(owner)) {
+        if (dtype_ == DType::OTHER) dtype_name_ = dtype;
+    }
+
     ~NDArray() override = default;
 
     NDArray(const NDArray&) = default;
@@ -280,11 +773,16 @@ public:
         return as_imp_instance(ptr_, size());
     }
 
-    std::vector<std::size_t> shape() const override { return shape_; }
+    const Shape& shape() const override { return shape_; }
 
-    std::string dtype() const override { return dtype_; }
+    const std::string& dtype() const override {
+        return dtype_ == DType::OTHER ? dtype_name_ : dtypeName(dtype_);
+    }
 
-    std::string containerType() const override { return "array-like"; }
+    const std::string& containerType() const override {
+        static const std::string array_like("array-like");
+        return array_like;
+    }
 
     /*
      * Return a casted pointer to the held array data.
@@ -302,6 +800,23 @@ public:
     // Return a void pointer to the held array data.
     void* data() const { return ptr_; }
 
+    // Return the owner of the array data, null if it is not owned.
+    const std::shared_ptr<const void>& owner() const { return owner_; }
+
+    /*
+     * Return the alignment of the held array data in bytes, i.e. the largest
+     * power of 2 which divides its address.
+     */
+    std::size_t alignment() const {
+        auto address = reinterpret_cast<std::uintptr_t>(ptr_);
+        return address & (~address + 1);
+    }
+
+    // Return true if the held array data is aligned to the given bytes.
+    bool isAligned(std::size_t bytes) const {
+        return reinterpret_cast<std::uintptr_t>(ptr_) % bytes == 0;
+    }
+
 private:
     /*
      * Use to check data type before casting an NDArray object.
@@ -309,21 +824,49 @@ private:
      * Implicit type conversion is not allowed.
      */
     template <typename T>
-    static bool validateType(const std::string& type_string) {
-        if (type_string == "uint64_t" && std::is_same<T, uint64_t>::value) return true;
-        if (type_string == "uint32_t" && std::is_same<T, uint32_t>::value) return true;
-        if (type_string == "uint16_t" && std::is_same<T, uint16_t>::value) return true;
-        if (type_string == "uint8_t" && std::is_same<T, uint8_t>::value) return true;
-        if (type_string == "int64_t" && std::is_same<T, int64_t>::value) return true;
-        if (type_string == "int32_t" && std::is_same<T, int32_t>::value) return true;
-        if (type_string == "int16_t" && std::is_same<T, int16_t>::value) return true;
-        if (type_string == "int8_t" && std::is_same<T, int8_t>::value) return true;
-        if (type_string == "float" && std::is_same<T, float>::value) return true;
-        if (type_string == "double" && std::is_same<T, double>::value) return true;
-        return (type_string == "bool" && std::is_same<T, bool>::value);
+    static bool validateType(DType dtype) {
+        return dtypeOf<T>() != DType::OTHER && dtype == dtypeOf<T>();
     }
 };
 
+/*
+ * Convert a float16 array to float, or copy a float array, into an output
+ * buffer of array.size() elements.
+ *
+ * Return an NDArray which refers to the output buffer.
+ *
+ * Exceptions:
+ * TypeMismatchErrorNDArray: if the dtype is neither float16 nor float
+ */
+inline NDArray toFloat32(const NDArray& array, float* dst, ThreadPool& pool=ThreadPool::global()) {
+    if (array.dtypeId() == DType::FLOAT16)
+        halfToFloat(array.data<Float16>(), array.size(), dst, pool);
+    else if (array.dtypeId() == DType::FLOAT)
+        std::memcpy(dst, array.data(), array.size() * sizeof(float));
+    else
+        throw TypeMismatchErrorNDArray("Cannot convert an array of " + array.dtype() + " to float");
+    return NDArray(dst, array.shape(), DType::FLOAT);
+}
+
+/*
+ * Convert a float array to float16, or copy a float16 array, into an
+ * output buffer of array.size() elements.
+ *
+ * Return an NDArray which refers to the output buffer.
+ *
+ * Exceptions:
+ * TypeMismatchErrorNDArray: if the dtype is neither float nor float16
+ */
+inline NDArray toFloat16(const NDArray& array, Float16* dst, ThreadPool& pool=ThreadPool::global()) {
+    if (array.dtypeId() == DType::FLOAT)
+        floatToHalf(array.data<float>(), array.size(), dst, pool);
+    else if (array.dtypeId() == DType::FLOAT16)
+        std::memcpy(dst, array.data(), array.size() * sizeof(Float16));
+    else
+        throw TypeMismatchErrorNDArray("Cannot convert an array of " + array.dtype() + " to float16");
+    return NDArray(dst, array.shape(), DType::FLOAT16);
+}
+
 } // karabo_bridge
 
 
@@ -376,6 +919,9 @@ struct kb_data {
 
     MsgpackObject& operator[](const std::string& key) { return data_.at(key); }
 
+    iterator find(const std::string& key) { return data_.find(key); }
+    const_iterator find(const std::string& key) const { return data_.find(key); }
+
     iterator begin() noexcept { return data_.begin(); }
     iterator end() noexcept { return data_.end(); }
     const_iterator begin() const noexcept { return data_.begin(); }
@@ -390,30 +936,85 @@ struct kb_data {
 
     std::size_t bytesReceived() const {
         std::size_t size_ = 0;
-        for (auto& m : mpmsg_) size_ += m.size();
+        for (auto& f : frames_) size_ += f->msg.size();
         return size_;
     }
 
     void appendMsg(zmq::message_t&& msg) {
-        mpmsg_.push_back(std::move(msg));
+        frames_.push_back(std::make_shared<detail::Frame>(std::move(msg)));
     }
 
-    void appendHandle(msgpack::object_handle&& oh) {
-        handles_.push_back(std::move(oh));
+    void appendFrame(std::shared_ptr<detail::Frame> frame) {
+        frames_.push_back(std::move(frame));
+    }
+
+    /*
+     * Charge the received bytes to the memory tracker of a client. The
+     * bytes of each frame are released when the frame is destroyed, i.e.
+     * with this object unless an array or object taken from it still
+     * refers to the frame.
+     */
+    void trackMemory(const std::shared_ptr<detail::MemoryTracker>& tracker) {
+        for (auto& f : frames_) {
+            f->lease.reset();
+            f->lease.charge(tracker, f->msg.size());
+        }
     }
 
     void swap(kb_data& other) {
         metadata.swap(other.metadata);
         array.swap(other.array);
         data_.swap(other.data_);
-        mpmsg_.swap(other.mpmsg_);
-        handles_.swap(other.handles_);
+        frames_.swap(other.frames_);
     }
 
 private:
     ObjectMap data_;
-    std::vector<zmq::message_t> mpmsg_; // maintain the lifetime of data
-    std::vector<msgpack::object_handle> handles_; // maintain the lifetime of data
+    // The frames are shared with the arrays and objects which refer to
+    // them, so that these can outlive this object.
+    std::vector<std::shared_ptr<detail::Frame>> frames_;
+};
+
+/*
+ * Data of a source in consecutive trains, returned by Client::nextBatch().
+ *
+ * - The data member "metadata" holds a column of each metadata key;
+ * - The data member "data" holds a column of each normal data;
+ * - The data member "array" holds the arrays of all the trains stacked
+ *   along a new leading axis, i.e. of shape [n_trains, ...], in one
+ *   contiguous buffer.
+ *
+ * As with kb_data, the objects and the arrays share the ownership of their
+ * memory and stay valid after the batch is destroyed.
+ */
+struct kb_batch {
+    kb_batch() = default;
+
+    kb_batch(const kb_batch&) = delete;
+    kb_batch& operator=(const kb_batch&) = delete;
+
+    kb_batch(kb_batch&&) = default;
+    kb_batch& operator=(kb_batch&&) = default;
+
+    std::map<std::string, std::vector<MsgpackObject>> metadata;
+    std::map<std::string, std::vector<MsgpackObject>> data;
+    std::map<std::string, NDArray> array;
+
+    // Return the number of trains.
+    std::size_t size() const { return n_trains_; }
+
+    std::size_t bytes() const {
+        std::size_t bytes = 0;
+        for (auto& f : buffers_) bytes += f->msg.size();
+        return bytes;
+    }
+
+private:
+    friend class Client;
+
+    std::size_t n_trains_ = 0;
+    std::shared_ptr<msgpack::zone> zone_ = std::make_shared<msgpack::zone>(); // deep copies of the columns
+    std::vector<std::shared_ptr<detail::Frame>> buffers_; // stacked arrays
 };
 
 /*
@@ -433,6 +1034,10 @@ std::string vectorToString(const std::vector<T>& vec) {
     return ss.str();
 }
 
+inline std::string vectorToString(const Shape& shape) {
+    return vectorToString(std::vector<std::size_t>(shape));
+}
+
 /*
  * Convert the python type to the corresponding C++ type
  */
@@ -445,22 +1050,475 @@ inline void toCppTypeString(std::string& dtype) {
         dtype = "double";
 }
 
+namespace detail {
+
+/*
+ * Return the data type of a python type name in a header, DType::OTHER if
+ * it is not a numeric type, like toDType() after toCppTypeString().
+ */
+inline DType numpyDType(const StringRef& name) {
+    static const char* const names[] = {
+        "bool", "int8", "uint8", "int16", "uint16", "int32", "uint32", "int64", "uint64",
+        "float16", "float32", "float64"
+    };
+    for (std::size_t i = 0; i <= static_cast<std::size_t>(DType::DOUBLE); ++i) {
+        if (name == names[i]) return static_cast<DType>(i);
+    }
+    return DType::OTHER;
+}
+
+} // detail
+
+/*
+ * Convert the C++ type to the corresponding python type
+ */
+inline std::string toPythonTypeString(const std::string& dtype) {
+    if (dtype == "float") return "float32";
+    if (dtype == "double") return "float64";
+    if (dtype.size() > 2 && dtype.compare(dtype.size() - 2, 2, "_t") == 0)
+        return dtype.substr(0, dtype.size() - 2);
+    return dtype;
+}
+
+/*
+ * Return the size in bytes of the C++ type, 0 if unknown.
+ */
+inline std::size_t itemSize(DType dtype) {
+    switch (dtype) {
+        case DType::BOOL: case DType::INT8: case DType::UINT8: return 1;
+        case DType::INT16: case DType::UINT16: case DType::FLOAT16: return 2;
+        case DType::INT32: case DType::UINT32: case DType::FLOAT: return 4;
+        case DType::INT64: case DType::UINT64: case DType::DOUBLE: return 8;
+        default: return 0;
+    }
+}
+
+inline std::size_t itemSize(const std::string& dtype) { return itemSize(toDType(dtype)); }
+
+/*
+ * Header frames of a train, decoded without the data frames.
+ */
+struct TrainHeader {
+    // train ID, i.e. "timestamp.tid" of the first source which has it, 0 if none does
+    uint64_t tid = 0;
+    // "timestamp.tid" of each source, 0 if unknown
+    std::map<std::string, uint64_t> sources;
+    // total bytes of the multipart message
+    std::size_t bytes = 0;
+    // bytes of the header and data frames of each source
+    std::map<std::string, std::size_t> source_bytes;
+    // "content" of the header frames of each source in order, e.g. "msgpack"
+    // and "array", empty if a header has none
+    std::map<std::string, std::vector<std::string>> contents;
+
+    bool hasSource(const std::string& source) const { return sources.count(source) > 0; }
+};
+
+/*
+ * Predicate which accepts or rejects a train from its header.
+ */
+using TrainFilter = std::function<bool(const TrainHeader&)>;
+
+// defined in kb_binding.hpp
+template<typename T> class StructDecoder;
+
+
+namespace detail {
+
+/*
+ * Return the value of a key in a msgpack map, nullptr if not found.
+ */
+inline const msgpack::object* findKey(const msgpack::object& obj, const char* key) {
+    if (obj.type != msgpack::type::MAP) return nullptr;
+    std::size_t size = std::strlen(key);
+    for (uint32_t i = 0; i < obj.via.map.size; ++i) {
+        const msgpack::object& k = obj.via.map.ptr[i].key;
+        if (k.type == msgpack::type::STR && k.via.str.size == size &&
+            std::memcmp(k.via.str.ptr, key, size) == 0)
+            return &obj.via.map.ptr[i].val;
+    }
+    return nullptr;
+}
+
+/*
+ * Decode the header frames, i.e. every other frame, of a train.
+ *
+ * Exceptions:
+ * std::runtime_error if a header frame has no "source"
+ */
+inline TrainHeader peekTrainHeader(const MultipartMsg& mpmsg) {
+    TrainHeader header;
+    for (auto& msg : mpmsg) header.bytes += msg.size();
+
+    for (std::size_t i = 0; i < mpmsg.size(); i += 2) {
+        std::size_t nbytes = mpmsg[i].size() + (i + 1 < mpmsg.size() ? mpmsg[i + 1].size() : 0);
+
+        HeaderFields fields;
+        if (parseHeader(mpmsg[i].data(), mpmsg[i].size(), fields) && !fields.source.isNull()) {
+            std::string name = fields.source.str();
+            uint64_t& tid = header.sources[name];
+            header.source_bytes[name] += nbytes;
+            header.contents[name].push_back(fields.content.str());
+            if (fields.has_tid) {
+                tid = fields.tid;
+                if (!header.tid) header.tid = tid;
+            }
+            continue;
+        }
+
+        msgpack::object_handle oh;
+        msgpack::unpack(oh, static_cast<const char*>(mpmsg[i].data()), mpmsg[i].size());
+        const msgpack::object& obj = oh.get();
+
+        const msgpack::object* source = findKey(obj, "source");
+        if (!source || source->type != msgpack::type::STR)
+            throw std::runtime_error("The header does not contain a valid \"source\"!");
+        std::string name = source->as<std::string>();
+        uint64_t& tid = header.sources[name];
+        header.source_bytes[name] += nbytes;
+        const msgpack::object* content = findKey(obj, "content");
+        header.contents[name].push_back(content && content->type == msgpack::type::STR ?
+                                        content->as<std::string>() : std::string());
+
+        const msgpack::object* metadata = findKey(obj, "metadata");
+        if (!metadata) continue;
+        const msgpack::object* ts = findKey(*metadata, "timestamp.tid");
+        if (ts && ts->type == msgpack::type::POSITIVE_INTEGER) {
+            tid = ts->via.u64;
+            if (!header.tid) header.tid = tid;
+        }
+    }
+    return header;
+}
+
+/*
+ * Replace the data of a compressed array with the decompressed one, which
+ * is received into a buffer from the pool if given.
+ *
+ * Exceptions:
+ * std::runtime_error if the dtype is unknown
+ * CompressionError if the data cannot be decompressed
+ */
+inline void decompressFrame(zmq::message_t& frame, const std::vector<std::size_t>& shape,
+                            const std::string& dtype, Compression codec, BufferPool* pool) {
+    std::size_t itemsize = itemSize(dtype);
+    if (!itemsize)
+        throw std::runtime_error("Unknown data type of compressed array: " + dtype);
+    std::size_t nbytes = itemsize;
+    for (auto v : shape) nbytes *= v;
+
+    zmq::message_t msg = pool ? pool->message(nbytes) : zmq::message_t(nbytes);
+    decompressArray(frame.data(), frame.size(), msg.data(), nbytes, itemsize, codec);
+    frame = std::move(msg);
+}
+
+/*
+ * Decode the (header, data) frame pairs of a train into kb_data per source.
+ * The frames are moved into the kb_data, and compressed arrays are
+ * decompressed into buffers from the pool if given. Every array shares
+ * the ownership of its data frame, and every object of the metadata and
+ * data the ownership of the zone it is unpacked into.
+ *
+ * Exceptions:
+ * std::runtime_error if unknown "content" is found
+ * CompressionError if a compressed array cannot be decompressed
+ */
+inline std::map<std::string, kb_data> decodeTrain(MultipartMsg& mpmsg, BufferPool* pool) {
+    std::map<std::string, kb_data> data_pkg;
+
+    kb_data kbdt;
+
+    std::string source;
+    bool is_initialized = false;
+    auto it = mpmsg.begin();
+    while(it != mpmsg.end()) {
+        // Array headers, one per array, are parsed without allocation, and
+        // the others or unknown layouts by the generic msgpack path.
+        HeaderFields fields;
+        if (parseHeader(it->data(), it->size(), fields) && !fields.source.isNull()
+                && !fields.path.isNull() && fields.has_shape) {
+            DType dtype = detail::numpyDType(fields.dtype);
+            bool is_array = fields.content == "array" || fields.content == "ImageData";
+            bool is_compressed = fields.content == "compressed-array" && !fields.compression.isNull();
+            if (dtype != DType::OTHER && (is_array || is_compressed)) {
+                if (fields.source != source) source.assign(fields.source.data(), fields.source.size());
+                std::string path = fields.path.str();
+                Shape shape(fields.shape.begin(), fields.shape.begin() + fields.ndim);
+                Compression codec = is_compressed ? toCompression(fields.compression.str())
+                                                  : Compression::LZ4;
+
+                kbdt.appendMsg(std::move(*it));
+                std::advance(it, 1);
+
+                if (is_compressed) detail::decompressFrame(*it, shape, dtypeName(dtype), codec, pool);
+                auto frame = std::make_shared<detail::Frame>(std::move(*it));
+                std::advance(it, 1);
+                kbdt.array.insert(std::make_pair(std::move(path),
+                                                 NDArray(frame->msg.data(), shape, dtype, frame)));
+                kbdt.appendFrame(std::move(frame));
+                continue;
+            }
+        }
+
+        // the header must contain "source" and "content"
+        msgpack::object_handle oh_header;
+        msgpack::unpack(oh_header, static_cast<const char*>(it->data()), it->size());
+        auto header_unpacked = oh_header.get().as<ObjectMap>();
+
+        auto content = header_unpacked.at("content").as<std::string>();
+        // read before the zone of the header may be released
+        auto header_source = header_unpacked.at("source").as<std::string>();
+
+        // the next message is the content (data)
+        if (content == "msgpack") {
+            if (!is_initialized)
+                is_initialized = true;
+            else {
+                data_pkg.insert(std::make_pair(source, std::move(kbdt)));
+                // TODO: the following 'swap" seems to be redundant
+                kb_data empty_data;
+                kbdt.swap(empty_data);
+            }
+
+            kbdt.appendMsg(std::move(*it));
+            std::advance(it, 1);
+
+            // the objects share the zones they are unpacked into
+            auto header_owner = std::make_shared<msgpack::object_handle>(std::move(oh_header));
+            const msgpack::object* metadata = detail::findKey(header_owner->get(), "metadata");
+            if (!metadata) throw std::out_of_range("The header does not contain \"metadata\"!");
+            kbdt.metadata = detail::sharedObjectMap(*metadata, header_owner);
+
+            auto data_owner = std::make_shared<msgpack::object_handle>();
+            msgpack::unpack(*data_owner, static_cast<const char*>(it->data()), it->size());
+            for (auto& v : detail::sharedObjectMap(data_owner->get(), data_owner)) kbdt.insert(v);
+
+            kbdt.appendMsg(std::move(*it));
+            std::advance(it, 1);
+
+        } else if ((content == "array" || content == "ImageData")) {
+            kbdt.appendMsg(std::move(*it));
+            std::advance(it, 1);
+
+            auto tmp = header_unpacked.at("shape").as<std::vector<unsigned int>>();
+            std::vector<std::size_t> shape(tmp.begin(), tmp.end());
+            auto dtype = header_unpacked.at("dtype").as<std::string>();
+            toCppTypeString(dtype);
+
+            auto frame = std::make_shared<detail::Frame>(std::move(*it));
+            std::advance(it, 1);
+            kbdt.array.insert(std::make_pair(header_unpacked.at("path").as<std::string>(),
+                                             NDArray(frame->msg.data(), shape, dtype, frame)));
+            kbdt.appendFrame(std::move(frame));
+        } else if (content == "compressed-array") {
+            kbdt.appendMsg(std::move(*it));
+            std::advance(it, 1);
+
+            auto tmp = header_unpacked.at("shape").as<std::vector<unsigned int>>();
+            std::vector<std::size_t> shape(tmp.begin(), tmp.end());
+            auto dtype = header_unpacked.at("dtype").as<std::string>();
+            toCppTypeString(dtype);
+            auto codec = toCompression(header_unpacked.at("compression").as<std::string>());
+
+            detail::decompressFrame(*it, shape, dtype, codec, pool);
+
+            auto frame = std::make_shared<detail::Frame>(std::move(*it));
+            std::advance(it, 1);
+            kbdt.array.insert(std::make_pair(header_unpacked.at("path").as<std::string>(),
+                                             NDArray(frame->msg.data(), shape, dtype, frame)));
+            kbdt.appendFrame(std::move(frame));
+        } else {
+            throw std::runtime_error("Unknown data content: " + content);
+        }
+
+        source = std::move(header_source);
+    }
+
+    data_pkg.insert(std::make_pair(source, std::move(kbdt)));
+    kb_data empty_data;
+    kbdt.swap(empty_data);
+
+    return data_pkg;
+}
+
+/*
+ * Return the train timestamp in seconds since the epoch from the metadata,
+ * NaN if it is not available.
+ */
+inline double trainTimestamp(const ObjectMap& metadata) {
+    try {
+        auto sec = metadata.find("timestamp.sec");
+        auto frac = metadata.find("timestamp.frac");
+        if (sec != metadata.end() && frac != metadata.end()) {
+            // "frac" is in attoseconds
+            if (sec->second.dtype() == "string")
+                return std::strtod(sec->second.as<std::string>().c_str(), nullptr)
+                       + 1e-18 * std::strtod(frac->second.as<std::string>().c_str(), nullptr);
+            return sec->second.as<double>() + 1e-18 * frac->second.as<double>();
+        }
+
+        auto timestamp = metadata.find("timestamp");
+        if (timestamp != metadata.end()) return timestamp->second.as<double>();
+    } catch (const CastError&) {}
+
+    return std::nan("");
+}
+
+} // detail
+
+/*
+ * Recovery of a Client from a stalled, restarted or lost server.
+ */
+struct RecoveryOptions {
+    // Allow a new request after a timeout (ZMQ_REQ_RELAXED), and drop the
+    // late replies to the previous ones (ZMQ_REQ_CORRELATE).
+    bool req_relaxed = false;
+    // Rebuild the socket after this many consecutive timeouts, switching to
+    // the next group of endpoints. "0" for never.
+    std::size_t max_timeouts = 0;
+    // Initial and maximum intervals in milliseconds between attempts to
+    // reconnect to an endpoint (ZMQ_RECONNECT_IVL and ZMQ_RECONNECT_IVL_MAX).
+    int reconnect_ivl = 100;
+    int reconnect_ivl_max = 0;
+    // Endpoints tried in order after the ones passed to Client::connect(),
+    // before starting over.
+    std::vector<std::string> fallback_endpoints;
+};
+
+/*
+ * Counters and timing of the recovery of a Client.
+ */
+struct RecoveryStats {
+    std::size_t timeouts = 0; // requests which timed out
+    std::size_t reconnections = 0; // socket rebuilds
+    std::size_t failovers = 0; // rebuilds which switched to other endpoints
+    // time in seconds from the first timeout to the next received train
+    double last_recovery_time = 0.;
+    double max_recovery_time = 0.;
+    std::vector<std::string> endpoints; // endpoints of the current socket
+};
 
 /*
  * Karabo-bridge Client class.
  */
 class Client {
+    SocketType socket_type_;
     zmq::context_t ctx_;
     zmq::socket_t socket_;
 
+    int timeout_ms_; // receive timeout, -1 for infinite
+    RecoveryOptions recovery_;
+    // groups of endpoints: the connected ones followed by each fallback
+    std::vector<std::vector<std::string>> endpoint_groups_ {{}};
+    std::size_t endpoint_group_ = 0;
+    std::size_t consecutive_timeouts_ = 0;
+    std::chrono::steady_clock::time_point stall_start_;
+    RecoveryStats recovery_stats_;
+
     // Set to true if the client has sent request to the server to ask
     // for data.
     bool recv_ready_ = false;
 
+    // bytes held by all the kb_data returned by this client
+    std::shared_ptr<detail::MemoryTracker> memory_tracker_ =
+        std::make_shared<detail::MemoryTracker>();
+    std::size_t memory_budget_ = 0; // 0 for unlimited
+    MemoryPolicy memory_policy_ = MemoryPolicy::BACKPRESSURE;
+    std::size_t last_train_bytes_ = 0;
+    std::size_t dropped_trains_ = 0;
+
+    // receive array data into buffers from the pool if set
+    std::shared_ptr<BufferPool> buffer_pool_;
+
+    TrainFilter train_filter_;
+    std::size_t skipped_trains_ = 0;
+
+    // frames referred to by the views filled by nextInto()
+    MultipartMsg bound_msg_;
+
+    TrainTracker train_tracker_;
+    // time when the first message of the last multipart message is received
+    std::chrono::system_clock::time_point receive_time_;
+    std::chrono::steady_clock::time_point receive_steady_time_;
+
+    // Return the ZMQ socket type of a SocketType.
+    static int zmqSocketType(SocketType type) {
+        switch (type) {
+            case SocketType::SUB: return ZMQ_SUB;
+            case SocketType::PULL: return ZMQ_PULL;
+            default: return ZMQ_REQ;
+        }
+    }
+
+    /*
+     * Apply the socket options and connect to the current group of endpoints.
+     */
+    void setupSocket() {
+        socket_.setsockopt(ZMQ_RCVTIMEO, timeout_ms_);
+        socket_.setsockopt(ZMQ_LINGER, 0);
+        if (socket_type_ == SocketType::SUB) socket_.setsockopt(ZMQ_SUBSCRIBE, "", 0);
+        applyRecoveryOptions();
+        for (auto& endpoint : endpoint_groups_[endpoint_group_]) socket_.connect(endpoint);
+    }
+
+    void applyRecoveryOptions() {
+        if (socket_type_ == SocketType::REQ) {
+            int relaxed = recovery_.req_relaxed ? 1 : 0;
+            socket_.setsockopt(ZMQ_REQ_RELAXED, relaxed);
+            socket_.setsockopt(ZMQ_REQ_CORRELATE, relaxed);
+        }
+        socket_.setsockopt(ZMQ_RECONNECT_IVL, recovery_.reconnect_ivl);
+        socket_.setsockopt(ZMQ_RECONNECT_IVL_MAX, recovery_.reconnect_ivl_max);
+    }
+
+    /*
+     * Close the socket and open a new one to a group of endpoints.
+     */
+    void rebuildSocket(std::size_t group) {
+        std::size_t previous = endpoint_group_;
+        endpoint_group_ = group;
+
+        socket_ = zmq::socket_t(ctx_, zmqSocketType(socket_type_));
+        setupSocket();
+        recv_ready_ = false;
+
+        ++recovery_stats_.reconnections;
+        if (endpoint_group_ != previous) ++recovery_stats_.failovers;
+        std::cout << "Reconnecting to server: ";
+        for (auto& endpoint : endpoint_groups_[endpoint_group_]) std::cout << endpoint << " ";
+        std::cout << std::endl;
+    }
+
+    void onTimeout() {
+        if (!consecutive_timeouts_) stall_start_ = std::chrono::steady_clock::now();
+        ++consecutive_timeouts_;
+        ++recovery_stats_.timeouts;
+
+        if (recovery_.max_timeouts && consecutive_timeouts_ % recovery_.max_timeouts == 0) {
+            std::size_t group = endpoint_group_;
+            do {
+                group = (group + 1) % endpoint_groups_.size();
+            } while (endpoint_groups_[group].empty() && group != endpoint_group_);
+            rebuildSocket(group);
+        } else if (recovery_.req_relaxed)
+            recv_ready_ = false; // send a new request next time
+    }
+
+    void onReceive() {
+        if (!consecutive_timeouts_) return;
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - stall_start_).count();
+        recovery_stats_.last_recovery_time = t;
+        recovery_stats_.max_recovery_time = std::max(recovery_stats_.max_recovery_time, t);
+        consecutive_timeouts_ = 0;
+    }
+
     /*
-     * Send a "next" request to server.
+     * Send a "next" request to server, only with SocketType::REQ.
      */
     void sendRequest() {
+        // SUB and PULL sockets receive without a request
+        if (socket_type_ != SocketType::REQ) return;
+
         zmq::message_t request(4);
         memcpy(request.data(), "next", request.size());
         socket_.send(request);
@@ -468,23 +1526,92 @@ class Client {
 
     /*
      * Receive a multipart message from the server.
+     *
+     * The whole message is always received, so that the socket stays in
+     * step with the server when an error is thrown.
+     *
+     * Exceptions:
+     * ZmqTimeoutError: if the message is not received in time
+     * std::runtime_error: if the size of an array frame does not match its
+     *                     header
      */
     MultipartMsg receiveMultipartMsg() {
         int64_t more;  // multipart checker
         MultipartMsg mpmsg;
+        std::size_t array_bytes = 0; // array size announced by the previous header
+        std::string mismatch;
         while (true) {
             zmq::message_t msg;
-            auto flag = socket_.recv(&msg);
+            bool flag;
+            if (array_bytes) flag = receiveToBufferPool(msg, array_bytes);
+            else flag = socket_.recv(&msg);
             if (!flag) throw ZmqTimeoutError();
+            if (array_bytes && msg.size() != array_bytes && mismatch.empty())
+                mismatch = "Received " + std::to_string(msg.size()) + " bytes of array data while " +
+                           std::to_string(array_bytes) + " bytes are expected from the header!";
+
+            if (mpmsg.empty()) {
+                receive_time_ = std::chrono::system_clock::now();
+                receive_steady_time_ = std::chrono::steady_clock::now();
+            }
+
+            // headers and data come in pairs
+            array_bytes = 0;
+            if (buffer_pool_ && mpmsg.size() % 2 == 0) array_bytes = arrayBytes(msg);
 
             mpmsg.emplace_back(std::move(msg));
             std::size_t more_size = sizeof(int64_t);
             socket_.getsockopt(ZMQ_RCVMORE, &more, &more_size);
             if (more == 0) break;
         }
+        if (!mismatch.empty()) {
+            recv_ready_ = false;
+            throw std::runtime_error(mismatch);
+        }
         return mpmsg;
     }
 
+    /*
+     * Receive a message and copy it into a buffer of the given size from
+     * the pool, i.e. this costs one more memcpy of the array data than
+     * receiving a zmq::message_t.
+     *
+     * A message of another size is kept in the buffer allocated by zmq, so
+     * that it is neither truncated nor split from the rest of the train.
+     */
+    bool receiveToBufferPool(zmq::message_t& msg, std::size_t size) {
+        zmq::message_t received;
+        if (!socket_.recv(&received)) return false;
+        if (received.size() != size) {
+            msg = std::move(received);
+            return true;
+        }
+        msg = buffer_pool_->message(size);
+        std::memcpy(msg.data(), received.data(), size);
+        return true;
+    }
+
+    /*
+     * Return the size in bytes of the array announced by a header message,
+     * 0 if it is not an array header.
+     *
+     * Only the allocation-free parser is used, so that a header is not
+     * unpacked twice. The data of the headers which it does not understand
+     * are received into the buffers allocated by zmq, and the normal
+     * decoding reports their errors.
+     */
+    static std::size_t arrayBytes(const zmq::message_t& header) {
+        HeaderFields fields;
+        if (!parseHeader(header.data(), header.size(), fields)) return 0;
+        if (fields.content != "array" && fields.content != "ImageData") return 0;
+
+        DType dtype = detail::numpyDType(fields.dtype);
+        if (!fields.has_shape || dtype == DType::OTHER) return 0;
+        std::size_t size = itemSize(dtype);
+        for (std::size_t k = 0; k < fields.ndim; ++k) size *= fields.shape[k];
+        return size;
+    }
+
     /*
      * Parse a single message packed by msgpack using "visitor".
      */
@@ -630,6 +1757,205 @@ class Client {
         return output;
     }
 
+    /*
+     * Update the train statistics of the sources in the received data.
+     */
+    void recordTrains(const std::map<std::string, kb_data>& data_pkg) {
+        double receive_time = std::chrono::duration<double>(
+            receive_time_.time_since_epoch()).count();
+        double queue = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - receive_steady_time_).count();
+
+        for (auto& v : data_pkg) {
+            auto tid = v.second.metadata.find("timestamp.tid");
+            if (tid == v.second.metadata.end()) continue;
+            try {
+                double latency = receive_time - detail::trainTimestamp(v.second.metadata);
+                train_tracker_.record(v.first, tid->second.as<uint64_t>(), latency, queue);
+            } catch (const CastError&) {}
+        }
+    }
+
+    /*
+     * Update the ordering statistics of the sources of a train which is
+     * not decoded.
+     */
+    void recordHeader(const TrainHeader& header) {
+        for (auto& v : header.sources) {
+            if (v.second) train_tracker_.record(v.first, v.second, std::nan(""), std::nan(""));
+        }
+    }
+
+    /*
+     * Return true if receiving the given bytes would exceed the memory budget.
+     *
+     * With MemoryPolicy::BACKPRESSURE and DROP_INCOMING, a train is always
+     * allowed if nothing is held, so that a train larger than the budget
+     * does not stall the client for good.
+     */
+    bool exceedsMemoryBudget(std::size_t incoming) const {
+        if (!memory_budget_) return false;
+        std::size_t in_use = bytesInUse();
+        if (in_use == 0 && memory_policy_ != MemoryPolicy::FAIL_FAST) return false;
+        return in_use + incoming > memory_budget_;
+    }
+
+    /*
+     * Request and receive the next train which passes the train filter and
+     * the memory budget.
+     *
+     * Return false if there is none. With a timeout, the trains rejected by
+     * the filter are skipped for no longer than the timeout.
+     */
+    bool receiveTrain(MultipartMsg& mpmsg) {
+        auto start = std::chrono::steady_clock::now();
+
+        if (!recv_ready_) {
+            // the size of the previous train is the best guess for the next one
+            if (memory_policy_ == MemoryPolicy::BACKPRESSURE && exceedsMemoryBudget(last_train_bytes_))
+                return false;
+
+            sendRequest();
+            recv_ready_ = true;
+        }
+
+        while (true) {
+            try {
+                mpmsg = receiveMultipartMsg();
+                recv_ready_ = false;
+            } catch (const ZmqTimeoutError&) {
+                onTimeout();
+                return false;
+            }
+            onReceive();
+
+            if (mpmsg.empty() || !train_filter_) break;
+
+            TrainHeader header = detail::peekTrainHeader(mpmsg);
+            if (train_filter_(header)) break;
+
+            // release the train undecoded and ask for the next one
+            ++skipped_trains_;
+            recordHeader(header);
+            mpmsg.clear();
+            if (timeout_ms_ >= 0 && std::chrono::steady_clock::now() - start >=
+                                    std::chrono::milliseconds(timeout_ms_))
+                return false;
+            sendRequest();
+            recv_ready_ = true;
+        }
+
+        if (mpmsg.empty()) return false;
+
+        std::size_t train_bytes = 0;
+        for (auto& msg : mpmsg) train_bytes += msg.size();
+        last_train_bytes_ = train_bytes;
+        if (exceedsMemoryBudget(train_bytes)) {
+            if (memory_policy_ == MemoryPolicy::FAIL_FAST)
+                throw MemoryBudgetError(
+                    "Receiving " + std::to_string(train_bytes) + " bytes with "
+                    + std::to_string(bytesInUse()) + " bytes in use exceeds the memory budget of "
+                    + std::to_string(memory_budget_) + " bytes");
+            if (memory_policy_ == MemoryPolicy::DROP_INCOMING) {
+                ++dropped_trains_;
+                return false;
+            }
+        }
+
+        if (mpmsg.size() % 2)
+            throw std::runtime_error(
+                "The multipart message is expected to contain (header, data) pairs!");
+
+        return true;
+    }
+
+    // A stacked array of a batch being received.
+    struct BatchArray {
+        std::shared_ptr<detail::Frame> buffer;
+        std::vector<std::size_t> shape; // of a train
+        std::string dtype;
+        std::size_t bytes; // of a train
+    };
+
+    /*
+     * Append a decoded train to a batch being received, whose buffers are
+     * allocated for "capacity" trains by the first train.
+     */
+    void appendToBatch(std::map<std::string, kb_data>& train,
+                       std::map<std::string, kb_batch>& batch,
+                       std::map<std::string, std::map<std::string, BatchArray>>& stacks,
+                       std::size_t capacity, const std::vector<std::string>& paths) {
+        bool first = batch.empty();
+        if (!first && train.size() != batch.size())
+            throw BatchError("The sources of a train differ from the first train of the batch");
+
+        for (auto& src : train) {
+            const std::string& source = src.first;
+            kb_data& kbdt = src.second;
+            auto it = batch.find(source);
+            if (it == batch.end()) {
+                if (!first) throw BatchError(source + " is not in the first train of the batch");
+                it = batch.insert(std::make_pair(source, kb_batch())).first;
+            }
+            kb_batch& b = it->second;
+            std::size_t i = b.n_trains_;
+
+            auto appendColumns = [&](ObjectMap::const_iterator begin, ObjectMap::const_iterator end,
+                                     std::map<std::string, std::vector<MsgpackObject>>& columns) {
+                if (!first && static_cast<std::size_t>(std::distance(begin, end)) != columns.size())
+                    throw BatchError("The keys of " + source + " differ from the first train of the batch");
+                for (auto it = begin; it != end; ++it) {
+                    auto& column = columns[it->first];
+                    if (column.size() != i)
+                        throw BatchError(it->first + " of " + source + " is not in the first train of the batch");
+                    column.emplace_back(msgpack::object(it->second.as<msgpack::object>(), *b.zone_), b.zone_);
+                }
+            };
+            appendColumns(kbdt.metadata.cbegin(), kbdt.metadata.cend(), b.metadata);
+            appendColumns(kbdt.cbegin(), kbdt.cend(), b.data);
+
+            auto& stack = stacks[source];
+            std::size_t n_stacked = 0;
+            for (auto& v : kbdt.array) {
+                if (!paths.empty() && std::find(paths.begin(), paths.end(), v.first) == paths.end())
+                    continue;
+                const NDArray& a = v.second;
+                auto shape = a.shape();
+                auto s = stack.find(v.first);
+                if (first) {
+                    std::size_t bytes = itemSize(a.dtype());
+                    if (!bytes) throw BatchError(v.first + " of " + source + " has unknown dtype " + a.dtype());
+                    for (auto d : shape) bytes *= d;
+                    auto buffer = std::make_shared<detail::Frame>(
+                        buffer_pool_ ? buffer_pool_->message(capacity * bytes) : zmq::message_t(capacity * bytes));
+                    s = stack.insert(std::make_pair(
+                        v.first, BatchArray{std::move(buffer), shape, a.dtype(), bytes})).first;
+                } else if (s == stack.end()) {
+                    throw BatchError(v.first + " of " + source + " is not in the first train of the batch");
+                } else if (a.dtype() != s->second.dtype) {
+                    throw BatchError(v.first + " of " + source + " has dtype " + a.dtype()
+                                     + ", expected " + s->second.dtype);
+                } else if (shape != s->second.shape) {
+                    throw BatchError(v.first + " of " + source + " has shape " + vectorToString(shape)
+                                     + ", expected " + vectorToString(s->second.shape));
+                }
+                std::memcpy(static_cast<char*>(s->second.buffer->msg.data()) + i * s->second.bytes,
+                            a.data(), s->second.bytes);
+                // the rows are charged as they are filled, so that the budget
+                // check before receiving the next train sees them
+                s->second.buffer->lease.charge(memory_tracker_, s->second.bytes);
+                ++n_stacked;
+            }
+            if (n_stacked != stack.size()) {
+                for (auto& s : stack) {
+                    if (!kbdt.array.count(s.first))
+                        throw BatchError(s.first + " of " + source + " is not in every train of the batch");
+                }
+            }
+            ++b.n_trains_;
+        }
+    }
+
     /*
      * Add formatted output to a stringstream.
      */
@@ -650,10 +1976,12 @@ public:
      * Constructor.
      *
      * @param timeout: connection timeout in second. "-1." (default) for infinite.
+     * @param type: socket type, which must match the socket of the server.
      */
-    explicit Client(double timeout=-1.): ctx_(1), socket_(ctx_, ZMQ_REQ) {
-      socket_.setsockopt(ZMQ_RCVTIMEO, timeout < 0 ? -1 : static_cast<int>(1000 * timeout));
-      socket_.setsockopt(ZMQ_LINGER, 0);
+    explicit Client(double timeout=-1., SocketType type=SocketType::REQ)
+        : socket_type_(type), ctx_(1), socket_(ctx_, zmqSocketType(type)),
+          timeout_ms_(timeout < 0 ? -1 : static_cast<int>(1000 * timeout)) {
+      setupSocket();
     }
 
     // The destructor of zmq::context_t calls 'zmq_ctx_destroy'.
@@ -667,102 +1995,248 @@ public:
 
     void connect(const std::string& endpoint) {
         std::cout << "Connecting to server: " << endpoint << std::endl;
-        socket_.connect(endpoint);
+        endpoint_groups_[0].push_back(endpoint);
+        if (endpoint_group_ == 0) socket_.connect(endpoint);
     }
 
     /*
-     * Request and return the next data from the server.
+     * Recover automatically from timeouts.
      *
-     * Exceptions:
-     * std::runtime_error if unexpected message number or unknown "content" is found
+     * With max_timeouts > 0, the time to recover from a lost server is
+     * bounded by max_timeouts times the timeout of the client for each
+     * group of endpoints tried. It has no effect with an infinite timeout.
      */
-    std::map<std::string, kb_data> next() {
-        std::map<std::string, kb_data> data_pkg;
-
-        if (!recv_ready_) {
-            sendRequest();
-            recv_ready_ = true;
+    void setRecovery(const RecoveryOptions& options) {
+        recovery_ = options;
+        endpoint_groups_.resize(1);
+        for (auto& endpoint : options.fallback_endpoints)
+            endpoint_groups_.push_back({endpoint});
+        if (endpoint_group_ >= endpoint_groups_.size()) {
+            rebuildSocket(0);
+        } else {
+            applyRecoveryOptions();
         }
+    }
 
-        MultipartMsg mpmsg;
-        try {
-            mpmsg = receiveMultipartMsg();
-            recv_ready_ = false;
-        } catch (const ZmqTimeoutError&) {
-            return data_pkg;
-        }
+    const RecoveryOptions& recovery() const { return recovery_; }
 
-        if (mpmsg.empty()) return data_pkg;
+    RecoveryStats recoveryStats() const {
+        RecoveryStats stats = recovery_stats_;
+        stats.endpoints = endpoint_groups_[endpoint_group_];
+        return stats;
+    }
 
-        if (mpmsg.size() % 2)
-            throw std::runtime_error(
-                "The multipart message is expected to contain (header, data) pairs!");
+    /*
+     * Limit the bytes held by all the live kb_data returned by this client.
+     *
+     * @param bytes: memory budget in bytes. "0" for unlimited.
+     * @param policy: policy applied when the budget would be exceeded.
+     */
+    void setMemoryBudget(std::size_t bytes, MemoryPolicy policy=MemoryPolicy::BACKPRESSURE) {
+        memory_budget_ = bytes;
+        memory_policy_ = policy;
+    }
 
-        kb_data kbdt;
-
-        std::string source;
-        bool is_initialized = false;
-        auto it = mpmsg.begin();
-        while(it != mpmsg.end()) {
-            // the header must contain "source" and "content"
-            msgpack::object_handle oh_header;
-            msgpack::unpack(oh_header, static_cast<const char*>(it->data()), it->size());
-            auto header_unpacked = oh_header.get().as<ObjectMap>();
-
-            auto content = header_unpacked.at("content").as<std::string>();
-
-            // the next message is the content (data)
-            if (content == "msgpack") {
-                if (!is_initialized)
-                    is_initialized = true;
-                else {
-                    data_pkg.insert(std::make_pair(source, std::move(kbdt)));
-                    // TODO: the following 'swap" seems to be redundant
-                    kb_data empty_data;
-                    kbdt.swap(empty_data);
-                }
+    std::size_t memoryBudget() const { return memory_budget_; }
 
-                kbdt.appendMsg(std::move(*it));
-                std::advance(it, 1);
+    // Return the bytes currently held by the live kb_data from this client.
+    std::size_t bytesInUse() const { return memory_tracker_->inUse(); }
 
-                msgpack::object_handle oh_data;
-                msgpack::unpack(oh_data, static_cast<const char*>(it->data()), it->size());
-                kbdt.metadata = header_unpacked.at("metadata").as<ObjectMap>();
+    // Return the high-water mark of bytesInUse().
+    std::size_t peakBytesInUse() const { return memory_tracker_->peak(); }
 
-                auto data_unpacked = oh_data.get().as<ObjectMap>();
-                for (auto& v : data_unpacked) kbdt.insert(v); // shallow copy
+    void resetPeakBytesInUse() { memory_tracker_->resetPeak(); }
 
-                kbdt.appendHandle(std::move(oh_header));
-                kbdt.appendHandle(std::move(oh_data));
+    // Return the number of trains discarded by MemoryPolicy::DROP_INCOMING.
+    std::size_t droppedTrains() const { return dropped_trains_; }
 
-            } else if ((content == "array" || content == "ImageData")) {
-                kbdt.appendMsg(std::move(*it));
-                std::advance(it, 1);
+    /*
+     * Receive array data into aligned buffers recycled by the given pool.
+     * Each array is copied from the buffer allocated by zmq, which costs
+     * one more memcpy per array. An array whose size does not match its
+     * header stays in the zmq buffer and the train is rejected.
+     *
+     * @param pool: buffer pool, nullptr (default) to receive array data into
+     *              the buffers allocated by zmq.
+     */
+    void setBufferPool(const std::shared_ptr<BufferPool>& pool) { buffer_pool_ = pool; }
 
-                auto tmp = header_unpacked.at("shape").as<std::vector<unsigned int>>();
-                std::vector<std::size_t> shape(tmp.begin(), tmp.end());
-                auto dtype = header_unpacked.at("dtype").as<std::string>();
-                toCppTypeString(dtype);
+    /*
+     * Return a snapshot of the train loss, ordering and latency statistics
+     * of each source, which are collected from "timestamp.tid",
+     * "timestamp.sec" and "timestamp.frac" in the metadata.
+     *
+     * It is safe to call this member function from another thread.
+     */
+    std::map<std::string, SourceStats> trainStats() const { return train_tracker_.snapshot(); }
+
+    void resetTrainStats() { train_tracker_.reset(); }
+
+    /*
+     * Accept or reject each train from its header frames before decoding it.
+     *
+     * Only "source", "content" and the "timestamp.tid" of the metadata are
+     * decoded to build the TrainHeader. The data of a rejected train are
+     * released without being decoded, and next() requests the following
+     * train, until the timeout of the client if set.
+     * For example, keep every 10th train via
+     *
+     *     client.setTrainFilter([](const TrainHeader& h) { return h.tid % 10 == 0; });
+     *
+     * @param filter: predicate which returns true to accept a train. An empty
+     *                function (default) accepts all the trains.
+     */
+    void setTrainFilter(TrainFilter filter=TrainFilter()) { train_filter_ = std::move(filter); }
+
+    // Return the number of trains rejected by the train filter.
+    std::size_t skippedTrains() const { return skipped_trains_; }
+
+    /*
+     * Request and return the next data from the server.
+     *
+     * Trains rejected by the train filter are skipped. An empty map is
+     * returned if the request times out, no train passes the train filter
+     * within the timeout or, with
+     * MemoryPolicy::BACKPRESSURE and DROP_INCOMING, if the memory budget does
+     * not allow another train.
+     *
+     * Exceptions:
+     * std::runtime_error if unexpected message number or unknown "content" is found
+     * CompressionError if a compressed array cannot be decompressed
+     * MemoryBudgetError if the memory budget is exceeded with MemoryPolicy::FAIL_FAST
+     */
+    std::map<std::string, kb_data> next() {
+        std::map<std::string, kb_data> data_pkg;
+
+        MultipartMsg mpmsg;
+        if (!receiveTrain(mpmsg)) return data_pkg;
+
+        data_pkg = detail::decodeTrain(mpmsg, buffer_pool_.get());
 
-                kbdt.array.insert(std::make_pair(header_unpacked.at("path").as<std::string>(),
-                                                 NDArray(it->data(), shape, dtype)));
-            } else {
-                throw std::runtime_error("Unknown data content: " + content);
+        for (auto& v : data_pkg) v.second.trackMemory(memory_tracker_);
+
+        recordTrains(data_pkg);
+
+        return data_pkg;
+    }
+
+    /*
+     * Receive n trains and stack their data along a new leading axis.
+     *
+     * Arrays of the same path are copied into one contiguous buffer of shape
+     * [n_trains, ...], from the buffer pool if set, and metadata and normal
+     * data are returned as columns of n_trains values. Fewer than n trains
+     * are returned if a request times out or the memory budget does not
+     * allow another train. The rows stacked so far count against the
+     * budget, while the buffers are only charged in full when the batch
+     * is returned.
+     *
+     * @param n: number of trains.
+     * @param paths: array paths to stack, empty (default) for all. The
+     *               other arrays are released after each train.
+     * @param pipelined: request the next train before decoding the current
+     *                   one, including after the last train of the batch.
+     *                   The memory budget is not checked before sending this
+     *                   request.
+     *
+     * Exceptions:
+     * the exceptions of next()
+     * BatchError if the sources, keys, array paths, shapes or dtypes of a
+     *            train differ from the first train of the batch
+     */
+    std::map<std::string, kb_batch> nextBatch(std::size_t n,
+                                              const std::vector<std::string>& paths={},
+                                              bool pipelined=false) {
+        std::map<std::string, kb_batch> batch;
+        std::map<std::string, std::map<std::string, BatchArray>> stacks;
+
+        for (std::size_t i = 0; i < n; ++i) {
+            MultipartMsg mpmsg;
+            if (!receiveTrain(mpmsg)) break;
+            if (pipelined) {
+                sendRequest();
+                recv_ready_ = true;
             }
 
-            source = header_unpacked.at("source").as<std::string>();
+            auto train = detail::decodeTrain(mpmsg, buffer_pool_.get());
+            recordTrains(train);
+            appendToBatch(train, batch, stacks, n, paths);
+        }
 
-            kbdt.appendMsg(std::move(*it));
-            std::advance(it, 1);
+        for (auto& v : batch) {
+            kb_batch& b = v.second;
+            for (auto& s : stacks[v.first]) {
+                BatchArray& a = s.second;
+                std::vector<std::size_t> shape {b.n_trains_};
+                shape.insert(shape.end(), a.shape.begin(), a.shape.end());
+                a.buffer->lease.charge(memory_tracker_, a.buffer->msg.size() - a.buffer->lease.bytes());
+                b.array.insert(std::make_pair(s.first, NDArray(a.buffer->msg.data(), shape, a.dtype, a.buffer)));
+                b.buffers_.push_back(std::move(a.buffer));
+            }
         }
+        return batch;
+    }
 
-        data_pkg.insert(std::make_pair(source, std::move(kbdt)));
-        kb_data empty_data;
-        kbdt.swap(empty_data);
+    /*
+     * Request the next train and decode a source directly into a struct
+     * declared with KARABO_BRIDGE_BIND (see kb_binding.hpp), without
+     * building kb_data.
+     *
+     * The ArrayView members refer to the data held by the client, which
+     * stay valid until the next call of this member function. The train is
+     * not counted in bytesInUse() and trainStats().
+     *
+     * Return false if the request times out, the memory budget does not
+     * allow another train or the source is not in the train.
+     *
+     * Exceptions:
+     * the exceptions of next() and StructDecoder::decode()
+     */
+    template<typename T>
+    bool nextInto(StructDecoder<T>& decoder, T& out) {
+        bound_msg_.clear();
+        if (!receiveTrain(bound_msg_)) return false;
+        return decoder.decode(bound_msg_, out, buffer_pool_.get());
+    }
 
-        return data_pkg;
+    /*
+     * Request the next train and return its frames without decoding them,
+     * e.g. to forward them (see ShmRelay in kb_shm.hpp). The train is not
+     * counted in bytesInUse() and trainStats().
+     *
+     * Return false if the request times out or the memory budget does not
+     * allow another train.
+     *
+     * Exceptions:
+     * std::runtime_error if unexpected message number is found
+     * MemoryBudgetError if the memory budget is exceeded with MemoryPolicy::FAIL_FAST
+     */
+    bool nextMultipartMsg(MultipartMsg& mpmsg) {
+        mpmsg.clear();
+        return receiveTrain(mpmsg);
     }
 
+    /*
+     * Receive the next train and only decode its header frames, e.g. to
+     * monitor a stream cheaply. The train IDs are counted in trainStats().
+     *
+     * Return false if the request times out or the memory budget does not
+     * allow another train.
+     *
+     * Exceptions:
+     * the exceptions of nextMultipartMsg()
+     * std::runtime_error if a header frame has no "source"
+     */
+    bool nextHeader(TrainHeader& header) {
+        MultipartMsg mpmsg;
+        if (!receiveTrain(mpmsg)) return false;
+        header = detail::peekTrainHeader(mpmsg);
+        recordHeader(header);
+        return true;
+    }
+
+    SocketType socketType() const { return socket_type_; }
+
     /*
      * Parse the next multipart message.
      *
@@ -0,0 +1,433 @@
+/*
+    Compression of array data.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_COMPRESSION_HPP
+#define KARABO_BRIDGE_KB_COMPRESSION_HPP
+
+#include <msgpack.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef KARABO_BRIDGE_WITH_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef KARABO_BRIDGE_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "kb_parallel.hpp"
+
+
+namespace karabo_bridge {
+
+class CompressionError : public std::runtime_error {
+public:
+    explicit CompressionError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+/*
+ * Codecs for the "compressed-array" content.
+ *
+ * The "bitshuffle-*" codecs transpose the bits of each block of elements
+ * before compressing it, which makes the slowly varying detector data much
+ * more compressible.
+ */
+enum class Compression {
+    LZ4,
+    ZSTD,
+    BITSHUFFLE_LZ4,
+    BITSHUFFLE_ZSTD
+};
+
+/*
+ * Return the name of a codec in the "compression" field of a header.
+ */
+inline std::string toString(Compression codec) {
+    switch (codec) {
+        case Compression::LZ4: return "lz4";
+        case Compression::ZSTD: return "zstd";
+        case Compression::BITSHUFFLE_LZ4: return "bitshuffle-lz4";
+        case Compression::BITSHUFFLE_ZSTD: return "bitshuffle-zstd";
+    }
+    return "";
+}
+
+/*
+ * Return the codec from the "compression" field of a header.
+ *
+ * Exceptions:
+ * CompressionError: if the codec is unknown
+ */
+inline Compression toCompression(const std::string& name) {
+    if (name == "lz4") return Compression::LZ4;
+    if (name == "zstd") return Compression::ZSTD;
+    if (name == "bitshuffle-lz4") return Compression::BITSHUFFLE_LZ4;
+    if (name == "bitshuffle-zstd") return Compression::BITSHUFFLE_ZSTD;
+    throw CompressionError("Unknown compression: " + name);
+}
+
+namespace detail {
+
+inline bool isBitshuffled(Compression codec) {
+    return codec == Compression::BITSHUFFLE_LZ4 || codec == Compression::BITSHUFFLE_ZSTD;
+}
+
+inline void writeUint64BE(char* dst, uint64_t v) {
+    for (int i = 7; i >= 0; --i, v >>= 8) dst[i] = static_cast<char>(v & 0xff);
+}
+
+inline void writeUint32BE(char* dst, uint32_t v) {
+    for (int i = 3; i >= 0; --i, v >>= 8) dst[i] = static_cast<char>(v & 0xff);
+}
+
+inline uint64_t readUint64BE(const char* src) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v = (v << 8) | static_cast<uint8_t>(src[i]);
+    return v;
+}
+
+inline uint32_t readUint32BE(const char* src) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v = (v << 8) | static_cast<uint8_t>(src[i]);
+    return v;
+}
+
+/*
+ * Transpose an 8x8 bit matrix, where byte i holds row i.
+ */
+inline uint64_t transposeBits8x8(uint64_t x) {
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+    return x;
+}
+
+inline uint64_t loadUint64LE(const uint8_t* bytes) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) v = (v << 8) | bytes[i];
+    return v;
+}
+
+inline void storeUint64LE(uint8_t* bytes, uint64_t v) {
+    for (int i = 0; i < 8; ++i, v >>= 8) bytes[i] = static_cast<uint8_t>(v & 0xff);
+}
+
+/*
+ * Bit-transpose n_elements (a multiple of 8) elements of itemsize bytes.
+ *
+ * Bit k of byte j of all the elements ends up in row (8 * j + k) of the
+ * output, which has n_elements / 8 bytes. This is the layout of bitshuffle.
+ */
+inline void bitshuffle(const void* src, void* dst, std::size_t n_elements, std::size_t itemsize) {
+    auto in = static_cast<const uint8_t*>(src);
+    auto out = static_cast<uint8_t*>(dst);
+    std::size_t row_bytes = n_elements / 8;
+    uint8_t group[8];
+    uint8_t rows[8];
+    for (std::size_t g = 0; g < row_bytes; ++g) {
+        for (std::size_t j = 0; j < itemsize; ++j) {
+            for (std::size_t i = 0; i < 8; ++i) group[i] = in[(8 * g + i) * itemsize + j];
+            storeUint64LE(rows, transposeBits8x8(loadUint64LE(group)));
+            for (std::size_t k = 0; k < 8; ++k) out[(8 * j + k) * row_bytes + g] = rows[k];
+        }
+    }
+}
+
+/*
+ * Inverse of bitshuffle.
+ */
+inline void bitunshuffle(const void* src, void* dst, std::size_t n_elements, std::size_t itemsize) {
+    auto in = static_cast<const uint8_t*>(src);
+    auto out = static_cast<uint8_t*>(dst);
+    std::size_t row_bytes = n_elements / 8;
+    uint8_t group[8];
+    uint8_t rows[8];
+    for (std::size_t g = 0; g < row_bytes; ++g) {
+        for (std::size_t j = 0; j < itemsize; ++j) {
+            for (std::size_t k = 0; k < 8; ++k) rows[k] = in[(8 * j + k) * row_bytes + g];
+            storeUint64LE(group, transposeBits8x8(loadUint64LE(rows)));
+            for (std::size_t i = 0; i < 8; ++i) out[(8 * g + i) * itemsize + j] = group[i];
+        }
+    }
+}
+
+inline bool isLz4(Compression codec) {
+    return codec == Compression::LZ4 || codec == Compression::BITSHUFFLE_LZ4;
+}
+
+inline std::size_t compressBound(Compression codec, std::size_t n) {
+#ifdef KARABO_BRIDGE_WITH_LZ4
+    if (isLz4(codec)) return static_cast<std::size_t>(LZ4_compressBound(static_cast<int>(n)));
+#endif
+#ifdef KARABO_BRIDGE_WITH_ZSTD
+    if (!isLz4(codec)) return ZSTD_compressBound(n);
+#endif
+    (void)n;
+    throw CompressionError("karabo-bridge is built without " + toString(codec) + " support");
+}
+
+/*
+ * Compress a block and return the compressed size.
+ */
+inline std::size_t compressBlock(Compression codec, const char* src, std::size_t n,
+                                 char* dst, std::size_t capacity) {
+#ifdef KARABO_BRIDGE_WITH_LZ4
+    if (isLz4(codec)) {
+        int ret = LZ4_compress_default(src, dst, static_cast<int>(n), static_cast<int>(capacity));
+        if (ret <= 0) throw CompressionError("LZ4 compression failed");
+        return static_cast<std::size_t>(ret);
+    }
+#endif
+#ifdef KARABO_BRIDGE_WITH_ZSTD
+    if (!isLz4(codec)) {
+        std::size_t ret = ZSTD_compress(dst, capacity, src, n, 1);
+        if (ZSTD_isError(ret))
+            throw CompressionError(std::string("zstd compression failed: ") + ZSTD_getErrorName(ret));
+        return ret;
+    }
+#endif
+    (void)src; (void)n; (void)dst; (void)capacity;
+    throw CompressionError("karabo-bridge is built without " + toString(codec) + " support");
+}
+
+/*
+ * Decompress a block of exactly n bytes.
+ */
+inline void decompressBlock(Compression codec, const char* src, std::size_t compressed_size,
+                            char* dst, std::size_t n) {
+#ifdef KARABO_BRIDGE_WITH_LZ4
+    if (isLz4(codec)) {
+        int ret = LZ4_decompress_safe(src, dst, static_cast<int>(compressed_size), static_cast<int>(n));
+        if (ret < 0 || static_cast<std::size_t>(ret) != n)
+            throw CompressionError("Corrupted LZ4 block");
+        return;
+    }
+#endif
+#ifdef KARABO_BRIDGE_WITH_ZSTD
+    if (!isLz4(codec)) {
+        std::size_t ret = ZSTD_decompress(dst, n, src, compressed_size);
+        if (ZSTD_isError(ret) || ret != n)
+            throw CompressionError("Corrupted zstd block");
+        return;
+    }
+#endif
+    (void)src; (void)compressed_size; (void)dst; (void)n;
+    throw CompressionError("karabo-bridge is built without " + toString(codec) + " support");
+}
+
+/*
+ * Split the data into blocks of the format shared by compressArray and
+ * decompressArray.
+ *
+ * With bitshuffle, the block size must be a multiple of 8 elements, the last
+ * block is shortened to a multiple of 8 elements and the remaining bytes are
+ * stored uncompressed after the blocks.
+ */
+struct BlockLayout {
+    static std::size_t unit(std::size_t itemsize, bool shuffled) { return shuffled ? 8 * itemsize : 1; }
+
+    std::size_t block_bytes;
+    std::size_t n_blocks;
+    std::size_t last_block_bytes;
+    std::size_t leftover_bytes; // stored uncompressed
+
+    BlockLayout(std::size_t nbytes, std::size_t itemsize, std::size_t block_size, bool shuffled) {
+        std::size_t unit = BlockLayout::unit(itemsize, shuffled);
+        if (block_size % unit)
+            throw CompressionError("The block size must be a multiple of " + std::to_string(unit));
+        // a block larger than the array would only waste memory
+        if (block_size > std::max(nbytes, unit))
+            throw CompressionError("The block size of " + std::to_string(block_size)
+                                   + " bytes exceeds the array of " + std::to_string(nbytes) + " bytes");
+        block_bytes = block_size;
+        std::size_t compressed_bytes = nbytes / unit * unit;
+        leftover_bytes = nbytes - compressed_bytes;
+        n_blocks = (compressed_bytes + block_bytes - 1) / block_bytes;
+        last_block_bytes = n_blocks ? compressed_bytes - (n_blocks - 1) * block_bytes : 0;
+    }
+
+    std::size_t blockBytes(std::size_t i) const {
+        return i == n_blocks - 1 ? last_block_bytes : block_bytes;
+    }
+};
+
+} // detail
+
+// Size of the frame header: uncompressed bytes (uint64) and block size (uint32).
+constexpr std::size_t compressionHeaderSize() { return 12; }
+
+// Default size of the independently compressed blocks in bytes.
+constexpr std::size_t defaultCompressionBlockSize() { return 65536; }
+
+/*
+ * Compress array data for the "compressed-array" content.
+ *
+ * The output starts with the uncompressed size (big-endian uint64) and the
+ * block size in bytes (big-endian uint32), followed by the blocks, each
+ * prefixed by its compressed size (big-endian uint32). Blocks are
+ * compressed in parallel.
+ *
+ * @param src: array data.
+ * @param nbytes: size of the array data in bytes.
+ * @param itemsize: size of an array element in bytes.
+ * @param codec: compression codec.
+ * @param block_size: block size in bytes, rounded down to a multiple of 8
+ *                    elements with bitshuffle and reduced to the size of
+ *                    the array.
+ * @param pool: threads used for the compression.
+ *
+ * Exceptions:
+ * CompressionError: if the codec is not supported or compression fails
+ */
+inline std::string compressArray(const void* src, std::size_t nbytes, std::size_t itemsize,
+                                 Compression codec,
+                                 std::size_t block_size=defaultCompressionBlockSize(),
+                                 ThreadPool& pool=ThreadPool::global()) {
+    bool shuffled = detail::isBitshuffled(codec);
+    std::size_t unit = detail::BlockLayout::unit(itemsize, shuffled);
+    block_size = std::min(block_size, nbytes);
+    block_size = std::max<std::size_t>(block_size / unit, 1) * unit;
+    detail::BlockLayout layout(nbytes, itemsize, block_size, shuffled);
+
+    std::size_t bound = detail::compressBound(codec, layout.block_bytes);
+    std::vector<std::string> blocks(layout.n_blocks);
+    auto input = static_cast<const char*>(src);
+    pool.parallelFor(0, layout.n_blocks, [&](std::size_t begin, std::size_t end) {
+        std::vector<char> shuffled_block(shuffled ? layout.block_bytes : 0);
+        std::vector<char> compressed(bound);
+        for (std::size_t i = begin; i < end; ++i) {
+            const char* block = input + i * layout.block_bytes;
+            std::size_t n = layout.blockBytes(i);
+            if (shuffled) {
+                detail::bitshuffle(block, shuffled_block.data(), n / itemsize, itemsize);
+                block = shuffled_block.data();
+            }
+            std::size_t size = detail::compressBlock(codec, block, n, compressed.data(), bound);
+            blocks[i].resize(4 + size);
+            detail::writeUint32BE(&blocks[i][0], static_cast<uint32_t>(size));
+            memcpy(&blocks[i][4], compressed.data(), size);
+        }
+    });
+
+    std::size_t total = compressionHeaderSize() + layout.leftover_bytes;
+    for (auto& b : blocks) total += b.size();
+
+    std::string output(compressionHeaderSize(), '\0');
+    output.reserve(total);
+    detail::writeUint64BE(&output[0], nbytes);
+    detail::writeUint32BE(&output[8], static_cast<uint32_t>(layout.block_bytes));
+    for (auto& b : blocks) output.append(b);
+    output.append(input + nbytes - layout.leftover_bytes, layout.leftover_bytes);
+    return output;
+}
+
+/*
+ * Decompress array data compressed by compressArray. Blocks are decompressed
+ * in parallel straight into the destination. The block size in the data must
+ * not exceed the array, which bounds the memory of the bitshuffled blocks.
+ *
+ * @param src: compressed data.
+ * @param size: size of the compressed data in bytes.
+ * @param dst: destination of the array data.
+ * @param nbytes: size of the array data in bytes.
+ * @param itemsize: size of an array element in bytes.
+ * @param codec: compression codec.
+ * @param pool: threads used for the decompression.
+ *
+ * Exceptions:
+ * CompressionError: if the codec is not supported or the data is corrupted
+ */
+inline void decompressArray(const void* src, std::size_t size, void* dst, std::size_t nbytes,
+                            std::size_t itemsize, Compression codec,
+                            ThreadPool& pool=ThreadPool::global()) {
+    auto input = static_cast<const char*>(src);
+    auto output = static_cast<char*>(dst);
+    if (size < compressionHeaderSize()) throw CompressionError("Truncated compressed array");
+    if (detail::readUint64BE(input) != nbytes)
+        throw CompressionError("The size of the compressed array does not match its header");
+    std::size_t block_size = detail::readUint32BE(input + 8);
+    if (!block_size) throw CompressionError("Invalid block size of the compressed array");
+
+    bool shuffled = detail::isBitshuffled(codec);
+    detail::BlockLayout layout(nbytes, itemsize, block_size, shuffled);
+
+    // locate the blocks
+    std::vector<std::size_t> offsets(layout.n_blocks + 1);
+    std::size_t offset = compressionHeaderSize();
+    for (std::size_t i = 0; i < layout.n_blocks; ++i) {
+        if (offset + 4 > size) throw CompressionError("Truncated compressed array");
+        offsets[i] = offset;
+        offset += 4 + detail::readUint32BE(input + offset);
+    }
+    offsets[layout.n_blocks] = offset;
+    if (offset + layout.leftover_bytes != size)
+        throw CompressionError("The size of the compressed array does not match its blocks");
+
+    pool.parallelFor(0, layout.n_blocks, [&](std::size_t begin, std::size_t end) {
+        std::vector<char> shuffled_block(shuffled ? layout.block_bytes : 0);
+        for (std::size_t i = begin; i < end; ++i) {
+            char* block = output + i * layout.block_bytes;
+            std::size_t n = layout.blockBytes(i);
+            const char* compressed = input + offsets[i] + 4;
+            std::size_t compressed_size = offsets[i + 1] - offsets[i] - 4;
+            if (shuffled) {
+                detail::decompressBlock(codec, compressed, compressed_size, shuffled_block.data(), n);
+                detail::bitunshuffle(shuffled_block.data(), block, n / itemsize, itemsize);
+            } else {
+                detail::decompressBlock(codec, compressed, compressed_size, block, n);
+            }
+        }
+    });
+
+    memcpy(output + nbytes - layout.leftover_bytes, input + offset, layout.leftover_bytes);
+}
+
+/*
+ * Pack the header of a "compressed-array" content for a sender.
+ *
+ * @param dtype: data type name of numpy, e.g. "uint16" or "float32".
+ */
+inline msgpack::sbuffer packCompressedArrayHeader(const std::string& source,
+                                                  const std::string& path,
+                                                  const std::string& dtype,
+                                                  const std::vector<std::size_t>& shape,
+                                                  Compression codec) {
+    msgpack::sbuffer sbuf;
+    msgpack::packer<msgpack::sbuffer> pk(sbuf);
+    pk.pack_map(6);
+    pk.pack(std::string("source"));
+    pk.pack(source);
+    pk.pack(std::string("content"));
+    pk.pack(std::string("compressed-array"));
+    pk.pack(std::string("path"));
+    pk.pack(path);
+    pk.pack(std::string("dtype"));
+    pk.pack(dtype);
+    pk.pack(std::string("shape"));
+    pk.pack_array(static_cast<uint32_t>(shape.size()));
+    for (auto v : shape) pk.pack(static_cast<uint64_t>(v));
+    pk.pack(std::string("compression"));
+    pk.pack(toString(codec));
+    return sbuf;
+}
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_COMPRESSION_HPP
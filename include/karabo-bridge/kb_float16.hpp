@@ -0,0 +1,195 @@
+/*
+    Half-precision floating point storage and conversion.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_FLOAT16_HPP
+#define KARABO_BRIDGE_KB_FLOAT16_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__F16C__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "kb_parallel.hpp"
+
+
+namespace karabo_bridge {
+
+namespace detail {
+
+inline uint32_t floatBits(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof bits);
+    return bits;
+}
+
+inline float bitsFloat(uint32_t bits) {
+    float value;
+    std::memcpy(&value, &bits, sizeof value);
+    return value;
+}
+
+// Return all ones if the condition holds, otherwise 0.
+inline uint32_t selectMask(bool condition) { return 0u - static_cast<uint32_t>(condition); }
+
+/*
+ * Portable IEEE 754 binary16 conversions, rounding to the nearest even.
+ * NaN payloads are kept as far as they fit and NaNs are quieted, like
+ * F16C does.
+ *
+ * All the cases are computed and selected with masks instead of branches,
+ * so that the compiler can vectorize the loops of the bulk conversions.
+ */
+inline uint16_t floatToHalfBits(float value) {
+    uint32_t f = floatBits(value);
+    const uint32_t sign = (f >> 16) & 0x8000u;
+    f &= 0x7fffffffu;
+
+    // normal: rebias the exponent, (15 - 127) << 23 modulo 2^32, and round
+    // the mantissa, which may carry into the exponent up to Inf
+    const uint32_t normal = (f + 0xc8000fffu + ((f >> 13) & 1u)) >> 13;
+    // subnormal or zero, i.e. below 2^-14: adding 0.5 lets the FPU round
+    // the mantissa to units of 2^-24
+    const uint32_t subnormal = floatBits(bitsFloat(f) + 0.5f) - 0x3f000000u;
+    // Inf or NaN, or too large, i.e. at least 2^16
+    const uint32_t special = 0x7c00u | (selectMask(f > 0x7f800000u) & (0x200u | ((f >> 13) & 0x3ffu)));
+
+    const uint32_t is_large = selectMask(f >= 0x47800000u);
+    const uint32_t is_small = selectMask(f < 0x38800000u);
+    const uint32_t h = (is_large & special) | (~is_large & ((is_small & subnormal) | (~is_small & normal)));
+    return static_cast<uint16_t>(h | sign);
+}
+
+inline float halfBitsToFloat(uint16_t h) {
+    uint32_t f = static_cast<uint32_t>(h & 0x7fffu) << 13;
+    const uint32_t exp = f & 0x0f800000u;
+    // rebias the exponent, twice for Inf and NaN, and quiet a NaN like F16C
+    f += 0x38000000u + (selectMask(exp == 0x0f800000u) & 0x38000000u);
+    f |= selectMask(exp == 0x0f800000u && (h & 0x3ffu)) & 0x00400000u;
+    // subnormal or zero: the mantissa in units of 2^-24
+    const float subnormal = static_cast<float>(static_cast<int32_t>(h & 0x3ffu)) * 5.9604644775390625e-8f;
+
+    const uint32_t is_small = selectMask(exp == 0);
+    f = (is_small & floatBits(subnormal)) | (~is_small & f);
+    return bitsFloat(f | (static_cast<uint32_t>(h & 0x8000u) << 16));
+}
+
+} // detail
+
+/*
+ * Storage type of the "float16" dtype, i.e. an IEEE 754 binary16 value.
+ *
+ * It only converts from and to float, which is where the arithmetic is
+ * done.
+ */
+class Float16 {
+
+    uint16_t bits_;
+
+public:
+    Float16() = default;
+
+    explicit Float16(float value) : bits_(fromFloat(value)) {}
+
+    operator float() const {
+#if defined(__F16C__)
+        return _cvtsh_ss(bits_);
+#else
+        return detail::halfBitsToFloat(bits_);
+#endif
+    }
+
+    uint16_t bits() const { return bits_; }
+
+    static Float16 fromBits(uint16_t bits) {
+        Float16 h;
+        h.bits_ = bits;
+        return h;
+    }
+
+private:
+    static uint16_t fromFloat(float value) {
+#if defined(__F16C__)
+        return static_cast<uint16_t>(_cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT));
+#else
+        return detail::floatToHalfBits(value);
+#endif
+    }
+};
+
+static_assert(sizeof(Float16) == 2, "Float16 must be stored in 2 bytes");
+
+
+namespace detail {
+
+inline void halfToFloatRun(const Float16* src, std::size_t n, float* dst) {
+    std::size_t i = 0;
+#if defined(__AVX512F__)
+    for (; i + 16 <= n; i += 16) {
+        __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(h));
+    }
+#endif
+#if defined(__F16C__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+    }
+#endif
+    for (; i < n; ++i) dst[i] = static_cast<float>(src[i]);
+}
+
+inline void floatToHalfRun(const float* src, std::size_t n, Float16* dst) {
+    std::size_t i = 0;
+#if defined(__AVX512F__)
+    for (; i + 16 <= n; i += 16) {
+        __m256i h = _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), h);
+    }
+#endif
+#if defined(__F16C__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+    }
+#endif
+    for (; i < n; ++i) dst[i] = Float16(src[i]);
+}
+
+} // detail
+
+/*
+ * Convert half-precision values to float, 16 or 8 at a time with AVX-512F
+ * or F16C if the code is compiled for them (e.g. -mavx512f or -mf16c), and
+ * split across the thread pool.
+ */
+inline void halfToFloat(const Float16* src, std::size_t n, float* dst,
+                        ThreadPool& pool=ThreadPool::global()) {
+    pool.parallelFor(0, n, [&](std::size_t begin, std::size_t end) {
+        detail::halfToFloatRun(src + begin, end - begin, dst + begin);
+    }, std::max<std::size_t>(1 << 16, pool.grainFor(n)));
+}
+
+/*
+ * Convert float values to half precision, rounding to the nearest even.
+ * Values beyond the range of float16 become Inf.
+ */
+inline void floatToHalf(const float* src, std::size_t n, Float16* dst,
+                        ThreadPool& pool=ThreadPool::global()) {
+    pool.parallelFor(0, n, [&](std::size_t begin, std::size_t end) {
+        detail::floatToHalfRun(src + begin, end - begin, dst + begin);
+    }, std::max<std::size_t>(1 << 16, pool.grainFor(n)));
+}
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_FLOAT16_HPP
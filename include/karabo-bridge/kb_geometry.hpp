@@ -0,0 +1,432 @@
+/*
+    Assembly of multi-module detector images.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_GEOMETRY_HPP
+#define KARABO_BRIDGE_KB_GEOMETRY_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kb_client.hpp"
+#include "kb_parallel.hpp"
+
+
+namespace karabo_bridge {
+
+class GeometryError : public std::runtime_error {
+public:
+    explicit GeometryError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+/*
+ * Placement of a rectangular tile of a module in the lab frame, following
+ * the conventions of CrystFEL geometry files.
+ *
+ * Pixel (ss, fs) of the tile covers the parallelogram with the corner
+ * corner + (ss - min_ss) * ss_vec + (fs - min_fs) * fs_vec, in units of
+ * pixels. The ranges of ss and fs are inclusive.
+ */
+struct TileGeometry {
+    std::size_t module = 0;
+    std::size_t min_ss = 0;
+    std::size_t max_ss = 0;
+    std::size_t min_fs = 0;
+    std::size_t max_fs = 0;
+    double corner_x = 0.;
+    double corner_y = 0.;
+    double ss_x = 0.;
+    double ss_y = 1.;
+    double fs_x = 1.;
+    double fs_y = 0.;
+};
+
+
+namespace detail {
+
+// Parse a CrystFEL direction like "+0.0012x -0.999y".
+inline void parseDirection(const std::string& value, double& x, double& y) {
+    x = 0.;
+    y = 0.;
+    std::string s;
+    for (auto c : value) if (c != ' ' && c != '\t') s.push_back(c);
+
+    std::size_t pos = 0;
+    while (pos < s.size()) {
+        std::size_t end = s.find_first_of("xyz", pos);
+        if (end == std::string::npos) throw GeometryError("Invalid direction: " + value);
+
+        std::string coef = s.substr(pos, end - pos);
+        double v;
+        if (coef.empty() || coef == "+") v = 1.;
+        else if (coef == "-") v = -1.;
+        else {
+            char* stop;
+            v = std::strtod(coef.c_str(), &stop);
+            if (*stop != '\0') throw GeometryError("Invalid direction: " + value);
+        }
+
+        if (s[end] == 'x') x = v;
+        else if (s[end] == 'y') y = v;
+        pos = end + 1;
+    }
+}
+
+inline std::string trim(const std::string& s) {
+    auto begin = s.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) return "";
+    auto end = s.find_last_not_of(" \t\r");
+    return s.substr(begin, end - begin + 1);
+}
+
+} // detail
+
+/*
+ * Geometry of a detector made of modules of the same shape, which assembles
+ * [pulses, modules, ss, fs] arrays into 2D images.
+ *
+ * Each pixel is placed at the image pixel which contains its center. The
+ * placement is computed once into runs of image pixels which are copied
+ * from equally spaced data pixels, so that the assembly is a parallel
+ * gather. Image pixels not covered by any tile are gaps, and a pixel
+ * covered by several tiles takes the value of the last tile.
+ */
+class DetectorGeometry {
+
+    // run of image pixels in a row
+    struct Segment {
+        std::size_t dst; // offset in the image
+        std::size_t src; // offset in the module data of a pulse
+        std::size_t length;
+        std::ptrdiff_t step; // step in the module data, 0 for a gap
+    };
+
+    std::vector<TileGeometry> tiles_;
+    std::size_t n_modules_ = 0;
+    std::size_t n_ss_ = 0;
+    std::size_t n_fs_ = 0;
+
+    std::size_t height_ = 0;
+    std::size_t width_ = 0;
+    double x_min_ = 0.; // lab-frame position of the left edge of column 0
+    double y_min_ = 0.; // lab-frame position of the top edge of row 0
+
+    std::vector<Segment> segments_;
+    std::vector<std::size_t> row_begin_; // index of the first segment of each row
+
+    static constexpr std::size_t gap() { return std::numeric_limits<std::size_t>::max(); }
+
+    template<typename F>
+    void forEachPixel(F&& f) const {
+        for (auto& t : tiles_) {
+            for (std::size_t ss = t.min_ss; ss <= t.max_ss; ++ss) {
+                for (std::size_t fs = t.min_fs; fs <= t.max_fs; ++fs) {
+                    double u = ss - t.min_ss + 0.5;
+                    double v = fs - t.min_fs + 0.5;
+                    double x = t.corner_x + u * t.ss_x + v * t.fs_x;
+                    double y = t.corner_y + u * t.ss_y + v * t.fs_y;
+                    f(t.module, ss, fs, x, y);
+                }
+            }
+        }
+    }
+
+    void build() {
+        for (auto& t : tiles_) {
+            if (t.module >= n_modules_ || t.max_ss >= n_ss_ || t.max_fs >= n_fs_ ||
+                t.min_ss > t.max_ss || t.min_fs > t.max_fs)
+                throw GeometryError("Tile out of the module shape");
+        }
+
+        double x_min = std::numeric_limits<double>::infinity();
+        double y_min = x_min;
+        double x_max = -x_min;
+        double y_max = -x_min;
+        forEachPixel([&](std::size_t, std::size_t, std::size_t, double x, double y) {
+            x_min = std::min(x_min, std::floor(x));
+            y_min = std::min(y_min, std::floor(y));
+            x_max = std::max(x_max, std::floor(x));
+            y_max = std::max(y_max, std::floor(y));
+        });
+
+        segments_.clear();
+        row_begin_.clear();
+        if (tiles_.empty()) {
+            height_ = width_ = 0;
+            row_begin_.push_back(0);
+            return;
+        }
+
+        x_min_ = x_min;
+        y_min_ = y_min;
+        width_ = static_cast<std::size_t>(x_max - x_min) + 1;
+        height_ = static_cast<std::size_t>(y_max - y_min) + 1;
+
+        // flat lookup table of the data pixel of each image pixel
+        std::vector<std::size_t> lut(height_ * width_, gap());
+        const std::size_t module_size = n_ss_ * n_fs_;
+        forEachPixel([&](std::size_t module, std::size_t ss, std::size_t fs, double x, double y) {
+            auto col = static_cast<std::size_t>(std::floor(x) - x_min);
+            auto row = static_cast<std::size_t>(std::floor(y) - y_min);
+            lut[row * width_ + col] = module * module_size + ss * n_fs_ + fs;
+        });
+
+        // compress the table into runs with a constant step
+        for (std::size_t row = 0; row < height_; ++row) {
+            row_begin_.push_back(segments_.size());
+            std::size_t col = 0;
+            while (col < width_) {
+                const std::size_t* p = &lut[row * width_];
+                Segment seg{row * width_ + col, p[col], 1, 0};
+                if (p[col] == gap()) {
+                    while (col + seg.length < width_ && p[col + seg.length] == gap()) ++seg.length;
+                } else {
+                    seg.step = 1;
+                    if (col + 1 < width_ && p[col + 1] != gap())
+                        seg.step = static_cast<std::ptrdiff_t>(p[col + 1]) -
+                                   static_cast<std::ptrdiff_t>(p[col]);
+                    while (col + seg.length < width_ && p[col + seg.length] != gap() &&
+                           static_cast<std::ptrdiff_t>(p[col + seg.length]) ==
+                           static_cast<std::ptrdiff_t>(p[col]) + seg.step * static_cast<std::ptrdiff_t>(seg.length))
+                        ++seg.length;
+                }
+                segments_.push_back(seg);
+                col += seg.length;
+            }
+        }
+        row_begin_.push_back(segments_.size());
+    }
+
+    template<typename T>
+    void assembleRow(const T* src, T* dst, std::size_t row, T fill) const {
+        for (std::size_t i = row_begin_[row]; i < row_begin_[row + 1]; ++i) {
+            const Segment& seg = segments_[i];
+            T* d = dst + seg.dst;
+            if (seg.step == 0) {
+                std::fill(d, d + seg.length, fill);
+            } else if (seg.step == 1) {
+                std::memcpy(d, src + seg.src, seg.length * sizeof(T));
+            } else {
+                const T* s = src + seg.src;
+                const std::ptrdiff_t step = seg.step;
+                for (std::size_t k = 0; k < seg.length; ++k)
+                    d[k] = s[static_cast<std::ptrdiff_t>(k) * step];
+            }
+        }
+    }
+
+public:
+    DetectorGeometry() { build(); }
+
+    /*
+     * Constructor.
+     *
+     * @param tiles: placement of the tiles.
+     * @param module_shape: shape [modules, ss, fs] of the data of a pulse.
+     *
+     * Exceptions:
+     * GeometryError: if a tile is out of the module shape
+     */
+    DetectorGeometry(const std::vector<TileGeometry>& tiles,
+                     const std::vector<std::size_t>& module_shape) : tiles_(tiles) {
+        if (module_shape.size() != 3)
+            throw GeometryError("The module shape must be [modules, ss, fs]");
+        n_modules_ = module_shape[0];
+        n_ss_ = module_shape[1];
+        n_fs_ = module_shape[2];
+        build();
+    }
+
+    /*
+     * Read the panels of a CrystFEL geometry file.
+     *
+     * A setting without a panel name is the default of the panels which
+     * follow it. The module of a panel is given by the "dimN" setting with
+     * a number, e.g. "p0a0/dim1 = 0", while "dimN = ss" or "dimN = modno"
+     * name the axes. Without one, the modules are assumed to be stacked
+     * along the slow-scan axis. The regions whose names start with "bad_"
+     * are not panels.
+     *
+     * @param in: geometry file.
+     * @param module_shape: shape [modules, ss, fs] of the data of a pulse.
+     *
+     * Exceptions:
+     * GeometryError: if the file is invalid or a tile is out of the module shape
+     */
+    static DetectorGeometry fromCrystFEL(std::istream& in,
+                                         const std::vector<std::size_t>& module_shape) {
+        if (module_shape.size() != 3 || !module_shape[1])
+            throw GeometryError("The module shape must be [modules, ss, fs]");
+
+        std::map<std::string, std::map<std::string, std::string>> panels;
+        std::vector<std::string> names; // in the order of the file
+        std::map<std::string, std::string> defaults;
+        std::string line;
+        while (std::getline(in, line)) {
+            line = line.substr(0, line.find(';'));
+            auto eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            std::string key = detail::trim(line.substr(0, eq));
+            std::string value = detail::trim(line.substr(eq + 1));
+            auto slash = key.find('/');
+            if (slash == std::string::npos) {
+                defaults[key] = value;
+                continue;
+            }
+
+            std::string name = key.substr(0, slash);
+            if (name.compare(0, 4, "bad_") == 0) continue;
+            // a panel starts with the defaults set before it
+            if (!panels.count(name)) {
+                names.push_back(name);
+                panels[name] = defaults;
+            }
+            panels[name][key.substr(slash + 1)] = value;
+        }
+
+        std::vector<TileGeometry> tiles;
+        for (auto& name : names) {
+            auto& keys = panels[name];
+            auto get = [&](const std::string& key) -> const std::string& {
+                auto it = keys.find(key);
+                if (it == keys.end()) throw GeometryError("Panel " + name + " has no " + key);
+                return it->second;
+            };
+            auto isSize = [](const std::string& v) {
+                return !v.empty() && v.find_first_not_of("0123456789") == std::string::npos;
+            };
+            auto toSize = [&](const std::string& key) {
+                const std::string& v = get(key);
+                if (!isSize(v)) throw GeometryError("Invalid " + name + "/" + key);
+                return static_cast<std::size_t>(std::strtoull(v.c_str(), nullptr, 10));
+            };
+            auto toDouble = [&](const std::string& key) {
+                char* stop;
+                const std::string& v = get(key);
+                double x = std::strtod(v.c_str(), &stop);
+                if (*stop != '\0') throw GeometryError("Invalid " + name + "/" + key);
+                return x;
+            };
+
+            TileGeometry t;
+            t.min_ss = toSize("min_ss");
+            t.max_ss = toSize("max_ss");
+            t.min_fs = toSize("min_fs");
+            t.max_fs = toSize("max_fs");
+            // the module index is the only "dimN" which is a number
+            std::string module_dim;
+            for (auto& v : keys) {
+                if (v.first.compare(0, 3, "dim") != 0 || !isSize(v.second)) continue;
+                if (!module_dim.empty())
+                    throw GeometryError("Panel " + name + " has both " + module_dim + " and " + v.first);
+                module_dim = v.first;
+            }
+            if (!module_dim.empty()) {
+                t.module = toSize(module_dim);
+            } else {
+                t.module = t.min_ss / module_shape[1];
+                t.min_ss -= t.module * module_shape[1];
+                t.max_ss -= t.module * module_shape[1];
+            }
+            t.corner_x = toDouble("corner_x");
+            t.corner_y = toDouble("corner_y");
+            detail::parseDirection(get("ss"), t.ss_x, t.ss_y);
+            detail::parseDirection(get("fs"), t.fs_x, t.fs_y);
+            tiles.push_back(t);
+        }
+
+        return DetectorGeometry(tiles, module_shape);
+    }
+
+    const std::vector<TileGeometry>& tiles() const { return tiles_; }
+
+    // Return the shape [modules, ss, fs] of the data of a pulse.
+    std::vector<std::size_t> moduleShape() const { return {n_modules_, n_ss_, n_fs_}; }
+
+    // Return the shape [rows, columns] of an assembled image.
+    std::vector<std::size_t> imageShape() const { return {height_, width_}; }
+
+    /*
+     * Return the lab-frame position (x, y) of the corner of image pixel
+     * (0, 0). Columns run along x and rows along y.
+     */
+    std::pair<double, double> origin() const { return {x_min_, y_min_}; }
+
+    /*
+     * Assemble the data of pulses into images.
+     *
+     * @param src: data of shape [pulses, modules, ss, fs].
+     * @param n_pulses: number of pulses.
+     * @param dst: buffer of shape [pulses, rows, columns].
+     * @param fill: value of the gaps.
+     * @param pool: thread pool.
+     */
+    template<typename T>
+    void assemble(const T* src, std::size_t n_pulses, T* dst, T fill=T(),
+                  ThreadPool& pool=ThreadPool::global()) const {
+        const std::size_t src_size = n_modules_ * n_ss_ * n_fs_;
+        const std::size_t dst_size = height_ * width_;
+        const std::size_t n_rows = n_pulses * height_;
+        pool.parallelFor(0, n_rows, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t r = begin; r < end; ++r) {
+                std::size_t pulse = r / height_;
+                assembleRow(src + pulse * src_size, dst + pulse * dst_size, r % height_, fill);
+            }
+        }, pool.grainFor(n_rows));
+    }
+
+    /*
+     * Assemble an array of shape [pulses, modules, ss, fs], or
+     * [modules, ss, fs] for a single pulse, into images.
+     *
+     * @param array: data.
+     * @param dst: buffer of shape [pulses, rows, columns].
+     * @param fill: value of the gaps.
+     * @param pool: thread pool.
+     *
+     * Return an NDArray which refers to the buffer.
+     *
+     * Exceptions:
+     * GeometryError: if the shape of the array does not match
+     * TypeMismatchErrorNDArray: if T does not match the dtype of the array
+     */
+    template<typename T>
+    NDArray assemble(const NDArray& array, T* dst, T fill=T(),
+                     ThreadPool& pool=ThreadPool::global()) const {
+        std::vector<std::size_t> shape = array.shape();
+        std::size_t n_pulses = 1;
+        if (shape.size() == 4) {
+            n_pulses = shape[0];
+            shape.erase(shape.begin());
+        }
+        if (shape != moduleShape())
+            throw GeometryError("The array does not match the module shape of the geometry");
+
+        assemble(array.data<T>(), n_pulses, dst, fill, pool);
+
+        std::vector<std::size_t> out_shape {height_, width_};
+        if (array.shape().size() == 4) out_shape.insert(out_shape.begin(), n_pulses);
+        return NDArray(dst, out_shape, array.dtype());
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_GEOMETRY_HPP
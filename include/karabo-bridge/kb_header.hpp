@@ -0,0 +1,312 @@
+/*
+    Allocation-free parser of bridge header frames.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_HEADER_HPP
+#define KARABO_BRIDGE_KB_HEADER_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+
+
+namespace karabo_bridge {
+
+/*
+ * A non-owning view of a string in a frame, which must outlive the view.
+ *
+ * A null view, i.e. the default one, stands for a missing field and is
+ * different from an empty string.
+ */
+class StringRef {
+
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+
+public:
+    StringRef() = default;
+
+    StringRef(const char* data, std::size_t size) : data_(data), size_(size) {}
+
+    const char* data() const { return data_; }
+
+    std::size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    bool isNull() const { return data_ == nullptr; }
+
+    std::string str() const { return isNull() ? std::string() : std::string(data_, size_); }
+
+    bool operator==(const char* s) const {
+        return !isNull() && std::strlen(s) == size_ && std::memcmp(data_, s, size_) == 0;
+    }
+
+    bool operator!=(const char* s) const { return !(*this == s); }
+
+    bool operator==(const std::string& s) const {
+        return !isNull() && s.size() == size_ && std::memcmp(data_, s.data(), size_) == 0;
+    }
+
+    bool operator!=(const std::string& s) const { return !(*this == s); }
+};
+
+/*
+ * Fields of a header frame used to decode a train. The strings refer to
+ * the frame.
+ */
+struct HeaderFields {
+
+    static constexpr std::size_t maxRank() { return 8; }
+
+    StringRef source;
+    StringRef content;
+    StringRef path;
+    StringRef dtype;
+    StringRef compression;
+
+    bool has_shape = false;
+    std::size_t ndim = 0;
+    std::array<std::size_t, 8> shape {{}};
+
+    bool has_metadata = false;
+    // "timestamp.tid" of the metadata if it is a non-negative integer
+    bool has_tid = false;
+    uint64_t tid = 0;
+};
+
+
+namespace detail {
+
+/*
+ * Bounds-checked reader of msgpack data. Every method returns false
+ * instead of reading past the end or if the data are not of the expected
+ * type, in which case the position is unspecified.
+ */
+class MsgpackReader {
+
+    const uint8_t* p_;
+    const uint8_t* end_;
+
+    bool readBE(std::size_t n, uint64_t& v) {
+        if (static_cast<std::size_t>(end_ - p_) < n) return false;
+        v = 0;
+        for (std::size_t i = 0; i < n; ++i) v = (v << 8) | p_[i];
+        p_ += n;
+        return true;
+    }
+
+    bool advance(uint64_t n) {
+        if (static_cast<uint64_t>(end_ - p_) < n) return false;
+        p_ += n;
+        return true;
+    }
+
+public:
+    MsgpackReader(const void* data, std::size_t size)
+        : p_(static_cast<const uint8_t*>(data)), end_(static_cast<const uint8_t*>(data) + size) {}
+
+    bool atEnd() const { return p_ == end_; }
+
+    bool peek(uint8_t& tag) const {
+        if (p_ == end_) return false;
+        tag = *p_;
+        return true;
+    }
+
+    bool readMapSize(uint64_t& n) {
+        if (p_ == end_) return false;
+        uint8_t tag = *p_++;
+        if ((tag & 0xf0) == 0x80) { n = tag & 0x0f; return true; }
+        if (tag == 0xde) return readBE(2, n);
+        if (tag == 0xdf) return readBE(4, n);
+        return false;
+    }
+
+    bool readArraySize(uint64_t& n) {
+        if (p_ == end_) return false;
+        uint8_t tag = *p_++;
+        if ((tag & 0xf0) == 0x90) { n = tag & 0x0f; return true; }
+        if (tag == 0xdc) return readBE(2, n);
+        if (tag == 0xdd) return readBE(4, n);
+        return false;
+    }
+
+    bool readString(StringRef& s) {
+        if (p_ == end_) return false;
+        uint8_t tag = *p_++;
+        uint64_t n;
+        if ((tag & 0xe0) == 0xa0) n = tag & 0x1f;
+        else if (tag == 0xd9) { if (!readBE(1, n)) return false; }
+        else if (tag == 0xda) { if (!readBE(2, n)) return false; }
+        else if (tag == 0xdb) { if (!readBE(4, n)) return false; }
+        else return false;
+
+        const char* data = reinterpret_cast<const char*>(p_);
+        if (!advance(n)) return false;
+        s = StringRef(data, static_cast<std::size_t>(n));
+        return true;
+    }
+
+    // Read a non-negative integer, which may also be packed as a signed one.
+    bool readUint(uint64_t& v) {
+        if (p_ == end_) return false;
+        uint8_t tag = *p_++;
+        if (tag <= 0x7f) { v = tag; return true; }
+        if (tag >= 0xcc && tag <= 0xcf) return readBE(std::size_t(1) << (tag - 0xcc), v);
+        if (tag >= 0xd0 && tag <= 0xd3) {
+            std::size_t n = std::size_t(1) << (tag - 0xd0);
+            if (!readBE(n, v)) return false;
+            // negative if the sign bit of the n-byte integer is set
+            return (v >> (8 * n - 1)) == 0;
+        }
+        return false;
+    }
+
+    /*
+     * Skip n objects including nested ones. The objects still to skip are
+     * counted instead of recursing, and every object takes at least one
+     * byte, so that corrupted sizes fail early.
+     */
+    bool skip(uint64_t n=1) {
+        while (n) {
+            if (p_ == end_ || n > static_cast<uint64_t>(end_ - p_)) return false;
+            --n;
+            uint8_t tag = *p_++;
+            uint64_t size;
+            if (tag <= 0x7f || tag >= 0xe0) continue; // fixint
+            if ((tag & 0xf0) == 0x80) { n += 2 * uint64_t(tag & 0x0f); continue; } // fixmap
+            if ((tag & 0xf0) == 0x90) { n += tag & 0x0f; continue; } // fixarray
+            if ((tag & 0xe0) == 0xa0) { if (!advance(tag & 0x1f)) return false; continue; } // fixstr
+            switch (tag) {
+                case 0xc0: case 0xc2: case 0xc3: break; // nil, false, true
+                case 0xc4: case 0xd9: if (!readBE(1, size) || !advance(size)) return false; break;
+                case 0xc5: case 0xda: if (!readBE(2, size) || !advance(size)) return false; break;
+                case 0xc6: case 0xdb: if (!readBE(4, size) || !advance(size)) return false; break;
+                case 0xc7: if (!readBE(1, size) || !advance(size + 1)) return false; break; // ext 8
+                case 0xc8: if (!readBE(2, size) || !advance(size + 1)) return false; break;
+                case 0xc9: if (!readBE(4, size) || !advance(size + 1)) return false; break;
+                case 0xca: if (!advance(4)) return false; break; // float 32
+                case 0xcb: if (!advance(8)) return false; break;
+                case 0xcc: case 0xd0: if (!advance(1)) return false; break;
+                case 0xcd: case 0xd1: if (!advance(2)) return false; break;
+                case 0xce: case 0xd2: if (!advance(4)) return false; break;
+                case 0xcf: case 0xd3: if (!advance(8)) return false; break;
+                case 0xd4: if (!advance(2)) return false; break; // fixext 1
+                case 0xd5: if (!advance(3)) return false; break;
+                case 0xd6: if (!advance(5)) return false; break;
+                case 0xd7: if (!advance(9)) return false; break;
+                case 0xd8: if (!advance(17)) return false; break;
+                case 0xdc: if (!readBE(2, size)) return false; n += size; break; // array 16
+                case 0xdd: if (!readBE(4, size)) return false; n += size; break;
+                case 0xde: if (!readBE(2, size)) return false; n += 2 * size; break; // map 16
+                case 0xdf: if (!readBE(4, size)) return false; n += 2 * size; break;
+                default: return false; // 0xc1 is never used
+            }
+        }
+        return true;
+    }
+};
+
+// Read a string field which must not be repeated.
+inline bool readField(MsgpackReader& reader, StringRef& field) {
+    return field.isNull() && reader.readString(field);
+}
+
+inline bool readShape(MsgpackReader& reader, HeaderFields& fields) {
+    uint64_t n;
+    if (fields.has_shape || !reader.readArraySize(n) || n > HeaderFields::maxRank()) return false;
+    for (std::size_t i = 0; i < n; ++i) {
+        uint64_t v;
+        // the generic decoder reads the shape as unsigned int
+        if (!reader.readUint(v) || v > std::numeric_limits<unsigned int>::max()) return false;
+        fields.shape[i] = static_cast<std::size_t>(v);
+    }
+    fields.ndim = static_cast<std::size_t>(n);
+    fields.has_shape = true;
+    return true;
+}
+
+inline bool readMetadata(MsgpackReader& reader, HeaderFields& fields) {
+    if (fields.has_metadata) return false;
+    fields.has_metadata = true;
+
+    uint8_t tag;
+    if (!reader.peek(tag)) return false;
+    // metadata which are not a map are left to the generic decoder
+    if (!((tag & 0xf0) == 0x80 || tag == 0xde || tag == 0xdf)) return reader.skip();
+
+    uint64_t n;
+    if (!reader.readMapSize(n)) return false;
+    bool seen_tid = false;
+    for (uint64_t i = 0; i < n; ++i) {
+        // keys which are not strings are skipped
+        StringRef key;
+        if (!reader.peek(tag)) return false;
+        bool is_str = (tag & 0xe0) == 0xa0 || (tag >= 0xd9 && tag <= 0xdb);
+        if (is_str ? !reader.readString(key) : !reader.skip()) return false;
+
+        if (key == "timestamp.tid") {
+            if (seen_tid || !reader.peek(tag)) return false;
+            seen_tid = true;
+            if (tag <= 0x7f || (tag >= 0xcc && tag <= 0xd3)) {
+                if (!reader.readUint(fields.tid)) return false;
+                fields.has_tid = true;
+                continue;
+            }
+        }
+        if (!reader.skip()) return false;
+    }
+    return true;
+}
+
+} // detail
+
+/*
+ * Parse a header frame, i.e. a msgpack map, in a single bounds-checked
+ * scan without allocating memory.
+ *
+ * The string fields "source", "content", "path", "dtype" and
+ * "compression", the "shape" and "timestamp.tid" of the "metadata" are
+ * extracted, and the other fields are skipped.
+ *
+ * Return false for a layout which is not understood, e.g. a truncated
+ * frame, a field of an unexpected type, a repeated field or a shape of
+ * rank above 8, in which case the frame should be decoded by the generic
+ * msgpack path.
+ */
+inline bool parseHeader(const void* data, std::size_t size, HeaderFields& fields) {
+    fields = HeaderFields();
+    detail::MsgpackReader reader(data, size);
+
+    uint64_t n;
+    if (!reader.readMapSize(n)) return false;
+    for (uint64_t i = 0; i < n; ++i) {
+        StringRef key;
+        if (!reader.readString(key)) return false;
+
+        bool ok;
+        if (key == "source") ok = detail::readField(reader, fields.source);
+        else if (key == "content") ok = detail::readField(reader, fields.content);
+        else if (key == "path") ok = detail::readField(reader, fields.path);
+        else if (key == "dtype") ok = detail::readField(reader, fields.dtype);
+        else if (key == "compression") ok = detail::readField(reader, fields.compression);
+        else if (key == "shape") ok = detail::readShape(reader, fields);
+        else if (key == "metadata") ok = detail::readMetadata(reader, fields);
+        else ok = reader.skip();
+        if (!ok) return false;
+    }
+    return reader.atEnd();
+}
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_HEADER_HPP
@@ -0,0 +1,184 @@
+/*
+    Thread pool for the data processing kernels.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_PARALLEL_HPP
+#define KARABO_BRIDGE_KB_PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace karabo_bridge {
+
+/*
+ * A fixed-size pool of worker threads which runs one loop at a time.
+ *
+ * The calling thread takes part in the work, so a pool of size 1 has no
+ * worker thread at all.
+ */
+class ThreadPool {
+
+    using RangeFunction = std::function<void(std::size_t, std::size_t)>;
+
+    struct Job {
+        const RangeFunction& fn;
+        std::atomic<std::size_t> next;
+        std::size_t end;
+        std::size_t grain;
+
+        std::mutex error_mtx;
+        std::exception_ptr error;
+
+        Job(const RangeFunction& f, std::size_t b, std::size_t e, std::size_t g)
+            : fn(f), next(b), end(e), grain(g) {}
+
+        void run() {
+            while (true) {
+                std::size_t begin = next.fetch_add(grain);
+                if (begin >= end) break;
+                try {
+                    fn(begin, std::min(begin + grain, end));
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mtx);
+                    if (!error) error = std::current_exception();
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> workers_;
+
+    std::mutex mtx_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+    Job* job_ = nullptr;
+    uint64_t generation_ = 0;
+    std::size_t busy_ = 0;
+    bool stop_ = false;
+
+    // only one loop runs at a time
+    std::mutex submit_mtx_;
+
+    // nested loops run serially
+    static bool& inLoop() {
+        static thread_local bool in_loop = false;
+        return in_loop;
+    }
+
+    void work() {
+        inLoop() = true;
+        uint64_t generation = 0;
+        std::unique_lock<std::mutex> lock(mtx_);
+        while (true) {
+            start_cv_.wait(lock, [&] { return stop_ || generation_ != generation; });
+            if (stop_) return;
+            generation = generation_;
+            if (!job_) continue; // the loop has already finished
+
+            Job* job = job_;
+            ++busy_;
+            lock.unlock();
+            job->run();
+            lock.lock();
+            if (--busy_ == 0) done_cv_.notify_all();
+        }
+    }
+
+public:
+    /*
+     * Constructor.
+     *
+     * @param n_threads: number of threads including the calling thread. "0"
+     *                   (default) for the number of hardware threads.
+     */
+    explicit ThreadPool(std::size_t n_threads=0) {
+        if (!n_threads) n_threads = std::max(1u, std::thread::hardware_concurrency());
+        for (std::size_t i = 1; i < n_threads; ++i)
+            workers_.emplace_back(&ThreadPool::work, this);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stop_ = true;
+        }
+        start_cv_.notify_all();
+        for (auto& t : workers_) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Return the number of threads including the calling thread.
+    std::size_t size() const { return workers_.size() + 1; }
+
+    /*
+     * Call fn(chunk_begin, chunk_end) on chunks of at most "grain" indices
+     * which cover [begin, end), and return when all of them are done.
+     *
+     * Exceptions:
+     * the first exception thrown by fn is rethrown
+     */
+    void parallelFor(std::size_t begin, std::size_t end, const RangeFunction& fn,
+                     std::size_t grain=1) {
+        if (begin >= end) return;
+        grain = std::max<std::size_t>(grain, 1);
+
+        if (workers_.empty() || inLoop() || end - begin <= grain) {
+            fn(begin, end);
+            return;
+        }
+
+        std::lock_guard<std::mutex> submit_lock(submit_mtx_);
+        Job job(fn, begin, end, grain);
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            job_ = &job;
+            ++generation_;
+        }
+        start_cv_.notify_all();
+
+        inLoop() = true;
+        job.run();
+        inLoop() = false;
+
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            done_cv_.wait(lock, [this] { return busy_ == 0; });
+            job_ = nullptr;
+        }
+
+        if (job.error) std::rethrow_exception(job.error);
+    }
+
+    /*
+     * Return a grain which splits [0, n) into a few chunks per thread.
+     */
+    std::size_t grainFor(std::size_t n) const {
+        return std::max<std::size_t>(1, n / (4 * size()));
+    }
+
+    // Return the pool shared by default in this library.
+    static ThreadPool& global() {
+        static ThreadPool pool;
+        return pool;
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_PARALLEL_HPP
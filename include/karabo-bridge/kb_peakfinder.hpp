@@ -0,0 +1,436 @@
+/*
+    Bragg peak finding for hit finding in serial crystallography.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_PEAKFINDER_HPP
+#define KARABO_BRIDGE_KB_PEAKFINDER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "kb_client.hpp"
+#include "kb_parallel.hpp"
+
+
+namespace karabo_bridge {
+
+class PeakFinderError : public std::runtime_error {
+public:
+    explicit PeakFinderError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+struct PeakFinderOptions {
+    // minimum value of a peak pixel
+    float adc_threshold = 0.f;
+    // minimum signal-to-noise ratio of a peak pixel above the local background
+    float min_snr = 6.f;
+    // The local background of a pixel is computed from the square ring
+    // between the two radii around it, so that it excludes the peak.
+    std::size_t background_inner_radius = 2;
+    std::size_t background_outer_radius = 5;
+    // minimum number of unmasked background pixels
+    std::size_t min_background_pixels = 8;
+    // limits of the number of pixels of a peak
+    std::size_t min_pixels = 2;
+    std::size_t max_pixels = 200;
+    // minimum number of peaks of a hit
+    std::size_t min_peaks = 10;
+    // maximum number of peaks reported per pulse
+    std::size_t max_peaks = 2048;
+};
+
+/*
+ * A peak, i.e. a connected component (8-connectivity) of the pixels of a
+ * module above the threshold.
+ */
+struct Peak {
+    uint32_t pulse = 0;
+    uint32_t module = 0;
+    // intensity-weighted center above the background in pixels
+    float ss = 0.f;
+    float fs = 0.f;
+    // summed intensity above the background
+    float intensity = 0.f;
+    float max_intensity = 0.f;
+    // maximum signal-to-noise ratio of the pixels
+    float snr = 0.f;
+    uint32_t n_pixels = 0;
+};
+
+struct PeakFinderResult {
+    // peaks ordered by pulse and module, at most max_peaks per pulse
+    std::vector<Peak> peaks;
+    // number of peaks found in each pulse, including those not reported
+    std::vector<uint32_t> n_peaks;
+    // whether each pulse is a hit
+    std::vector<uint8_t> hits;
+
+    std::size_t nHits() const {
+        return static_cast<std::size_t>(std::count(hits.begin(), hits.end(), 1));
+    }
+};
+
+
+namespace detail {
+
+/*
+ * Scratch buffers for finding the peaks of a module, which are reused
+ * across the modules processed by a thread.
+ */
+struct PeakFinderScratch {
+    // The rows of the summed-area tables of the unmasked values, their
+    // squares and count, which are needed by a row of pixels. Row r of a
+    // table is stored at r % n_rows and has n_fs + 1 columns.
+    std::size_t n_rows = 0;
+    std::vector<double> sum;
+    std::vector<double> sum2;
+    std::vector<double> count;
+    // clipped columns of the outer and inner boxes of the ring of each pixel
+    std::vector<std::size_t> outer_lo, outer_hi, inner_lo, inner_hi;
+    // background and signal-to-noise ratio of the candidate pixels
+    std::vector<float> background;
+    std::vector<float> snr;
+    // 1 for the candidate pixels which are not yet in a peak
+    std::vector<uint8_t> candidate;
+    // candidate flags of a row
+    std::vector<float> pass;
+    std::vector<uint32_t> stack;
+
+    void resize(std::size_t n_ss, std::size_t n_fs, std::size_t ro, std::size_t ri) {
+        n_rows = 2 * ro + 2;
+        sum.resize(n_rows * (n_fs + 1));
+        sum2.resize(n_rows * (n_fs + 1));
+        count.resize(n_rows * (n_fs + 1));
+        // row 0 of the tables
+        std::fill(sum.begin(), sum.begin() + n_fs + 1, 0.);
+        std::fill(sum2.begin(), sum2.begin() + n_fs + 1, 0.);
+        std::fill(count.begin(), count.begin() + n_fs + 1, 0.);
+
+        if (outer_lo.size() != n_fs) {
+            outer_lo.resize(n_fs);
+            outer_hi.resize(n_fs);
+            inner_lo.resize(n_fs);
+            inner_hi.resize(n_fs);
+            for (std::size_t j = 0; j < n_fs; ++j) {
+                outer_lo[j] = j > ro ? j - ro : 0;
+                outer_hi[j] = std::min(j + ro + 1, n_fs);
+                inner_lo[j] = j > ri ? j - ri : 0;
+                inner_hi[j] = std::min(j + ri + 1, n_fs);
+            }
+        }
+
+        background.resize(n_ss * n_fs);
+        snr.resize(n_ss * n_fs);
+        candidate.resize(n_ss * n_fs);
+        pass.resize(n_fs);
+    }
+};
+
+/*
+ * Return whether a pixel passes the thresholds given the sum, the sum of
+ * squares and the number of the pixels of its background ring.
+ *
+ * The SNR test (v - mean)^2 >= snr^2 * var is multiplied by n^2 to avoid
+ * the divisions, so that the test of a row is vectorized.
+ */
+inline bool passesThresholds(double v, double s, double s2, double n, double adc_threshold,
+                             double snr2, double min_n) {
+    double signal_n = v * n - s; // (v - mean) * n
+    double var_n2 = s2 * n - s * s; // var * n^2
+    return (v > adc_threshold) & (n >= min_n) & (signal_n > 0.) & (signal_n * signal_n >= snr2 * var_n2);
+}
+
+/*
+ * Find the peaks of a module of n_ss x n_fs pixels and append them to "peaks".
+ *
+ * The rows of the summed-area tables are computed just before they are
+ * needed and only 2 * outer radius + 2 of them are kept, so that the
+ * working set of a module stays in the L1/L2 cache.
+ */
+template<typename T>
+inline void findModulePeaks(const T* data, const uint8_t* mask, std::size_t n_ss, std::size_t n_fs,
+                            const PeakFinderOptions& opts, PeakFinderScratch& scratch,
+                            uint32_t pulse, uint32_t module, std::vector<Peak>& peaks) {
+    const std::size_t ro = opts.background_outer_radius, ri = opts.background_inner_radius;
+    scratch.resize(n_ss, n_fs, ro, ri);
+    const std::size_t w = n_fs + 1;
+    const std::size_t n_rows = scratch.n_rows;
+    double* sum = scratch.sum.data();
+    double* sum2 = scratch.sum2.data();
+    double* count = scratch.count.data();
+
+    // Compute row r (> 0) of the summed-area tables from row r - 1.
+    auto computeRow = [&](std::size_t r) {
+        std::size_t prev = (r - 1) % n_rows * w, cur = r % n_rows * w;
+        double row_sum = 0., row_sum2 = 0., row_count = 0.;
+        const T* row = data + (r - 1) * n_fs;
+        const uint8_t* row_mask = mask ? mask + (r - 1) * n_fs : nullptr;
+        sum[cur] = sum2[cur] = count[cur] = 0.;
+        for (std::size_t j = 0; j < n_fs; ++j) {
+            double v = static_cast<double>(row[j]);
+            bool valid = (!row_mask || !row_mask[j]) && !std::isnan(v);
+            double x = valid ? v : 0.;
+            row_sum += x;
+            row_sum2 += x * x;
+            row_count += valid ? 1. : 0.;
+            sum[cur + j + 1] = sum[prev + j + 1] + row_sum;
+            sum2[cur + j + 1] = sum2[prev + j + 1] + row_sum2;
+            count[cur + j + 1] = count[prev + j + 1] + row_count;
+        }
+    };
+
+    const double adc_threshold = opts.adc_threshold;
+    const double snr2 = static_cast<double>(opts.min_snr) * opts.min_snr;
+    const double min_n = static_cast<double>(opts.min_background_pixels);
+
+    // columns whose ring is not clipped in fs
+    const std::size_t j_begin = std::min(ro, n_fs);
+    const std::size_t j_end = std::max(j_begin, n_fs > ro ? n_fs - ro : 0);
+
+    // candidate pixels
+    bool any = false;
+    std::size_t next_row = 1;
+    for (std::size_t i = 0; i < n_ss; ++i) {
+        // rows of the outer and inner boxes of the ring
+        std::size_t r0 = i > ro ? i - ro : 0, r1 = std::min(i + ro + 1, n_ss);
+        std::size_t q0 = i > ri ? i - ri : 0, q1 = std::min(i + ri + 1, n_ss);
+        while (next_row <= r1) computeRow(next_row++);
+
+        const double *sa = sum + r0 % n_rows * w, *sb = sum + r1 % n_rows * w;
+        const double *sc = sum + q0 % n_rows * w, *sd = sum + q1 % n_rows * w;
+        const double *ua = sum2 + r0 % n_rows * w, *ub = sum2 + r1 % n_rows * w;
+        const double *uc = sum2 + q0 % n_rows * w, *ud = sum2 + q1 % n_rows * w;
+        const double *na = count + r0 % n_rows * w, *nb = count + r1 % n_rows * w;
+        const double *nc = count + q0 % n_rows * w, *nd = count + q1 % n_rows * w;
+
+        // sums over the ring of a column, clipped to the module
+        auto ring = [&](const double* a, const double* b, const double* c, const double* d,
+                        std::size_t j) {
+            std::size_t c0 = scratch.outer_lo[j], c1 = scratch.outer_hi[j];
+            std::size_t d0 = scratch.inner_lo[j], d1 = scratch.inner_hi[j];
+            return (b[c1] - a[c1] - b[c0] + a[c0]) - (d[d1] - c[d1] - d[d0] + c[d0]);
+        };
+
+        const T* row = data + i * n_fs;
+        float* pass = scratch.pass.data();
+        auto testEdge = [&](std::size_t j) {
+            pass[j] = passesThresholds(row[j], ring(sa, sb, sc, sd, j), ring(ua, ub, uc, ud, j),
+                                       ring(na, nb, nc, nd, j), adc_threshold, snr2, min_n) ? 1.f : 0.f;
+        };
+        for (std::size_t j = 0; j < j_begin; ++j) testEdge(j);
+        for (std::size_t j = j_end; j < n_fs; ++j) testEdge(j);
+
+        // The results go to a float buffer, which unlike "candidate"
+        // cannot alias the tables, so that the loop is vectorized.
+        const std::size_t po = ro + 1, mo = ro, pi = ri + 1, mi = ri;
+        for (std::size_t j = j_begin; j < j_end; ++j) {
+            double s = (sb[j + po] - sa[j + po] - sb[j - mo] + sa[j - mo])
+                     - (sd[j + pi] - sc[j + pi] - sd[j - mi] + sc[j - mi]);
+            double s2 = (ub[j + po] - ua[j + po] - ub[j - mo] + ua[j - mo])
+                      - (ud[j + pi] - uc[j + pi] - ud[j - mi] + uc[j - mi]);
+            double n = (nb[j + po] - na[j + po] - nb[j - mo] + na[j - mo])
+                     - (nd[j + pi] - nc[j + pi] - nd[j - mi] + nc[j - mi]);
+            pass[j] = passesThresholds(row[j], s, s2, n, adc_threshold, snr2, min_n) ? 1.f : 0.f;
+        }
+
+        uint8_t* cand = &scratch.candidate[i * n_fs];
+        for (std::size_t j = 0; j < n_fs; ++j) {
+            cand[j] = pass[j] != 0.f && !(mask && mask[i * n_fs + j]);
+            if (!cand[j]) continue;
+
+            double n = ring(na, nb, nc, nd, j);
+            double mean = ring(sa, sb, sc, sd, j) / n;
+            double var = std::max(0., ring(ua, ub, uc, ud, j) / n - mean * mean);
+            double signal = row[j] - mean;
+            scratch.background[i * n_fs + j] = static_cast<float>(mean);
+            scratch.snr[i * n_fs + j] = var > 0. ? static_cast<float>(signal / std::sqrt(var))
+                                                 : std::numeric_limits<float>::infinity();
+            any = true;
+        }
+    }
+    if (!any) return;
+
+    // connected components of the candidates
+    auto& stack = scratch.stack;
+    for (std::size_t seed = 0; seed < n_ss * n_fs; ++seed) {
+        if (!scratch.candidate[seed]) continue;
+
+        Peak peak;
+        peak.pulse = pulse;
+        peak.module = module;
+        double total = 0., wss = 0., wfs = 0.;
+
+        scratch.candidate[seed] = 0;
+        stack.clear();
+        stack.push_back(static_cast<uint32_t>(seed));
+        while (!stack.empty()) {
+            std::size_t k = stack.back();
+            stack.pop_back();
+            std::size_t i = k / n_fs, j = k % n_fs;
+
+            double signal = static_cast<double>(data[k]) - scratch.background[k];
+            total += signal;
+            wss += signal * i;
+            wfs += signal * j;
+            peak.max_intensity = std::max(peak.max_intensity, static_cast<float>(data[k]));
+            peak.snr = std::max(peak.snr, scratch.snr[k]);
+            ++peak.n_pixels;
+
+            for (std::size_t ii = i ? i - 1 : 0; ii <= std::min(i + 1, n_ss - 1); ++ii) {
+                for (std::size_t jj = j ? j - 1 : 0; jj <= std::min(j + 1, n_fs - 1); ++jj) {
+                    std::size_t kk = ii * n_fs + jj;
+                    if (scratch.candidate[kk]) {
+                        scratch.candidate[kk] = 0;
+                        stack.push_back(static_cast<uint32_t>(kk));
+                    }
+                }
+            }
+        }
+
+        if (peak.n_pixels < opts.min_pixels || peak.n_pixels > opts.max_pixels) continue;
+        peak.intensity = static_cast<float>(total);
+        peak.ss = static_cast<float>(wss / total);
+        peak.fs = static_cast<float>(wfs / total);
+        peaks.push_back(peak);
+    }
+}
+
+} // detail
+
+/*
+ * Peak finder which scores the pulses of a detector as hits.
+ *
+ * A pixel is a peak candidate if it is above the ADC threshold and its
+ * signal-to-noise ratio above the local background is at least min_snr.
+ * The mean and the standard deviation of the background are computed in
+ * O(1) per pixel from summed-area tables over a square ring around the
+ * pixel, which excludes the peak itself. The candidates are grouped into
+ * connected components which have between min_pixels and max_pixels
+ * pixels, and a pulse with at least min_peaks peaks is a hit.
+ *
+ * The modules of all the pulses are processed in parallel. The tables are
+ * kept for a band of rows only, which stays in the cache, and the scratch
+ * buffers are reused by a thread.
+ */
+class PeakFinder {
+
+    PeakFinderOptions opts_;
+    std::vector<std::size_t> module_shape_;
+    std::vector<uint8_t> mask_;
+
+public:
+    /*
+     * Constructor.
+     *
+     * @param module_shape: [modules, ss, fs] of the data of a pulse.
+     * @param options: options.
+     * @param mask: pixels of shape [modules, ss, fs] to ignore (nonzero), empty for none.
+     *
+     * Exceptions:
+     * PeakFinderError: if the shape or the mask is invalid
+     */
+    explicit PeakFinder(const std::vector<std::size_t>& module_shape,
+                        const PeakFinderOptions& options=PeakFinderOptions(),
+                        std::vector<uint8_t> mask={})
+        : opts_(options), module_shape_(module_shape), mask_(std::move(mask)) {
+        if (module_shape_.size() != 3)
+            throw PeakFinderError("The module shape must be [modules, ss, fs]");
+        if (!mask_.empty() && mask_.size() != pixelsPerPulse())
+            throw PeakFinderError("The mask does not match the module shape");
+        if (opts_.background_outer_radius <= opts_.background_inner_radius)
+            throw PeakFinderError("The outer background radius must be larger than the inner one");
+    }
+
+    const PeakFinderOptions& options() const { return opts_; }
+
+    std::size_t pixelsPerPulse() const {
+        return module_shape_[0] * module_shape_[1] * module_shape_[2];
+    }
+
+    /*
+     * Find the peaks of pulses.
+     *
+     * @param data: data of shape [pulses, modules, ss, fs].
+     * @param n_pulses: number of pulses.
+     * @param pool: thread pool.
+     */
+    template<typename T>
+    PeakFinderResult find(const T* data, std::size_t n_pulses,
+                          ThreadPool& pool=ThreadPool::global()) const {
+        const std::size_t n_modules = module_shape_[0];
+        const std::size_t n_ss = module_shape_[1];
+        const std::size_t n_fs = module_shape_[2];
+        const std::size_t module_size = n_ss * n_fs;
+        const std::size_t n_tasks = n_pulses * n_modules;
+
+        std::vector<std::vector<Peak>> task_peaks(n_tasks);
+        pool.parallelFor(0, n_tasks, [&](std::size_t begin, std::size_t end) {
+            detail::PeakFinderScratch scratch;
+            for (std::size_t t = begin; t < end; ++t) {
+                std::size_t module = t % n_modules;
+                detail::findModulePeaks(data + t * module_size,
+                                        mask_.empty() ? nullptr : &mask_[module * module_size],
+                                        n_ss, n_fs, opts_, scratch,
+                                        static_cast<uint32_t>(t / n_modules),
+                                        static_cast<uint32_t>(module), task_peaks[t]);
+            }
+        }, pool.grainFor(n_tasks));
+
+        PeakFinderResult result;
+        result.n_peaks.assign(n_pulses, 0);
+        result.hits.assign(n_pulses, 0);
+        for (std::size_t t = 0; t < n_tasks; ++t) {
+            std::size_t p = t / n_modules;
+            for (auto& peak : task_peaks[t]) {
+                if (result.n_peaks[p]++ < opts_.max_peaks) result.peaks.push_back(peak);
+            }
+        }
+        for (std::size_t p = 0; p < n_pulses; ++p)
+            result.hits[p] = result.n_peaks[p] >= opts_.min_peaks ? 1 : 0;
+        return result;
+    }
+
+    /*
+     * Find the peaks of an array of shape [pulses, modules, ss, fs], or
+     * [modules, ss, fs] for a single pulse.
+     *
+     * Exceptions:
+     * PeakFinderError: if the shape does not match
+     * TypeMismatchErrorNDArray: if the dtype is not numeric
+     */
+    PeakFinderResult find(const NDArray& array, ThreadPool& pool=ThreadPool::global()) const {
+        const Shape& shape = array.shape();
+        if (shape.size() != 3 && shape.size() != 4)
+            throw PeakFinderError("The array must have the shape [pulses, modules, ss, fs]");
+        if (!std::equal(module_shape_.begin(), module_shape_.end(), shape.end() - 3))
+            throw PeakFinderError("The array does not match the module shape " +
+                                  vectorToString(module_shape_));
+        std::size_t n_pulses = shape.size() == 4 ? shape[0] : 1;
+
+        switch (array.dtypeId()) {
+            case DType::FLOAT: return find(array.data<float>(), n_pulses, pool);
+            case DType::DOUBLE: return find(array.data<double>(), n_pulses, pool);
+            case DType::UINT16: return find(array.data<uint16_t>(), n_pulses, pool);
+            case DType::INT16: return find(array.data<int16_t>(), n_pulses, pool);
+            case DType::UINT32: return find(array.data<uint32_t>(), n_pulses, pool);
+            case DType::INT32: return find(array.data<int32_t>(), n_pulses, pool);
+            default:
+                throw TypeMismatchErrorNDArray("Cannot find peaks in an array of " + array.dtype());
+        }
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_PEAKFINDER_HPP
@@ -0,0 +1,495 @@
+/*
+    Binned 8-bit previews of detector frames for live viewers.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_PREVIEW_HPP
+#define KARABO_BRIDGE_KB_PREVIEW_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kb_client.hpp"
+#include "kb_parallel.hpp"
+
+
+namespace karabo_bridge {
+
+class PreviewError : public std::runtime_error {
+public:
+    explicit PreviewError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+/*
+ * Projection over the pulses, i.e. the first or the last axis, of the frames.
+ */
+enum class Projection {
+    NONE, // bin every pulse
+    MEAN,
+    MAX
+};
+
+// Lookup table from the linearly scaled value to the displayed value.
+using ByteLut = std::array<uint8_t, 256>;
+
+struct PreviewOptions {
+    // the last two axes other than the pulse axis are binned by bin x bin,
+    // 1 for no binning
+    std::size_t bin = 4;
+    Projection projection = Projection::MEAN;
+    // the first or the last axis, e.g. 3 for [modules, ss, fs, pulses]
+    std::size_t pulse_axis = 0;
+    // the range [low, high] mapped to [0, 255] is given by the percentiles
+    // of the binned values
+    float low_percentile = 1.f;
+    float high_percentile = 99.f;
+};
+
+
+namespace detail {
+
+/*
+ * Bin "bin" rows of "n_cols" elements of "n_pulses" pulses into a row of
+ * n_cols / bin elements.
+ *
+ * The rows are first reduced column-wise into "acc" and "count" in loops
+ * without branches, which the compiler can vectorize, and then across the
+ * columns of a bin. NaN elements are ignored and an output without any
+ * valid element is NaN.
+ */
+template<typename T>
+inline void binRow(const T* const* rows, std::size_t n_rows, std::size_t n_cols, std::size_t bin,
+                   Projection projection, float* acc, float* count, float* dst) {
+    const std::size_t n_used = n_cols / bin * bin;
+    const bool is_max = projection == Projection::MAX;
+    const float init = is_max ? -std::numeric_limits<float>::infinity() : 0.f;
+    std::fill(acc, acc + n_used, init);
+    std::fill(count, count + n_used, 0.f);
+
+    for (std::size_t r = 0; r < n_rows; ++r) {
+        const T* row = rows[r];
+        if (is_max) {
+            for (std::size_t c = 0; c < n_used; ++c) {
+                float x = static_cast<float>(row[c]);
+                bool valid = x == x;
+                acc[c] = std::max(acc[c], valid ? x : init);
+                count[c] += valid ? 1.f : 0.f;
+            }
+        } else {
+            for (std::size_t c = 0; c < n_used; ++c) {
+                float x = static_cast<float>(row[c]);
+                bool valid = x == x;
+                acc[c] += valid ? x : 0.f;
+                count[c] += valid ? 1.f : 0.f;
+            }
+        }
+    }
+
+    for (std::size_t oc = 0; oc < n_cols / bin; ++oc) {
+        const float* a = acc + oc * bin;
+        const float* n = count + oc * bin;
+        float value = init, total = 0.f;
+        for (std::size_t k = 0; k < bin; ++k) {
+            value = is_max ? std::max(value, a[k]) : value + a[k];
+            total += n[k];
+        }
+        if (total == 0.f) dst[oc] = std::numeric_limits<float>::quiet_NaN();
+        else dst[oc] = is_max ? value : value / total;
+    }
+}
+
+/*
+ * Bin "bin" rows of "n_cols" pixels, each of "n_pulses" contiguous pulses,
+ * into a row of n_cols / bin pixels, which keep their pulses if they are
+ * not projected.
+ *
+ * The pulses of a pixel are reduced first, so that the rows are read
+ * contiguously, and then the columns of a bin as in binRow.
+ */
+template<typename T>
+inline void binRowPulsesLast(const T* const* rows, std::size_t n_rows, std::size_t n_cols,
+                             std::size_t n_pulses, std::size_t bin, Projection projection,
+                             float* acc, float* count, float* dst) {
+    const std::size_t n_used = n_cols / bin * bin;
+    const bool is_max = projection == Projection::MAX;
+    const std::size_t n_out = projection == Projection::NONE ? n_pulses : 1;
+    const float init = is_max ? -std::numeric_limits<float>::infinity() : 0.f;
+    std::fill(acc, acc + n_used * n_out, init);
+    std::fill(count, count + n_used * n_out, 0.f);
+
+    for (std::size_t r = 0; r < n_rows; ++r) {
+        for (std::size_t c = 0; c < n_used; ++c) {
+            const T* pixel = rows[r] + c * n_pulses;
+            if (n_out == 1) {
+                float a = acc[c], n = count[c];
+                for (std::size_t p = 0; p < n_pulses; ++p) {
+                    float x = static_cast<float>(pixel[p]);
+                    bool valid = x == x;
+                    a = is_max ? std::max(a, valid ? x : init) : a + (valid ? x : 0.f);
+                    n += valid ? 1.f : 0.f;
+                }
+                acc[c] = a;
+                count[c] = n;
+            } else {
+                float* a = acc + c * n_pulses;
+                float* n = count + c * n_pulses;
+                for (std::size_t p = 0; p < n_pulses; ++p) {
+                    float x = static_cast<float>(pixel[p]);
+                    bool valid = x == x;
+                    a[p] = is_max ? std::max(a[p], valid ? x : init) : a[p] + (valid ? x : 0.f);
+                    n[p] += valid ? 1.f : 0.f;
+                }
+            }
+        }
+    }
+
+    for (std::size_t oc = 0; oc < n_cols / bin; ++oc) {
+        for (std::size_t p = 0; p < n_out; ++p) {
+            float value = init, total = 0.f;
+            for (std::size_t k = 0; k < bin; ++k) {
+                float a = acc[(oc * bin + k) * n_out + p];
+                value = is_max ? std::max(value, a) : value + a;
+                total += count[(oc * bin + k) * n_out + p];
+            }
+            if (total == 0.f) dst[oc * n_out + p] = std::numeric_limits<float>::quiet_NaN();
+            else dst[oc * n_out + p] = is_max ? value : value / total;
+        }
+    }
+}
+
+// Return whether the pulses of an array are in its last axis.
+inline bool pulsesLast(const std::vector<std::size_t>& shape, std::size_t pulse_axis) {
+    if (pulse_axis == 0) return false;
+    if (shape.size() < 3 || pulse_axis != shape.size() - 1)
+        throw PreviewError("The pulse axis must be the first or the last one of the frames, got axis "
+                           + std::to_string(pulse_axis) + " of " + std::to_string(shape.size()));
+    return true;
+}
+
+} // detail
+
+/*
+ * Return the shape of the preview of an array of shape [..., rows, cols]
+ * with the pulses first, i.e. [..., rows / bin, cols / bin] without the
+ * first axis if it is projected, or of shape [..., rows, cols, pulses]
+ * with the pulses last, i.e. [..., rows / bin, cols / bin, pulses] without
+ * the last axis if it is projected. The remainders of the rows and columns
+ * are dropped.
+ *
+ * Exceptions:
+ * PreviewError: if the array has less than 2 dimensions, bin is 0 or the
+ *               pulse axis is neither the first nor the last one
+ */
+inline std::vector<std::size_t> previewShape(const std::vector<std::size_t>& shape, std::size_t bin,
+                                             Projection projection, std::size_t pulse_axis=0) {
+    if (shape.size() < 2) throw PreviewError("The frames must have at least 2 dimensions");
+    if (!bin) throw PreviewError("The bin size must be positive");
+
+    std::vector<std::size_t> out;
+    if (detail::pulsesLast(shape, pulse_axis)) {
+        for (std::size_t k = 0; k + 3 < shape.size(); ++k) out.push_back(shape[k]);
+        out.push_back(shape[shape.size() - 3] / bin);
+        out.push_back(shape[shape.size() - 2] / bin);
+        if (projection == Projection::NONE) out.push_back(shape.back());
+        return out;
+    }
+    std::size_t first = projection != Projection::NONE && shape.size() > 2 ? 1 : 0;
+    for (std::size_t k = first; k + 2 < shape.size(); ++k) out.push_back(shape[k]);
+    out.push_back(shape[shape.size() - 2] / bin);
+    out.push_back(shape[shape.size() - 1] / bin);
+    return out;
+}
+
+/*
+ * Bin the frames of an array and project them over the pulses in a single
+ * pass.
+ *
+ * @param src: data of shape [pulses, ..., rows, cols] or
+ *             [..., rows, cols, pulses], e.g. [modules, ss, fs, pulses] as
+ *             sent by the detectors.
+ * @param shape: shape of the data.
+ * @param bin: bin size of the rows and columns.
+ * @param projection: projection over the pulses.
+ * @param pulse_axis: 0 or the last axis.
+ * @param dst: output buffer of shape previewShape(shape, bin, projection, pulse_axis).
+ *             The projection of an array without pulses is NaN.
+ * @param pool: thread pool.
+ *
+ * Exceptions:
+ * PreviewError: if the array has less than 2 dimensions, bin is 0 or the
+ *               pulse axis is neither the first nor the last one
+ */
+template<typename T>
+inline void binFrames(const T* src, const std::vector<std::size_t>& shape, std::size_t bin,
+                      Projection projection, std::size_t pulse_axis, float* dst,
+                      ThreadPool& pool=ThreadPool::global()) {
+    auto out_shape = previewShape(shape, bin, projection, pulse_axis);
+    const bool pulses_last = detail::pulsesLast(shape, pulse_axis);
+    if (projection != Projection::NONE && shape.size() > 2 && !shape[pulses_last ? shape.size() - 1 : 0]) {
+        // the projection of no pulses
+        std::size_t n_out = 1;
+        for (auto n : out_shape) n_out *= n;
+        std::fill(dst, dst + n_out, std::numeric_limits<float>::quiet_NaN());
+        return;
+    }
+    if (pulses_last) {
+        const std::size_t n_pulses = shape.back();
+        const std::size_t n_rows = shape[shape.size() - 3];
+        const std::size_t n_cols = shape[shape.size() - 2];
+        const std::size_t frame_size = n_rows * n_cols * n_pulses;
+        std::size_t n_frames = 1;
+        for (std::size_t k = 0; k + 3 < shape.size(); ++k) n_frames *= shape[k];
+        const std::size_t n_out = projection == Projection::NONE ? n_pulses : 1;
+
+        const std::size_t out_rows = n_rows / bin, out_cols = n_cols / bin;
+        const std::size_t n_tasks = n_frames * out_rows;
+        if (!n_tasks || !out_cols || !n_pulses) return;
+
+        pool.parallelFor(0, n_tasks, [&](std::size_t begin, std::size_t end) {
+            std::vector<float> acc(n_cols * n_out), count(n_cols * n_out);
+            std::vector<const T*> rows(bin);
+            for (std::size_t t = begin; t < end; ++t) {
+                std::size_t frame = t / out_rows;
+                std::size_t out_row = t % out_rows;
+                for (std::size_t r = 0; r < bin; ++r)
+                    rows[r] = src + frame * frame_size + (out_row * bin + r) * n_cols * n_pulses;
+                detail::binRowPulsesLast(rows.data(), bin, n_cols, n_pulses, bin, projection,
+                                         acc.data(), count.data(), dst + t * out_cols * n_out);
+            }
+        }, pool.grainFor(n_tasks));
+        return;
+    }
+
+    const std::size_t n_rows = shape[shape.size() - 2];
+    const std::size_t n_cols = shape[shape.size() - 1];
+    const std::size_t frame_size = n_rows * n_cols;
+    std::size_t n_total = 1;
+    for (std::size_t k = 0; k + 2 < shape.size(); ++k) n_total *= shape[k];
+    const std::size_t n_pulses = projection != Projection::NONE && shape.size() > 2 ? shape[0] : 1;
+    const std::size_t n_frames = n_pulses ? n_total / n_pulses : 0;
+
+    const std::size_t out_rows = n_rows / bin, out_cols = n_cols / bin;
+    const std::size_t n_tasks = n_frames * out_rows;
+    if (!n_tasks || !out_cols) return;
+
+    pool.parallelFor(0, n_tasks, [&](std::size_t begin, std::size_t end) {
+        std::vector<float> acc(n_cols), count(n_cols);
+        std::vector<const T*> rows(n_pulses * bin);
+        for (std::size_t t = begin; t < end; ++t) {
+            std::size_t frame = t / out_rows;
+            std::size_t out_row = t % out_rows;
+            for (std::size_t p = 0; p < n_pulses; ++p)
+                for (std::size_t r = 0; r < bin; ++r)
+                    rows[p * bin + r] = src + (p * n_frames + frame) * frame_size
+                                            + (out_row * bin + r) * n_cols;
+            detail::binRow(rows.data(), rows.size(), n_cols, bin, projection,
+                           acc.data(), count.data(), dst + t * out_cols);
+        }
+    }, pool.grainFor(n_tasks));
+}
+
+// Bin the frames of an array with the pulses first.
+template<typename T>
+inline void binFrames(const T* src, const std::vector<std::size_t>& shape, std::size_t bin,
+                      Projection projection, float* dst, ThreadPool& pool=ThreadPool::global()) {
+    binFrames(src, shape, bin, projection, 0, dst, pool);
+}
+
+/*
+ * Bin an array and project it over the pulses, which are in the first or
+ * the last axis.
+ *
+ * Return an NDArray of float which refers to the output buffer.
+ *
+ * Exceptions:
+ * PreviewError: if the array has less than 2 dimensions, bin is 0 or the
+ *               pulse axis is neither the first nor the last one
+ * TypeMismatchErrorNDArray: if the dtype is not numeric
+ */
+inline NDArray binFrames(const NDArray& array, std::size_t bin, Projection projection,
+                         std::size_t pulse_axis, float* dst, ThreadPool& pool=ThreadPool::global()) {
+    std::vector<std::size_t> shape = array.shape();
+    switch (array.dtypeId()) {
+        case DType::UINT8: binFrames(array.data<uint8_t>(), shape, bin, projection, pulse_axis, dst, pool); break;
+        case DType::INT8: binFrames(array.data<int8_t>(), shape, bin, projection, pulse_axis, dst, pool); break;
+        case DType::UINT16: binFrames(array.data<uint16_t>(), shape, bin, projection, pulse_axis, dst, pool); break;
+        case DType::INT16: binFrames(array.data<int16_t>(), shape, bin, projection, pulse_axis, dst, pool); break;
+        case DType::UINT32: binFrames(array.data<uint32_t>(), shape, bin, projection, pulse_axis, dst, pool); break;
+        case DType::INT32: binFrames(array.data<int32_t>(), shape, bin, projection, pulse_axis, dst, pool); break;
+        case DType::FLOAT16: binFrames(array.data<Float16>(), shape, bin, projection, pulse_axis, dst, pool); break;
+        case DType::FLOAT: binFrames(array.data<float>(), shape, bin, projection, pulse_axis, dst, pool); break;
+        case DType::DOUBLE: binFrames(array.data<double>(), shape, bin, projection, pulse_axis, dst, pool); break;
+        default:
+            throw TypeMismatchErrorNDArray("Cannot bin an array of " + array.dtype());
+    }
+    return NDArray(dst, previewShape(shape, bin, projection, pulse_axis), DType::FLOAT);
+}
+
+// Bin an array with the pulses first.
+inline NDArray binFrames(const NDArray& array, std::size_t bin, Projection projection, float* dst,
+                         ThreadPool& pool=ThreadPool::global()) {
+    return binFrames(array, bin, projection, 0, dst, pool);
+}
+
+/*
+ * Return the values at two percentiles, in [0, 100], of the non-NaN
+ * values. At most "max_samples" evenly spaced values are used.
+ *
+ * Return (0, 0) if there is no value.
+ */
+inline std::pair<float, float> percentileRange(const float* data, std::size_t n,
+                                               float low, float high,
+                                               std::size_t max_samples=1 << 16) {
+    std::size_t stride = std::max<std::size_t>(1, n / std::max<std::size_t>(max_samples, 1));
+    std::vector<float> samples;
+    samples.reserve(n / stride + 1);
+    for (std::size_t i = 0; i < n; i += stride) {
+        if (!std::isnan(data[i])) samples.push_back(data[i]);
+    }
+    if (samples.empty()) return {0.f, 0.f};
+
+    auto at = [&samples](float q) {
+        q = std::min(std::max(q, 0.f), 100.f);
+        std::size_t k = static_cast<std::size_t>(std::lround(q / 100.f * (samples.size() - 1)));
+        std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+        return samples[k];
+    };
+    float lo = at(low);
+    float hi = at(high);
+    return {lo, hi};
+}
+
+// Return a lookup table of a gamma correction, e.g. 0.5 to brighten weak signals.
+inline ByteLut gammaLut(double gamma) {
+    ByteLut lut;
+    for (std::size_t i = 0; i < lut.size(); ++i)
+        lut[i] = static_cast<uint8_t>(std::lround(255. * std::pow(i / 255., gamma)));
+    return lut;
+}
+
+/*
+ * Map values linearly from [low, high] to [0, 255], clipping the values
+ * outside, and optionally through a lookup table. NaN is mapped to 0.
+ *
+ * @param lut: lookup table, or nullptr for none.
+ */
+inline void scaleToUint8(const float* src, std::size_t n, float low, float high, uint8_t* dst,
+                         const ByteLut* lut=nullptr, ThreadPool& pool=ThreadPool::global()) {
+    const float scale = high > low ? 255.f / (high - low) : 0.f;
+    pool.parallelFor(0, n, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            float x = (src[i] - low) * scale;
+            x = x == x ? std::min(std::max(x, 0.f), 255.f) : 0.f;
+            dst[i] = static_cast<uint8_t>(x + 0.5f);
+        }
+        if (lut) {
+            for (std::size_t i = begin; i < end; ++i) dst[i] = (*lut)[dst[i]];
+        }
+    }, std::max<std::size_t>(1 << 16, pool.grainFor(n)));
+}
+
+/*
+ * Produce an 8-bit preview of an array: bin it, project it over the pulses
+ * and map it to uint8 between the percentiles of the options.
+ *
+ * @param array: data of shape [pulses, ..., rows, cols] or
+ *               [..., rows, cols, pulses], see options.pulse_axis.
+ * @param options: preview options.
+ * @param buffer: float buffer for the binned values, which is resized.
+ * @param dst: output buffer of the size of the preview.
+ * @param lut: lookup table, or nullptr for none.
+ * @param pool: thread pool.
+ *
+ * Return an NDArray of uint8 which refers to the output buffer.
+ *
+ * Exceptions:
+ * PreviewError: if the array has less than 2 dimensions, bin is 0 or the
+ *               pulse axis is neither the first nor the last one
+ * TypeMismatchErrorNDArray: if the dtype is not numeric
+ */
+inline NDArray preview(const NDArray& array, const PreviewOptions& options,
+                       std::vector<float>& buffer, uint8_t* dst, const ByteLut* lut=nullptr,
+                       ThreadPool& pool=ThreadPool::global()) {
+    auto shape = previewShape(array.shape(), options.bin, options.projection, options.pulse_axis);
+    std::size_t n = 1;
+    for (auto v : shape) n *= v;
+    buffer.resize(n);
+
+    binFrames(array, options.bin, options.projection, options.pulse_axis, buffer.data(), pool);
+    auto range = percentileRange(buffer.data(), n, options.low_percentile, options.high_percentile);
+    scaleToUint8(buffer.data(), n, range.first, range.second, dst, lut, pool);
+    return NDArray(dst, shape, DType::UINT8);
+}
+
+/*
+ * Append an array as a new source to the frames of a train, e.g. to
+ * publish a preview with a ShmRelay or a ZeroMQ socket.
+ *
+ * @param mpmsg: frames of a train.
+ * @param source: name of the new source.
+ * @param tid: train ID, stored as "timestamp.tid" of the metadata.
+ * @param path: path of the array.
+ * @param array: array data, which are copied.
+ *
+ * Exceptions:
+ * PreviewError: if the dtype is unknown
+ */
+inline void appendArraySource(MultipartMsg& mpmsg, const std::string& source, uint64_t tid,
+                              const std::string& path, const NDArray& array) {
+    std::size_t itemsize = itemSize(array.dtypeId());
+    if (!itemsize) throw PreviewError("Unknown dtype: " + array.dtype());
+
+    msgpack::sbuffer header;
+    msgpack::packer<msgpack::sbuffer> pk_header(header);
+    pk_header.pack_map(3);
+    pk_header.pack(std::string("source"));
+    pk_header.pack(source);
+    pk_header.pack(std::string("content"));
+    pk_header.pack(std::string("msgpack"));
+    pk_header.pack(std::string("metadata"));
+    pk_header.pack_map(2);
+    pk_header.pack(std::string("source"));
+    pk_header.pack(source);
+    pk_header.pack(std::string("timestamp.tid"));
+    pk_header.pack(tid);
+    mpmsg.emplace_back(header.data(), header.size());
+
+    msgpack::sbuffer data;
+    msgpack::packer<msgpack::sbuffer> pk_data(data);
+    pk_data.pack_map(0);
+    mpmsg.emplace_back(data.data(), data.size());
+
+    msgpack::sbuffer array_header;
+    msgpack::packer<msgpack::sbuffer> pk_array(array_header);
+    pk_array.pack_map(5);
+    pk_array.pack(std::string("source"));
+    pk_array.pack(source);
+    pk_array.pack(std::string("content"));
+    pk_array.pack(std::string("array"));
+    pk_array.pack(std::string("path"));
+    pk_array.pack(path);
+    pk_array.pack(std::string("dtype"));
+    pk_array.pack(toPythonTypeString(array.dtype()));
+    pk_array.pack(std::string("shape"));
+    pk_array.pack_array(static_cast<uint32_t>(array.shape().size()));
+    for (auto v : array.shape()) pk_array.pack(static_cast<uint64_t>(v));
+    mpmsg.emplace_back(array_header.data(), array_header.size());
+
+    mpmsg.emplace_back(array.data(), array.size() * itemsize);
+}
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_PREVIEW_HPP
@@ -0,0 +1,261 @@
+/*
+    Selection of pulses of arrays.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_SELECTION_HPP
+#define KARABO_BRIDGE_KB_SELECTION_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kb_client.hpp"
+#include "kb_parallel.hpp"
+
+
+namespace karabo_bridge {
+
+class SelectionError : public std::invalid_argument {
+public:
+    explicit SelectionError(const std::string& msg) : std::invalid_argument(msg) {}
+};
+
+/*
+ * Indices of the selected pulses of a train, in output order.
+ */
+class PulseSelection {
+
+    std::vector<std::size_t> indices_;
+    // (first index, length) of the runs of consecutive indices
+    std::vector<std::pair<std::size_t, std::size_t>> runs_;
+
+    void buildRuns() {
+        runs_.clear();
+        for (auto i : indices_) {
+            if (!runs_.empty() && runs_.back().first + runs_.back().second == i) ++runs_.back().second;
+            else runs_.emplace_back(i, 1);
+        }
+    }
+
+public:
+    PulseSelection() = default;
+
+    explicit PulseSelection(std::vector<std::size_t> indices) : indices_(std::move(indices)) {
+        buildRuns();
+    }
+
+    // Select the pulses whose mask is true.
+    static PulseSelection fromMask(const std::vector<bool>& mask) {
+        std::vector<std::size_t> indices;
+        for (std::size_t i = 0; i < mask.size(); ++i) if (mask[i]) indices.push_back(i);
+        return PulseSelection(std::move(indices));
+    }
+
+    static PulseSelection fromMask(const uint8_t* mask, std::size_t n) {
+        std::vector<std::size_t> indices;
+        for (std::size_t i = 0; i < n; ++i) if (mask[i]) indices.push_back(i);
+        return PulseSelection(std::move(indices));
+    }
+
+    /*
+     * Select the pulses whose value of a 1D integer array, e.g.
+     * "image.cellId", satisfies a predicate, which is called with the
+     * value of each pulse.
+     *
+     * Exceptions:
+     * SelectionError: if the array is not 1D or not of an integer dtype
+     */
+    template<typename Predicate>
+    static PulseSelection fromValues(const NDArray& values, Predicate pred) {
+        std::size_t n = values.size();
+        // also e.g. [pulses, 1]
+        if (values.shape().size() > 1 && values.shape()[0] != n)
+            throw SelectionError("The values must be a 1D array");
+        std::vector<std::size_t> indices;
+        switch (values.dtypeId()) {
+            case DType::UINT8: selectWhere(values.data<uint8_t>(), n, pred, indices); break;
+            case DType::INT8: selectWhere(values.data<int8_t>(), n, pred, indices); break;
+            case DType::UINT16: selectWhere(values.data<uint16_t>(), n, pred, indices); break;
+            case DType::INT16: selectWhere(values.data<int16_t>(), n, pred, indices); break;
+            case DType::UINT32: selectWhere(values.data<uint32_t>(), n, pred, indices); break;
+            case DType::INT32: selectWhere(values.data<int32_t>(), n, pred, indices); break;
+            case DType::UINT64: selectWhere(values.data<uint64_t>(), n, pred, indices); break;
+            case DType::INT64: selectWhere(values.data<int64_t>(), n, pred, indices); break;
+            default: throw SelectionError("Cannot select by an array of " + values.dtype());
+        }
+        return PulseSelection(std::move(indices));
+    }
+
+    std::size_t size() const { return indices_.size(); }
+
+    bool empty() const { return indices_.empty(); }
+
+    const std::vector<std::size_t>& indices() const { return indices_; }
+
+    const std::vector<std::pair<std::size_t, std::size_t>>& runs() const { return runs_; }
+
+private:
+    template<typename T, typename Predicate>
+    static void selectWhere(const T* v, std::size_t n, Predicate& pred, std::vector<std::size_t>& indices) {
+        for (std::size_t i = 0; i < n; ++i) if (pred(v[i])) indices.push_back(i);
+    }
+};
+
+
+namespace detail {
+
+// Gather the selected elements of rows of n elements into rows of indices.size() elements.
+template<typename T>
+inline void gatherRows(const T* src, std::size_t n, T* dst, const std::vector<std::size_t>& indices,
+                       std::size_t row_begin, std::size_t row_end) {
+    const std::size_t m = indices.size();
+    const std::size_t* idx = indices.data();
+    for (std::size_t r = row_begin; r < row_end; ++r) {
+        const T* s = src + r * n;
+        T* d = dst + r * m;
+        for (std::size_t j = 0; j < m; ++j) d[j] = s[idx[j]];
+    }
+}
+
+inline void gatherRowsBytes(const char* src, std::size_t n, char* dst,
+                            const std::vector<std::size_t>& indices, std::size_t itemsize,
+                            std::size_t row_begin, std::size_t row_end) {
+    const std::size_t m = indices.size();
+    for (std::size_t r = row_begin; r < row_end; ++r) {
+        for (std::size_t j = 0; j < m; ++j)
+            std::memcpy(dst + (r * m + j) * itemsize, src + (r * n + indices[j]) * itemsize, itemsize);
+    }
+}
+
+} // detail
+
+/*
+ * Copy the selected pulses of a C-contiguous array into a dense output
+ * buffer, in which the pulse axis has selection.size() elements.
+ *
+ * If the pulse axis is the innermost one, e.g. [modules, ss, fs, pulses],
+ * the elements of each row are gathered with a typed kernel. Otherwise,
+ * the consecutive selected pulses are copied as single blocks, e.g. one
+ * memcpy for all the selected pulses of [pulses, modules, ss, fs] which
+ * are adjacent. The work is split across the thread pool.
+ *
+ * @param src: input data.
+ * @param dst: output buffer, which must not overlap the input.
+ * @param shape: shape of the input.
+ * @param itemsize: size of an element in bytes.
+ * @param axis: the pulse axis.
+ * @param selection: selected pulses.
+ * @param pool: thread pool.
+ *
+ * Exceptions:
+ * SelectionError: if the axis or a selected pulse is out of range
+ */
+inline void selectPulses(const void* src, void* dst,
+                         const std::vector<std::size_t>& shape, std::size_t itemsize,
+                         std::size_t axis, const PulseSelection& selection,
+                         ThreadPool& pool=ThreadPool::global()) {
+    if (axis >= shape.size())
+        throw SelectionError("axis " + std::to_string(axis) + " is out of range for an array of dimension "
+                             + std::to_string(shape.size()));
+    const std::size_t n = shape[axis];
+    for (auto i : selection.indices()) {
+        if (i >= n) throw SelectionError("Pulse " + std::to_string(i) + " is out of range for "
+                                         + std::to_string(n) + " pulses");
+    }
+
+    std::size_t n_outer = 1, inner = itemsize;
+    for (std::size_t k = 0; k < axis; ++k) n_outer *= shape[k];
+    for (std::size_t k = axis + 1; k < shape.size(); ++k) inner *= shape[k];
+    const std::size_t m = selection.size();
+    if (!n_outer || !m || !inner) return;
+
+    const auto in = static_cast<const char*>(src);
+    auto out = static_cast<char*>(dst);
+
+    if (inner == itemsize && selection.runs().size() * 4 > m) {
+        // innermost pulse axis with scattered pulses: gather the elements
+        auto& indices = selection.indices();
+        pool.parallelFor(0, n_outer, [&](std::size_t b, std::size_t e) {
+            switch (itemsize) {
+                case 1:
+                    detail::gatherRows(reinterpret_cast<const uint8_t*>(in), n,
+                                       reinterpret_cast<uint8_t*>(out), indices, b, e);
+                    break;
+                case 2:
+                    detail::gatherRows(reinterpret_cast<const uint16_t*>(in), n,
+                                       reinterpret_cast<uint16_t*>(out), indices, b, e);
+                    break;
+                case 4:
+                    detail::gatherRows(reinterpret_cast<const uint32_t*>(in), n,
+                                       reinterpret_cast<uint32_t*>(out), indices, b, e);
+                    break;
+                case 8:
+                    detail::gatherRows(reinterpret_cast<const uint64_t*>(in), n,
+                                       reinterpret_cast<uint64_t*>(out), indices, b, e);
+                    break;
+                default:
+                    detail::gatherRowsBytes(in, n, out, indices, itemsize, b, e);
+            }
+        }, pool.grainFor(n_outer));
+        return;
+    }
+
+    // copy the runs of consecutive pulses of every outer index
+    auto& runs = selection.runs();
+    std::vector<std::size_t> dst_offsets(runs.size()); // in pulses
+    for (std::size_t k = 1; k < runs.size(); ++k)
+        dst_offsets[k] = dst_offsets[k - 1] + runs[k - 1].second;
+
+    const std::size_t n_tasks = n_outer * runs.size();
+    pool.parallelFor(0, n_tasks, [&](std::size_t b, std::size_t e) {
+        for (std::size_t t = b; t < e; ++t) {
+            std::size_t o = t / runs.size();
+            std::size_t k = t % runs.size();
+            std::memcpy(out + (o * m + dst_offsets[k]) * inner,
+                        in + (o * n + runs[k].first) * inner,
+                        runs[k].second * inner);
+        }
+    }, pool.grainFor(n_tasks));
+}
+
+/*
+ * Copy the selected pulses of an array into an output buffer.
+ *
+ * @param array: input array.
+ * @param axis: the pulse axis, e.g. 3 for [modules, ss, fs, pulses] or 0 for
+ *              [pulses, modules, ss, fs].
+ * @param selection: selected pulses.
+ * @param dst: output buffer of array.size() / shape[axis] * selection.size() elements.
+ * @param pool: thread pool.
+ *
+ * Return an NDArray which refers to the output buffer.
+ *
+ * Exceptions:
+ * SelectionError: if the axis or a selected pulse is out of range or the
+ *                 dtype is unknown
+ */
+inline NDArray selectPulses(const NDArray& array, std::size_t axis, const PulseSelection& selection,
+                            void* dst, ThreadPool& pool=ThreadPool::global()) {
+    std::size_t itemsize = itemSize(array.dtypeId());
+    if (!itemsize) throw SelectionError("Unknown dtype: " + array.dtype());
+
+    std::vector<std::size_t> shape = array.shape();
+    selectPulses(array.data(), dst, shape, itemsize, axis, selection, pool);
+
+    shape[axis] = selection.size();
+    return NDArray(dst, shape, array.dtypeId());
+}
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_SELECTION_HPP
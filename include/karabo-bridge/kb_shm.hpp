@@ -0,0 +1,563 @@
+/*
+    Relay of trains to the local processes via a shared-memory ring buffer.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_SHM_HPP
+#define KARABO_BRIDGE_KB_SHM_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kb_client.hpp"
+
+
+namespace karabo_bridge {
+
+class ShmError : public std::runtime_error {
+public:
+    explicit ShmError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+namespace detail {
+
+// Return true if std::atomic<uint64_t> is always lock-free, whichever
+// standard integer type uint64_t is.
+constexpr bool isAtomicUint64LockFree() {
+    return std::is_same<uint64_t, unsigned long>::value ? ATOMIC_LONG_LOCK_FREE == 2
+         : std::is_same<uint64_t, unsigned long long>::value && ATOMIC_LLONG_LOCK_FREE == 2;
+}
+
+// the counters are shared between processes
+static_assert(isAtomicUint64LockFree() && std::is_same<int32_t, int>::value && ATOMIC_INT_LOCK_FREE == 2,
+              "shared-memory ring buffer requires lock-free atomics");
+#if __cplusplus >= 201703L
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int32_t>::is_always_lock_free,
+              "shared-memory ring buffer requires lock-free atomics");
+#endif
+
+inline constexpr uint64_t shmMagic() { return 0x324547444952424bULL; } // "KBRIDGE2"
+
+inline constexpr std::size_t shmAlign(std::size_t n) { return (n + 63) / 64 * 64; }
+
+struct ShmRingHeader {
+    uint64_t magic;
+    uint64_t n_slots;
+    uint64_t slot_bytes; // capacity of the frames of a slot
+    uint64_t max_frames;
+    uint64_t pid; // process of the relay
+    std::atomic<uint64_t> head; // sequence number of the last published train, 0 if none
+};
+
+/*
+ * A slot holds a train as its frame sizes followed by the frames, each
+ * aligned to 64 bytes.
+ *
+ * "readers" counts the trains held by the readers, or is -1 while the relay
+ * writes the slot. "seq" is the sequence number of the train, 0 while the
+ * slot is written.
+ */
+struct ShmSlotHeader {
+    std::atomic<uint64_t> seq;
+    std::atomic<int32_t> readers;
+    uint32_t n_frames;
+};
+
+// Return whether a process is running. A reused pid counts as running.
+inline bool processAlive(uint64_t pid) {
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+}
+
+/*
+ * Return whether a shared-memory object may be replaced by a new relay,
+ * i.e. it does not exist, it was left uninitialized or its relay is not
+ * running anymore.
+ */
+inline bool shmReplaceable(const std::string& name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) return errno == ENOENT;
+
+    bool replaceable = false;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        if (st.st_size == 0) {
+            replaceable = true;
+        } else if (static_cast<std::size_t>(st.st_size) >= sizeof(ShmRingHeader)) {
+            void* addr = mmap(nullptr, sizeof(ShmRingHeader), PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED) {
+                auto header = static_cast<const ShmRingHeader*>(addr);
+                // the magic number is written last by the relay
+                replaceable = header->magic == 0
+                              || (header->magic == shmMagic() && !processAlive(header->pid));
+                munmap(addr, sizeof(ShmRingHeader));
+            }
+        }
+    }
+    close(fd);
+    return replaceable;
+}
+
+/*
+ * A mapped shared-memory object, which is unlinked on destruction by its
+ * owner if it has not been replaced meanwhile.
+ */
+class ShmMapping {
+    std::string name_;
+    void* addr_ = MAP_FAILED;
+    std::size_t size_ = 0;
+    bool owner_;
+    dev_t dev_ = 0;
+    ino_t ino_ = 0;
+
+    // Return whether the name still refers to this object.
+    bool linked() const {
+        int fd = shm_open(name_.c_str(), O_RDONLY, 0);
+        if (fd < 0) return false;
+        struct stat st;
+        bool same = fstat(fd, &st) == 0 && st.st_dev == dev_ && st.st_ino == ino_;
+        close(fd);
+        return same;
+    }
+
+public:
+    /*
+     * Create a shared-memory object of the given size (owner), which
+     * replaces a stale one, or open an existing one (size 0).
+     *
+     * Exceptions:
+     * ShmError: if the object cannot be created or opened, or if the owner
+     *           finds it in use by a running relay
+     */
+    ShmMapping(const std::string& name, std::size_t size) : name_(name), owner_(size > 0) {
+        if (owner_) {
+            if (!shmReplaceable(name))
+                throw ShmError("Shared memory " + name + " is in use by a running relay or another program");
+            // a stale object left by a relay which crashed
+            shm_unlink(name.c_str());
+        }
+        int fd = owner_ ? shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600)
+                        : shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            throw ShmError("Failed to open shared memory " + name + ": " + std::strerror(errno));
+
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            dev_ = st.st_dev;
+            ino_ = st.st_ino;
+        }
+        if (owner_ && ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            int err = errno;
+            close(fd);
+            shm_unlink(name.c_str());
+            throw ShmError("Failed to allocate shared memory " + name + ": " + std::strerror(err));
+        }
+        if (!owner_) size = fstat(fd, &st) == 0 ? static_cast<std::size_t>(st.st_size) : 0;
+
+        if (size) addr_ = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr_ == MAP_FAILED) {
+            if (owner_) shm_unlink(name.c_str());
+            throw ShmError("Failed to map shared memory " + name);
+        }
+        size_ = size;
+    }
+
+    ~ShmMapping() {
+        munmap(addr_, size_);
+        if (owner_ && linked()) shm_unlink(name_.c_str());
+    }
+
+    ShmMapping(const ShmMapping&) = delete;
+    ShmMapping& operator=(const ShmMapping&) = delete;
+
+    char* data() const { return static_cast<char*>(addr_); }
+
+    std::size_t size() const { return size_; }
+};
+
+/*
+ * Layout of a ring buffer in a mapping.
+ */
+class ShmRing {
+    char* base_;
+    std::size_t slot_stride_;
+
+public:
+    static std::size_t framesOffset(std::size_t max_frames) {
+        return shmAlign(sizeof(ShmSlotHeader) + max_frames * sizeof(uint64_t));
+    }
+
+    static std::size_t slotStride(std::size_t slot_bytes, std::size_t max_frames) {
+        return framesOffset(max_frames) + shmAlign(slot_bytes);
+    }
+
+    static std::size_t totalSize(std::size_t n_slots, std::size_t slot_bytes, std::size_t max_frames) {
+        return shmAlign(sizeof(ShmRingHeader)) + n_slots * slotStride(slot_bytes, max_frames);
+    }
+
+    explicit ShmRing(char* base) : base_(base) {
+        slot_stride_ = slotStride(header()->slot_bytes, header()->max_frames);
+    }
+
+    ShmRingHeader* header() const { return reinterpret_cast<ShmRingHeader*>(base_); }
+
+    ShmSlotHeader* slot(uint64_t seq) const {
+        return reinterpret_cast<ShmSlotHeader*>(
+            base_ + shmAlign(sizeof(ShmRingHeader)) + (seq % header()->n_slots) * slot_stride_);
+    }
+
+    uint64_t* frameSizes(ShmSlotHeader* slot) const {
+        return reinterpret_cast<uint64_t*>(slot + 1);
+    }
+
+    char* frames(ShmSlotHeader* slot) const {
+        return reinterpret_cast<char*>(slot) + framesOffset(header()->max_frames);
+    }
+};
+
+// hint passed to the free function of the frames of a train read from a ring
+struct ShmLease {
+    std::shared_ptr<ShmMapping> mapping;
+    std::atomic<int32_t>* readers;
+    std::atomic<std::size_t> frames;
+};
+
+inline void releaseShmFrame(void*, void* hint) {
+    auto lease = static_cast<ShmLease*>(hint);
+    if (lease->frames.fetch_sub(1) == 1) {
+        lease->readers->fetch_sub(1, std::memory_order_release);
+        delete lease;
+    }
+}
+
+} // detail
+
+/*
+ * Publisher of trains into a POSIX shared-memory ring buffer, which is read
+ * by ShmReader in any number of processes on the same host, so that one
+ * network receive serves all of them.
+ *
+ * A slot is only overwritten when no reader holds the train in it anymore.
+ * A held slot is skipped and the train goes to the next free slot, so that
+ * a reader which keeps a train, or crashes while holding it, only takes
+ * its slot out of the ring. The train is dropped if all the slots are
+ * held.
+ *
+ * The shared-memory object is removed on destruction, and the readers have
+ * to be reopened after the relay is restarted. An object left by a relay
+ * which crashed is replaced, while a second relay with the name of a
+ * running one is refused.
+ */
+class ShmRelay {
+    std::shared_ptr<detail::ShmMapping> mapping_;
+    detail::ShmRing ring_;
+    uint64_t next_seq_ = 1;
+    std::size_t published_ = 0;
+    std::size_t dropped_ = 0;
+    std::size_t skipped_slots_ = 0;
+
+    static detail::ShmMapping* create(const std::string& name, std::size_t n_slots,
+                                      std::size_t slot_bytes, std::size_t max_frames) {
+        if (!n_slots || !slot_bytes || !max_frames)
+            throw ShmError("The ring buffer must have at least one slot, byte and frame");
+        auto mapping = new detail::ShmMapping(
+            name, detail::ShmRing::totalSize(n_slots, slot_bytes, max_frames));
+
+        auto header = new (mapping->data()) detail::ShmRingHeader;
+        header->n_slots = n_slots;
+        header->slot_bytes = slot_bytes;
+        header->max_frames = max_frames;
+        header->pid = static_cast<uint64_t>(getpid());
+        header->head.store(0);
+        detail::ShmRing ring(mapping->data());
+        for (std::size_t i = 0; i < n_slots; ++i) {
+            auto slot = new (ring.slot(i)) detail::ShmSlotHeader;
+            slot->seq.store(0);
+            slot->readers.store(0);
+            slot->n_frames = 0;
+        }
+        // readers check the magic number last
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = detail::shmMagic();
+        return mapping;
+    }
+
+public:
+    /*
+     * Create a ring buffer.
+     *
+     * @param name: name of the shared-memory object, e.g. "/karabo-bridge".
+     * @param n_slots: number of trains in the ring buffer.
+     * @param slot_bytes: capacity of a slot, which must hold all the frames
+     *                    of a train, each padded to 64 bytes.
+     * @param max_frames: maximum number of frames of a train.
+     *
+     * Exceptions:
+     * ShmError if the shared-memory object cannot be created or is in use
+     *          by a running relay
+     */
+    ShmRelay(const std::string& name, std::size_t n_slots, std::size_t slot_bytes,
+             std::size_t max_frames=256)
+        : mapping_(create(name, n_slots, slot_bytes, max_frames)), ring_(mapping_->data()) {}
+
+    ShmRelay(const ShmRelay&) = delete;
+    ShmRelay& operator=(const ShmRelay&) = delete;
+
+    /*
+     * Copy the frames of a train into the next free slot. The sequence
+     * numbers of the held slots which are skipped are never published.
+     *
+     * Return false if the train is dropped because it does not fit into a
+     * slot or all the slots are held by readers.
+     */
+    bool publish(const MultipartMsg& mpmsg) {
+        auto header = ring_.header();
+        std::size_t bytes = 0;
+        for (auto& msg : mpmsg) bytes += detail::shmAlign(msg.size());
+        if (mpmsg.size() > header->max_frames || bytes > header->slot_bytes) {
+            ++dropped_;
+            return false;
+        }
+
+        detail::ShmSlotHeader* slot = nullptr;
+        for (uint64_t i = 0; i < header->n_slots; ++i) {
+            auto candidate = ring_.slot(next_seq_ + i);
+            int32_t idle = 0;
+            if (candidate->readers.compare_exchange_strong(idle, -1, std::memory_order_acquire)) {
+                slot = candidate;
+                next_seq_ += i;
+                skipped_slots_ += i;
+                break;
+            }
+        }
+        if (!slot) {
+            ++dropped_;
+            return false;
+        }
+        slot->seq.store(0, std::memory_order_relaxed);
+
+        uint64_t* sizes = ring_.frameSizes(slot);
+        char* dst = ring_.frames(slot);
+        for (auto& msg : mpmsg) {
+            *sizes++ = msg.size();
+            std::memcpy(dst, msg.data(), msg.size());
+            dst += detail::shmAlign(msg.size());
+        }
+        slot->n_frames = static_cast<uint32_t>(mpmsg.size());
+
+        slot->seq.store(next_seq_, std::memory_order_release);
+        slot->readers.store(0, std::memory_order_release);
+        header->head.store(next_seq_, std::memory_order_release);
+        ++next_seq_;
+        ++published_;
+        return true;
+    }
+
+    /*
+     * Receive the next train from a client and publish it.
+     *
+     * Return false if no train is received or it is dropped.
+     *
+     * Exceptions:
+     * the exceptions of Client::nextMultipartMsg()
+     */
+    bool relayNext(Client& client) {
+        MultipartMsg mpmsg;
+        if (!client.nextMultipartMsg(mpmsg)) return false;
+        return publish(mpmsg);
+    }
+
+    std::size_t publishedTrains() const { return published_; }
+
+    // Return the number of trains which did not fit or found all the slots held.
+    std::size_t droppedTrains() const { return dropped_; }
+
+    // Return the number of times a slot held by a reader was skipped.
+    std::size_t skippedSlots() const { return skipped_slots_; }
+};
+
+/*
+ * Reader of the trains published by a ShmRelay, with the same interface as
+ * Client.
+ *
+ * The frames of kb_data and NDArray refer to the shared memory without a
+ * copy and must not be modified, since they are shared with the other
+ * readers. A train is held in its slot until all its kb_data and the arrays
+ * taken from them are destroyed: a single array keeps the whole slot, which
+ * the relay then skips. Arrays kept for longer than a few trains, e.g. in
+ * caches, should be copied, e.g. with as<std::vector<T>>(), so that the
+ * ring does not run out of slots.
+ * A reader which falls behind by more than the ring size skips to the
+ * latest train.
+ */
+class ShmReader {
+    std::shared_ptr<detail::ShmMapping> mapping_;
+    detail::ShmRing ring_;
+    int timeout_ms_;
+    uint64_t next_seq_;
+    std::size_t missed_ = 0;
+    std::shared_ptr<BufferPool> buffer_pool_;
+    MultipartMsg bound_msg_;
+
+    static detail::ShmMapping* open(const std::string& name) {
+        auto mapping = new detail::ShmMapping(name, 0);
+        auto header = reinterpret_cast<detail::ShmRingHeader*>(mapping->data());
+        if (mapping->size() < sizeof(detail::ShmRingHeader) || header->magic != detail::shmMagic()
+            || mapping->size() < detail::ShmRing::totalSize(
+                header->n_slots, header->slot_bytes, header->max_frames)) {
+            delete mapping;
+            throw ShmError(name + " is not a karabo-bridge ring buffer");
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return mapping;
+    }
+
+    // Hold the train with the given sequence number if it is still in its slot.
+    bool acquire(uint64_t seq, MultipartMsg& mpmsg) {
+        auto slot = ring_.slot(seq);
+        int32_t readers = slot->readers.load(std::memory_order_relaxed);
+        do {
+            if (readers < 0) return false;
+        } while (!slot->readers.compare_exchange_weak(readers, readers + 1,
+                                                     std::memory_order_acquire));
+        if (slot->seq.load(std::memory_order_acquire) != seq) {
+            slot->readers.fetch_sub(1, std::memory_order_release);
+            return false;
+        }
+
+        uint32_t n_frames = slot->n_frames;
+        if (!n_frames) {
+            slot->readers.fetch_sub(1, std::memory_order_release);
+            return true;
+        }
+        auto lease = new detail::ShmLease{mapping_, &slot->readers, {n_frames}};
+        const uint64_t* sizes = ring_.frameSizes(slot);
+        char* src = ring_.frames(slot);
+        for (uint32_t i = 0; i < n_frames; ++i) {
+            mpmsg.emplace_back(src, sizes[i], detail::releaseShmFrame, lease);
+            src += detail::shmAlign(sizes[i]);
+        }
+        return true;
+    }
+
+public:
+    /*
+     * Open the ring buffer of a relay. Reading starts from the latest train.
+     *
+     * @param name: name of the shared-memory object.
+     * @param timeout: timeout of waiting for a train in seconds, negative for infinite.
+     *
+     * Exceptions:
+     * ShmError if the ring buffer does not exist
+     */
+    explicit ShmReader(const std::string& name, double timeout=-1.)
+        : mapping_(open(name)), ring_(mapping_->data()),
+          timeout_ms_(timeout < 0 ? -1 : static_cast<int>(1000 * timeout)) {
+        uint64_t head = ring_.header()->head.load(std::memory_order_acquire);
+        next_seq_ = head ? head : 1;
+    }
+
+    ShmReader(const ShmReader&) = delete;
+    ShmReader& operator=(const ShmReader&) = delete;
+
+    /*
+     * Wait for the next train and return its frames, which hold its slot
+     * until they are destroyed.
+     *
+     * Return false on timeout.
+     */
+    bool nextMultipartMsg(MultipartMsg& mpmsg) {
+        mpmsg.clear();
+        auto header = ring_.header();
+        auto start = std::chrono::steady_clock::now();
+        std::size_t n_polls = 0;
+        while (true) {
+            uint64_t head = header->head.load(std::memory_order_acquire);
+            if (head >= next_seq_) {
+                if (head - next_seq_ >= header->n_slots) {
+                    // overwritten, skip to the latest train
+                    missed_ += head - next_seq_;
+                    next_seq_ = head;
+                }
+                if (acquire(next_seq_, mpmsg)) {
+                    ++next_seq_;
+                    return true;
+                }
+                // skipped by the relay because a reader held the slot, or
+                // overwritten, which is found at the next poll
+                if (head > next_seq_ && ring_.slot(next_seq_)->seq.load(std::memory_order_acquire) < next_seq_)
+                    ++next_seq_;
+                else
+                    std::this_thread::yield();
+                continue;
+            }
+
+            if (timeout_ms_ >= 0 && std::chrono::steady_clock::now() - start
+                                    >= std::chrono::milliseconds(timeout_ms_))
+                return false;
+            if (++n_polls < 64) std::this_thread::yield();
+            else std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    /*
+     * Return the next train, or an empty map on timeout.
+     *
+     * Exceptions:
+     * the exceptions of Client::next()
+     */
+    std::map<std::string, kb_data> next() {
+        MultipartMsg mpmsg;
+        if (!nextMultipartMsg(mpmsg) || mpmsg.empty()) return std::map<std::string, kb_data>();
+        return detail::decodeTrain(mpmsg, buffer_pool_.get());
+    }
+
+    /*
+     * Decode a source of the next train into a struct declared with
+     * KARABO_BRIDGE_BIND (see kb_binding.hpp). The ArrayView members stay
+     * valid until the next call of this member function.
+     *
+     * Return false on timeout or if the source is not in the train.
+     */
+    template<typename T>
+    bool nextInto(StructDecoder<T>& decoder, T& out) {
+        bound_msg_.clear();
+        if (!nextMultipartMsg(bound_msg_)) return false;
+        return decoder.decode(bound_msg_, out, buffer_pool_.get());
+    }
+
+    // Decompress compressed arrays into buffers from the pool.
+    void setBufferPool(const std::shared_ptr<BufferPool>& pool) { buffer_pool_ = pool; }
+
+    /*
+     * Return the number of trains overwritten before they were read. The
+     * slots skipped by the relay while they were overwritten are counted
+     * as well.
+     */
+    std::size_t missedTrains() const { return missed_; }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_SHM_HPP
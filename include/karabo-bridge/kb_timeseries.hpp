@@ -0,0 +1,313 @@
+/*
+    Rolling time series of scalar data across trains.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_TIMESERIES_HPP
+#define KARABO_BRIDGE_KB_TIMESERIES_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kb_client.hpp"
+
+
+namespace karabo_bridge {
+
+class TimeSeriesError : public std::runtime_error {
+public:
+    explicit TimeSeriesError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+/*
+ * Fixed-capacity ring of (train ID, value) samples of a scalar channel.
+ *
+ * The train IDs and the values are stored in two contiguous columns. The
+ * mean, variance, min and max of the samples in the ring are updated in
+ * O(1) (amortized) on every append, so that they cost nothing to query.
+ * The mean and variance are recomputed from the ring whenever it has been
+ * overwritten once, so that the rounding errors of the evictions do not
+ * accumulate. The train IDs must increase: older or repeated trains
+ * are rejected, which keeps the columns sorted for the range queries.
+ */
+class TimeSeries {
+
+    std::size_t capacity_;
+    std::vector<uint64_t> tids_;
+    std::vector<double> values_;
+    uint64_t first_ = 0; // sequence number of the oldest sample
+    uint64_t end_ = 0; // sequence number of the next sample
+    uint64_t rejected_ = 0;
+
+    // Welford's running mean and sum of squared deviations
+    double mean_ = 0.;
+    double m2_ = 0.;
+    uint64_t refreshed_ = 0; // sequence number at the last recomputation
+
+    // sequence numbers of the candidates for the min and max of the ring,
+    // with increasing and decreasing values respectively
+    std::deque<uint64_t> min_candidates_;
+    std::deque<uint64_t> max_candidates_;
+
+    double valueAt(uint64_t seq) const { return values_[seq % capacity_]; }
+
+    void evict() {
+        double v = valueAt(first_);
+        std::size_t n = size();
+        if (n == 1) {
+            mean_ = 0.;
+            m2_ = 0.;
+        } else {
+            double mean = (n * mean_ - v) / (n - 1);
+            m2_ = std::max(0., m2_ - (v - mean_) * (v - mean));
+            mean_ = mean;
+        }
+        if (!min_candidates_.empty() && min_candidates_.front() == first_) min_candidates_.pop_front();
+        if (!max_candidates_.empty() && max_candidates_.front() == first_) max_candidates_.pop_front();
+        ++first_;
+    }
+
+    // Recompute the mean and the sum of squared deviations in two passes.
+    void refresh() {
+        double sum = 0.;
+        for (uint64_t seq = first_; seq < end_; ++seq) sum += valueAt(seq);
+        mean_ = sum / size();
+        double m2 = 0.;
+        for (uint64_t seq = first_; seq < end_; ++seq) {
+            double d = valueAt(seq) - mean_;
+            m2 += d * d;
+        }
+        m2_ = m2;
+        refreshed_ = end_;
+    }
+
+    // Return the first sequence number whose train ID is not less than tid.
+    uint64_t lowerBound(uint64_t tid) const {
+        uint64_t lo = first_, hi = end_;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (tids_[mid % capacity_] < tid) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+public:
+    /*
+     * Constructor.
+     *
+     * @param capacity: maximum number of samples.
+     *
+     * Exceptions:
+     * TimeSeriesError: if the capacity is 0
+     */
+    explicit TimeSeries(std::size_t capacity) : capacity_(capacity) {
+        if (!capacity_) throw TimeSeriesError("The capacity of a time series must be positive");
+        tids_.resize(capacity_);
+        values_.resize(capacity_);
+    }
+
+    /*
+     * Append a sample, evicting the oldest one if the ring is full.
+     *
+     * Return false if the sample is rejected because its train ID is not
+     * larger than the last one, or the value is NaN.
+     */
+    bool append(uint64_t tid, double value) {
+        if ((!empty() && tid <= lastTid()) || std::isnan(value)) {
+            ++rejected_;
+            return false;
+        }
+        if (size() == capacity_) evict();
+
+        tids_[end_ % capacity_] = tid;
+        values_[end_ % capacity_] = value;
+
+        double delta = value - mean_;
+        mean_ += delta / (size() + 1);
+        m2_ += delta * (value - mean_);
+
+        while (!min_candidates_.empty() && valueAt(min_candidates_.back()) >= value)
+            min_candidates_.pop_back();
+        min_candidates_.push_back(end_);
+        while (!max_candidates_.empty() && valueAt(max_candidates_.back()) <= value)
+            max_candidates_.pop_back();
+        max_candidates_.push_back(end_);
+
+        ++end_;
+        if (first_ && end_ - refreshed_ >= capacity_) refresh();
+        return true;
+    }
+
+    // Remove the samples and reset the number of rejected ones.
+    void clear() {
+        first_ = end_ = refreshed_ = 0;
+        rejected_ = 0;
+        mean_ = m2_ = 0.;
+        min_candidates_.clear();
+        max_candidates_.clear();
+    }
+
+    std::size_t capacity() const { return capacity_; }
+
+    std::size_t size() const { return static_cast<std::size_t>(end_ - first_); }
+
+    bool empty() const { return end_ == first_; }
+
+    // Return the number of rejected samples.
+    uint64_t rejected() const { return rejected_; }
+
+    // Return the i-th oldest sample.
+    uint64_t tid(std::size_t i) const { return tids_[(first_ + i) % capacity_]; }
+    double value(std::size_t i) const { return values_[(first_ + i) % capacity_]; }
+
+    // 0 if empty
+    uint64_t firstTid() const { return empty() ? 0 : tid(0); }
+    uint64_t lastTid() const { return empty() ? 0 : tid(size() - 1); }
+
+    // Statistics of the samples in the ring. NaN if empty.
+    double mean() const { return empty() ? std::nan("") : mean_; }
+
+    // population variance
+    double variance() const { return empty() ? std::nan("") : m2_ / size(); }
+
+    double min() const { return empty() ? std::nan("") : valueAt(min_candidates_.front()); }
+
+    double max() const { return empty() ? std::nan("") : valueAt(max_candidates_.front()); }
+
+    /*
+     * Copy the samples with train IDs in [first_tid, last_tid].
+     *
+     * Return the number of samples copied.
+     */
+    std::size_t query(uint64_t first_tid, uint64_t last_tid,
+                      std::vector<uint64_t>& tids, std::vector<double>& values) const {
+        tids.clear();
+        values.clear();
+        if (last_tid < first_tid) return 0;
+        uint64_t begin = lowerBound(first_tid);
+        uint64_t end = last_tid == std::numeric_limits<uint64_t>::max() ? end_ : lowerBound(last_tid + 1);
+        tids.reserve(end - begin);
+        values.reserve(end - begin);
+        for (uint64_t seq = begin; seq < end; ++seq) {
+            tids.push_back(tids_[seq % capacity_]);
+            values.push_back(values_[seq % capacity_]);
+        }
+        return tids.size();
+    }
+};
+
+/*
+ * Rolling time series of registered scalar paths of the received trains.
+ *
+ * The values are converted to double and copied out of the data, so that
+ * no kb_data is held. A path is looked up in the data of a source first
+ * and then in its metadata, e.g. "timestamp.tid".
+ *
+ * TimeSeriesStore store(100000);
+ * store.addChannel("SA1_XTD2_XGM/XGM/DOOCS", "pulseEnergy.photonFlux");
+ * while (true) {
+ *     store.record(client.next());
+ *     auto& flux = store.channel("SA1_XTD2_XGM/XGM/DOOCS", "pulseEnergy.photonFlux");
+ *     std::cout << flux.mean() << " +- " << std::sqrt(flux.variance()) << "\n";
+ * }
+ */
+class TimeSeriesStore {
+
+    using Key = std::pair<std::string, std::string>; // source, path
+
+    std::size_t capacity_;
+    std::map<Key, TimeSeries> channels_;
+
+public:
+    /*
+     * Constructor.
+     *
+     * @param capacity: default capacity of the channels.
+     */
+    explicit TimeSeriesStore(std::size_t capacity) : capacity_(capacity) {}
+
+    /*
+     * Register a path of a source. Nothing is done if it is already registered.
+     *
+     * @param source: data source.
+     * @param path: data or metadata path.
+     * @param capacity: capacity of the channel, 0 for the default one.
+     */
+    TimeSeries& addChannel(const std::string& source, const std::string& path,
+                           std::size_t capacity=0) {
+        auto it = channels_.find(Key(source, path));
+        if (it == channels_.end())
+            it = channels_.emplace(Key(source, path), TimeSeries(capacity ? capacity : capacity_)).first;
+        return it->second;
+    }
+
+    void removeChannel(const std::string& source, const std::string& path) {
+        channels_.erase(Key(source, path));
+    }
+
+    /*
+     * Exceptions:
+     * std::out_of_range: if the channel is not registered
+     */
+    const TimeSeries& channel(const std::string& source, const std::string& path) const {
+        return channels_.at(Key(source, path));
+    }
+
+    std::vector<std::pair<std::string, std::string>> channels() const {
+        std::vector<std::pair<std::string, std::string>> keys;
+        for (auto& v : channels_) keys.push_back(v.first);
+        return keys;
+    }
+
+    /*
+     * Append the values of the registered paths of a train.
+     *
+     * The train ID of a source is its "timestamp.tid". Sources without a
+     * train ID and missing paths are skipped.
+     *
+     * Return the number of appended values.
+     *
+     * Exceptions:
+     * CastErrorMsgpackObject: if a value is not a number
+     */
+    std::size_t record(const std::map<std::string, kb_data>& data) {
+        std::size_t n = 0;
+        for (auto& v : channels_) {
+            auto src = data.find(v.first.first);
+            if (src == data.end()) continue;
+            auto tid = src->second.metadata.find("timestamp.tid");
+            if (tid == src->second.metadata.end()) continue;
+
+            const std::string& path = v.first.second;
+            auto it = src->second.find(path);
+            if (it == src->second.end()) {
+                it = src->second.metadata.find(path);
+                if (it == src->second.metadata.end()) continue;
+            }
+            if (v.second.append(tid->second.as<uint64_t>(), it->second.as<double>())) ++n;
+        }
+        return n;
+    }
+
+    void clear() {
+        for (auto& v : channels_) v.second.clear();
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_TIMESERIES_HPP
@@ -0,0 +1,227 @@
+/*
+    Statistics of the received trains.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_TRAIN_STATS_HPP
+#define KARABO_BRIDGE_KB_TRAIN_STATS_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+
+
+namespace karabo_bridge {
+
+namespace detail {
+
+// number of bins of a LatencyHistogram
+constexpr std::size_t latencyHistogramBins() { return 40; }
+
+} // detail
+
+/*
+ * Histogram of latencies with logarithmic bins.
+ *
+ * Bin 0 counts latencies below 1 us and bin i (i > 0) counts latencies in
+ * [2^(i-1), 2^i) us. The last bin also counts all the longer latencies.
+ * Negative latencies, e.g. due to unsynchronized clocks, are counted in
+ * bin 0 as well as in negative().
+ */
+class LatencyHistogram {
+public:
+    static constexpr std::size_t nBins() { return detail::latencyHistogramBins(); }
+
+    using Bins = std::array<uint64_t, detail::latencyHistogramBins()>;
+
+private:
+    Bins bins_;
+    uint64_t count_ = 0;
+    uint64_t negative_ = 0;
+    double sum_ = 0.;
+    double min_ = std::numeric_limits<double>::infinity();
+    double max_ = -std::numeric_limits<double>::infinity();
+
+public:
+    LatencyHistogram() { bins_.fill(0); }
+
+    /*
+     * Add a latency in seconds.
+     */
+    void record(double seconds) {
+        double us = seconds * 1e6;
+        std::size_t bin = 0;
+        if (us < 0) {
+            ++negative_;
+        } else if (us >= 1.) {
+            int exponent;
+            std::frexp(us, &exponent); // us = m * 2^exponent, 0.5 <= m < 1
+            bin = std::min(static_cast<std::size_t>(exponent), nBins() - 1);
+        }
+        ++bins_[bin];
+        ++count_;
+        sum_ += seconds;
+        min_ = std::min(min_, seconds);
+        max_ = std::max(max_, seconds);
+    }
+
+    uint64_t count() const { return count_; }
+
+    uint64_t negative() const { return negative_; }
+
+    // NaN if empty
+    double mean() const { return count_ ? sum_ / count_ : std::nan(""); }
+
+    double min() const { return count_ ? min_ : std::nan(""); }
+
+    double max() const { return count_ ? max_ : std::nan(""); }
+
+    const Bins& bins() const { return bins_; }
+
+    // Return the upper edge of a bin in seconds.
+    static double binUpperEdge(std::size_t bin) { return std::ldexp(1e-6, static_cast<int>(bin)); }
+
+    /*
+     * Return the upper edge of the bin which contains the q-quantile, e.g.
+     * q = 0.99 for the 99th percentile. NaN if empty.
+     */
+    double percentile(double q) const {
+        if (!count_) return std::nan("");
+        auto threshold = static_cast<uint64_t>(std::ceil(q * count_));
+        uint64_t cumulative = 0;
+        for (std::size_t i = 0; i < nBins(); ++i) {
+            cumulative += bins_[i];
+            if (cumulative >= threshold && cumulative) return binUpperEdge(i);
+        }
+        return binUpperEdge(nBins() - 1);
+    }
+};
+
+/*
+ * Snapshot of the statistics of the trains received from a source.
+ */
+struct SourceStats {
+    uint64_t trains = 0; // number of trains received
+    uint64_t first_tid = 0; // first train ID received
+    uint64_t last_tid = 0; // largest train ID received
+    uint64_t gaps = 0; // number of forward jumps in train ID
+    uint64_t missing = 0; // trains skipped by the jumps which have not arrived later
+    uint64_t duplicates = 0; // trains received more than once
+    uint64_t reordered = 0; // trains received after a train with a larger ID
+
+    // receive time minus the train timestamp
+    LatencyHistogram latency;
+    // time between receiving a train and returning it to the user
+    LatencyHistogram queue;
+};
+
+/*
+ * Thread-safe tracking of train loss, ordering and latency per source.
+ */
+class TrainTracker {
+
+    // the missing train IDs are kept in at most this number of ranges
+    static constexpr std::size_t maxMissingRanges() { return 1024; }
+
+    struct State {
+        SourceStats stats;
+        // ranges of missing train IDs, i.e. last ID -> first ID
+        std::map<uint64_t, uint64_t> missing_ranges;
+        // train IDs below it are not tracked, e.g. older than first_tid
+        uint64_t tracked_from = 0;
+    };
+
+    mutable std::mutex mtx_;
+    std::map<std::string, State> sources_;
+
+    /*
+     * Forget the oldest ranges beyond maxMissingRanges(). Their trains
+     * remain counted as missing.
+     */
+    static void trimMissingRanges(State& state) {
+        while (state.missing_ranges.size() > maxMissingRanges()) {
+            auto it = state.missing_ranges.begin();
+            state.tracked_from = it->first + 1;
+            state.missing_ranges.erase(it);
+        }
+    }
+
+    static void updateOrder(State& state, uint64_t tid) {
+        SourceStats& stats = state.stats;
+        if (!stats.trains) {
+            stats.first_tid = tid;
+            stats.last_tid = tid;
+            state.tracked_from = tid;
+        } else if (tid > stats.last_tid) {
+            if (tid - stats.last_tid > 1) {
+                ++stats.gaps;
+                stats.missing += tid - stats.last_tid - 1;
+                state.missing_ranges[tid - 1] = stats.last_tid + 1;
+                trimMissingRanges(state);
+            }
+            stats.last_tid = tid;
+        } else if (tid < state.tracked_from) {
+            // it cannot be told whether such a train is a duplicate
+            ++stats.reordered;
+        } else {
+            auto it = state.missing_ranges.lower_bound(tid);
+            if (it == state.missing_ranges.end() || it->second > tid) {
+                ++stats.duplicates;
+            } else {
+                // a late train fills in a gap, which is split around it
+                ++stats.reordered;
+                --stats.missing;
+                uint64_t first = it->second, last = it->first;
+                state.missing_ranges.erase(it);
+                if (first < tid) state.missing_ranges[tid - 1] = first;
+                if (tid < last) state.missing_ranges[last] = tid + 1;
+                trimMissingRanges(state);
+            }
+        }
+        ++stats.trains;
+    }
+
+public:
+    /*
+     * Record a received train.
+     *
+     * @param source: data source.
+     * @param tid: train ID.
+     * @param latency: receive time minus the train timestamp in seconds, NaN if unknown.
+     * @param queue: time between receiving the train and returning it in seconds,
+     *               NaN if it is not returned.
+     */
+    void record(const std::string& source, uint64_t tid, double latency, double queue) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        State& state = sources_[source];
+        updateOrder(state, tid);
+        if (!std::isnan(latency)) state.stats.latency.record(latency);
+        if (!std::isnan(queue)) state.stats.queue.record(queue);
+    }
+
+    std::map<std::string, SourceStats> snapshot() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::map<std::string, SourceStats> stats;
+        for (auto& v : sources_) stats.insert(std::make_pair(v.first, v.second.stats));
+        return stats;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        sources_.clear();
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_TRAIN_STATS_HPP
@@ -0,0 +1,410 @@
+/*
+    Axis permutation of arrays.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_KB_TRANSPOSE_HPP
+#define KARABO_BRIDGE_KB_TRANSPOSE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "kb_client.hpp"
+#include "kb_parallel.hpp"
+
+
+namespace karabo_bridge {
+
+class TransposeError : public std::invalid_argument {
+public:
+    explicit TransposeError(const std::string& msg) : std::invalid_argument(msg) {}
+};
+
+
+namespace detail {
+
+/*
+ * Transpose a micro tile of N x N elements, where N = microTileSize<T>().
+ *
+ * The specializations use SSE2 shuffles on a tile which fits in 128-bit
+ * registers.
+ */
+template<typename T>
+constexpr std::size_t microTileSize() { return 1; }
+
+template<typename T>
+inline void transposeMicroTile(const T* src, std::size_t lda, T* dst, std::size_t ldb) {
+    for (std::size_t i = 0; i < microTileSize<T>(); ++i)
+        for (std::size_t j = 0; j < microTileSize<T>(); ++j)
+            dst[j * ldb + i] = src[i * lda + j];
+}
+
+#if defined(__SSE2__)
+
+template<>
+constexpr std::size_t microTileSize<uint16_t>() { return 8; }
+
+template<>
+inline void transposeMicroTile<uint16_t>(const uint16_t* src, std::size_t lda,
+                                         uint16_t* dst, std::size_t ldb) {
+    __m128i r[8];
+    for (int i = 0; i < 8; ++i)
+        r[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * lda));
+
+    __m128i t0 = _mm_unpacklo_epi16(r[0], r[1]);
+    __m128i t1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i t2 = _mm_unpacklo_epi16(r[2], r[3]);
+    __m128i t3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i t4 = _mm_unpacklo_epi16(r[4], r[5]);
+    __m128i t5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i t6 = _mm_unpacklo_epi16(r[6], r[7]);
+    __m128i t7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+    __m128i u0 = _mm_unpacklo_epi32(t0, t2);
+    __m128i u1 = _mm_unpackhi_epi32(t0, t2);
+    __m128i u2 = _mm_unpacklo_epi32(t1, t3);
+    __m128i u3 = _mm_unpackhi_epi32(t1, t3);
+    __m128i u4 = _mm_unpacklo_epi32(t4, t6);
+    __m128i u5 = _mm_unpackhi_epi32(t4, t6);
+    __m128i u6 = _mm_unpacklo_epi32(t5, t7);
+    __m128i u7 = _mm_unpackhi_epi32(t5, t7);
+
+    r[0] = _mm_unpacklo_epi64(u0, u4);
+    r[1] = _mm_unpackhi_epi64(u0, u4);
+    r[2] = _mm_unpacklo_epi64(u1, u5);
+    r[3] = _mm_unpackhi_epi64(u1, u5);
+    r[4] = _mm_unpacklo_epi64(u2, u6);
+    r[5] = _mm_unpackhi_epi64(u2, u6);
+    r[6] = _mm_unpacklo_epi64(u3, u7);
+    r[7] = _mm_unpackhi_epi64(u3, u7);
+
+    for (int i = 0; i < 8; ++i)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * ldb), r[i]);
+}
+
+template<>
+constexpr std::size_t microTileSize<uint32_t>() { return 4; }
+
+template<>
+inline void transposeMicroTile<uint32_t>(const uint32_t* src, std::size_t lda,
+                                         uint32_t* dst, std::size_t ldb) {
+    __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + lda));
+    __m128i r2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * lda));
+    __m128i r3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * lda));
+
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t2 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi64(t0, t2));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + ldb), _mm_unpackhi_epi64(t0, t2));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2 * ldb), _mm_unpacklo_epi64(t1, t3));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * ldb), _mm_unpackhi_epi64(t1, t3));
+}
+
+template<>
+constexpr std::size_t microTileSize<uint64_t>() { return 2; }
+
+template<>
+inline void transposeMicroTile<uint64_t>(const uint64_t* src, std::size_t lda,
+                                         uint64_t* dst, std::size_t ldb) {
+    __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + lda));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi64(r0, r1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + ldb), _mm_unpackhi_epi64(r0, r1));
+}
+
+#endif // __SSE2__
+
+/*
+ * Transpose a tile of n_a x n_b elements with row stride "lda" into a tile
+ * of n_b x n_a elements with row stride "ldb".
+ */
+template<typename T>
+inline void transposeTile(const T* src, std::size_t lda, T* dst, std::size_t ldb,
+                          std::size_t n_a, std::size_t n_b) {
+    constexpr std::size_t m = microTileSize<T>();
+    std::size_t full_a = n_a / m * m;
+    std::size_t full_b = n_b / m * m;
+
+    for (std::size_t i = 0; i < full_a; i += m) {
+        for (std::size_t j = 0; j < full_b; j += m)
+            transposeMicroTile<T>(src + i * lda + j, lda, dst + j * ldb + i, ldb);
+        for (std::size_t j = full_b; j < n_b; ++j)
+            for (std::size_t ii = i; ii < i + m; ++ii) dst[j * ldb + ii] = src[ii * lda + j];
+    }
+    for (std::size_t i = full_a; i < n_a; ++i)
+        for (std::size_t j = 0; j < n_b; ++j) dst[j * ldb + i] = src[i * lda + j];
+}
+
+// Element of an unusual size, moved by memcpy.
+inline void transposeTileBytes(const char* src, std::size_t lda, char* dst, std::size_t ldb,
+                               std::size_t n_a, std::size_t n_b, std::size_t itemsize) {
+    for (std::size_t i = 0; i < n_a; ++i)
+        for (std::size_t j = 0; j < n_b; ++j)
+            std::memcpy(dst + (j * ldb + i) * itemsize, src + (i * lda + j) * itemsize, itemsize);
+}
+
+/*
+ * Shape and permutation with the size-1 axes removed and the axes which
+ * stay adjacent after the permutation merged.
+ *
+ * For example, [16, 128, 512, 64] with axes (3, 0, 1, 2) becomes [65536, 64]
+ * with axes (1, 0).
+ */
+struct TransposePlan {
+    std::vector<std::size_t> shape;
+    std::vector<std::size_t> axes;
+
+    TransposePlan(const std::vector<std::size_t>& src_shape, const std::vector<std::size_t>& src_axes) {
+        std::vector<std::size_t> kept; // input axes of size > 1 in output order
+        for (auto k : src_axes) if (src_shape[k] > 1) kept.push_back(k);
+
+        // groups of input axes which are contiguous in both orders, in output order
+        std::vector<std::pair<std::size_t, std::size_t>> groups; // (first input axis, size)
+        for (std::size_t i = 0; i < kept.size(); ++i) {
+            bool adjacent = false;
+            if (i > 0) {
+                // the axes in between, if any, have size 1
+                std::size_t prev = kept[i - 1];
+                if (kept[i] > prev) {
+                    adjacent = true;
+                    for (std::size_t k = prev + 1; k < kept[i]; ++k)
+                        if (src_shape[k] > 1) adjacent = false;
+                }
+            }
+            if (adjacent) groups.back().second *= src_shape[kept[i]];
+            else groups.emplace_back(kept[i], src_shape[kept[i]]);
+        }
+
+        std::vector<std::size_t> order(groups.size()); // group indices in input order
+        for (std::size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&groups](std::size_t l, std::size_t r) {
+            return groups[l].first < groups[r].first;
+        });
+
+        shape.resize(groups.size());
+        axes.resize(groups.size());
+        for (std::size_t k = 0; k < order.size(); ++k) {
+            shape[k] = groups[order[k]].second;
+            axes[order[k]] = k;
+        }
+    }
+};
+
+// Block of the cache-blocked transpose in elements per side.
+inline std::size_t transposeBlockSize(std::size_t itemsize) {
+    return itemsize <= 4 ? 64 : 32;
+}
+
+} // detail
+
+/*
+ * Permute the axes of a C-contiguous array into an output buffer, in the
+ * manner of numpy.transpose: axis i of the output is axis axes[i] of the
+ * input.
+ *
+ * Elements of 2, 4 and 8 bytes are transposed in cache-sized blocks with
+ * SIMD kernels. The work is split across the thread pool.
+ *
+ * @param src: input data.
+ * @param dst: output buffer of the same size as the input, which must not
+ *             overlap it.
+ * @param shape: shape of the input.
+ * @param itemsize: size of an element in bytes.
+ * @param axes: a permutation of [0, shape.size()).
+ * @param pool: thread pool.
+ *
+ * Exceptions:
+ * TransposeError: if axes is not a permutation of the axes of the input
+ */
+inline void transpose(const void* src, void* dst,
+                      const std::vector<std::size_t>& shape, std::size_t itemsize,
+                      const std::vector<std::size_t>& axes,
+                      ThreadPool& pool=ThreadPool::global()) {
+    if (axes.size() != shape.size())
+        throw TransposeError("axes do not match the array of dimension " +
+                             std::to_string(shape.size()));
+    std::vector<bool> seen(shape.size(), false);
+    for (auto k : axes) {
+        if (k >= shape.size() || seen[k]) throw TransposeError("axes is not a permutation");
+        seen[k] = true;
+    }
+
+    std::size_t size = 1;
+    for (auto v : shape) size *= v;
+    if (!size || !itemsize) return;
+
+    detail::TransposePlan plan(shape, axes);
+    const std::size_t ndim = plan.shape.size();
+    const auto in = static_cast<const char*>(src);
+    auto out = static_cast<char*>(dst);
+
+    if (ndim <= 1) {
+        // nothing but size-1 axes moves
+        pool.parallelFor(0, size * itemsize, [in, out](std::size_t b, std::size_t e) {
+            std::memcpy(out + b, in + b, e - b);
+        }, std::max<std::size_t>(1 << 20, pool.grainFor(size * itemsize)));
+        return;
+    }
+
+    // strides in elements of the input axes, in the input and in the output
+    std::vector<std::size_t> src_strides(ndim), dst_strides(ndim);
+    std::size_t stride = 1;
+    for (std::size_t k = ndim; k-- > 0;) {
+        src_strides[k] = stride;
+        stride *= plan.shape[k];
+    }
+    stride = 1;
+    for (std::size_t i = ndim; i-- > 0;) {
+        dst_strides[plan.axes[i]] = stride;
+        stride *= plan.shape[plan.axes[i]];
+    }
+
+    const std::size_t last = ndim - 1;
+    if (plan.axes[last] == last) {
+        // the innermost axis stays: copy the rows
+        const std::size_t row = plan.shape[last] * itemsize;
+        std::vector<std::size_t> outer(plan.axes.begin(), plan.axes.end() - 1);
+        std::size_t n_rows = size / plan.shape[last];
+        pool.parallelFor(0, n_rows, [&](std::size_t b, std::size_t e) {
+            for (std::size_t r = b; r < e; ++r) {
+                std::size_t src_offset = 0;
+                std::size_t index = r;
+                for (std::size_t i = outer.size(); i-- > 0;) {
+                    std::size_t k = outer[i];
+                    src_offset += index % plan.shape[k] * src_strides[k];
+                    index /= plan.shape[k];
+                }
+                std::memcpy(out + r * row, in + src_offset * itemsize, row);
+            }
+        }, pool.grainFor(n_rows));
+        return;
+    }
+
+    // Transpose the input axis "a", which becomes the innermost one, with
+    // the innermost input axis "b" for every index of the other axes.
+    const std::size_t a = plan.axes[last];
+    const std::size_t b = last;
+    const std::size_t n_a = plan.shape[a];
+    const std::size_t n_b = plan.shape[b];
+    const std::size_t lda = src_strides[a];
+    const std::size_t ldb = dst_strides[b];
+
+    std::vector<std::size_t> outer; // the other axes in output order
+    for (auto k : plan.axes) if (k != a && k != b) outer.push_back(k);
+    std::size_t n_outer = size / (n_a * n_b);
+
+    const std::size_t block = detail::transposeBlockSize(itemsize);
+    const std::size_t blocks_a = (n_a + block - 1) / block;
+    const std::size_t blocks_b = (n_b + block - 1) / block;
+    const std::size_t n_tiles = n_outer * blocks_b * blocks_a;
+
+    pool.parallelFor(0, n_tiles, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t t = begin; t < end; ++t) {
+            // consecutive tiles write consecutive blocks of an output row
+            std::size_t ia = t % blocks_a * block;
+            std::size_t ib = t / blocks_a % blocks_b * block;
+            std::size_t index = t / (blocks_a * blocks_b);
+
+            std::size_t src_offset = ia * lda + ib;
+            std::size_t dst_offset = ib * ldb + ia;
+            for (std::size_t i = outer.size(); i-- > 0;) {
+                std::size_t k = outer[i];
+                std::size_t idx = index % plan.shape[k];
+                index /= plan.shape[k];
+                src_offset += idx * src_strides[k];
+                dst_offset += idx * dst_strides[k];
+            }
+
+            std::size_t m_a = std::min(block, n_a - ia);
+            std::size_t m_b = std::min(block, n_b - ib);
+            const char* s = in + src_offset * itemsize;
+            char* d = out + dst_offset * itemsize;
+            switch (itemsize) {
+                case 1:
+                    detail::transposeTile(reinterpret_cast<const uint8_t*>(s), lda,
+                                          reinterpret_cast<uint8_t*>(d), ldb, m_a, m_b);
+                    break;
+                case 2:
+                    detail::transposeTile(reinterpret_cast<const uint16_t*>(s), lda,
+                                          reinterpret_cast<uint16_t*>(d), ldb, m_a, m_b);
+                    break;
+                case 4:
+                    detail::transposeTile(reinterpret_cast<const uint32_t*>(s), lda,
+                                          reinterpret_cast<uint32_t*>(d), ldb, m_a, m_b);
+                    break;
+                case 8:
+                    detail::transposeTile(reinterpret_cast<const uint64_t*>(s), lda,
+                                          reinterpret_cast<uint64_t*>(d), ldb, m_a, m_b);
+                    break;
+                default:
+                    detail::transposeTileBytes(s, lda, d, ldb, m_a, m_b, itemsize);
+            }
+        }
+    }, pool.grainFor(n_tiles));
+}
+
+/*
+ * Permute the axes of an array into an output buffer.
+ *
+ * @param array: input array.
+ * @param axes: a permutation of the axes of the input.
+ * @param dst: output buffer of array.size() elements.
+ * @param pool: thread pool.
+ *
+ * Return an NDArray which refers to the output buffer.
+ *
+ * Exceptions:
+ * TransposeError: if axes is not a permutation of the axes of the input or
+ *                 the dtype is unknown
+ */
+inline NDArray transpose(const NDArray& array, const std::vector<std::size_t>& axes, void* dst,
+                         ThreadPool& pool=ThreadPool::global()) {
+    std::size_t itemsize = itemSize(array.dtype());
+    if (!itemsize) throw TransposeError("Unknown dtype: " + array.dtype());
+
+    std::vector<std::size_t> shape = array.shape();
+    transpose(array.data(), dst, shape, itemsize, axes, pool);
+
+    std::vector<std::size_t> out_shape;
+    for (auto k : axes) out_shape.push_back(shape[k]);
+    return NDArray(dst, out_shape, array.dtype());
+}
+
+/*
+ * Move the last (pulse) axis of an array to the front, e.g. from
+ * [modules, ss, fs, pulses] to [pulses, modules, ss, fs], so that each
+ * pulse is contiguous.
+ *
+ * Exceptions:
+ * TransposeError: if the array is a scalar or the dtype is unknown
+ */
+inline NDArray toPulseMajor(const NDArray& array, void* dst, ThreadPool& pool=ThreadPool::global()) {
+    std::size_t ndim = array.shape().size();
+    if (!ndim) throw TransposeError("Cannot move the pulse axis of a 0-d array");
+
+    std::vector<std::size_t> axes {ndim - 1};
+    for (std::size_t k = 0; k + 1 < ndim; ++k) axes.push_back(k);
+    return transpose(array, axes, dst, pool);
+}
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_KB_TRANSPOSE_HPP
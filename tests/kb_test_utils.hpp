@@ -0,0 +1,75 @@
+#ifndef KARABO_BRIDGE_TEST_UTILS_HPP
+#define KARABO_BRIDGE_TEST_UTILS_HPP
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "karabo-bridge/kb_client.hpp"
+
+
+namespace karabo_bridge {
+
+/*
+ * helper functions for unittest
+ */
+
+using Frames = std::vector<std::string>;
+
+template<typename T>
+inline void _packKeyValue(msgpack::packer<msgpack::sbuffer>& pk, const std::string& key, const T& value) {
+    pk.pack(key);
+    pk.pack(value);
+}
+
+// Pack a train of a single source which has an array of "n_bytes" uint8.
+inline Frames _packTrain(uint64_t tid, std::size_t n_bytes, const std::string& source="camera") {
+    Frames frames;
+
+    auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    msgpack::sbuffer header;
+    msgpack::packer<msgpack::sbuffer> pk_header(header);
+    pk_header.pack_map(3);
+    _packKeyValue(pk_header, "source", source);
+    _packKeyValue(pk_header, "content", std::string("msgpack"));
+    pk_header.pack(std::string("metadata"));
+    pk_header.pack_map(4);
+    _packKeyValue(pk_header, "source", source);
+    _packKeyValue(pk_header, "timestamp.tid", tid);
+    _packKeyValue(pk_header, "timestamp.sec", std::to_string(now / 1000000));
+    _packKeyValue(pk_header, "timestamp.frac", std::to_string(now % 1000000 * 1000000000000));
+    frames.emplace_back(header.data(), header.size());
+
+    msgpack::sbuffer data;
+    msgpack::packer<msgpack::sbuffer> pk_data(data);
+    pk_data.pack_map(1);
+    _packKeyValue(pk_data, "header.pulseCount", static_cast<uint64_t>(64));
+    frames.emplace_back(data.data(), data.size());
+
+    msgpack::sbuffer array_header;
+    msgpack::packer<msgpack::sbuffer> pk_array(array_header);
+    pk_array.pack_map(5);
+    _packKeyValue(pk_array, "source", source);
+    _packKeyValue(pk_array, "content", std::string("array"));
+    _packKeyValue(pk_array, "path", std::string("image.data"));
+    _packKeyValue(pk_array, "dtype", std::string("uint8"));
+    _packKeyValue(pk_array, "shape", std::vector<uint64_t>({n_bytes}));
+    frames.emplace_back(array_header.data(), array_header.size());
+
+    frames.emplace_back(std::string(n_bytes, '\x01'));
+
+    return frames;
+}
+
+// Copy frames into the messages received from a socket.
+inline MultipartMsg _toMultipartMsg(const Frames& frames) {
+    MultipartMsg mpmsg;
+    for (auto& frame : frames) mpmsg.emplace_back(frame.data(), frame.size());
+    return mpmsg;
+}
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_TEST_UTILS_HPP
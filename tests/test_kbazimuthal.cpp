@@ -0,0 +1,190 @@
+#include <cmath>
+#include <numeric>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_azimuthal.hpp"
+#include "karabo-bridge/kb_calibration.hpp"
+
+
+namespace karabo_bridge {
+
+namespace {
+
+// A single module of 9 x 9 pixels centered at the origin.
+DetectorGeometry _geometry() {
+    TileGeometry t;
+    t.max_ss = 8;
+    t.max_fs = 8;
+    t.corner_x = -4.5;
+    t.corner_y = -4.5;
+    return DetectorGeometry({t}, {1, 9, 9});
+}
+
+double _radius(std::size_t ss, std::size_t fs) {
+    return std::hypot(ss - 4., fs - 4.);
+}
+
+} // namespace
+
+TEST(TestAzimuthal, TestConstantImage) {
+    AzimuthalOptions options;
+    options.n_bins = 5;
+    AzimuthalIntegrator integrator(_geometry(), 0., 0., 100., options);
+    EXPECT_EQ(5, integrator.nBins());
+    EXPECT_EQ(81, integrator.pixelsPerPulse());
+    EXPECT_EQ(81, integrator.nnz());
+    EXPECT_EQ(0., integrator.radialRange().first);
+    EXPECT_NEAR(std::sqrt(32.), integrator.radialRange().second, 1e-9);
+
+    std::vector<uint16_t> src(81, 7);
+    std::vector<float> dst(5);
+    ThreadPool pool(2);
+    integrator.integrate(src.data(), 1, dst.data(), pool);
+    for (auto v : dst) EXPECT_FLOAT_EQ(7.f, v);
+
+    // pixel splitting does not change the mean
+    options.split = 4;
+    AzimuthalIntegrator split_integrator(_geometry(), 0., 0., 100., options);
+    split_integrator.integrate(src.data(), 1, dst.data(), pool);
+    for (auto v : dst) EXPECT_NEAR(7.f, v, 1e-5);
+    EXPECT_GT(split_integrator.nnz(), 81);
+}
+
+TEST(TestAzimuthal, TestRadialProfile) {
+    AzimuthalOptions options;
+    options.n_bins = 3;
+    options.r_min = 0.;
+    options.r_max = 6.;
+    AzimuthalIntegrator integrator(_geometry(), 0., 0., 100., options);
+    EXPECT_THAT(integrator.radialAxis(), ::testing::ElementsAre(1., 3., 5.));
+
+    // the image of the radius
+    std::vector<double> src(81);
+    for (std::size_t ss = 0; ss < 9; ++ss)
+        for (std::size_t fs = 0; fs < 9; ++fs) src[ss * 9 + fs] = _radius(ss, fs);
+
+    std::vector<double> expected(3, 0.);
+    std::vector<int> counts(3, 0);
+    for (auto r : src) {
+        expected[static_cast<std::size_t>(r / 2.)] += r;
+        ++counts[static_cast<std::size_t>(r / 2.)];
+    }
+
+    std::vector<float> dst(3);
+    integrator.integrate(src.data(), 1, dst.data());
+    for (std::size_t b = 0; b < 3; ++b) EXPECT_NEAR(expected[b] / counts[b], dst[b], 1e-5);
+}
+
+TEST(TestAzimuthal, TestMask) {
+    AzimuthalOptions options;
+    options.n_bins = 3;
+    std::vector<uint8_t> mask(81, 0);
+    mask[2 * 9 + 3] = 1;
+
+    AzimuthalIntegrator integrator(_geometry(), 0., 0., 100., options, mask);
+    EXPECT_EQ(80, integrator.nnz());
+
+    std::vector<float> src(81, 1.f);
+    src[2 * 9 + 3] = 1e6f; // hot pixel
+    std::vector<float> dst(3);
+    integrator.integrate(src.data(), 1, dst.data());
+    for (auto v : dst) EXPECT_FLOAT_EQ(1.f, v);
+
+    EXPECT_THROW(AzimuthalIntegrator(_geometry(), 0., 0., 100., options, std::vector<uint8_t>(80)),
+                 IntegrationError);
+    options.n_bins = 0;
+    EXPECT_THROW(AzimuthalIntegrator(_geometry(), 0., 0., 100., options), IntegrationError);
+}
+
+TEST(TestAzimuthal, TestSolidAngle) {
+    AzimuthalOptions options;
+    options.n_bins = 10;
+    options.unit = RadialUnit::TWO_THETA;
+    options.solid_angle = true;
+    const double distance = 4.;
+    AzimuthalIntegrator integrator(_geometry(), 0., 0., distance, options);
+    EXPECT_EQ(0., integrator.radialRange().first);
+    EXPECT_NEAR(std::atan2(std::sqrt(32.), distance) * 180. / std::acos(-1.),
+                integrator.radialRange().second, 1e-9);
+
+    // an isotropic scatterer: the intensity is proportional to the solid angle
+    std::vector<float> src(81);
+    for (std::size_t ss = 0; ss < 9; ++ss) {
+        for (std::size_t fs = 0; fs < 9; ++fs) {
+            double cos_2theta = distance / std::hypot(distance, _radius(ss, fs));
+            src[ss * 9 + fs] = static_cast<float>(100. * std::pow(cos_2theta, 3));
+        }
+    }
+    std::vector<float> dst(10);
+    integrator.integrate(src.data(), 1, dst.data());
+    for (auto v : dst) {
+        if (v != 0.f) {
+            EXPECT_NEAR(100.f, v, 1e-3);
+        }
+    }
+
+    EXPECT_THROW(AzimuthalIntegrator(_geometry(), 0., 0., 0., options), IntegrationError);
+}
+
+TEST(TestAzimuthal, TestNaNPixels) {
+    AzimuthalOptions options;
+    options.n_bins = 5;
+    AzimuthalIntegrator integrator(_geometry(), 0., 0., 100., options);
+
+    // cell 0 masks the central pixel, cell 1 every pixel of the first bin
+    Calibration calib(2, 81);
+    const std::size_t center = 4 * 9 + 4;
+    const std::size_t neighbours[] = {3 * 9 + 4, 5 * 9 + 4, 4 * 9 + 3, 4 * 9 + 5};
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    calib.relativeGain(0, 0)[center] = nan;
+    calib.relativeGain(1, 0)[center] = nan;
+    for (auto px : neighbours) calib.relativeGain(1, 0)[px] = nan;
+
+    std::vector<uint16_t> raw(2 * 81, 10);
+    for (std::size_t p = 0; p < 2; ++p) {
+        raw[p * 81 + center] = 1000;
+        for (auto px : neighbours) raw[p * 81 + px] = 20;
+    }
+    std::vector<uint16_t> cells = {0, 1};
+    std::vector<float> photons(2 * 81);
+    calib.correct(raw.data(), static_cast<const uint16_t*>(nullptr), cells.data(), 2, photons.data());
+
+    std::vector<float> dst(2 * 5);
+    integrator.integrate(photons.data(), 2, dst.data());
+    // the mean of the other pixels of the bin
+    EXPECT_FLOAT_EQ(20.f, dst[0]);
+    EXPECT_TRUE(std::isnan(dst[5]));
+    for (std::size_t p = 0; p < 2; ++p)
+        for (std::size_t b = 1; b < 5; ++b) EXPECT_FLOAT_EQ(10.f, dst[p * 5 + b]);
+}
+
+TEST(TestAzimuthal, TestNDArray) {
+    AzimuthalOptions options;
+    options.n_bins = 6;
+    AzimuthalIntegrator integrator(_geometry(), 0.5, -0.5, 100., options);
+
+    const std::size_t n_pulses = 3;
+    std::vector<int32_t> src(n_pulses * 81);
+    for (std::size_t p = 0; p < n_pulses; ++p)
+        std::fill(src.begin() + p * 81, src.begin() + (p + 1) * 81, static_cast<int32_t>(p + 1));
+    std::vector<float> dst(n_pulses * 6);
+
+    NDArray array(src.data(), {n_pulses, 1, 9, 9}, DType::INT32);
+    auto profiles = integrator.integrate(array, dst.data());
+    EXPECT_THAT(profiles.shape(), ::testing::ElementsAre(n_pulses, 6));
+    EXPECT_EQ("float", profiles.dtype());
+    for (std::size_t p = 0; p < n_pulses; ++p)
+        for (std::size_t b = 0; b < 6; ++b) EXPECT_FLOAT_EQ(p + 1., dst[p * 6 + b]);
+
+    NDArray single(src.data(), {1, 9, 9}, DType::INT32);
+    EXPECT_THAT(integrator.integrate(single, dst.data()).shape(), ::testing::ElementsAre(6));
+
+    NDArray wrong(src.data(), {n_pulses, 1, 9, 8}, DType::INT32);
+    EXPECT_THROW(integrator.integrate(wrong, dst.data()), IntegrationError);
+    NDArray strings(src.data(), {1, 9, 9}, DType::STRING);
+    EXPECT_THROW(integrator.integrate(strings, dst.data()), TypeMismatchErrorNDArray);
+}
+
+} // karabo_bridge
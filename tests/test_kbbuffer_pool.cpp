@@ -0,0 +1,87 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_client.hpp"
+
+
+namespace karabo_bridge {
+
+TEST(TestBufferPool, TestRecycle) {
+    auto pool = std::make_shared<BufferPool>(HugePages::NONE);
+
+    void* ptr;
+    {
+        auto msg = pool->message(1000);
+        EXPECT_EQ(1000, msg.size());
+        ptr = msg.data();
+        EXPECT_EQ(0, reinterpret_cast<std::uintptr_t>(ptr) % BufferPool::alignment());
+        EXPECT_EQ(BufferPool::pageSize(), pool->allocatedBytes());
+        EXPECT_EQ(0, pool->idleBytes());
+    }
+    EXPECT_EQ(BufferPool::pageSize(), pool->idleBytes());
+
+    {
+        // the idle buffer is recycled
+        auto msg = pool->message(2000);
+        EXPECT_EQ(ptr, msg.data());
+        EXPECT_EQ(0, pool->idleBytes());
+
+        // a buffer which is too large is not recycled
+        void* ptr_large = pool->message(3 * BufferPool::pageSize()).data();
+        EXPECT_EQ(3 * BufferPool::pageSize(), pool->idleBytes());
+        auto msg_small = pool->message(10);
+        EXPECT_NE(ptr_large, msg_small.data());
+        EXPECT_EQ(3 * BufferPool::pageSize(), pool->idleBytes());
+        EXPECT_EQ(5 * BufferPool::pageSize(), pool->allocatedBytes());
+    }
+    EXPECT_EQ(5 * BufferPool::pageSize(), pool->idleBytes());
+
+    pool->clear();
+    EXPECT_EQ(0, pool->idleBytes());
+    EXPECT_EQ(0, pool->allocatedBytes());
+}
+
+TEST(TestBufferPool, TestLifetime) {
+    auto pool = std::make_shared<BufferPool>(HugePages::TRANSPARENT, 0);
+
+    // the buffer keeps the pool alive
+    auto msg = pool->message(BufferPool::hugePageSize() + 1);
+    std::weak_ptr<BufferPool> weak_pool = pool;
+    pool.reset();
+    EXPECT_FALSE(weak_pool.expired());
+    EXPECT_EQ(0, reinterpret_cast<std::uintptr_t>(msg.data()) % BufferPool::hugePageSize());
+    EXPECT_EQ(2 * BufferPool::hugePageSize(), weak_pool.lock()->allocatedBytes());
+
+    msg = zmq::message_t();
+    EXPECT_TRUE(weak_pool.expired());
+}
+
+TEST(TestBufferPool, TestExplicitHugePages) {
+    // fall back to transparent huge pages if none is reserved
+    auto pool = std::make_shared<BufferPool>(HugePages::EXPLICIT);
+    auto msg = pool->message(BufferPool::hugePageThreshold());
+    EXPECT_EQ(0, reinterpret_cast<std::uintptr_t>(msg.data()) % BufferPool::hugePageSize());
+    EXPECT_EQ(BufferPool::hugePageSize(), pool->allocatedBytes());
+    memset(msg.data(), 1, msg.size());
+
+    // small buffers are backed by regular pages
+    auto msg_small = pool->message(100);
+    EXPECT_EQ(BufferPool::hugePageSize() + BufferPool::pageSize(), pool->allocatedBytes());
+    memset(msg_small.data(), 1, msg_small.size());
+}
+
+TEST(TestBufferPool, TestNDArrayAlignment) {
+    auto pool = std::make_shared<BufferPool>(HugePages::NONE);
+    auto msg = pool->message(64);
+
+    NDArray aligned(msg.data(), {4, 4}, "float");
+    EXPECT_GE(aligned.alignment(), BufferPool::alignment());
+    EXPECT_TRUE(aligned.isAligned(64));
+
+    NDArray unaligned(static_cast<char*>(msg.data()) + 4, {3, 4}, "float");
+    EXPECT_EQ(4, unaligned.alignment());
+    EXPECT_TRUE(unaligned.isAligned(4));
+    EXPECT_FALSE(unaligned.isAligned(16));
+}
+
+} // karabo_bridge
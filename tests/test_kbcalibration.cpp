@@ -0,0 +1,163 @@
+#include <cmath>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_calibration.hpp"
+
+
+namespace karabo_bridge {
+
+namespace {
+
+// Fill the constants so that they differ for each cell, stage and pixel.
+void _fillConstants(Calibration& calib) {
+    for (std::size_t c = 0; c < calib.nCells(); ++c) {
+        for (std::size_t s = 0; s < Calibration::nStages(); ++s) {
+            float* offset = calib.offset(c, s);
+            float* relgain = calib.relativeGain(c, s);
+            for (std::size_t i = 0; i < calib.nPixels(); ++i) {
+                offset[i] = 100.f * s + c + 0.5f * (i % 7);
+                relgain[i] = 1.f + 0.25f * s + 0.01f * (i % 5);
+            }
+        }
+        for (std::size_t s = 0; s < Calibration::nStages() - 1; ++s) {
+            float* threshold = calib.threshold(c, s);
+            for (std::size_t i = 0; i < calib.nPixels(); ++i) threshold[i] = 1000.f * (s + 1) + i % 3;
+        }
+    }
+}
+
+} // namespace
+
+TEST(TestCalibration, TestThreshold) {
+    const std::size_t n_cells = 4;
+    const std::size_t n_pixels = 1003;
+    const std::size_t n_pulses = 5;
+    Calibration calib(n_cells, n_pixels);
+    _fillConstants(calib);
+
+    std::vector<uint16_t> raw(n_pulses * n_pixels);
+    std::vector<uint16_t> gain(raw.size());
+    for (std::size_t i = 0; i < raw.size(); ++i) {
+        raw[i] = static_cast<uint16_t>(500 + i % 1000);
+        gain[i] = static_cast<uint16_t>(i * 7 % 3000);
+    }
+    std::vector<uint16_t> cells {3, 1, 0, 2, 3};
+
+    std::vector<float> dst(raw.size());
+    ThreadPool pool(3);
+    calib.correct(raw.data(), gain.data(), cells.data(), n_pulses, dst.data(), pool);
+
+    for (std::size_t p = 0; p < n_pulses; ++p) {
+        std::size_t c = cells[p];
+        for (std::size_t i = 0; i < n_pixels; ++i) {
+            std::size_t k = p * n_pixels + i;
+            std::size_t stage = (gain[k] >= calib.threshold(c, 0)[i]) + (gain[k] >= calib.threshold(c, 1)[i]);
+            float expected = (raw[k] - calib.offset(c, stage)[i]) * calib.relativeGain(c, stage)[i];
+            ASSERT_FLOAT_EQ(expected, dst[k]) << p << " " << i;
+        }
+    }
+
+    // the same with uint8_t gain, which takes the scalar kernel
+    std::vector<uint8_t> gain8(raw.size());
+    for (std::size_t i = 0; i < raw.size(); ++i) gain8[i] = static_cast<uint8_t>(i % 256);
+    for (std::size_t c = 0; c < n_cells; ++c) {
+        std::fill(calib.threshold(c, 0), calib.threshold(c, 0) + n_pixels, 100.f);
+        std::fill(calib.threshold(c, 1), calib.threshold(c, 1) + n_pixels, 200.f);
+    }
+    calib.correct(raw.data(), gain8.data(), cells.data(), n_pulses, dst.data(), pool);
+    for (std::size_t k = 0; k < raw.size(); ++k) {
+        std::size_t i = k % n_pixels;
+        std::size_t c = cells[k / n_pixels];
+        std::size_t stage = (gain8[k] >= 100) + (gain8[k] >= 200);
+        ASSERT_FLOAT_EQ((raw[k] - calib.offset(c, stage)[i]) * calib.relativeGain(c, stage)[i], dst[k]);
+    }
+
+    cells[2] = 4;
+    EXPECT_THROW(calib.correct(raw.data(), gain.data(), cells.data(), n_pulses, dst.data(), pool),
+                 CalibrationError);
+    EXPECT_THROW(calib.offset(4, 0), CalibrationError);
+    EXPECT_THROW(calib.threshold(0, 2), CalibrationError);
+}
+
+TEST(TestCalibration, TestStage) {
+    const std::size_t n_pixels = 10;
+    Calibration calib(2, n_pixels, GainMode::STAGE);
+    EXPECT_EQ(GainMode::STAGE, calib.gainMode());
+    _fillConstants(calib);
+    calib.relativeGain(1, 2)[9] = std::nanf(""); // masked pixel
+
+    std::vector<uint16_t> raw(2 * n_pixels, 1000);
+    std::vector<uint16_t> gain {0, 1, 2, 3, 0, 1, 2, 3, 0, 2,
+                                0, 1, 2, 3, 0, 1, 2, 3, 0, 2};
+    std::vector<uint16_t> cells {0, 1};
+    std::vector<float> dst(raw.size());
+
+    NDArray data_array(raw.data(), {2, 2, 5}, "uint16_t");
+    NDArray gain_array(gain.data(), {2, 2, 5}, "uint16_t");
+    NDArray cell_array(cells.data(), {2}, "uint16_t");
+    NDArray out = calib.correct(data_array, gain_array, cell_array, dst.data());
+    EXPECT_EQ("float", out.dtype());
+    EXPECT_THAT(out.shape(), ::testing::ElementsAre(2, 2, 5));
+
+    for (std::size_t k = 0; k < raw.size() - 1; ++k) {
+        std::size_t i = k % n_pixels;
+        std::size_t c = cells[k / n_pixels];
+        std::size_t stage = std::min<std::size_t>(gain[k], 2);
+        ASSERT_FLOAT_EQ((1000 - calib.offset(c, stage)[i]) * calib.relativeGain(c, stage)[i], dst[k]);
+    }
+    EXPECT_TRUE(std::isnan(dst.back()));
+
+    // no gain array: the first stage only
+    calib.correct(raw.data(), static_cast<const uint16_t*>(nullptr), cells.data(), 2, dst.data());
+    EXPECT_FLOAT_EQ((1000 - calib.offset(1, 0)[3]) * calib.relativeGain(1, 0)[3], dst[13]);
+
+    NDArray wrong_axis(raw.data(), {2, 5, 2}, "uint16_t");
+    EXPECT_THROW(calib.correct(wrong_axis, wrong_axis, cell_array, 1, dst.data()), CalibrationError);
+    NDArray wrong_cells(cells.data(), {1}, "uint16_t");
+    EXPECT_THROW(calib.correct(data_array, gain_array, wrong_cells, dst.data()), CalibrationError);
+    NDArray wrong_data(raw.data(), {2, 2, 5}, "int16_t");
+    EXPECT_THROW(calib.correct(wrong_data, gain_array, cell_array, dst.data()), TypeMismatchErrorNDArray);
+}
+
+TEST(TestCalibration, TestPulsesLast) {
+    const std::size_t n_cells = 4;
+    const std::size_t n_ss = 17, n_fs = 59; // not a multiple of the tile
+    const std::size_t n_pixels = n_ss * n_fs;
+    const std::size_t n_pulses = 5;
+    Calibration calib(n_cells, n_pixels);
+    _fillConstants(calib);
+
+    // [pulses, pixels] and the same data as [pixels, pulses]
+    std::vector<uint16_t> raw(n_pulses * n_pixels), gain(raw.size());
+    std::vector<uint16_t> raw_last(raw.size()), gain_last(raw.size());
+    for (std::size_t p = 0; p < n_pulses; ++p) {
+        for (std::size_t i = 0; i < n_pixels; ++i) {
+            std::size_t k = p * n_pixels + i;
+            raw[k] = raw_last[i * n_pulses + p] = static_cast<uint16_t>(500 + k % 1000);
+            gain[k] = gain_last[i * n_pulses + p] = static_cast<uint16_t>(k * 7 % 3000);
+        }
+    }
+    std::vector<uint16_t> cells {3, 1, 0, 2, 3};
+
+    ThreadPool pool(3);
+    std::vector<float> expected(raw.size()), dst(raw.size());
+    calib.correct(raw.data(), gain.data(), cells.data(), n_pulses, expected.data(), pool);
+
+    NDArray data_array(raw_last.data(), {n_ss, n_fs, n_pulses}, "uint16_t");
+    NDArray gain_array(gain_last.data(), {n_ss, n_fs, n_pulses}, "uint16_t");
+    NDArray cell_array(cells.data(), {n_pulses}, "uint16_t");
+    NDArray out = calib.correct(data_array, gain_array, cell_array, 2, dst.data(), pool);
+    EXPECT_THAT(out.shape(), ::testing::ElementsAre(n_pulses, n_ss, n_fs));
+    EXPECT_EQ(expected, dst);
+
+    // without gain
+    calib.correct(raw.data(), static_cast<const uint16_t*>(nullptr), cells.data(), n_pulses,
+                  expected.data(), pool);
+    calib.correctPulsesLast(raw_last.data(), static_cast<const uint16_t*>(nullptr), cells.data(),
+                            n_pulses, dst.data(), pool);
+    EXPECT_EQ(expected, dst);
+}
+
+} // karabo_bridge
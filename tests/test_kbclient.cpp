@@ -3,11 +3,17 @@
 //
 #include <iostream>
 #include <future>
+#include <thread>
+#include <functional>
 
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
 #include "karabo-bridge/kb_client.hpp"
+#include "karabo-bridge/kb_binding.hpp"
+#include "karabo-bridge/kb_shm.hpp"
+
+#include "kb_test_utils.hpp"
 
 
 namespace karabo_bridge {
@@ -15,6 +21,87 @@ namespace karabo_bridge {
 using ::testing::ElementsAre;
 using ::testing::ElementsAreArray;
 
+#if defined(KARABO_BRIDGE_WITH_LZ4)
+
+// Pack a train of a single source which has a compressed uint16 array.
+Frames _packCompressedTrain(const std::vector<uint16_t>& array, const std::string& source="camera") {
+    Frames frames = _packTrain(0, 0, source);
+    frames.pop_back();
+    frames.pop_back();
+
+    auto header = packCompressedArrayHeader(source, "image.data", "uint16",
+                                            {2, array.size() / 2}, Compression::BITSHUFFLE_LZ4);
+    frames.emplace_back(header.data(), header.size());
+    frames.emplace_back(compressArray(array.data(), array.size() * sizeof(uint16_t),
+                                      sizeof(uint16_t), Compression::BITSHUFFLE_LZ4));
+    return frames;
+}
+
+#endif
+
+struct Camera {
+    uint64_t tid;
+    std::string source;
+    uint32_t n_pulses;
+    ArrayView<uint8_t> image;
+
+    KARABO_BRIDGE_BIND("timestamp.tid", tid,
+                       "source", source,
+                       "header.pulseCount", n_pulses,
+                       "image.data", image)
+};
+
+// a uint16 image, which is the type of compressed trains only
+struct Camera16 {
+    ArrayView<uint16_t> image;
+
+    KARABO_BRIDGE_BIND("image.data", image)
+};
+
+struct CameraWrongPath {
+    uint64_t missing;
+
+    KARABO_BRIDGE_BIND("header.missing", missing)
+};
+
+/*
+ * A REP server which replies each request with the frames made by a factory.
+ */
+class FakeServer {
+    zmq::context_t ctx_;
+    zmq::socket_t socket_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+
+public:
+    FakeServer(const std::string& endpoint, std::function<Frames(uint64_t)> factory)
+        : ctx_(1), socket_(ctx_, ZMQ_REP), running_(true) {
+        socket_.setsockopt(ZMQ_RCVTIMEO, 10);
+        socket_.setsockopt(ZMQ_LINGER, 0);
+        socket_.bind(endpoint);
+        thread_ = std::thread([this, factory]() {
+            uint64_t tid = 10000;
+            while (running_) {
+                zmq::message_t request;
+                if (!socket_.recv(&request)) continue;
+                auto frames = factory(tid++);
+                for (std::size_t i = 0; i < frames.size(); ++i) {
+                    socket_.send(frames[i].data(), frames[i].size(),
+                                 i == frames.size() - 1 ? 0 : ZMQ_SNDMORE);
+                }
+            }
+        });
+    }
+
+    ~FakeServer() {
+        running_ = false;
+        thread_.join();
+    }
+};
+
+/*
+ * test cases
+ */
 
 TEST(TestClient, TestTimeout) {
     // test client with short timeout
@@ -40,4 +127,574 @@ TEST(TestClient, TestTimeout) {
     delete client_inf; // close the blocking socket
 }
 
-} // karabo_bridge
\ No newline at end of file
+TEST(TestClient, TestMemoryBudget) {
+    const std::size_t n_bytes = 1000;
+    FakeServer server("tcp://127.0.0.1:12347",
+                      [n_bytes](uint64_t tid) { return _packTrain(tid, n_bytes); });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12347");
+
+    std::size_t train_bytes;
+    {
+        auto data = client.next();
+        ASSERT_EQ(1, data.size());
+        train_bytes = data.at("camera").bytesReceived();
+        EXPECT_EQ(train_bytes, client.bytesInUse());
+        EXPECT_EQ(train_bytes, client.peakBytesInUse());
+    }
+    EXPECT_EQ(0, client.bytesInUse());
+    EXPECT_EQ(train_bytes, client.peakBytesInUse());
+
+    // backpressure: no request is sent until memory is released
+    client.setMemoryBudget(train_bytes + train_bytes / 2);
+    {
+        auto data1 = client.next();
+        EXPECT_EQ(1, data1.size());
+        EXPECT_TRUE(client.next().empty());
+    }
+    EXPECT_EQ(1, client.next().size());
+
+    // drop the received train
+    client.setMemoryBudget(train_bytes + train_bytes / 2, MemoryPolicy::DROP_INCOMING);
+    {
+        auto data1 = client.next();
+        EXPECT_EQ(1, data1.size());
+        EXPECT_TRUE(client.next().empty());
+        EXPECT_EQ(1, client.droppedTrains());
+    }
+
+    // a train larger than the budget is accepted if nothing is held
+    for (auto policy : {MemoryPolicy::BACKPRESSURE, MemoryPolicy::DROP_INCOMING}) {
+        client.setMemoryBudget(train_bytes / 2, policy);
+        auto data1 = client.next();
+        EXPECT_EQ(1, data1.size());
+        EXPECT_TRUE(client.next().empty());
+    }
+    EXPECT_EQ(1, client.next().size());
+
+    // fail fast
+    client.setMemoryBudget(train_bytes - 1, MemoryPolicy::FAIL_FAST);
+    EXPECT_THROW(client.next(), MemoryBudgetError);
+    client.setMemoryBudget(0);
+    EXPECT_EQ(1, client.next().size());
+    EXPECT_EQ(0, client.bytesInUse());
+}
+
+TEST(TestClient, TestBufferPool) {
+    const std::size_t n_bytes = 100000;
+    FakeServer server("tcp://127.0.0.1:12348",
+                      [n_bytes](uint64_t tid) { return _packTrain(tid, n_bytes); });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12348");
+    auto pool = std::make_shared<BufferPool>();
+    client.setBufferPool(pool);
+
+    void* ptr;
+    {
+        auto data = client.next();
+        auto& array = data.at("camera").array.at("image.data");
+        ptr = array.data();
+        EXPECT_TRUE(array.isAligned(BufferPool::alignment()));
+        EXPECT_THAT(array.as<std::vector<uint8_t>>(), ::testing::Each(1));
+        EXPECT_EQ(64, data.at("camera")["header.pulseCount"].as<int>());
+    }
+    EXPECT_GT(pool->idleBytes(), n_bytes);
+
+    // the buffer is recycled
+    auto data = client.next();
+    EXPECT_EQ(ptr, data.at("camera").array.at("image.data").data());
+    EXPECT_EQ(0, pool->idleBytes());
+}
+
+TEST(TestClient, TestBufferPoolMismatch) {
+    // the header of the first source of train 10000 announces more data
+    // than are sent, and another source follows
+    FakeServer server("tcp://127.0.0.1:12360", [](uint64_t tid) {
+        auto frames = _packTrain(tid, 100);
+        if (tid == 10000) {
+            frames.back().resize(50);
+            auto other = _packTrain(tid, 10, "other");
+            frames.insert(frames.end(), other.begin(), other.end());
+        }
+        return frames;
+    });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12360");
+    client.setBufferPool(std::make_shared<BufferPool>());
+
+    EXPECT_THROW(client.next(), std::runtime_error);
+
+    // the rest of the train is not left in the socket
+    auto data = client.next();
+    ASSERT_EQ(1, data.count("camera"));
+    EXPECT_EQ(10001, data.at("camera").metadata.at("timestamp.tid").as<uint64_t>());
+    EXPECT_THAT(data.at("camera").array.at("image.data").as<std::vector<uint8_t>>(), ::testing::Each(1));
+}
+
+TEST(TestClient, TestTrainStats) {
+    std::vector<uint64_t> tids {1, 2, 3, 5, 6, 6, 4, 9};
+    std::size_t i_train = 0;
+    FakeServer server("tcp://127.0.0.1:12350", [&tids, &i_train](uint64_t) {
+        return _packTrain(tids[i_train++ % tids.size()], 10);
+    });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12350");
+    for (std::size_t i = 0; i < tids.size(); ++i) client.next();
+
+    auto stats = client.trainStats();
+    ASSERT_EQ(1, stats.size());
+    auto& s = stats.at("camera");
+    EXPECT_EQ(8, s.trains);
+    EXPECT_EQ(9, s.last_tid);
+    EXPECT_EQ(2, s.gaps);
+    EXPECT_EQ(2, s.missing);
+    EXPECT_EQ(1, s.duplicates);
+    EXPECT_EQ(1, s.reordered);
+
+    // the client and the server share the same clock
+    EXPECT_EQ(8, s.latency.count());
+    EXPECT_EQ(0, s.latency.negative());
+    EXPECT_LT(s.latency.max(), 1.);
+    EXPECT_EQ(8, s.queue.count());
+    EXPECT_LT(s.queue.max(), 1.);
+
+    client.resetTrainStats();
+    EXPECT_TRUE(client.trainStats().empty());
+}
+
+TEST(TestClient, TestTrainFilter) {
+    FakeServer server("tcp://127.0.0.1:12351", [](uint64_t tid) { return _packTrain(tid, 100); });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12351");
+
+    std::vector<TrainHeader> headers;
+    client.setTrainFilter([&headers](const TrainHeader& header) {
+        headers.push_back(header);
+        return header.tid % 4 == 0;
+    });
+    for (int i = 0; i < 3; ++i) {
+        auto data = client.next();
+        ASSERT_EQ(1, data.size());
+        EXPECT_EQ(0, data.at("camera").metadata.at("timestamp.tid").as<uint64_t>() % 4);
+    }
+    // the server starts from 10000
+    EXPECT_EQ(9, headers.size());
+    EXPECT_EQ(6, client.skippedTrains());
+
+    ASSERT_FALSE(headers.empty());
+    EXPECT_TRUE(headers[0].hasSource("camera"));
+    EXPECT_FALSE(headers[0].hasSource("motor"));
+    EXPECT_EQ(headers[0].tid, headers[0].sources.at("camera"));
+    EXPECT_GT(headers[0].bytes, 100);
+    EXPECT_THAT(headers[0].contents.at("camera"), ElementsAre("msgpack", "array"));
+
+    // skipped trains count in the ordering statistics only
+    auto stats = client.trainStats().at("camera");
+    EXPECT_EQ(9, stats.trains);
+    EXPECT_EQ(0, stats.missing);
+    EXPECT_EQ(3, stats.queue.count());
+
+    client.setTrainFilter();
+    auto data = client.next();
+    EXPECT_EQ(1, data.size());
+    EXPECT_EQ(6, client.skippedTrains());
+
+    // a filter which rejects every train does not block beyond the timeout
+    Client rejecting(0.2);
+    rejecting.connect("tcp://127.0.0.1:12351");
+    rejecting.setTrainFilter([](const TrainHeader&) { return false; });
+    EXPECT_TRUE(rejecting.next().empty());
+    EXPECT_GT(rejecting.skippedTrains(), 0);
+}
+
+TEST(TestClient, TestStructBinding) {
+    FakeServer server("tcp://127.0.0.1:12352", [](uint64_t tid) {
+        auto frames = _packTrain(tid, 10 + tid % 3, "camera");
+        auto other = _packTrain(tid, 5, "other");
+        frames.insert(frames.begin(), other.begin(), other.end());
+        return frames;
+    });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12352");
+
+    StructDecoder<Camera> decoder("camera");
+    EXPECT_EQ("camera", decoder.source());
+    Camera camera;
+    for (uint64_t tid = 10000; tid < 10003; ++tid) {
+        ASSERT_TRUE(client.nextInto(decoder, camera));
+        EXPECT_EQ(tid, camera.tid);
+        EXPECT_EQ("camera", camera.source);
+        EXPECT_EQ(64, camera.n_pulses);
+        EXPECT_THAT(camera.image.shape(), ElementsAre(10 + tid % 3));
+        ASSERT_EQ(10 + tid % 3, camera.image.size());
+        EXPECT_THAT(std::vector<uint8_t>(camera.image.begin(), camera.image.end()),
+                    ::testing::Each(1));
+    }
+
+    StructDecoder<Camera> missing_source("motor");
+    EXPECT_FALSE(client.nextInto(missing_source, camera));
+
+    StructDecoder<Camera16> wrong_type("camera");
+    Camera16 camera16;
+    EXPECT_THROW(client.nextInto(wrong_type, camera16), TypeMismatchErrorNDArray);
+
+    StructDecoder<CameraWrongPath> wrong_path("camera");
+    CameraWrongPath camera_wrong_path;
+    EXPECT_THROW(client.nextInto(wrong_path, camera_wrong_path), BindingError);
+}
+
+TEST(TestClient, TestStructBindingLayout) {
+    // the frames of "camera" move when "other" comes first, and train 10004
+    // has a shape which is not made of integers
+    FakeServer server("tcp://127.0.0.1:12362", [](uint64_t tid) {
+        auto frames = _packTrain(tid, 10 + tid % 3, "camera");
+        if (tid % 2) {
+            auto other = _packTrain(tid, 5, "other");
+            frames.insert(frames.begin(), other.begin(), other.end());
+        }
+        if (tid == 10004) {
+            msgpack::sbuffer header;
+            msgpack::packer<msgpack::sbuffer> pk(header);
+            pk.pack_map(5);
+            _packKeyValue(pk, "source", std::string("camera"));
+            _packKeyValue(pk, "content", std::string("array"));
+            _packKeyValue(pk, "path", std::string("image.data"));
+            _packKeyValue(pk, "dtype", std::string("uint8"));
+            _packKeyValue(pk, "shape", std::vector<double>({1.5}));
+            frames[frames.size() - 2] = std::string(header.data(), header.size());
+        }
+        return frames;
+    });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12362");
+
+    StructDecoder<Camera> decoder("camera");
+    Camera camera;
+    for (uint64_t tid = 10000; tid < 10004; ++tid) {
+        ASSERT_TRUE(client.nextInto(decoder, camera));
+        EXPECT_EQ(tid, camera.tid);
+        EXPECT_THAT(camera.image.shape(), ElementsAre(10 + tid % 3));
+        EXPECT_THAT(std::vector<uint8_t>(camera.image.begin(), camera.image.end()),
+                    ::testing::Each(1));
+    }
+    EXPECT_THROW(client.nextInto(decoder, camera), BindingError);
+
+    ASSERT_TRUE(client.nextInto(decoder, camera));
+    EXPECT_EQ(10005, camera.tid);
+    EXPECT_EQ(10 + 10005 % 3, camera.image.size());
+}
+
+TEST(TestClient, TestBatch) {
+    FakeServer server("tcp://127.0.0.1:12357",
+                      [](uint64_t tid) { return _packTrain(tid, tid < 10006 ? 100 : 50); });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12357");
+    client.setBufferPool(std::make_shared<BufferPool>());
+
+    {
+        auto batch = client.nextBatch(3);
+        ASSERT_EQ(1, batch.size());
+        auto& camera = batch.at("camera");
+        EXPECT_EQ(3, camera.size());
+        auto& image = camera.array.at("image.data");
+        EXPECT_THAT(image.shape(), ElementsAre(3, 100));
+        EXPECT_EQ("uint8_t", image.dtype());
+        EXPECT_TRUE(image.isAligned(BufferPool::alignment()));
+        EXPECT_THAT(image.as<std::vector<uint8_t>>(), ::testing::Each(1));
+
+        auto& tids = camera.metadata.at("timestamp.tid");
+        ASSERT_EQ(3, tids.size());
+        for (std::size_t i = 0; i < 3; ++i) EXPECT_EQ(10000 + i, tids[i].as<uint64_t>());
+        ASSERT_EQ(3, camera.data.at("header.pulseCount").size());
+        EXPECT_EQ(64, camera.data.at("header.pulseCount")[2].as<int>());
+
+        EXPECT_EQ(camera.bytes(), client.bytesInUse());
+        EXPECT_EQ(3, client.trainStats().at("camera").trains);
+    }
+    EXPECT_EQ(0, client.bytesInUse());
+
+    // the request of train 10005 is sent with the last train of the batch
+    auto batch = client.nextBatch(2, {"missing.path"}, true);
+    EXPECT_EQ(2, batch.at("camera").size());
+    EXPECT_TRUE(batch.at("camera").array.empty());
+    EXPECT_EQ(10004, batch.at("camera").metadata.at("timestamp.tid")[1].as<uint64_t>());
+
+    // train 10006 has a smaller array
+    EXPECT_THROW(client.nextBatch(2), BatchError);
+
+    // the stacked rows count against the budget: room for 2 rows and a train
+    std::size_t train_bytes = client.next().at("camera").bytesReceived();
+    client.setMemoryBudget(2 * 50 + train_bytes);
+    {
+        auto limited = client.nextBatch(10);
+        EXPECT_EQ(3, limited.at("camera").size());
+        EXPECT_EQ(limited.at("camera").bytes(), client.bytesInUse());
+    }
+    EXPECT_EQ(0, client.bytesInUse());
+}
+
+TEST(TestClient, TestBatchOwnership) {
+    FakeServer server("tcp://127.0.0.1:12361", [](uint64_t tid) { return _packTrain(tid, 100); });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12361");
+    client.setBufferPool(std::make_shared<BufferPool>());
+
+    NDArray image;
+    MsgpackObject tid;
+    {
+        auto batch = client.nextBatch(2);
+        image = batch.at("camera").array.at("image.data");
+        tid = batch.at("camera").metadata.at("timestamp.tid")[1];
+    }
+    // the stacked buffer and the column are kept by the copies
+    EXPECT_THAT(image.shape(), ElementsAre(2, 100));
+    EXPECT_THAT(image.as<std::vector<uint8_t>>(), ::testing::Each(1));
+    EXPECT_EQ(10001, tid.as<uint64_t>());
+    EXPECT_EQ(200, client.bytesInUse());
+
+    image = NDArray();
+    EXPECT_EQ(0, client.bytesInUse());
+}
+
+TEST(TestClient, TestBatchMissingArray) {
+    // the trains of odd IDs have no array
+    FakeServer server("tcp://127.0.0.1:12359", [](uint64_t tid) {
+        auto frames = _packTrain(tid, 100);
+        if (tid % 2) frames.resize(2);
+        return frames;
+    });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12359");
+
+    // the array is not stacked
+    EXPECT_EQ(2, client.nextBatch(2, {"missing.path"}).at("camera").size());
+
+    EXPECT_THROW(client.nextBatch(2), BatchError);
+}
+
+TEST(TestClient, TestSubSocket) {
+    // publish trains until the test is done, since a subscriber misses the
+    // trains sent before it joins
+    zmq::context_t ctx(1);
+    zmq::socket_t publisher(ctx, ZMQ_PUB);
+    publisher.setsockopt(ZMQ_LINGER, 0);
+    publisher.bind("tcp://127.0.0.1:12356");
+    std::atomic<bool> running(true);
+    std::thread thread([&]() {
+        uint64_t tid = 10000;
+        while (running) {
+            auto frames = _packTrain(tid++, 100);
+            for (std::size_t i = 0; i < frames.size(); ++i) {
+                publisher.send(frames[i].data(), frames[i].size(),
+                               i == frames.size() - 1 ? 0 : ZMQ_SNDMORE);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    Client client(1., SocketType::SUB);
+    EXPECT_EQ(SocketType::SUB, client.socketType());
+    client.connect("tcp://127.0.0.1:12356");
+
+    auto data = client.next();
+    ASSERT_EQ(1, data.size());
+    uint64_t tid = data.at("camera").metadata.at("timestamp.tid").as<uint64_t>();
+
+    TrainHeader header;
+    ASSERT_TRUE(client.nextHeader(header));
+    EXPECT_GT(header.tid, tid);
+    ASSERT_EQ(1, header.source_bytes.size());
+    EXPECT_EQ(header.bytes, header.source_bytes.at("camera"));
+    EXPECT_GT(header.bytes, 100);
+    EXPECT_EQ(2, client.trainStats().at("camera").trains);
+
+    running = false;
+    thread.join();
+}
+
+TEST(TestClient, TestShmRelay) {
+    FakeServer server("tcp://127.0.0.1:12355",
+                      [](uint64_t tid) { return _packTrain(tid, 10 + tid % 3); });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12355");
+
+    std::string name = "/kb_test_relay_" + std::to_string(getpid());
+    ShmRelay relay(name, 4, 1 << 16);
+    ShmReader reader(name, 1.);
+    ShmReader bound_reader(name, 1.);
+
+    StructDecoder<Camera> decoder("camera");
+    Camera camera;
+    for (uint64_t tid = 10000; tid < 10003; ++tid) {
+        ASSERT_TRUE(relay.relayNext(client));
+
+        auto data = reader.next();
+        ASSERT_EQ(1, data.size());
+        EXPECT_EQ(tid, data.at("camera").metadata.at("timestamp.tid").as<uint64_t>());
+        EXPECT_THAT(data.at("camera").array.at("image.data").shape(), ElementsAre(10 + tid % 3));
+
+        ASSERT_TRUE(bound_reader.nextInto(decoder, camera));
+        EXPECT_EQ(tid, camera.tid);
+        EXPECT_EQ(10 + tid % 3, camera.image.size());
+    }
+    EXPECT_EQ(3, relay.publishedTrains());
+    EXPECT_EQ(0, client.bytesInUse());
+}
+
+TEST(TestClient, TestFailover) {
+    FakeServer fallback("tcp://127.0.0.1:12354",
+                        [](uint64_t tid) { return _packTrain(tid, 10); });
+
+    // no server is listening on the primary endpoint
+    Client client(0.1);
+    client.connect("tcp://127.0.0.1:12353");
+    RecoveryOptions options;
+    options.req_relaxed = true;
+    options.max_timeouts = 2;
+    options.reconnect_ivl = 10;
+    options.fallback_endpoints = {"tcp://127.0.0.1:12354"};
+    client.setRecovery(options);
+
+    EXPECT_TRUE(client.next().empty());
+    auto stats = client.recoveryStats();
+    EXPECT_EQ(1, stats.timeouts);
+    EXPECT_EQ(0, stats.reconnections);
+    EXPECT_THAT(stats.endpoints, ElementsAre("tcp://127.0.0.1:12353"));
+
+    EXPECT_TRUE(client.next().empty());
+    stats = client.recoveryStats();
+    EXPECT_EQ(2, stats.timeouts);
+    EXPECT_EQ(1, stats.reconnections);
+    EXPECT_EQ(1, stats.failovers);
+    EXPECT_THAT(stats.endpoints, ElementsAre("tcp://127.0.0.1:12354"));
+
+    auto data = client.next();
+    ASSERT_EQ(1, data.size());
+    stats = client.recoveryStats();
+    EXPECT_GE(stats.last_recovery_time, 0.1);
+    EXPECT_LT(stats.last_recovery_time, 1.);
+    EXPECT_EQ(stats.last_recovery_time, stats.max_recovery_time);
+
+    // the next timeouts rebuild the socket to the primary endpoint again
+    client.setRecovery(RecoveryOptions());
+    EXPECT_THAT(client.recoveryStats().endpoints, ElementsAre("tcp://127.0.0.1:12353"));
+    EXPECT_EQ(2, client.recoveryStats().failovers);
+}
+
+void _freeAndFlag(void* data, void* hint) {
+    std::free(data);
+    *static_cast<bool*>(hint) = true;
+}
+
+TEST(TestClient, TestFrameOwnership) {
+    MultipartMsg mpmsg = _toMultipartMsg(_packTrain(10000, 0));
+    mpmsg.pop_back();
+    mpmsg.pop_back();
+
+    // two arrays whose frames record when they are freed
+    bool freed[2] = {false, false};
+    const char* paths[2] = {"image.data", "image.mask"};
+    for (int i = 0; i < 2; ++i) {
+        msgpack::sbuffer header;
+        msgpack::packer<msgpack::sbuffer> pk(header);
+        pk.pack_map(5);
+        _packKeyValue(pk, "source", std::string("camera"));
+        _packKeyValue(pk, "content", std::string("array"));
+        _packKeyValue(pk, "path", std::string(paths[i]));
+        _packKeyValue(pk, "dtype", std::string("uint16"));
+        _packKeyValue(pk, "shape", std::vector<uint64_t>({50}));
+        mpmsg.emplace_back(header.data(), header.size());
+
+        auto ptr = static_cast<uint16_t*>(std::malloc(100));
+        std::fill(ptr, ptr + 50, static_cast<uint16_t>(i + 1));
+        mpmsg.emplace_back(ptr, 100, _freeAndFlag, &freed[i]);
+    }
+
+    auto tracker = std::make_shared<detail::MemoryTracker>();
+    NDArray image;
+    MsgpackObject sec, pulse_count;
+    {
+        auto train = detail::decodeTrain(mpmsg, nullptr);
+        auto& data = train.at("camera");
+        data.trackMemory(tracker);
+        image = data.array.at("image.data");
+        sec = data.metadata.at("timestamp.sec");
+        pulse_count = data["header.pulseCount"];
+    }
+    // only the frame of the kept array is still alive
+    EXPECT_FALSE(freed[0]);
+    EXPECT_TRUE(freed[1]);
+    EXPECT_EQ(100, tracker->inUse());
+    EXPECT_EQ(std::vector<uint16_t>(50, 1), image.as<std::vector<uint16_t>>());
+    EXPECT_FALSE(sec.as<std::string>().empty());
+    EXPECT_EQ(64, pulse_count.as<int>());
+
+    // the frame can be passed on with the array
+    NDArray moved = std::move(image);
+    image = NDArray();
+    EXPECT_FALSE(freed[0]);
+    moved = NDArray();
+    EXPECT_TRUE(freed[0]);
+    EXPECT_EQ(0, tracker->inUse());
+
+    // the budget of a client counts the frames held by the arrays
+    FakeServer server("tcp://127.0.0.1:12358", [](uint64_t tid) { return _packTrain(tid, 1000); });
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12358");
+    {
+        auto data = client.next();
+        image = data.at("camera").array.at("image.data");
+    }
+    EXPECT_EQ(1000, client.bytesInUse());
+    image = NDArray();
+    EXPECT_EQ(0, client.bytesInUse());
+}
+
+#if defined(KARABO_BRIDGE_WITH_LZ4)
+
+TEST(TestClient, TestCompressedArray) {
+    std::vector<uint16_t> array(20000);
+    for (std::size_t i = 0; i < array.size(); ++i) array[i] = static_cast<uint16_t>(i % 1000);
+    FakeServer server("tcp://127.0.0.1:12349",
+                      [&array](uint64_t) { return _packCompressedTrain(array); });
+
+    Client client(1.);
+    client.connect("tcp://127.0.0.1:12349");
+
+    auto data = client.next();
+    auto& image = data.at("camera").array.at("image.data");
+    EXPECT_EQ("uint16_t", image.dtype());
+    EXPECT_THAT(image.shape(), ElementsAre(2, 10000));
+    EXPECT_THAT(image.as<std::vector<uint16_t>>(), ElementsAreArray(array));
+    EXPECT_EQ(64, data.at("camera")["header.pulseCount"].as<int>());
+
+    // decompress into the buffer pool
+    client.setBufferPool(std::make_shared<BufferPool>());
+    data = client.next();
+    EXPECT_TRUE(data.at("camera").array.at("image.data").isAligned(BufferPool::alignment()));
+    EXPECT_THAT(data.at("camera").array.at("image.data").as<std::vector<uint16_t>>(),
+                ElementsAreArray(array));
+
+    // decompress into a bound view
+    StructDecoder<Camera16> decoder("camera");
+    Camera16 camera;
+    ASSERT_TRUE(client.nextInto(decoder, camera));
+    EXPECT_THAT(camera.image.shape(), ElementsAre(2, 10000));
+    EXPECT_THAT(std::vector<uint16_t>(camera.image.begin(), camera.image.end()),
+                ElementsAreArray(array));
+}
+
+#endif
+
+} // karabo_bridge
@@ -0,0 +1,139 @@
+#include <random>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_compression.hpp"
+
+
+namespace karabo_bridge {
+
+/*
+ * helper functions for unittest
+ */
+
+// raw detector-like data: slowly varying values with noise in the lower bits
+std::vector<uint16_t> _rawData(std::size_t n) {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> noise(0, 15);
+    std::vector<uint16_t> data(n);
+    for (std::size_t i = 0; i < n; ++i) data[i] = static_cast<uint16_t>(5000 + noise(gen));
+    return data;
+}
+
+/*
+ * test cases
+ */
+
+TEST(TestCompression, TestCodecNames) {
+    for (auto codec : {Compression::LZ4, Compression::ZSTD,
+                       Compression::BITSHUFFLE_LZ4, Compression::BITSHUFFLE_ZSTD})
+        EXPECT_EQ(codec, toCompression(toString(codec)));
+    EXPECT_THROW(toCompression("gzip"), CompressionError);
+}
+
+TEST(TestCompression, TestBitshuffle) {
+    const std::size_t n = 64;
+    auto data = _rawData(n);
+
+    std::vector<uint8_t> shuffled(n * 2);
+    detail::bitshuffle(data.data(), shuffled.data(), n, 2);
+
+    // compare with the definition
+    for (std::size_t i = 0; i < n; ++i) {
+        for (std::size_t j = 0; j < 2; ++j) {
+            for (std::size_t k = 0; k < 8; ++k) {
+                int expected = (reinterpret_cast<uint8_t*>(data.data())[2 * i + j] >> k) & 1;
+                int bit = (shuffled[(8 * j + k) * (n / 8) + i / 8] >> (i % 8)) & 1;
+                ASSERT_EQ(expected, bit);
+            }
+        }
+    }
+
+    std::vector<uint16_t> unshuffled(n);
+    detail::bitunshuffle(shuffled.data(), unshuffled.data(), n, 2);
+    EXPECT_EQ(data, unshuffled);
+}
+
+TEST(TestCompression, TestBlockSize) {
+    // rejected before any block is decompressed, so that no codec is needed
+    std::vector<char> compressed(compressionHeaderSize() + 4, '\0');
+    detail::writeUint64BE(&compressed[0], 64);
+    std::vector<uint16_t> decompressed(32);
+    for (uint32_t block_size : {0u, 128u, 0xffffffe0u}) {
+        detail::writeUint32BE(&compressed[8], block_size);
+        for (auto codec : {Compression::LZ4, Compression::BITSHUFFLE_ZSTD}) {
+            EXPECT_THROW(decompressArray(compressed.data(), compressed.size(), decompressed.data(),
+                                         64, 2, codec), CompressionError) << block_size;
+        }
+    }
+    // not a multiple of 8 elements with bitshuffle
+    detail::writeUint32BE(&compressed[8], 24);
+    EXPECT_THROW(decompressArray(compressed.data(), compressed.size(), decompressed.data(),
+                                 64, 2, Compression::BITSHUFFLE_LZ4), CompressionError);
+
+    detail::BlockLayout layout(20, 2, 16, true);
+    EXPECT_EQ(1, layout.n_blocks);
+    EXPECT_EQ(4, layout.leftover_bytes);
+    // a single block of 8 elements if the array is smaller
+    EXPECT_NO_THROW(detail::BlockLayout(6, 2, 16, true));
+    EXPECT_THROW(detail::BlockLayout(6, 2, 32, true), CompressionError);
+}
+
+#if defined(KARABO_BRIDGE_WITH_LZ4) && defined(KARABO_BRIDGE_WITH_ZSTD)
+
+TEST(TestCompression, TestRoundTrip) {
+    ThreadPool pool(4);
+    // the number of elements is not a multiple of 8 nor of the block size
+    auto data = _rawData(100003);
+    std::size_t nbytes = data.size() * sizeof(uint16_t);
+
+    for (auto codec : {Compression::LZ4, Compression::ZSTD,
+                       Compression::BITSHUFFLE_LZ4, Compression::BITSHUFFLE_ZSTD}) {
+        auto compressed = compressArray(data.data(), nbytes, sizeof(uint16_t), codec, 4096, pool);
+        if (detail::isBitshuffled(codec)) {
+            EXPECT_LT(compressed.size(), nbytes / 2);
+        }
+
+        std::vector<uint16_t> decompressed(data.size());
+        decompressArray(compressed.data(), compressed.size(), decompressed.data(), nbytes,
+                        sizeof(uint16_t), codec, pool);
+        EXPECT_EQ(data, decompressed) << toString(codec);
+    }
+
+    // the block size is reduced to the array
+    auto compressed = compressArray(data.data(), 100, sizeof(uint16_t), Compression::BITSHUFFLE_LZ4);
+    EXPECT_EQ(96, detail::readUint32BE(&compressed[8]));
+    compressed = compressArray(data.data(), 100, sizeof(uint16_t), Compression::LZ4);
+    EXPECT_EQ(100, detail::readUint32BE(&compressed[8]));
+
+    // empty array
+    compressed = compressArray(nullptr, 0, 4, Compression::BITSHUFFLE_LZ4);
+    EXPECT_EQ(compressionHeaderSize(), compressed.size());
+    decompressArray(compressed.data(), compressed.size(), nullptr, 0, 4, Compression::BITSHUFFLE_LZ4);
+}
+
+TEST(TestCompression, TestCorruptedData) {
+    auto data = _rawData(10000);
+    std::size_t nbytes = data.size() * sizeof(uint16_t);
+    auto compressed = compressArray(data.data(), nbytes, 2, Compression::BITSHUFFLE_LZ4, 1024);
+    std::vector<uint16_t> decompressed(data.size());
+
+    // wrong size
+    EXPECT_THROW(decompressArray(compressed.data(), compressed.size(), decompressed.data(),
+                                 nbytes - 2, 2, Compression::BITSHUFFLE_LZ4), CompressionError);
+    // truncated
+    EXPECT_THROW(decompressArray(compressed.data(), compressed.size() - 10, decompressed.data(),
+                                 nbytes, 2, Compression::BITSHUFFLE_LZ4), CompressionError);
+    EXPECT_THROW(decompressArray(compressed.data(), 5, decompressed.data(),
+                                 nbytes, 2, Compression::BITSHUFFLE_LZ4), CompressionError);
+    // corrupted block
+    compressed[compressionHeaderSize() + 4] ^= 0x5a;
+    compressed[compressionHeaderSize() + 5] ^= 0xff;
+    EXPECT_THROW(decompressArray(compressed.data(), compressed.size(), decompressed.data(),
+                                 nbytes, 2, Compression::BITSHUFFLE_LZ4), CompressionError);
+}
+
+#endif
+
+} // karabo_bridge
@@ -63,6 +63,36 @@ TEST(TestKbData, TestGeneral) {
     EXPECT_EQ(data.end(), it);
 }
 
+TEST(TestKbData, TestMemoryTracking) {
+    auto tracker = std::make_shared<detail::MemoryTracker>();
+
+    {
+        kb_data data;
+        data.appendMsg(zmq::message_t(100));
+        data.appendMsg(zmq::message_t(20));
+        data.trackMemory(tracker);
+        EXPECT_EQ(120, tracker->inUse());
+
+        // the charged bytes are moved along with the data
+        kb_data moved(std::move(data));
+        EXPECT_EQ(120, tracker->inUse());
+
+        kb_data other;
+        other.appendMsg(zmq::message_t(30));
+        other.trackMemory(tracker);
+        EXPECT_EQ(150, tracker->inUse());
+        EXPECT_EQ(150, tracker->peak());
+
+        kb_data empty_data;
+        other.swap(empty_data);
+    }
+    EXPECT_EQ(0, tracker->inUse());
+    EXPECT_EQ(150, tracker->peak());
+
+    tracker->resetPeak();
+    EXPECT_EQ(0, tracker->peak());
+}
+
 TEST(TestNdarray, TestGeneral) {
     uint16_t a[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
 
@@ -86,6 +116,51 @@ TEST(TestNdarray, TestGeneral) {
     EXPECT_THROW((array_uint16.as<std::array<uint16_t, 13>>()), CastErrorNDArray);
 }
 
+TEST(TestNdarray, TestDtypeAndShape) {
+    uint16_t a[12] = {};
+    NDArray array((void *) a, {2, 2, 3}, DType::UINT16);
+    EXPECT_EQ(DType::UINT16, array.dtypeId());
+    EXPECT_EQ("uint16_t", array.dtype());
+    EXPECT_THAT(array.shape(), ElementsAre(2, 2, 3));
+    EXPECT_EQ(3, array.shape()[2]);
+    EXPECT_EQ(12, array.size());
+    std::vector<std::size_t> shape = array.shape();
+    EXPECT_EQ(shape, array.shape());
+
+    // the name of an unrecognized dtype is kept
+    NDArray array_c64((void *) a, {3}, "complex64");
+    EXPECT_EQ(DType::OTHER, array_c64.dtypeId());
+    EXPECT_EQ("complex64", array_c64.dtype());
+    EXPECT_THROW(array_c64.data<uint16_t>(), TypeMismatchErrorNDArray);
+
+    std::string python_f16 = "float16";
+    toCppTypeString(python_f16);
+    NDArray array_f16((void *) a, {12}, python_f16);
+    EXPECT_EQ(DType::FLOAT16, array_f16.dtypeId());
+    EXPECT_EQ("float16", array_f16.dtype());
+    EXPECT_EQ(2, itemSize(array_f16.dtypeId()));
+    EXPECT_EQ(12, array_f16.as<std::vector<Float16>>().size());
+    EXPECT_THROW(array_f16.data<uint16_t>(), TypeMismatchErrorNDArray);
+
+    for (std::size_t i = 0; i < static_cast<std::size_t>(DType::OTHER); ++i) {
+        auto dtype = static_cast<DType>(i);
+        EXPECT_EQ(dtype, toDType(dtypeName(dtype)));
+    }
+    EXPECT_EQ(2, itemSize(DType::INT16));
+    EXPECT_EQ(0, itemSize(DType::STRING));
+
+    // shapes above the inline rank
+    std::vector<std::size_t> dims {1, 2, 1, 2, 1, 2, 1, 2, 3};
+    Shape large(dims);
+    EXPECT_EQ(9, large.size());
+    EXPECT_EQ(48, large.numel());
+    EXPECT_TRUE(large == dims);
+    EXPECT_TRUE(Shape(large) == large);
+    EXPECT_TRUE(Shape({1, 2}) != large);
+    EXPECT_TRUE(Shape().empty());
+    EXPECT_EQ(1, Shape().numel());
+}
+
 TEST(TestMsgpackObject, TestGeneral) {
     auto oh_uint = _packObject_t<std::size_t>(2147483648);
     auto obj_uint = oh_uint.get().as<MsgpackObject>();
@@ -156,4 +231,63 @@ TEST(TestMsgpackObject, TestGeneral) {
     EXPECT_NO_THROW(obj_bin.as<std::vector<unsigned char>>());
 }
 
-} // karabo_bridge
\ No newline at end of file
+TEST(TestMsgpackObject, TestView) {
+    std::vector<int> vec_int {1, 2, 300, 4};
+    auto oh_int = _packObject_t(vec_int);
+    auto obj_int = oh_int.get().as<MsgpackObject>();
+    MsgpackObject early_copy = obj_int;
+
+    auto view = obj_int.view<int>();
+    EXPECT_EQ(4, view.size());
+    EXPECT_THAT(view, ElementsAreArray(vec_int));
+    // cached
+    EXPECT_EQ(view.data(), obj_int.view<int>().data());
+    MsgpackObject copy = obj_int;
+    EXPECT_EQ(view.data(), copy.view<int>().data());
+    // a copy made before the conversion has its own cache
+    EXPECT_THAT(early_copy.view<int>(), ElementsAreArray(vec_int));
+    EXPECT_NE(view.data(), early_copy.view<int>().data());
+
+    auto view_d = obj_int.view<double>();
+    EXPECT_THAT(view_d, ElementsAre(1., 2., 300., 4.));
+    // the elements of the earlier view are kept
+    EXPECT_THAT(view, ElementsAreArray(vec_int));
+    EXPECT_NE(static_cast<const void*>(view.data()), obj_int.view<int>().data());
+
+    // out of range
+    EXPECT_THROW(obj_int.view<uint8_t>(), CastErrorMsgpackObject);
+    EXPECT_THROW(obj_int.view<bool>(), CastErrorMsgpackObject);
+
+    std::vector<int64_t> vec_neg {-1, -2, -128};
+    auto oh_neg = _packObject_t(vec_neg);
+    auto obj_neg = oh_neg.get().as<MsgpackObject>();
+    EXPECT_THAT(obj_neg.view<int8_t>(), ElementsAre(-1, -2, -128));
+    EXPECT_THROW(obj_neg.view<uint32_t>(), CastErrorMsgpackObject);
+
+    // mixed encodings
+    std::vector<int64_t> vec_mixed {-1, 2, -3};
+    auto oh_mixed = _packObject_t(vec_mixed);
+    auto obj_mixed = oh_mixed.get().as<MsgpackObject>();
+    EXPECT_THAT(obj_mixed.view<int16_t>(), ElementsAre(-1, 2, -3));
+    EXPECT_THAT(obj_mixed.view<float>(), ElementsAre(-1.f, 2.f, -3.f));
+
+    std::vector<double> vec_f {0.5, 1.5};
+    auto oh_f = _packObject_t(vec_f);
+    auto obj_f = oh_f.get().as<MsgpackObject>();
+    EXPECT_THAT(obj_f.view<float>(), ElementsAre(0.5f, 1.5f));
+    EXPECT_THROW(obj_f.view<int>(), CastErrorMsgpackObject);
+
+    std::vector<bool> vec_b {true, false, true};
+    auto oh_b = _packObject_t(vec_b);
+    auto obj_b = oh_b.get().as<MsgpackObject>();
+    EXPECT_THAT(obj_b.view<bool>(), ElementsAre(true, false, true));
+    EXPECT_THROW(obj_b.view<int>(), CastErrorMsgpackObject);
+
+    auto oh_empty = _packObject_t(std::vector<int>());
+    EXPECT_TRUE(oh_empty.get().as<MsgpackObject>().view<int>().empty());
+
+    auto oh_scalar = _packObject_t<int>(1);
+    EXPECT_THROW(oh_scalar.get().as<MsgpackObject>().view<int>(), CastErrorMsgpackObject);
+}
+
+} // karabo_bridge
@@ -0,0 +1,126 @@
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_client.hpp"
+
+
+namespace karabo_bridge {
+
+TEST(TestFloat16, TestScalar) {
+    EXPECT_EQ(0x3c00, Float16(1.f).bits());
+    EXPECT_EQ(0xc000, Float16(-2.f).bits());
+    EXPECT_EQ(0x2e66, Float16(0.1f).bits());
+    EXPECT_EQ(0x7bff, Float16(65504.f).bits());
+    EXPECT_EQ(0x7bff, Float16(65519.f).bits());
+    EXPECT_EQ(0x7c00, Float16(65520.f).bits());
+    EXPECT_EQ(0xfc00, Float16(-std::numeric_limits<float>::infinity()).bits());
+    EXPECT_EQ(0x0001, Float16(std::ldexp(1.f, -24)).bits());
+    EXPECT_EQ(0x0000, Float16(std::ldexp(1.f, -25)).bits());
+    EXPECT_EQ(0x0001, Float16(std::ldexp(1.5f, -25)).bits());
+    EXPECT_EQ(0x8000, Float16(-0.f).bits());
+    // ties are rounded to the even mantissa
+    EXPECT_EQ(0x3c00, Float16(1.f + std::ldexp(1.f, -11)).bits());
+    EXPECT_EQ(0x3c02, Float16(1.f + 3 * std::ldexp(1.f, -11)).bits());
+    EXPECT_TRUE(std::isnan(static_cast<float>(Float16(std::numeric_limits<float>::quiet_NaN()))));
+
+    EXPECT_EQ(1.f, static_cast<float>(Float16::fromBits(0x3c00)));
+    EXPECT_EQ(std::ldexp(1.f, -24), static_cast<float>(Float16::fromBits(0x0001)));
+    EXPECT_EQ(65504.f, static_cast<float>(Float16::fromBits(0x7bff)));
+    EXPECT_TRUE(std::isinf(static_cast<float>(Float16::fromBits(0x7c00))));
+}
+
+TEST(TestFloat16, TestExhaustive) {
+    // every half-precision value is exact in float and converts back
+    for (uint32_t bits = 0; bits <= 0xffff; ++bits) {
+        auto h = static_cast<uint16_t>(bits);
+        float f = detail::halfBitsToFloat(h);
+        float g = Float16::fromBits(h);
+        EXPECT_EQ(0, std::memcmp(&f, &g, sizeof f)) << bits;
+        if ((h & 0x7c00) == 0x7c00 && (h & 0x3ff)) {
+            EXPECT_TRUE(std::isnan(f)) << bits;
+            // a signaling NaN is quieted
+            EXPECT_EQ(h | 0x200, detail::floatToHalfBits(f)) << bits;
+        } else {
+            EXPECT_EQ(h, detail::floatToHalfBits(f)) << bits;
+        }
+    }
+}
+
+TEST(TestFloat16, TestBulk) {
+    ThreadPool pool(3);
+    // an odd size to exercise the tails of the vector loops
+    const std::size_t n = 3 * (1 << 16) + 13;
+    std::vector<float> src(n);
+    uint32_t state = 7;
+    for (auto& v : src) {
+        state = state * 1664525u + 1013904223u;
+        v = std::ldexp(static_cast<float>(state >> 8) / (1 << 24) - 0.5f, static_cast<int>(state % 40) - 25);
+    }
+    src[0] = std::numeric_limits<float>::infinity();
+    src[1] = 1e6f;
+
+    std::vector<Float16> half(n);
+    floatToHalf(src.data(), n, half.data(), pool);
+    std::vector<float> dst(n);
+    halfToFloat(half.data(), n, dst.data(), pool);
+    for (std::size_t i = 0; i < n; ++i) {
+        ASSERT_EQ(detail::floatToHalfBits(src[i]), half[i].bits()) << i;
+        float expected = detail::halfBitsToFloat(half[i].bits());
+        ASSERT_EQ(0, std::memcmp(&expected, &dst[i], sizeof expected)) << i;
+    }
+    EXPECT_TRUE(std::isinf(dst[1]));
+}
+
+TEST(TestFloat16, TestNDArray) {
+    std::vector<float> values {0.5f, -1.f, 3.f, 1024.f, 0.25f, 7.f};
+    NDArray array(values.data(), {2, 3}, DType::FLOAT);
+
+    std::vector<Float16> half(values.size());
+    auto array_f16 = toFloat16(array, half.data());
+    EXPECT_EQ(DType::FLOAT16, array_f16.dtypeId());
+    EXPECT_THAT(array_f16.shape(), ::testing::ElementsAre(2, 3));
+    EXPECT_EQ(0x3800, array_f16.data<Float16>()[0].bits());
+
+    std::vector<float> back(values.size());
+    auto array_f32 = toFloat32(array_f16, back.data());
+    EXPECT_EQ(DType::FLOAT, array_f32.dtypeId());
+    EXPECT_EQ(values, back);
+    EXPECT_EQ(values, array_f32.as<std::vector<float>>());
+
+    std::vector<uint16_t> ints(6);
+    NDArray array_u16(ints.data(), {6}, DType::UINT16);
+    EXPECT_THROW(toFloat32(array_u16, back.data()), TypeMismatchErrorNDArray);
+    EXPECT_THROW(toFloat16(array_u16, half.data()), TypeMismatchErrorNDArray);
+}
+
+TEST(TestFloat16, TestDecode) {
+    std::vector<Float16> half {Float16(1.5f), Float16(-2.f)};
+    msgpack::sbuffer header;
+    msgpack::packer<msgpack::sbuffer> pk(header);
+    pk.pack_map(5);
+    pk.pack(std::string("source"));
+    pk.pack(std::string("source"));
+    pk.pack(std::string("content"));
+    pk.pack(std::string("array"));
+    pk.pack(std::string("path"));
+    pk.pack(std::string("image.data"));
+    pk.pack(std::string("dtype"));
+    pk.pack(std::string("float16"));
+    pk.pack(std::string("shape"));
+    pk.pack(std::vector<std::size_t>{2});
+
+    MultipartMsg mpmsg;
+    mpmsg.emplace_back(header.data(), header.size());
+    mpmsg.emplace_back(half.data(), half.size() * sizeof(Float16));
+    auto train = detail::decodeTrain(mpmsg, nullptr);
+    auto& array = train.at("source").array.at("image.data");
+    EXPECT_EQ(DType::FLOAT16, array.dtypeId());
+    EXPECT_EQ(-2.f, static_cast<float>(array.data<Float16>()[1]));
+}
+
+} // karabo_bridge
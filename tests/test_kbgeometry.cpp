@@ -0,0 +1,178 @@
+#include <numeric>
+#include <sstream>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_geometry.hpp"
+
+
+namespace karabo_bridge {
+
+namespace {
+
+// Two modules of 4 x 6 pixels, each split into two tiles of 2 x 6 pixels.
+// Module 0 is unrotated, module 1 is rotated by 90 degrees and placed to
+// the right with a gap of one column.
+std::vector<TileGeometry> _tiles() {
+    std::vector<TileGeometry> tiles;
+    for (std::size_t i = 0; i < 2; ++i) {
+        TileGeometry t;
+        t.module = 0;
+        t.min_ss = 2 * i;
+        t.max_ss = 2 * i + 1;
+        t.min_fs = 0;
+        t.max_fs = 5;
+        t.corner_x = 0.;
+        t.corner_y = 2. * i;
+        tiles.push_back(t);
+    }
+    for (std::size_t i = 0; i < 2; ++i) {
+        TileGeometry t;
+        t.module = 1;
+        t.min_ss = 2 * i;
+        t.max_ss = 2 * i + 1;
+        t.min_fs = 0;
+        t.max_fs = 5;
+        // fs along -y, ss along +x
+        t.corner_x = 7. + 2. * i;
+        t.corner_y = 6.;
+        t.ss_x = 1.;
+        t.ss_y = 0.;
+        t.fs_x = 0.;
+        t.fs_y = -1.;
+        tiles.push_back(t);
+    }
+    return tiles;
+}
+
+} // namespace
+
+TEST(TestGeometry, TestAssemble) {
+    DetectorGeometry geom(_tiles(), {2, 4, 6});
+    EXPECT_THAT(geom.imageShape(), ::testing::ElementsAre(6, 11));
+    EXPECT_EQ(0., geom.origin().first);
+    EXPECT_EQ(0., geom.origin().second);
+
+    const std::size_t n_pulses = 3;
+    std::vector<int32_t> src(n_pulses * 2 * 4 * 6);
+    std::iota(src.begin(), src.end(), 1);
+    std::vector<int32_t> dst(n_pulses * 6 * 11, 0);
+
+    ThreadPool pool(3);
+    geom.assemble(src.data(), n_pulses, dst.data(), int32_t(-1), pool);
+
+    for (std::size_t p = 0; p < n_pulses; ++p) {
+        const int32_t* s = &src[p * 48];
+        const int32_t* d = &dst[p * 66];
+        for (std::size_t row = 0; row < 6; ++row) {
+            for (std::size_t col = 0; col < 11; ++col) {
+                int32_t expected = -1;
+                if (row < 4 && col < 6) expected = s[row * 6 + col]; // module 0
+                else if (col >= 7) expected = s[24 + (col - 7) * 6 + (5 - row)]; // module 1
+                ASSERT_EQ(expected, d[row * 11 + col]) << p << " " << row << " " << col;
+            }
+        }
+    }
+
+    EXPECT_THROW(DetectorGeometry(_tiles(), {2, 4, 5}), GeometryError);
+    EXPECT_THROW(DetectorGeometry(_tiles(), {1, 4, 6}), GeometryError);
+}
+
+TEST(TestGeometry, TestCrystFEL) {
+    std::stringstream ss;
+    ss << "; a comment\n"
+       << "clen = 0.119\n"
+       << "p0a0/dim1 = 0\n"
+       << "p0a0/min_fs = 0\n"
+       << "p0a0/max_fs = 5\n"
+       << "p0a0/min_ss = 0\n"
+       << "p0a0/max_ss = 3\n"
+       << "p0a0/fs = +1.0x +0.0y\n"
+       << "p0a0/ss = +y\n"
+       << "p0a0/corner_x = 0.0\n"
+       << "p0a0/corner_y = 0.0 ; another comment\n"
+       << "p1a0/min_fs = 0\n"
+       << "p1a0/max_fs = 5\n"
+       << "p1a0/min_ss = 4\n" // stacked modules
+       << "p1a0/max_ss = 7\n"
+       << "p1a0/fs = -y\n"
+       << "p1a0/ss = x\n"
+       << "p1a0/corner_x = 7\n"
+       << "p1a0/corner_y = 6\n"
+       << "bad_region/min_fs = 0\n"
+       << "rigid_group_q0 = p0a0\n";
+
+    DetectorGeometry geom = DetectorGeometry::fromCrystFEL(ss, {2, 4, 6});
+    ASSERT_EQ(2, geom.tiles().size());
+    auto& t = geom.tiles()[1];
+    EXPECT_EQ(1, t.module);
+    EXPECT_EQ(0, t.min_ss);
+    EXPECT_EQ(3, t.max_ss);
+    EXPECT_DOUBLE_EQ(1., t.ss_x);
+    EXPECT_DOUBLE_EQ(0., t.ss_y);
+    EXPECT_DOUBLE_EQ(0., t.fs_x);
+    EXPECT_DOUBLE_EQ(-1., t.fs_y);
+    EXPECT_THAT(geom.imageShape(), ::testing::ElementsAre(6, 11));
+
+    // the same placement as the tiles
+    std::vector<float> src(2 * 4 * 6);
+    std::iota(src.begin(), src.end(), 0.f);
+    NDArray array(src.data(), {2, 4, 6}, "float");
+    std::vector<float> dst1(66), dst2(66);
+    NDArray image = geom.assemble(array, dst1.data(), std::nanf(""));
+    EXPECT_THAT(image.shape(), ::testing::ElementsAre(6, 11));
+    DetectorGeometry(_tiles(), {2, 4, 6}).assemble(array, dst2.data(), std::nanf(""));
+    for (std::size_t i = 0; i < 66; ++i) {
+        if (std::isnan(dst1[i])) EXPECT_TRUE(std::isnan(dst2[i]));
+        else EXPECT_EQ(dst1[i], dst2[i]);
+    }
+
+    std::vector<double> dst3(66);
+    EXPECT_THROW(geom.assemble(array, dst3.data()), TypeMismatchErrorNDArray);
+    NDArray wrong(src.data(), {1, 8, 6}, "float");
+    EXPECT_THROW(geom.assemble(wrong, dst1.data()), GeometryError);
+
+    std::stringstream missing("p0a0/min_fs = 0\n");
+    EXPECT_THROW(DetectorGeometry::fromCrystFEL(missing, {1, 4, 6}), GeometryError);
+}
+
+TEST(TestGeometry, TestCrystFELDefaults) {
+    std::stringstream ss;
+    ss << "dim0 = %\n"
+       << "dim1 = modno\n"
+       << "dim2 = ss\n"
+       << "dim3 = fs\n"
+       << "min_fs = 0\n"
+       << "max_fs = 5\n"
+       << "min_ss = 0\n"
+       << "max_ss = 3\n"
+       << "fs = +x\n"
+       << "ss = +y\n"
+       << "badpanel/dim1 = 1\n" // a panel despite its name
+       << "badpanel/corner_x = 0\n"
+       << "badpanel/corner_y = 0\n"
+       << "fs = -x\n" // only applies to the following panels
+       << "p0a0/dim1 = 0\n"
+       << "p0a0/corner_x = 5\n"
+       << "p0a0/corner_y = 4\n"
+       << "bad_region/min_fs = 0\n";
+
+    DetectorGeometry geom = DetectorGeometry::fromCrystFEL(ss, {2, 4, 6});
+    ASSERT_EQ(2, geom.tiles().size());
+    auto& t0 = geom.tiles()[0];
+    EXPECT_EQ(1, t0.module);
+    EXPECT_EQ(5, t0.max_fs);
+    EXPECT_DOUBLE_EQ(1., t0.fs_x);
+    auto& t1 = geom.tiles()[1];
+    EXPECT_EQ(0, t1.module);
+    EXPECT_EQ(3, t1.max_ss);
+    EXPECT_DOUBLE_EQ(-1., t1.fs_x);
+    EXPECT_DOUBLE_EQ(1., t1.ss_y);
+
+    // the module index is ambiguous
+    std::stringstream ambiguous(ss.str() + "p0a0/dim2 = 1\n");
+    EXPECT_THROW(DetectorGeometry::fromCrystFEL(ambiguous, {2, 4, 6}), GeometryError);
+}
+
+} // karabo_bridge
@@ -0,0 +1,235 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_client.hpp"
+
+
+namespace karabo_bridge {
+
+namespace {
+
+using Bytes = std::vector<char>;
+
+Bytes _toBytes(const msgpack::sbuffer& buffer) { return Bytes(buffer.data(), buffer.data() + buffer.size()); }
+
+Bytes _arrayHeader(const std::string& source, const std::string& path, const std::string& dtype,
+                   const std::vector<std::size_t>& shape) {
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(buffer);
+    pk.pack_map(5);
+    pk.pack(std::string("source"));
+    pk.pack(source);
+    pk.pack(std::string("content"));
+    pk.pack(std::string("array"));
+    pk.pack(std::string("path"));
+    pk.pack(path);
+    pk.pack(std::string("dtype"));
+    pk.pack(dtype);
+    pk.pack(std::string("shape"));
+    pk.pack(shape);
+    return _toBytes(buffer);
+}
+
+// Headers of various layouts, including fields which are skipped.
+std::vector<Bytes> _corpus() {
+    std::vector<Bytes> corpus;
+    corpus.push_back(_arrayHeader("SPB_DET_AGIPD1M-1/DET/detector", "image.data", "float32", {64, 16, 512, 128}));
+    corpus.push_back(_arrayHeader("", "", "uint16", {}));
+
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(buffer);
+    pk.pack_map(3);
+    pk.pack(std::string("source"));
+    pk.pack(std::string("SA1_XTD2_XGM/DOOCS/MAIN"));
+    pk.pack(std::string("content"));
+    pk.pack(std::string("msgpack"));
+    pk.pack(std::string("metadata"));
+    pk.pack_map(5);
+    pk.pack(std::string("source"));
+    pk.pack(std::string("SA1_XTD2_XGM/DOOCS/MAIN"));
+    pk.pack(std::string("timestamp"));
+    pk.pack(1.5e9);
+    pk.pack(std::string("timestamp.frac"));
+    pk.pack(std::string("100000000000000000"));
+    pk.pack(std::string("ignored"));
+    pk.pack(std::vector<int>{-1, 70000, -70000});
+    pk.pack(std::string("timestamp.tid"));
+    pk.pack(uint64_t(10000000000));
+    corpus.push_back(_toBytes(buffer));
+
+    buffer.clear();
+    pk.pack_map(7);
+    pk.pack(std::string("content"));
+    pk.pack(std::string("compressed-array"));
+    pk.pack(std::string("extra"));
+    pk.pack_map(2);
+    pk.pack(std::string("bin"));
+    pk.pack_bin(3);
+    pk.pack_bin_body("abc", 3);
+    pk.pack(std::string("nested"));
+    pk.pack(std::vector<std::vector<double>>{{1., 2.}, {}});
+    pk.pack(std::string("source"));
+    pk.pack(std::string(300, 's'));
+    pk.pack(std::string("path"));
+    pk.pack(std::string("data.adc"));
+    pk.pack(std::string("dtype"));
+    pk.pack(std::string("int64"));
+    pk.pack(std::string("shape"));
+    pk.pack(std::vector<std::size_t>{70000, 3});
+    pk.pack(std::string("compression"));
+    pk.pack(std::string("bitshuffle-zstd"));
+    corpus.push_back(_toBytes(buffer));
+    return corpus;
+}
+
+// Check the parsed fields against the generic msgpack decoding.
+void _checkAgainstGeneric(const Bytes& bytes, const HeaderFields& fields) {
+    msgpack::object_handle oh;
+    ASSERT_NO_THROW(msgpack::unpack(oh, bytes.data(), bytes.size()));
+    const msgpack::object& obj = oh.get();
+    ASSERT_EQ(msgpack::type::MAP, obj.type);
+
+    std::vector<std::pair<const char*, const StringRef*>> strings {
+        {"source", &fields.source}, {"content", &fields.content}, {"path", &fields.path},
+        {"dtype", &fields.dtype}, {"compression", &fields.compression}
+    };
+    for (auto& s : strings) {
+        const msgpack::object* v = detail::findKey(obj, s.first);
+        ASSERT_EQ(v == nullptr, s.second->isNull()) << s.first;
+        if (v) {
+            EXPECT_EQ(v->as<std::string>(), s.second->str()) << s.first;
+        }
+    }
+
+    const msgpack::object* shape = detail::findKey(obj, "shape");
+    ASSERT_EQ(shape != nullptr, fields.has_shape);
+    if (shape) {
+        auto expected = shape->as<std::vector<unsigned int>>();
+        EXPECT_EQ(std::vector<std::size_t>(expected.begin(), expected.end()),
+                  std::vector<std::size_t>(fields.shape.begin(), fields.shape.begin() + fields.ndim));
+    }
+
+    const msgpack::object* metadata = detail::findKey(obj, "metadata");
+    const msgpack::object* tid = metadata ? detail::findKey(*metadata, "timestamp.tid") : nullptr;
+    bool has_tid = tid && tid->type == msgpack::type::POSITIVE_INTEGER;
+    ASSERT_EQ(has_tid, fields.has_tid);
+    if (has_tid) {
+        EXPECT_EQ(tid->via.u64, fields.tid);
+    }
+}
+
+} // namespace
+
+TEST(TestHeader, TestParse) {
+    auto bytes = _arrayHeader("source", "image.data", "uint16", {2, 3});
+    HeaderFields fields;
+    ASSERT_TRUE(parseHeader(bytes.data(), bytes.size(), fields));
+    EXPECT_TRUE(fields.source == "source");
+    EXPECT_TRUE(fields.content == "array");
+    EXPECT_TRUE(fields.path == std::string("image.data"));
+    EXPECT_EQ(DType::UINT16, detail::numpyDType(fields.dtype));
+    EXPECT_TRUE(fields.compression.isNull());
+    ASSERT_EQ(2, fields.ndim);
+    EXPECT_EQ(2, fields.shape[0]);
+    EXPECT_EQ(3, fields.shape[1]);
+    EXPECT_FALSE(fields.has_tid);
+
+    for (auto& header : _corpus()) {
+        ASSERT_TRUE(parseHeader(header.data(), header.size(), fields));
+        _checkAgainstGeneric(header, fields);
+    }
+
+    // layouts left to the generic path
+    bytes = _arrayHeader("source", "image.data", "uint16", {1, 1, 1, 1, 1, 1, 1, 1, 1});
+    EXPECT_FALSE(parseHeader(bytes.data(), bytes.size(), fields));
+    bytes = _arrayHeader("source", "image.data", "uint16", {1ul << 33});
+    EXPECT_FALSE(parseHeader(bytes.data(), bytes.size(), fields));
+    bytes.push_back('\0');
+    EXPECT_FALSE(parseHeader(bytes.data(), bytes.size(), fields));
+
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(buffer);
+    pk.pack_map(2);
+    pk.pack(std::string("source"));
+    pk.pack(std::string("a"));
+    pk.pack(std::string("source"));
+    pk.pack(std::string("b"));
+    EXPECT_FALSE(parseHeader(buffer.data(), buffer.size(), fields));
+
+    buffer.clear();
+    pk.pack_map(1);
+    pk.pack(std::string("source"));
+    pk.pack(1);
+    EXPECT_FALSE(parseHeader(buffer.data(), buffer.size(), fields));
+
+    buffer.clear();
+    pk.pack(std::vector<int>{1});
+    EXPECT_FALSE(parseHeader(buffer.data(), buffer.size(), fields));
+    EXPECT_FALSE(parseHeader(buffer.data(), 0, fields));
+}
+
+TEST(TestHeader, TestFuzz) {
+    uint32_t state = 2024;
+    auto random = [&state]() {
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    };
+
+    HeaderFields fields;
+    for (auto& header : _corpus()) {
+        // a truncated object is never complete
+        for (std::size_t n = 0; n < header.size(); ++n) {
+            Bytes truncated(header.begin(), header.begin() + n);
+            EXPECT_FALSE(parseHeader(truncated.data(), truncated.size(), fields)) << n;
+        }
+
+        for (int i = 0; i < 3000; ++i) {
+            Bytes mutated = header;
+            std::size_t n_changes = 1 + random() % 3;
+            for (std::size_t k = 0; k < n_changes; ++k) {
+                std::size_t pos = random() % mutated.size();
+                switch (random() % 3) {
+                    case 0: mutated[pos] = static_cast<char>(random()); break;
+                    case 1: mutated[pos] ^= static_cast<char>(1 << (random() % 8)); break;
+                    default: mutated.resize(pos + 1);
+                }
+            }
+            if (parseHeader(mutated.data(), mutated.size(), fields)) _checkAgainstGeneric(mutated, fields);
+        }
+    }
+}
+
+TEST(TestHeader, TestDecodeFallback) {
+    std::vector<uint16_t> data(9, 7);
+    MultipartMsg mpmsg;
+    // parsed without allocation
+    auto header = _arrayHeader("source", "a", "uint16", {3, 3});
+    mpmsg.emplace_back(header.data(), header.size());
+    mpmsg.emplace_back(data.data(), data.size() * sizeof(uint16_t));
+    // unknown dtype and rank above 8, which are decoded by the generic path
+    header = _arrayHeader("source", "b", "complex64", {9});
+    mpmsg.emplace_back(header.data(), header.size());
+    mpmsg.emplace_back(data.data(), data.size() * sizeof(uint16_t));
+    header = _arrayHeader("source", "c", "int16", {1, 1, 1, 1, 1, 1, 1, 1, 9});
+    mpmsg.emplace_back(header.data(), header.size());
+    mpmsg.emplace_back(data.data(), data.size() * sizeof(uint16_t));
+
+    EXPECT_EQ("source", detail::peekTrainHeader(mpmsg).sources.begin()->first);
+
+    auto train = detail::decodeTrain(mpmsg, nullptr);
+    ASSERT_EQ(1, train.count("source"));
+    auto& arrays = train.at("source").array;
+    ASSERT_EQ(3, arrays.size());
+    EXPECT_EQ("uint16_t", arrays.at("a").dtype());
+    EXPECT_THAT(arrays.at("a").shape(), ::testing::ElementsAre(3, 3));
+    EXPECT_EQ(std::vector<uint16_t>(9, 7), arrays.at("a").as<std::vector<uint16_t>>());
+    EXPECT_EQ("complex64", arrays.at("b").dtype());
+    EXPECT_EQ(9, arrays.at("c").shape().size());
+    EXPECT_EQ(DType::INT16, arrays.at("c").dtypeId());
+}
+
+} // karabo_bridge
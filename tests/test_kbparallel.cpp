@@ -0,0 +1,58 @@
+#include <numeric>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_parallel.hpp"
+
+
+namespace karabo_bridge {
+
+TEST(TestThreadPool, TestParallelFor) {
+    ThreadPool pool(4);
+    EXPECT_EQ(4, pool.size());
+
+    std::vector<int> visited(1000, 0);
+    for (int repeat = 0; repeat < 10; ++repeat) {
+        pool.parallelFor(0, visited.size(), [&](std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) ++visited[i];
+        }, 7);
+    }
+    EXPECT_THAT(visited, ::testing::Each(10));
+
+    // empty range
+    pool.parallelFor(5, 5, [](std::size_t, std::size_t) { FAIL(); });
+}
+
+TEST(TestThreadPool, TestNested) {
+    ThreadPool pool(3);
+    std::atomic<std::size_t> count(0);
+    pool.parallelFor(0, 8, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            pool.parallelFor(0, 10, [&](std::size_t b, std::size_t e) { count += e - b; });
+        }
+    });
+    EXPECT_EQ(80, count);
+}
+
+TEST(TestThreadPool, TestException) {
+    ThreadPool pool(2);
+    EXPECT_THROW(pool.parallelFor(0, 100, [](std::size_t begin, std::size_t) {
+        if (begin == 50) throw std::runtime_error("failed");
+    }), std::runtime_error);
+
+    // the pool is still usable
+    std::atomic<std::size_t> count(0);
+    pool.parallelFor(0, 100, [&](std::size_t b, std::size_t e) { count += e - b; });
+    EXPECT_EQ(100, count);
+}
+
+TEST(TestThreadPool, TestSingleThread) {
+    ThreadPool pool(1);
+    EXPECT_EQ(1, pool.size());
+    std::size_t count = 0;
+    pool.parallelFor(0, 100, [&](std::size_t b, std::size_t e) { count += e - b; }, 3);
+    EXPECT_EQ(100, count);
+}
+
+} // karabo_bridge
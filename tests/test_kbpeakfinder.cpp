@@ -0,0 +1,127 @@
+#include <cstdint>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_peakfinder.hpp"
+
+
+namespace karabo_bridge {
+
+namespace {
+
+const std::size_t n_modules = 2, n_ss = 32, n_fs = 40;
+const std::size_t module_size = n_ss * n_fs;
+
+// Background of 10 with a deterministic noise in [-1, 1].
+std::vector<float> _background(std::size_t n_pulses) {
+    std::vector<float> data(n_pulses * n_modules * module_size);
+    uint32_t state = 12345;
+    for (auto& v : data) {
+        state = state * 1664525u + 1013904223u;
+        v = 10.f + static_cast<float>(state >> 8) / (1 << 23) - 1.f;
+    }
+    return data;
+}
+
+// Add a 3 x 3 peak centered at (ss, fs).
+void _addPeak(std::vector<float>& data, std::size_t pulse, std::size_t module,
+              std::size_t ss, std::size_t fs) {
+    float* d = &data[(pulse * n_modules + module) * module_size];
+    for (std::size_t i = ss - 1; i <= ss + 1; ++i)
+        for (std::size_t j = fs - 1; j <= fs + 1; ++j)
+            d[i * n_fs + j] += (i == ss && j == fs) ? 200.f : 100.f;
+}
+
+} // namespace
+
+TEST(TestPeakFinder, TestFind) {
+    PeakFinderOptions options;
+    options.min_peaks = 4;
+    PeakFinder finder({n_modules, n_ss, n_fs}, options);
+
+    const std::size_t n_pulses = 3;
+    auto data = _background(n_pulses);
+    // pulse 0: 5 peaks in both modules
+    _addPeak(data, 0, 0, 5, 5);
+    _addPeak(data, 0, 0, 20, 30);
+    _addPeak(data, 0, 1, 10, 10);
+    _addPeak(data, 0, 1, 10, 20);
+    _addPeak(data, 0, 1, 1, 38); // at the edge
+    // pulse 1: a single hot pixel, too small to be a peak
+    data[(1 * n_modules + 0) * module_size + 15 * n_fs + 15] += 500.f;
+    // pulse 2: 1 peak
+    _addPeak(data, 2, 1, 16, 16);
+
+    ThreadPool pool(3);
+    auto result = finder.find(data.data(), n_pulses, pool);
+    EXPECT_THAT(result.n_peaks, ::testing::ElementsAre(5, 0, 1));
+    EXPECT_THAT(result.hits, ::testing::ElementsAre(1, 0, 0));
+    EXPECT_EQ(1, result.nHits());
+    ASSERT_EQ(6, result.peaks.size());
+
+    auto& peak = result.peaks[1];
+    EXPECT_EQ(0, peak.pulse);
+    EXPECT_EQ(0, peak.module);
+    EXPECT_NEAR(20.f, peak.ss, 0.05);
+    EXPECT_NEAR(30.f, peak.fs, 0.05);
+    EXPECT_EQ(9, peak.n_pixels);
+    EXPECT_NEAR(1000.f, peak.intensity, 20.f);
+    EXPECT_GT(peak.max_intensity, 200.f);
+    EXPECT_GT(peak.snr, 6.f);
+
+    for (std::size_t i = 0; i < result.peaks.size(); ++i) {
+        EXPECT_EQ(i < 5 ? 0 : 2, result.peaks[i].pulse);
+        EXPECT_EQ(i < 2 ? 0 : 1, result.peaks[i].module);
+    }
+
+    // a single-pixel peak is kept with min_pixels = 1
+    options.min_pixels = 1;
+    EXPECT_EQ(1, PeakFinder({n_modules, n_ss, n_fs}, options).find(data.data(), n_pulses, pool).n_peaks[1]);
+}
+
+TEST(TestPeakFinder, TestMaskAndLimits) {
+    auto data = _background(1);
+    _addPeak(data, 0, 0, 5, 5);
+    _addPeak(data, 0, 0, 20, 20);
+    _addPeak(data, 0, 1, 20, 20);
+
+    std::vector<uint8_t> mask(n_modules * module_size, 0);
+    mask[5 * n_fs + 5] = 1;
+    mask[5 * n_fs + 6] = 1;
+
+    PeakFinderOptions options;
+    options.max_pixels = 8;
+    PeakFinder finder({n_modules, n_ss, n_fs}, options, mask);
+    auto result = finder.find(data.data(), 1);
+    // the masked peak has 7 pixels
+    ASSERT_EQ(1, result.peaks.size());
+    EXPECT_EQ(7, result.peaks[0].n_pixels);
+
+    options.max_pixels = 200;
+    options.max_peaks = 2;
+    result = PeakFinder({n_modules, n_ss, n_fs}, options).find(data.data(), 1);
+    EXPECT_EQ(3, result.n_peaks[0]);
+    EXPECT_EQ(2, result.peaks.size());
+
+    EXPECT_THROW(PeakFinder({n_modules, n_ss, n_fs}, options, std::vector<uint8_t>(10)), PeakFinderError);
+    EXPECT_THROW(PeakFinder({n_ss, n_fs}), PeakFinderError);
+}
+
+TEST(TestPeakFinder, TestNDArray) {
+    auto data = _background(2);
+    _addPeak(data, 1, 1, 7, 7);
+    PeakFinder finder({n_modules, n_ss, n_fs});
+
+    NDArray array(data.data(), {2, n_modules, n_ss, n_fs}, DType::FLOAT);
+    auto result = finder.find(array);
+    EXPECT_THAT(result.n_peaks, ::testing::ElementsAre(0, 1));
+
+    NDArray single(data.data() + n_modules * module_size, {n_modules, n_ss, n_fs}, DType::FLOAT);
+    EXPECT_THAT(finder.find(single).n_peaks, ::testing::ElementsAre(1));
+
+    NDArray wrong(data.data(), {2, n_modules, n_fs, n_ss}, DType::FLOAT);
+    EXPECT_THROW(finder.find(wrong), PeakFinderError);
+}
+
+} // karabo_bridge
@@ -0,0 +1,167 @@
+#include <cmath>
+#include <numeric>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_preview.hpp"
+
+
+namespace karabo_bridge {
+
+TEST(TestPreview, TestBinFrames) {
+    ThreadPool pool(2);
+    // 2 pulses of 4 x 6 frames
+    std::vector<uint16_t> src(2 * 4 * 6);
+    std::iota(src.begin(), src.end(), 0);
+    NDArray array(src.data(), {2, 4, 6}, DType::UINT16);
+
+    EXPECT_THAT(previewShape({2, 4, 6}, 2, Projection::MEAN), ::testing::ElementsAre(2, 3));
+    EXPECT_THAT(previewShape({2, 4, 6}, 4, Projection::NONE), ::testing::ElementsAre(2, 1, 1));
+    EXPECT_THAT(previewShape({5, 7}, 2, Projection::MAX), ::testing::ElementsAre(2, 3));
+
+    std::vector<float> dst(2 * 2 * 3);
+    auto binned = binFrames(array, 2, Projection::NONE, dst.data(), pool);
+    EXPECT_THAT(binned.shape(), ::testing::ElementsAre(2, 2, 3));
+    EXPECT_EQ(DType::FLOAT, binned.dtypeId());
+    EXPECT_THAT(dst, ::testing::ElementsAre(3.5, 5.5, 7.5, 15.5, 17.5, 19.5,
+                                            27.5, 29.5, 31.5, 39.5, 41.5, 43.5));
+
+    binFrames(array, 2, Projection::MEAN, dst.data(), pool);
+    EXPECT_THAT(std::vector<float>(dst.begin(), dst.begin() + 6),
+                ::testing::ElementsAre(15.5, 17.5, 19.5, 27.5, 29.5, 31.5));
+
+    binned = binFrames(array, 3, Projection::MAX, dst.data(), pool);
+    EXPECT_THAT(binned.shape(), ::testing::ElementsAre(1, 2));
+    EXPECT_THAT(std::vector<float>(dst.begin(), dst.begin() + 2), ::testing::ElementsAre(38, 41));
+
+    EXPECT_THROW(binFrames(array, 0, Projection::MEAN, dst.data(), pool), PreviewError);
+    NDArray flat(src.data(), {48}, DType::UINT16);
+    EXPECT_THROW(binFrames(flat, 2, Projection::MEAN, dst.data(), pool), PreviewError);
+}
+
+TEST(TestPreview, TestPulsesLast) {
+    ThreadPool pool(2);
+    // 2 modules of 4 x 6 frames of 3 pulses, and the same data with the pulses first
+    std::vector<float> src(2 * 4 * 6 * 3);
+    std::iota(src.begin(), src.end(), 0.f);
+    std::vector<float> pulse_major(src.size());
+    for (std::size_t i = 0; i < 2 * 4 * 6; ++i)
+        for (std::size_t p = 0; p < 3; ++p) pulse_major[p * 2 * 4 * 6 + i] = src[i * 3 + p];
+    NDArray array(src.data(), {2, 4, 6, 3}, DType::FLOAT);
+    NDArray expected_array(pulse_major.data(), {3, 2, 4, 6}, DType::FLOAT);
+
+    EXPECT_THAT(previewShape({2, 4, 6, 3}, 2, Projection::MEAN, 3), ::testing::ElementsAre(2, 2, 3));
+    EXPECT_THAT(previewShape({2, 4, 6, 3}, 2, Projection::NONE, 3), ::testing::ElementsAre(2, 2, 3, 3));
+
+    std::vector<float> dst(2 * 2 * 3), expected(2 * 2 * 3);
+    for (auto projection : {Projection::MEAN, Projection::MAX}) {
+        auto binned = binFrames(array, 2, projection, 3, dst.data(), pool);
+        EXPECT_THAT(binned.shape(), ::testing::ElementsAre(2, 2, 3));
+        binFrames(expected_array, 2, projection, expected.data(), pool);
+        EXPECT_THAT(dst, ::testing::Pointwise(::testing::FloatEq(), expected));
+    }
+
+    // every pulse is binned and the pulses stay last
+    std::vector<float> all(2 * 2 * 3 * 3), all_expected(3 * 2 * 2 * 3);
+    binFrames(array, 2, Projection::NONE, 3, all.data(), pool);
+    binFrames(expected_array, 2, Projection::NONE, all_expected.data(), pool);
+    for (std::size_t i = 0; i < 2 * 2 * 3; ++i)
+        for (std::size_t p = 0; p < 3; ++p) EXPECT_FLOAT_EQ(all_expected[p * 12 + i], all[i * 3 + p]);
+
+    PreviewOptions options;
+    options.bin = 2;
+    options.pulse_axis = 3;
+    std::vector<float> buffer;
+    std::vector<uint8_t> image(2 * 2 * 3);
+    EXPECT_THAT(preview(array, options, buffer, image.data()).shape(), ::testing::ElementsAre(2, 2, 3));
+
+    // the pulses must be the first or the last axis
+    EXPECT_THROW(binFrames(array, 2, Projection::MEAN, 1, dst.data(), pool), PreviewError);
+    NDArray frame(src.data(), {4, 6}, DType::FLOAT);
+    EXPECT_THROW(binFrames(frame, 2, Projection::MEAN, 1, dst.data(), pool), PreviewError);
+}
+
+TEST(TestPreview, TestNaN) {
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    std::vector<float> src {1, nan, nan, nan,
+                            3, nan, nan, nan};
+    std::vector<float> dst(2);
+    binFrames(src.data(), {2, 4}, 2, Projection::MEAN, dst.data());
+    EXPECT_EQ(2.f, dst[0]);
+    EXPECT_TRUE(std::isnan(dst[1]));
+    binFrames(src.data(), {2, 4}, 2, Projection::MAX, dst.data());
+    EXPECT_EQ(3.f, dst[0]);
+    EXPECT_TRUE(std::isnan(dst[1]));
+
+    // the projection of no pulses, with the pulses first and last
+    std::vector<float> empty;
+    std::vector<float> frame(2 * 3, 5.f);
+    binFrames(empty.data(), {0, 4, 6}, 2, Projection::MEAN, frame.data());
+    for (auto v : frame) EXPECT_TRUE(std::isnan(v));
+    std::fill(frame.begin(), frame.end(), 5.f);
+    binFrames(empty.data(), {1, 4, 6, 0}, 2, Projection::MAX, 3, frame.data());
+    for (auto v : frame) EXPECT_TRUE(std::isnan(v));
+
+    // a stale buffer is not previewed
+    PreviewOptions options;
+    options.bin = 2;
+    std::vector<float> buffer(2 * 3, 100.f);
+    std::vector<uint8_t> image(2 * 3, 1);
+    NDArray no_pulses(empty.data(), {0, 4, 6}, DType::FLOAT);
+    EXPECT_THAT(preview(no_pulses, options, buffer, image.data()).shape(), ::testing::ElementsAre(2, 3));
+    EXPECT_THAT(image, ::testing::Each(0));
+}
+
+TEST(TestPreview, TestScale) {
+    std::vector<float> values(101);
+    std::iota(values.begin(), values.end(), 0.f);
+    values.push_back(std::numeric_limits<float>::quiet_NaN());
+    auto range = percentileRange(values.data(), values.size(), 10, 90);
+    EXPECT_EQ(10.f, range.first);
+    EXPECT_EQ(90.f, range.second);
+
+    std::vector<float> src {-1.f, 0.f, 5.f, 10.f, 20.f, std::numeric_limits<float>::quiet_NaN()};
+    std::vector<uint8_t> dst(src.size());
+    scaleToUint8(src.data(), src.size(), 0.f, 10.f, dst.data());
+    EXPECT_THAT(dst, ::testing::ElementsAre(0, 0, 128, 255, 255, 0));
+
+    auto lut = gammaLut(0.5);
+    EXPECT_EQ(0, lut[0]);
+    EXPECT_EQ(255, lut[255]);
+    EXPECT_EQ(128, lut[64]);
+    scaleToUint8(src.data(), src.size(), 0.f, 10.f, dst.data(), &lut);
+    EXPECT_THAT(dst, ::testing::ElementsAre(0, 0, 181, 255, 255, 0));
+}
+
+TEST(TestPreview, TestPublish) {
+    std::vector<float> src(3 * 8 * 8);
+    std::iota(src.begin(), src.end(), 0.f);
+    NDArray array(src.data(), {3, 8, 8}, DType::FLOAT);
+
+    PreviewOptions options;
+    options.bin = 2;
+    options.low_percentile = 0;
+    options.high_percentile = 100;
+    std::vector<float> buffer;
+    std::vector<uint8_t> dst(16);
+    auto image = preview(array, options, buffer, dst.data());
+    EXPECT_THAT(image.shape(), ::testing::ElementsAre(4, 4));
+    EXPECT_EQ(0, dst.front());
+    EXPECT_EQ(255, dst.back());
+
+    MultipartMsg mpmsg;
+    appendArraySource(mpmsg, "preview", 10001, "image.data", image);
+    ASSERT_EQ(4, mpmsg.size());
+
+    auto train = detail::decodeTrain(mpmsg, nullptr);
+    ASSERT_EQ(1, train.count("preview"));
+    auto& data = train.at("preview");
+    EXPECT_EQ(10001, data.metadata.at("timestamp.tid").as<uint64_t>());
+    auto decoded = data.array.at("image.data");
+    EXPECT_THAT(decoded.shape(), ::testing::ElementsAre(4, 4));
+    EXPECT_EQ("uint8_t", decoded.dtype());
+    EXPECT_EQ(dst, decoded.as<std::vector<uint8_t>>());
+}
+
+} // karabo_bridge
@@ -0,0 +1,106 @@
+#include <numeric>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_selection.hpp"
+
+
+namespace karabo_bridge {
+
+namespace {
+
+// Reference selection by computing the input index of every output element.
+template<typename T>
+std::vector<T> _naiveSelect(const std::vector<T>& src, const std::vector<std::size_t>& shape,
+                            std::size_t axis, const std::vector<std::size_t>& indices) {
+    std::size_t n_outer = 1, n_inner = 1;
+    for (std::size_t k = 0; k < axis; ++k) n_outer *= shape[k];
+    for (std::size_t k = axis + 1; k < shape.size(); ++k) n_inner *= shape[k];
+
+    std::vector<T> dst;
+    for (std::size_t o = 0; o < n_outer; ++o)
+        for (auto i : indices)
+            for (std::size_t j = 0; j < n_inner; ++j)
+                dst.push_back(src[(o * shape[axis] + i) * n_inner + j]);
+    return dst;
+}
+
+template<typename T>
+void _checkSelect(ThreadPool& pool, const std::vector<std::size_t>& shape, std::size_t axis,
+                  const std::vector<std::size_t>& indices) {
+    std::size_t size = 1;
+    for (auto v : shape) size *= v;
+    std::vector<T> src(size);
+    std::iota(src.begin(), src.end(), T(1));
+
+    PulseSelection selection(indices);
+    std::vector<T> dst(size / shape[axis] * indices.size());
+    selectPulses(src.data(), dst.data(), shape, sizeof(T), axis, selection, pool);
+    EXPECT_EQ(_naiveSelect(src, shape, axis, indices), dst) << "axis " << axis;
+}
+
+} // namespace
+
+TEST(TestSelection, TestSelection) {
+    auto selection = PulseSelection::fromMask(std::vector<bool>{false, true, true, true, false, true});
+    EXPECT_THAT(selection.indices(), ::testing::ElementsAre(1, 2, 3, 5));
+    EXPECT_EQ(2, selection.runs().size());
+    EXPECT_EQ(std::make_pair(std::size_t(1), std::size_t(3)), selection.runs()[0]);
+
+    uint8_t mask[] = {1, 0, 1};
+    EXPECT_THAT(PulseSelection::fromMask(mask, 3).indices(), ::testing::ElementsAre(0, 2));
+
+    std::vector<uint16_t> cell_ids {0, 1, 2, 3, 4, 5};
+    NDArray cells(cell_ids.data(), {6}, DType::UINT16);
+    auto odd = PulseSelection::fromValues(cells, [](uint64_t cell) { return cell % 2 == 1; });
+    EXPECT_THAT(odd.indices(), ::testing::ElementsAre(1, 3, 5));
+
+    NDArray cells_2d(cell_ids.data(), {2, 3}, DType::UINT16);
+    EXPECT_THROW(PulseSelection::fromValues(cells_2d, [](uint64_t) { return true; }), SelectionError);
+    NDArray cells_f(cell_ids.data(), {3}, DType::FLOAT);
+    EXPECT_THROW(PulseSelection::fromValues(cells_f, [](uint64_t) { return true; }), SelectionError);
+}
+
+TEST(TestSelection, TestSelectPulses) {
+    ThreadPool pool(3);
+    const std::vector<std::size_t> shape {3, 4, 5, 16};
+
+    std::vector<std::vector<std::size_t>> selections {
+        {0, 2, 5, 7, 11, 15}, // scattered
+        {3, 4, 5, 6, 7, 8, 9}, // a single run
+        {9, 1, 1}, // reordered and repeated
+        {}
+    };
+    for (auto& indices : selections) {
+        _checkSelect<uint16_t>(pool, shape, 3, indices);
+        _checkSelect<float>(pool, shape, 3, indices);
+        _checkSelect<uint8_t>(pool, shape, 3, indices);
+        _checkSelect<double>(pool, shape, 3, indices);
+    }
+
+    const std::vector<std::size_t> shape_front {16, 4, 5, 3};
+    for (auto& indices : selections) {
+        _checkSelect<uint16_t>(pool, shape_front, 0, indices);
+        _checkSelect<int32_t>(pool, {4, 16, 5, 3}, 1, indices);
+    }
+}
+
+TEST(TestSelection, TestNDArray) {
+    std::vector<float> src(2 * 3 * 8);
+    std::iota(src.begin(), src.end(), 0.f);
+    NDArray array(src.data(), {2, 3, 8}, DType::FLOAT);
+
+    PulseSelection selection({1, 6});
+    std::vector<float> dst(2 * 3 * 2);
+    auto selected = selectPulses(array, 2, selection, dst.data());
+    EXPECT_THAT(selected.shape(), ::testing::ElementsAre(2, 3, 2));
+    EXPECT_EQ(DType::FLOAT, selected.dtypeId());
+    EXPECT_EQ(dst.data(), selected.data<float>());
+    EXPECT_THAT(dst, ::testing::ElementsAre(1, 6, 9, 14, 17, 22, 25, 30, 33, 38, 41, 46));
+
+    EXPECT_THROW(selectPulses(array, 3, selection, dst.data()), SelectionError);
+    EXPECT_THROW(selectPulses(array, 2, PulseSelection({8}), dst.data()), SelectionError);
+}
+
+} // karabo_bridge
@@ -0,0 +1,149 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_shm.hpp"
+
+#include "kb_test_utils.hpp"
+
+
+namespace karabo_bridge {
+
+using ::testing::ElementsAre;
+using ::testing::Each;
+
+std::string _shmName() { return "/kb_test_" + std::to_string(getpid()); }
+
+TEST(TestShm, TestPublishAndRead) {
+    ShmRelay relay(_shmName(), 4, 1 << 16);
+    ShmReader reader(_shmName(), 0.05);
+    ShmReader other(_shmName(), 0.05);
+
+    EXPECT_TRUE(reader.next().empty()); // timeout
+
+    ASSERT_TRUE(relay.publish(_toMultipartMsg(_packTrain(1, 1000))));
+    auto data = reader.next();
+    ASSERT_EQ(1, data.size());
+    auto& camera = data.at("camera");
+    EXPECT_EQ(1, camera.metadata.at("timestamp.tid").as<uint64_t>());
+    EXPECT_EQ(64, camera["header.pulseCount"].as<int>());
+    auto& image = camera.array.at("image.data");
+    EXPECT_THAT(image.shape(), ElementsAre(1000));
+    EXPECT_TRUE(image.isAligned(64));
+    EXPECT_THAT(image.as<std::vector<uint8_t>>(), Each(1));
+
+    // every reader gets the train
+    auto data_other = other.next();
+    ASSERT_EQ(1, data_other.size());
+    EXPECT_THAT(data_other.at("camera").array.at("image.data").as<std::vector<uint8_t>>(), Each(1));
+
+    EXPECT_TRUE(reader.next().empty());
+    EXPECT_EQ(1, relay.publishedTrains());
+    EXPECT_EQ(0, relay.droppedTrains());
+}
+
+TEST(TestShm, TestSlotHeld) {
+    ShmRelay relay(_shmName(), 2, 1 << 16);
+    ShmReader reader(_shmName(), 0.05);
+
+    ASSERT_TRUE(relay.publish(_toMultipartMsg(_packTrain(1, 100))));
+    ASSERT_TRUE(relay.publish(_toMultipartMsg(_packTrain(2, 100))));
+
+    // the slot of train 3 is held by train 1, it goes to the slot of train 2
+    MultipartMsg held;
+    ASSERT_TRUE(reader.nextMultipartMsg(held));
+    EXPECT_TRUE(relay.publish(_toMultipartMsg(_packTrain(3, 100))));
+    EXPECT_EQ(1, relay.skippedSlots());
+    EXPECT_EQ(0, relay.droppedTrains());
+
+    // all the slots are held
+    MultipartMsg held_other;
+    ASSERT_TRUE(reader.nextMultipartMsg(held_other));
+    EXPECT_FALSE(relay.publish(_toMultipartMsg(_packTrain(4, 100))));
+    EXPECT_EQ(1, relay.droppedTrains());
+
+    held.clear();
+    held_other.clear();
+    EXPECT_TRUE(relay.publish(_toMultipartMsg(_packTrain(4, 100))));
+
+    // too large for a slot
+    EXPECT_FALSE(relay.publish(_toMultipartMsg(_packTrain(5, 1 << 16))));
+    EXPECT_EQ(2, relay.droppedTrains());
+    EXPECT_EQ(4, relay.publishedTrains());
+}
+
+TEST(TestShm, TestTrainPinned) {
+    ShmRelay relay(_shmName(), 4, 1 << 16);
+    ShmReader reader(_shmName(), 0.05);
+
+    ASSERT_TRUE(relay.publish(_toMultipartMsg(_packTrain(1, 100))));
+    auto pinned = reader.next();
+    ASSERT_EQ(1, pinned.size());
+    auto image = pinned.at("camera").array.at("image.data");
+    pinned.clear();
+
+    // the relay keeps publishing around the slot held by the array
+    for (uint64_t tid = 2; tid <= 20; ++tid) {
+        ASSERT_TRUE(relay.publish(_toMultipartMsg(_packTrain(tid, 100))));
+        auto data = reader.next();
+        ASSERT_EQ(1, data.size());
+        EXPECT_EQ(tid, data.at("camera").metadata.at("timestamp.tid").as<uint64_t>());
+    }
+    EXPECT_EQ(0, relay.droppedTrains());
+    EXPECT_EQ(6, relay.skippedSlots());
+    EXPECT_EQ(0, reader.missedTrains());
+    EXPECT_THAT(image.as<std::vector<uint8_t>>(), Each(1));
+}
+
+TEST(TestShm, TestSlowReader) {
+    ShmRelay relay(_shmName(), 4, 1 << 16);
+    ShmReader reader(_shmName(), 0.05);
+
+    for (uint64_t tid = 1; tid <= 10; ++tid) ASSERT_TRUE(relay.publish(_toMultipartMsg(_packTrain(tid, 10))));
+
+    // skip to the latest train
+    auto data = reader.next();
+    ASSERT_EQ(1, data.size());
+    EXPECT_EQ(10, data.at("camera").metadata.at("timestamp.tid").as<uint64_t>());
+    EXPECT_EQ(9, reader.missedTrains());
+}
+
+TEST(TestShm, TestRelayName) {
+    ShmRelay relay(_shmName(), 2, 1 << 16);
+
+    // the relay is running
+    EXPECT_THROW(ShmRelay(_shmName(), 2, 1 << 16), ShmError);
+    ShmReader reader(_shmName(), 0.05);
+    ASSERT_TRUE(relay.publish(_toMultipartMsg(_packTrain(1, 100))));
+    EXPECT_EQ(1, reader.next().size());
+
+    // pretend that the relay crashed
+    pid_t dead = fork();
+    if (dead == 0) _exit(0);
+    waitpid(dead, nullptr, 0);
+    int fd = shm_open(_shmName().c_str(), O_RDWR, 0);
+    ASSERT_GE(fd, 0);
+    void* addr = mmap(nullptr, sizeof(detail::ShmRingHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    ASSERT_NE(MAP_FAILED, addr);
+    static_cast<detail::ShmRingHeader*>(addr)->pid = static_cast<uint64_t>(dead);
+    munmap(addr, sizeof(detail::ShmRingHeader));
+
+    {
+        ShmRelay restarted(_shmName(), 2, 1 << 16);
+        ShmReader new_reader(_shmName(), 0.05);
+        ASSERT_TRUE(restarted.publish(_toMultipartMsg(_packTrain(2, 100))));
+        EXPECT_EQ(2, new_reader.next().at("camera").metadata.at("timestamp.tid").as<uint64_t>());
+    }
+}
+
+TEST(TestShm, TestOpenError) {
+    EXPECT_THROW(ShmReader("/kb_test_not_existing"), ShmError);
+    EXPECT_THROW(ShmRelay(_shmName(), 0, 100), ShmError);
+}
+
+} // karabo_bridge
@@ -0,0 +1,137 @@
+#include <cmath>
+#include <numeric>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_timeseries.hpp"
+
+
+namespace karabo_bridge {
+
+using ::testing::ElementsAre;
+
+TEST(TestTimeSeries, TestRollingStatistics) {
+    TimeSeries ts(4);
+    EXPECT_TRUE(ts.empty());
+    EXPECT_TRUE(std::isnan(ts.mean()));
+    EXPECT_TRUE(std::isnan(ts.min()));
+
+    std::vector<double> values {3., 1., 4., 1., 5., 9., 2., 6.};
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        ASSERT_TRUE(ts.append(100 + i, values[i]));
+
+        // compare with the statistics of the last 4 values
+        std::size_t begin = i + 1 > 4 ? i + 1 - 4 : 0;
+        std::vector<double> window(values.begin() + begin, values.begin() + i + 1);
+        double mean = std::accumulate(window.begin(), window.end(), 0.) / window.size();
+        double var = 0.;
+        for (auto v : window) var += (v - mean) * (v - mean);
+        var /= window.size();
+
+        ASSERT_EQ(window.size(), ts.size());
+        EXPECT_NEAR(mean, ts.mean(), 1e-12) << i;
+        EXPECT_NEAR(var, ts.variance(), 1e-12) << i;
+        EXPECT_EQ(*std::min_element(window.begin(), window.end()), ts.min()) << i;
+        EXPECT_EQ(*std::max_element(window.begin(), window.end()), ts.max()) << i;
+    }
+    EXPECT_EQ(104, ts.firstTid());
+    EXPECT_EQ(107, ts.lastTid());
+    EXPECT_EQ(5., ts.value(0));
+
+    // old, repeated and NaN samples
+    EXPECT_FALSE(ts.append(107, 1.));
+    EXPECT_FALSE(ts.append(50, 1.));
+    EXPECT_FALSE(ts.append(108, std::nan("")));
+    EXPECT_EQ(3, ts.rejected());
+    EXPECT_EQ(4, ts.size());
+
+    ts.clear();
+    EXPECT_TRUE(ts.empty());
+    EXPECT_EQ(0, ts.rejected());
+    EXPECT_TRUE(ts.append(1, 2.));
+    EXPECT_EQ(2., ts.mean());
+    EXPECT_EQ(0., ts.variance());
+
+    EXPECT_THROW(TimeSeries(0), TimeSeriesError);
+}
+
+TEST(TestTimeSeries, TestLongRun) {
+    // large values with a small spread lose precision on every eviction
+    TimeSeries ts(16);
+    std::vector<double> window;
+    for (uint64_t tid = 1; tid <= 1000000; ++tid) {
+        double value = 1e9 + (tid * 7919 % 1000) * 1e-3;
+        ts.append(tid, value);
+        if (tid > 1000000 - 16) window.push_back(value);
+    }
+
+    double mean = std::accumulate(window.begin(), window.end(), 0.) / window.size();
+    double var = 0.;
+    for (auto v : window) var += (v - mean) * (v - mean);
+    var /= window.size();
+    EXPECT_NEAR(mean, ts.mean(), 1e-6);
+    EXPECT_NEAR(var, ts.variance(), 1e-3 * var);
+}
+
+TEST(TestTimeSeries, TestQuery) {
+    TimeSeries ts(5);
+    // train IDs 10, 12, ..., 24 of which 16 to 24 are kept
+    for (uint64_t tid = 10; tid <= 24; tid += 2) ts.append(tid, static_cast<double>(tid) / 2);
+
+    std::vector<uint64_t> tids;
+    std::vector<double> values;
+    EXPECT_EQ(3, ts.query(17, 22, tids, values));
+    EXPECT_THAT(tids, ElementsAre(18, 20, 22));
+    EXPECT_THAT(values, ElementsAre(9., 10., 11.));
+
+    EXPECT_EQ(5, ts.query(0, UINT64_MAX, tids, values));
+    EXPECT_THAT(tids, ElementsAre(16, 18, 20, 22, 24));
+
+    EXPECT_EQ(0, ts.query(25, 30, tids, values));
+    EXPECT_EQ(0, ts.query(20, 19, tids, values));
+    EXPECT_TRUE(values.empty());
+}
+
+TEST(TestTimeSeries, TestStore) {
+    TimeSeriesStore store(10);
+    store.addChannel("xgm", "pulseEnergy");
+    store.addChannel("xgm", "timestamp.tid", 2);
+    store.addChannel("motor", "position");
+    EXPECT_EQ(3, store.channels().size());
+
+    for (uint64_t tid = 1; tid <= 3; ++tid) {
+        msgpack::sbuffer sbuf_tid, sbuf_energy;
+        msgpack::pack(sbuf_tid, tid);
+        msgpack::pack(sbuf_energy, 0.5 * tid);
+        auto h_tid = msgpack::unpack(sbuf_tid.data(), sbuf_tid.size());
+        auto h_energy = msgpack::unpack(sbuf_energy.data(), sbuf_energy.size());
+
+        std::map<std::string, kb_data> data;
+        data["xgm"].metadata.insert({"timestamp.tid", h_tid.get().as<MsgpackObject>()});
+        data["xgm"].insert(std::make_pair(std::string("pulseEnergy"),
+                                          h_energy.get().as<MsgpackObject>()));
+        data["motor"]; // no train ID
+        EXPECT_EQ(2, store.record(data));
+    }
+
+    auto& energy = store.channel("xgm", "pulseEnergy");
+    EXPECT_EQ(3, energy.size());
+    EXPECT_DOUBLE_EQ(1., energy.mean());
+    EXPECT_EQ(1.5, energy.max());
+
+    auto& tids = store.channel("xgm", "timestamp.tid");
+    EXPECT_EQ(2, tids.capacity());
+    EXPECT_EQ(2, tids.firstTid());
+    EXPECT_EQ(3., tids.max());
+
+    EXPECT_TRUE(store.channel("motor", "position").empty());
+    EXPECT_THROW(store.channel("motor", "velocity"), std::out_of_range);
+
+    store.removeChannel("motor", "position");
+    EXPECT_EQ(2, store.channels().size());
+    store.clear();
+    EXPECT_TRUE(energy.empty());
+}
+
+} // karabo_bridge
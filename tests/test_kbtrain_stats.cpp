@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_train_stats.hpp"
+
+
+namespace karabo_bridge {
+
+TEST(TestLatencyHistogram, TestGeneral) {
+    LatencyHistogram hist;
+    EXPECT_EQ(0, hist.count());
+    EXPECT_TRUE(std::isnan(hist.mean()));
+    EXPECT_TRUE(std::isnan(hist.percentile(0.5)));
+
+    hist.record(0.5e-6); // bin 0
+    hist.record(1.5e-6); // bin 1
+    hist.record(3e-6); // bin 2
+    hist.record(3.5e-6); // bin 2
+    hist.record(-1.); // bin 0
+    hist.record(1e9); // last bin
+
+    EXPECT_EQ(6, hist.count());
+    EXPECT_EQ(1, hist.negative());
+    EXPECT_EQ(2, hist.bins()[0]);
+    EXPECT_EQ(1, hist.bins()[1]);
+    EXPECT_EQ(2, hist.bins()[2]);
+    EXPECT_EQ(1, hist.bins()[LatencyHistogram::nBins() - 1]);
+    EXPECT_DOUBLE_EQ(-1., hist.min());
+    EXPECT_DOUBLE_EQ(1e9, hist.max());
+
+    EXPECT_DOUBLE_EQ(1e-6, hist.percentile(0.));
+    EXPECT_DOUBLE_EQ(2e-6, hist.percentile(0.5));
+    EXPECT_DOUBLE_EQ(4e-6, hist.percentile(0.8));
+    EXPECT_DOUBLE_EQ(LatencyHistogram::binUpperEdge(LatencyHistogram::nBins() - 1),
+                     hist.percentile(1.));
+}
+
+TEST(TestTrainTracker, TestOrdering) {
+    TrainTracker tracker;
+    for (uint64_t tid : {100, 101, 104, 103, 103, 105, 200, 102, 10})
+        tracker.record("source", tid, 0.01, 0.001);
+    tracker.record("other", 1, std::nan(""), 0.001);
+
+    auto stats = tracker.snapshot();
+    ASSERT_EQ(2, stats.size());
+
+    auto& s = stats.at("source");
+    EXPECT_EQ(9, s.trains);
+    EXPECT_EQ(100, s.first_tid);
+    EXPECT_EQ(200, s.last_tid);
+    EXPECT_EQ(2, s.gaps); // 101 -> 104 and 105 -> 200
+    EXPECT_EQ(1, s.duplicates); // 103
+    EXPECT_EQ(3, s.reordered); // 103, 102 and 10
+    // 102, 103 and 106 - 199 were missing, then 102 and 103 arrived, and 10
+    // is older than the first train
+    EXPECT_EQ(94, s.missing);
+    EXPECT_EQ(9, s.latency.count());
+    EXPECT_EQ(9, s.queue.count());
+
+    // no timestamp
+    EXPECT_EQ(0, stats.at("other").latency.count());
+    EXPECT_EQ(1, stats.at("other").queue.count());
+
+    // a late train fills in its gap only once, however old it is
+    for (uint64_t tid : {120, 120, 101, 300})
+        tracker.record("source", tid, 0.01, 0.001);
+    s = tracker.snapshot().at("source");
+    EXPECT_EQ(3, s.gaps);
+    EXPECT_EQ(3, s.duplicates); // 103, 120 and 101
+    EXPECT_EQ(4, s.reordered);
+    EXPECT_EQ(94 - 1 + 99, s.missing);
+
+    tracker.reset();
+    EXPECT_TRUE(tracker.snapshot().empty());
+}
+
+TEST(TestTrainTracker, TestManyGaps) {
+    TrainTracker tracker;
+    // every other train is missing
+    for (uint64_t tid = 0; tid < 4000; tid += 2) tracker.record("source", tid, 0.01, 0.001);
+    EXPECT_EQ(1999, tracker.snapshot().at("source").missing);
+
+    // the oldest gaps are forgotten but remain counted as missing
+    tracker.record("source", 1, 0.01, 0.001);
+    tracker.record("source", 3999 - 2, 0.01, 0.001);
+    tracker.record("source", 3999 - 2, 0.01, 0.001);
+    auto s = tracker.snapshot().at("source");
+    EXPECT_EQ(1998, s.missing);
+    EXPECT_EQ(2, s.reordered);
+    EXPECT_EQ(1, s.duplicates);
+}
+
+} // karabo_bridge
@@ -0,0 +1,114 @@
+#include <numeric>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "karabo-bridge/kb_transpose.hpp"
+
+
+namespace karabo_bridge {
+
+namespace {
+
+// Reference permutation by computing the input index of every output element.
+template<typename T>
+std::vector<T> _naiveTranspose(const std::vector<T>& src,
+                               const std::vector<std::size_t>& shape,
+                               const std::vector<std::size_t>& axes) {
+    std::vector<std::size_t> strides(shape.size(), 1);
+    for (std::size_t k = shape.size(); k-- > 1;) strides[k - 1] = strides[k] * shape[k];
+
+    std::vector<T> dst(src.size());
+    for (std::size_t i = 0; i < dst.size(); ++i) {
+        std::size_t index = i;
+        std::size_t offset = 0;
+        for (std::size_t j = axes.size(); j-- > 0;) {
+            offset += index % shape[axes[j]] * strides[axes[j]];
+            index /= shape[axes[j]];
+        }
+        dst[i] = src[offset];
+    }
+    return dst;
+}
+
+template<typename T>
+void _checkTranspose(ThreadPool& pool, const std::vector<std::size_t>& shape,
+                     const std::vector<std::size_t>& axes) {
+    std::size_t size = 1;
+    for (auto v : shape) size *= v;
+    std::vector<T> src(size);
+    std::iota(src.begin(), src.end(), T(1));
+
+    std::vector<T> dst(size, 0);
+    transpose(src.data(), dst.data(), shape, sizeof(T), axes, pool);
+    EXPECT_EQ(_naiveTranspose(src, shape, axes), dst) << "itemsize " << sizeof(T);
+}
+
+struct Triple { uint8_t v[3]; };
+
+} // namespace
+
+TEST(TestTranspose, TestPermutations) {
+    ThreadPool pool(4);
+
+    std::vector<std::pair<std::vector<std::size_t>, std::vector<std::size_t>>> cases {
+        {{7}, {0}},
+        {{67, 130}, {1, 0}},
+        {{64, 64}, {1, 0}},
+        {{4, 33, 17, 9}, {3, 0, 1, 2}}, // to pulse-major
+        {{4, 33, 17, 9}, {1, 2, 3, 0}},
+        {{4, 33, 17, 9}, {2, 0, 3, 1}},
+        {{4, 5, 6, 7}, {1, 0, 2, 3}}, // the innermost axis stays
+        {{4, 1, 6, 1, 7}, {4, 3, 0, 1, 2}}, // size-1 axes
+        {{1, 5, 1}, {2, 1, 0}},
+        {{3, 0, 2}, {2, 1, 0}}, // empty
+    };
+
+    for (auto& c : cases) {
+        _checkTranspose<uint8_t>(pool, c.first, c.second);
+        _checkTranspose<uint16_t>(pool, c.first, c.second);
+        _checkTranspose<uint32_t>(pool, c.first, c.second);
+        _checkTranspose<uint64_t>(pool, c.first, c.second);
+    }
+
+    // an element size without a dedicated kernel
+    std::vector<std::size_t> shape {5, 3, 70};
+    std::vector<Triple> src(5 * 3 * 70);
+    for (std::size_t i = 0; i < src.size(); ++i)
+        src[i] = Triple{{uint8_t(i), uint8_t(i >> 8), uint8_t(i % 7)}};
+    std::vector<Triple> dst(src.size());
+    transpose(src.data(), dst.data(), shape, sizeof(Triple), {2, 0, 1}, pool);
+    for (std::size_t i = 0; i < 70; ++i) {
+        for (std::size_t j = 0; j < 15; ++j) {
+            ASSERT_EQ(0, std::memcmp(&src[j * 70 + i], &dst[i * 15 + j], sizeof(Triple)));
+        }
+    }
+}
+
+TEST(TestTranspose, TestNDArray) {
+    ThreadPool pool(2);
+    std::vector<std::size_t> shape {2, 16, 24, 10}; // [modules, ss, fs, pulses]
+    std::vector<uint16_t> src(2 * 16 * 24 * 10);
+    std::iota(src.begin(), src.end(), 0);
+    NDArray array(src.data(), shape, "uint16_t");
+
+    std::vector<uint16_t> dst(src.size());
+    NDArray out = toPulseMajor(array, dst.data(), pool);
+    EXPECT_THAT(out.shape(), ::testing::ElementsAre(10, 2, 16, 24));
+    EXPECT_EQ("uint16_t", out.dtype());
+    EXPECT_EQ(dst.data(), out.data());
+    EXPECT_EQ(_naiveTranspose(src, shape, {3, 0, 1, 2}), dst);
+
+    std::vector<uint16_t> src_back(src.size());
+    NDArray back = transpose(out, {1, 2, 3, 0}, src_back.data(), pool);
+    EXPECT_THAT(back.shape(), ::testing::ElementsAre(2, 16, 24, 10));
+    EXPECT_EQ(src, src_back);
+
+    EXPECT_THROW(transpose(array, {0, 1, 2}, dst.data(), pool), TransposeError);
+    EXPECT_THROW(transpose(array, {0, 1, 2, 2}, dst.data(), pool), TransposeError);
+    EXPECT_THROW(transpose(array, {0, 1, 2, 4}, dst.data(), pool), TransposeError);
+    EXPECT_THROW(transpose(NDArray(src.data(), shape, "unknown"), {3, 0, 1, 2}, dst.data(), pool),
+                 TransposeError);
+}
+
+} // karabo_bridge